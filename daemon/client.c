@@ -5,24 +5,56 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include "daemon.h"
 #include "evloop.h"
 #include "client.h"
+#include "slave.h"
+#include "timer.h"
+#include "stats.h"
 
 /* Тип распознанной команды клиента */
 typedef enum
 {
-  CT_WRONG, /* Неправильная команда */
-  CT_EXIT,  /* Команда выхода */
-  CT_LEDS   /* Команда, выполняющая действия над светодиодами */
+  CT_WRONG,  /* Неправильная команда */
+  CT_EXIT,   /* Команда выхода */
+  CT_LEDS,   /* Команда, выполняющая действия над светодиодами */
+  CT_GAPS,   /* Команда получения статистики записей регистров порта */
+  CT_MATRIX, /* Команда записи кадрового буфера матрицы */
+  CT_SCAN,   /* Команда получения счётчиков развёртки матрицы */
+  CT_SHIFT,  /* Команда вывода на цепочки сдвиговых регистров */
+  CT_FRAMES, /* Команда получения счётчиков вывода на цепочки сдвиговых регистров */
+  CT_LCD,    /* Команда вывода текста на символьный индикатор */
+  CT_STATUS, /* Команда чтения линий состояния порта */
+  CT_SUBSCRIBE,  /* Команда подписки на события линий состояния портов */
+  CT_UNSUBSCRIBE, /* Команда отказа от подписки */
+  CT_CAPTURE, /* Команда захвата линий состояния порта */
+  CT_COUNTER, /* Команда чтения счётчика импульсов */
+  CT_COUNTER_RESET, /* Команда чтения и сброса счётчика импульсов */
+  CT_HEARTBEAT, /* Команда получения задержек ответа на проверки работоспособности */
+  CT_LOG,    /* Команда получения уровня журнала и количества отброшенных сообщений */
+  CT_LOG_LEVEL, /* Команда смены уровня журнала */
+  CT_STATS,  /* Команда получения счётчиков команд и задержек */
+  CT_STATS_OPS, /* Команда получения счётчиков операций над светодиодами */
+  CT_STATS_PORTS, /* Команда получения счётчиков команд по портам */
+  CT_LOOP,   /* Команда получения статистики цикла обработки событий */
+  CT_LOOP_ON, /* Команда включения сбора статистики цикла обработки событий */
+  CT_LOOP_OFF, /* Команда выключения сбора статистики цикла обработки событий */
+  CT_LOOP_RESET /* Команда сброса статистики цикла обработки событий */
 } command_type_t;
 
 /* Тип операнда распознанной команды клиента */
 typedef enum
 {
   OT_NONE,  /* Операнд для операции не требуется */
-  OT_BITS,  /* 12 бит, соответствующих светодиодам */
-  OT_SHIFT, /* Число от 0 до 11 включительно */
+  OT_BITS,  /* Биты, соответствующие светодиодам порта: до 12 бит у физического
+               порта и до ширины регистра у виртуального */
+  OT_SHIFT, /* Число от 0 до ширины регистра порта, не включая её */
+  OT_WIDE,  /* До 48 бит, соответствующих светодиодам матрицы */
+  OT_VECTOR, /* Шестнадцатеричный вектор бит для цепочек сдвиговых регистров */
+  OT_TEXT,  /* Текст в двойных кавычках */
+  OT_COUNT, /* Количество выборок от 1 до CLIENT_MAX_SAMPLES */
+  OT_LEVEL, /* Уровень важности сообщений журнала: имя или число от 0 до 7 */
 } operand_type_t;
 
 /* Распознанная команда */
@@ -31,10 +63,16 @@ typedef struct
   command_type_t command_type;     /* Тип команды */
   leds_operation_t leds_operation; /* Код операции над светодиодами, если operation = CT_LEDS */
   operand_type_t operand_type;     /* Тип операнда для операции над светодиодами */
-  int operand;                     /* Операнд для операции над светодиодами */
+  long long operand;               /* Операнд для операции над светодиодами */
   unsigned parport;                /* Номер параллельного порта в каталоге */
+  char *ports;                     /* Список портов для групповой операции над
+                                      светодиодами или NULL */
+  char *vector;                    /* Шестнадцатеричные цифры вектора, если operand_type = OT_VECTOR */
+  unsigned digits;                 /* Количество цифр вектора */
+  char *text;                      /* Текст без кавычек, если operand_type = OT_TEXT */
   char *error;                     /* Текст ошибки, если operation = CT_WRONG */
   char *rest;                      /* Нераспознанный остаток команды, если operation = CT_WRONG */
+  char *operand_text;              /* Начало операнда в строке команды */
 } command_t;
 
 /* Тип аппендикса команды, задающий номер порта */
@@ -64,6 +102,7 @@ command_definition_t commands[] = {
   {"and",    CT_LEDS, LEDS_AND, OT_BITS,  AT_ON_PORT},
   {"xor",    CT_LEDS, LEDS_XOR, OT_BITS,  AT_ON_PORT},
   {"add",    CT_LEDS, LEDS_ADD, OT_BITS,  AT_ON_PORT},
+  {"subscribe", CT_SUBSCRIBE, LEDS_GET, OT_NONE, AT_NONE}, /* Раньше "sub" из-за общего начала */
   {"sub",    CT_LEDS, LEDS_SUB, OT_BITS,  AT_ON_PORT},
   {"inc",    CT_LEDS, LEDS_INC, OT_NONE,  AT_ON_PORT},
   {"dec",    CT_LEDS, LEDS_DEC, OT_NONE,  AT_ON_PORT},
@@ -71,14 +110,41 @@ command_definition_t commands[] = {
   {"ls",     CT_LEDS, LEDS_LS,  OT_SHIFT, AT_ON_PORT},
   {"rcs",    CT_LEDS, LEDS_RCS, OT_SHIFT, AT_ON_PORT},
   {"lcs",    CT_LEDS, LEDS_LCS, OT_SHIFT, AT_ON_PORT},
+  {"gaps",   CT_GAPS,   LEDS_GET, OT_NONE,  AT_FROM_PORT},
+  {"matrix", CT_MATRIX, LEDS_SET, OT_WIDE,  AT_ON_PORT},
+  {"scan",   CT_SCAN,   LEDS_GET, OT_NONE,  AT_FROM_PORT},
+  {"shift",  CT_SHIFT,  LEDS_SET, OT_VECTOR, AT_ON_PORT},
+  {"frames", CT_FRAMES, LEDS_GET, OT_NONE,  AT_FROM_PORT},
+  {"lcd print", CT_LCD, LEDS_SET, OT_TEXT,  AT_ON_PORT},
+  {"status", CT_STATUS, LEDS_GET, OT_NONE,  AT_FROM_PORT},
+  {"unsubscribe", CT_UNSUBSCRIBE, LEDS_GET, OT_NONE, AT_NONE},
+  {"capture", CT_CAPTURE, LEDS_GET, OT_COUNT, AT_FROM_PORT},
+  {"counter reset", CT_COUNTER_RESET, LEDS_SET, OT_NONE, AT_ON_PORT},
+  {"counter", CT_COUNTER, LEDS_GET, OT_NONE, AT_FROM_PORT},
+  {"heartbeat", CT_HEARTBEAT, LEDS_GET, OT_NONE, AT_NONE},
   {"exit",   CT_EXIT, LEDS_GET, OT_NONE,  AT_NONE},
   {"quit",   CT_EXIT, LEDS_GET, OT_NONE,  AT_NONE},
   {"close",  CT_EXIT, LEDS_GET, OT_NONE,  AT_NONE},
   {"logout", CT_EXIT, LEDS_GET, OT_NONE,  AT_NONE},
+  {"log level", CT_LOG_LEVEL, LEDS_SET, OT_LEVEL, AT_NONE}, /* Позже "logout" из-за общего начала */
+  {"log",    CT_LOG,  LEDS_GET, OT_NONE,  AT_NONE},
+  {"stats ops", CT_STATS_OPS, LEDS_GET, OT_NONE, AT_NONE},
+  {"stats ports", CT_STATS_PORTS, LEDS_GET, OT_NONE, AT_NONE},
+  {"stats",  CT_STATS, LEDS_GET, OT_NONE,  AT_NONE},
+  {"loop measure on", CT_LOOP_ON, LEDS_SET, OT_NONE, AT_NONE},
+  {"loop measure off", CT_LOOP_OFF, LEDS_SET, OT_NONE, AT_NONE},
+  {"loop reset", CT_LOOP_RESET, LEDS_SET, OT_NONE, AT_NONE},
+  {"loop",   CT_LOOP, LEDS_GET, OT_NONE,  AT_NONE},
 };
 
 #define NUM_COMMANDS (sizeof(commands) / sizeof(command_definition_t))
 
+/* Наибольшее количество выборок в одном захвате линий состояния */
+#define CLIENT_MAX_SAMPLES 1000000000ULL
+
+/* Количество команд, выполненных всеми клиентами */
+unsigned long long client_commands = 0;
+
 /* Проверяет строку s на совпадение начала с указанной строкой prefix.
    Если совпадение найдено, возвращается указатель на остаток строки,
    если совпадение не найдено - возвращается NULL */
@@ -135,6 +201,8 @@ char *parse_operand(char *s, command_t *command)
     return NULL;
   }
 
+  command->operand_text = s;
+
   /* Распознаём ключевые слова all и none */
   char *p;
   if (command->operand_type == OT_BITS)
@@ -142,7 +210,7 @@ char *parse_operand(char *s, command_t *command)
     p = is_prefix(s, "all");
     if (p != NULL)
     {
-      command->operand = 0x0FFF;
+      command->operand = LEDS_ALL;
       return skip_spaces(p);
     }
     else
@@ -156,8 +224,118 @@ char *parse_operand(char *s, command_t *command)
     }
   }
 
+  /* Распознаём текст в двойных кавычках. Последовательность \n заменяется
+     прямо в строке на перевод строки, а \" и \\ - на кавычку и обратную черту */
+  if (command->operand_type == OT_TEXT)
+  {
+    if (s[0] != '"')
+    {
+      command->command_type = CT_WRONG;
+      command->leds_operation = LEDS_GET;
+      command->operand_type = OT_NONE;
+      command->operand = -1;
+      command->parport = 0;
+      command->error = "Argument <text> must be enclosed in double quotes";
+      command->rest = s;
+      return NULL;
+    }
+
+    char *text = &(s[1]);
+    char *to = text;
+    for(p = text; (p[0] != '"') && (p[0] != '\0'); p++)
+    {
+      if ((p[0] == '\\') && (p[1] != '\0'))
+      {
+        p++;
+        to[0] = (p[0] == 'n') ? '\n' : p[0];
+      }
+      else
+      {
+        to[0] = p[0];
+      }
+      to++;
+    }
+
+    if (p[0] != '"')
+    {
+      command->command_type = CT_WRONG;
+      command->leds_operation = LEDS_GET;
+      command->operand_type = OT_NONE;
+      command->operand = -1;
+      command->parport = 0;
+      command->error = "Missing closing double quote in argument <text>";
+      command->rest = s;
+      return NULL;
+    }
+
+    /* Закрывающая кавычка находится не раньше конца текста после замен */
+    to[0] = '\0';
+    command->text = text;
+    return skip_spaces(&(p[1]));
+  }
+
+  /* Распознаём уровень важности сообщений журнала */
+  if (command->operand_type == OT_LEVEL)
+  {
+    size_t len = 0;
+    while ((s[len] != '\0') && !isspace(s[len]))
+    {
+      len++;
+    }
+
+    int level = log_level_parse(s, len);
+    if (level == -1)
+    {
+      command->command_type = CT_WRONG;
+      command->leds_operation = LEDS_GET;
+      command->operand_type = OT_NONE;
+      command->operand = -1;
+      command->parport = 0;
+      command->error = "Argument <level> must be one of emerg, alert, crit, err, warning, notice, info, debug";
+      command->rest = s;
+      return NULL;
+    }
+
+    command->operand = level;
+    return skip_spaces(&(s[len]));
+  }
+
+  /* Распознаём вектор бит из шестнадцатеричных цифр, префикс 0x не обязателен */
+  if (command->operand_type == OT_VECTOR)
+  {
+    p = is_prefix(s, "0x");
+    if (p != NULL)
+    {
+      s = p;
+    }
+
+    unsigned digits = 0;
+    while (isxdigit(s[digits]))
+    {
+      digits++;
+    }
+
+    if ((digits == 0) || (digits > PARPORT_SHIFT_MAX_BITS / 4))
+    {
+      command->command_type = CT_WRONG;
+      command->leds_operation = LEDS_GET;
+      command->operand_type = OT_NONE;
+      command->operand = -1;
+      command->parport = 0;
+      command->error = (digits == 0) ? "Argument <vector> starts with unexpected character" :
+                                       "Argument <vector> is too long";
+      command->rest = s;
+      return NULL;
+    }
+
+    command->vector = s;
+    command->digits = digits;
+    return skip_spaces(&(s[digits]));
+  }
+
   /* Распознаём числовые значения операндов */
-  if ((command->operand_type == OT_BITS) || (command->operand_type == OT_SHIFT))
+  if ((command->operand_type == OT_BITS) || (command->operand_type == OT_SHIFT) ||
+      (command->operand_type == OT_WIDE) || (command->operand_type == OT_COUNT))
   {
     /* Если первый символ операнда не является цифрой, то это не число */
     if (!isdigit(s[0]))
@@ -175,12 +353,14 @@ char *parse_operand(char *s, command_t *command)
     /* Выполняем преобразование строки в число */
     errno = 0;
     p = s;
-    unsigned long operand = strtoul(s, &p, 0);
+    unsigned long long operand = strtoull(s, &p, 0);
 
     /* Проверяем выход операнда за пределы допустимых значений */
     if ((errno == ERANGE) ||
-        ((command->operand_type == OT_BITS) && (operand > 0x0FFF)) ||
-        ((command->operand_type == OT_SHIFT) && (operand >= 12)))
+        ((command->operand_type == OT_BITS) && (operand > LEDS_ALL)) ||
+        ((command->operand_type == OT_SHIFT) && (operand >= LEDS_MAX_WIDTH)) ||
+        ((command->operand_type == OT_WIDE) && (operand > 0xFFFFFFFFFFFFULL)) ||
+        ((command->operand_type == OT_COUNT) && (operand > CLIENT_MAX_SAMPLES)))
     {
       command->command_type = CT_WRONG;
       command->leds_operation = LEDS_GET;
@@ -193,22 +373,22 @@ char *parse_operand(char *s, command_t *command)
     }
 
     /* Запоминаем значение операнда */
-    command->operand = (int)operand;
+    command->operand = (long long)operand;
     s = p;
   }
 
   return skip_spaces(s);
 }
 
-/* Разбор команды в строке */
-command_t parse_command(char *s)
+/* Разбор команды в строке без проверки операнда по ширине порта */
+command_t parse_command_text(char *s, parports_t *parports)
 {
   command_t command;
   char *p;
 
   if (s == NULL)
   {
-    log_message(LOG_ERR, "parse_command: source string is NULL pointer");
+    log_message(LOG_ERR, "parse_command_text: source string is NULL pointer");
 
     command.command_type = CT_WRONG;
     command.leds_operation = LEDS_GET;
@@ -236,8 +416,13 @@ command_t parse_command(char *s)
       command.operand_type = commands[i].operand_type;
       command.operand = -1;
       command.parport = 0;
+      command.ports = NULL;
+      command.vector = NULL;
+      command.digits = 0;
+      command.text = NULL;
       command.error = NULL;
       command.rest = NULL;
+      command.operand_text = NULL;
 
       s = skip_spaces(p);
       break;
@@ -259,7 +444,7 @@ command_t parse_command(char *s)
   }
 
   /* Если команде нужен аргумент, то попытаемся его распознать */
-  if ((command.operand_type == OT_BITS) || (command.operand_type == OT_SHIFT))
+  if (command.operand_type != OT_NONE)
   {
     /* Если аргумент не удалось распознать, завершаем работу */
     s = parse_operand(s, &command);
@@ -332,6 +517,49 @@ command_t parse_command(char *s)
     s = skip_spaces(p);
   }
 
+  /* Операцию над светодиодами можно выполнить сразу над несколькими портами:
+     on all ports или on ports <список номеров через запятую> */
+  if ((command.command_type == CT_LEDS) && (commands[i].appendix_type == AT_ON_PORT))
+  {
+    p = is_prefix(s, "all ports");
+    if (p != NULL)
+    {
+      s = skip_spaces(p);
+      if (s[0] != '\0')
+      {
+        command.command_type = CT_WRONG;
+        command.leds_operation = LEDS_GET;
+        command.operand_type = OT_NONE;
+        command.operand = -1;
+        command.parport = 0;
+        command.error = "Unexpected character after keyword 'ports'";
+        command.rest = s;
+        return command;
+      }
+      command.ports = "all";
+      return command;
+    }
+
+    p = is_prefix(s, "ports");
+    if (p != NULL)
+    {
+      s = skip_spaces(p);
+      if (s[0] == '\0')
+      {
+        command.command_type = CT_WRONG;
+        command.leds_operation = LEDS_GET;
+        command.operand_type = OT_NONE;
+        command.operand = -1;
+        command.parport = 0;
+        command.error = "Missing argument <ports>";
+        command.rest = s;
+        return command;
+      }
+      command.ports = s;
+      return command;
+    }
+  }
+
   /* Ищем ключевое слово port */
   p = is_prefix(s, "port");
   if (p == NULL)
@@ -347,8 +575,32 @@ command_t parse_command(char *s)
   }
   s = skip_spaces(p);
 
+  /* Порт можно указать именем, которое начинается с буквы */
+  if (isalpha(s[0]))
+  {
+    size_t len = 0;
+    while (isalnum(s[len]) || (s[len] == '-') || (s[len] == '_') || (s[len] == '.'))
+    {
+      len++;
+    }
+
+    int parport = parports_lookup(parports, s, len);
+    if (parport == -1)
+    {
+      command.command_type = CT_WRONG;
+      command.leds_operation = LEDS_GET;
+      command.operand_type = OT_NONE;
+      command.operand = -1;
+      command.parport = 0;
+      command.error = "Unknown <parport> name";
+      command.rest = s;
+      return command;
+    }
+    command.parport = (unsigned)parport;
+    s = skip_spaces(&(s[len]));
+  }
   /* Если первый символ операнда не является цифрой, то это не число */
-  if (!isdigit(s[0]))
+  else if (!isdigit(s[0]))
   {
     command.command_type = CT_WRONG;
     command.leds_operation = LEDS_GET;
@@ -359,45 +611,109 @@ command_t parse_command(char *s)
     command.rest = s;
     return command;
   }
+  /* В противном случае порт указан номером */
+  else
+  {
+    /* Выполняем преобразование строки с номером порта в число */
+    errno = 0;
+    p = s;
+    unsigned long parport = strtoul(s, &p, 0);
 
-  /* Выполняем преобразование строки с номером порта в число */
-  errno = 0;
-  p = s;
-  unsigned long parport = strtoul(s, &p, 0);
+    /* Анализируем ошибки переполнения */
+    if (errno == ERANGE)
+    {
+      command.command_type = CT_WRONG;
+      command.leds_operation = LEDS_GET;
+      command.operand_type = OT_NONE;
+      command.operand = -1;
+      command.parport = 0;
+      command.error = "Argument <parport> has too big value";
+      command.rest = s;
+      return command;
+    }
+    command.parport = (unsigned)parport;
+    s = skip_spaces(p);
+  }
 
-  /* Анализируем ошибки переполнения */
-  if (errno == ERANGE)
+  /* Если за номером порта идёт какое-то непотребство, сигнализируем об этом */
+  if (s[0] != '\0')
   {
     command.command_type = CT_WRONG;
     command.leds_operation = LEDS_GET;
     command.operand_type = OT_NONE;
     command.operand = -1;
     command.parport = 0;
-    command.error = "Argument <parport> has too big value";
+    command.error = "Unexpected character after <parport> value";
     command.rest = s;
     return command;
   }
-  command.parport = (unsigned)parport;
-  s = skip_spaces(p);
 
-  /* Если за номером порта идёт какое-то непотребство, сигнализируем об этом */
-  if (s[0] != '\0')
+  return command;
+}
+
+/* Разбор команды в строке. Имена портов ищутся в каталоге parports.
+   Операнд операции над светодиодами проверяется по ширине выбранного порта:
+   физический порт и группа зеркальных портов принимают не более 12 бит,
+   а виртуальный порт - не более ширины своего регистра */
+command_t parse_command(char *s, parports_t *parports)
+{
+  command_t command = parse_command_text(s, parports);
+  if ((command.command_type != CT_LEDS) ||
+      ((command.operand_type != OT_BITS) && (command.operand_type != OT_SHIFT)))
+  {
+    return command;
+  }
+
+  /* Групповые операции выполняются только над физическими портами. Если порт
+     не найден, то ошибку сообщит выполнение команды */
+  int width = (command.ports != NULL) ? 12 : parports_width(parports, command.parport);
+  if (width == -1)
+  {
+    return command;
+  }
+
+  if (((command.operand_type == OT_BITS) && (command.operand != LEDS_ALL) &&
+       (command.operand > (1LL << width) - 1)) ||
+      ((command.operand_type == OT_SHIFT) && (command.operand >= width)))
   {
     command.command_type = CT_WRONG;
     command.leds_operation = LEDS_GET;
     command.operand_type = OT_NONE;
+    command.rest = command.operand_text;
     command.operand = -1;
     command.parport = 0;
-    command.error = "Unexpected character after <parport> value";
-    command.rest = s;
-    return command;
+    command.error = "Argument <operand> has too big value";
   }
 
   return command;
 }
 
-#define IN_BUF_SIZE 32
-#define OUT_BUF_SIZE 128
+/* Преобразование шестнадцатеричных цифр вектора в байты в порядке от младших
+   к старшим. Возвращает количество байтов */
+size_t parse_vector(const char *s, unsigned digits, unsigned char *vector)
+{
+  size_t size = (digits + 1) / 2;
+  memset(vector, 0, size);
+
+  /* Последняя цифра соответствует младшим 4 битам вектора */
+  for(unsigned i = 0; i < digits; i++)
+  {
+    char c = s[digits - 1 - i];
+    unsigned value = isdigit(c) ? (unsigned)(c - '0') : (unsigned)(tolower(c) - 'a' + 10);
+    vector[i / 2] |= value << ((i % 2) * 4);
+  }
+
+  return size;
+}
+
+#define IN_BUF_SIZE 256
+#define OUT_BUF_SIZE 512
+
+/* Ответ на команду, которую не удалось выполнить */
+#define CLIENT_FAILED "Failed to execute command.\n"
+
+/* Сообщение клиенту, состояние которого не переносится в новую версию программы */
+#define CLIENT_UPGRADE "Daemon is upgrading, reconnect and repeat the command.\n"
 
 /* Структура данных, содержащая текущее состояние клиента */
 struct client_s
@@ -408,6 +724,24 @@ struct client_s
   /* Указатель на каталог портов, которыми управляет клиент */
   parports_t *parports;
 
+  /* Цикл обработки событий и сокет клиента в нём */
+  evloop_t *evloop;
+  socket_t *socket;
+
+  /* Признак подписки на события и ссылки на предыдущего
+     и следующего клиентов в списке подписчиков */
+  int subscribed;
+  struct client_s *prev;
+  struct client_s *next;
+  unsigned long long dropped; /* Количество событий, не поместившихся в буфер вывода */
+
+  /* Номер порта, на котором идёт захват линий состояния или передаются его
+     данные, или -1. Данные захвата передаются клиенту прямо из буфера
+     захвата вслед за содержимым буфера вывода */
+  int capture;
+  const unsigned char *stream;
+  size_t stream_size;
+
   /* Буферы ввода и вывода и количество байтов в них */
   char in_buf[IN_BUF_SIZE + 1];
   size_t in_size;
@@ -417,131 +751,723 @@ struct client_s
 
 typedef struct client_s client_t;
 
-/* Функция выполнения команды во входном буфере. Должна вызываться тогда,
-   когда во входном буфере будет собрана полная строка. Перед вызовом
-   функции символ перевода строки должен быть заменён на нулевой байт */
-int client_execute_command(client_t *client)
+/* Список клиентов, подписанных на события линий состояния портов */
+client_t *client_subscribers = NULL;
+
+/* Добавить клиента в список подписчиков */
+void client_subscribe(client_t *client)
 {
-  if (client == NULL)
+  if (client->subscribed)
   {
-    log_message(LOG_ERR, "client_execute_command: client pointer is NULL");
-    return -1;
+    return;
   }
 
-  /* Если в выходном буфере есть непрочитанный ответ на предыдущую команду,
-     то новую команду не выполняем */
-  if (client->out_size > 0)
+  client->prev = NULL;
+  client->next = client_subscribers;
+  if (client_subscribers != NULL)
   {
-    log_message(LOG_ERR, "client_execute_command: client not yet readed response on previous command");
-    return -1;
+    client_subscribers->prev = client;
   }
+  client_subscribers = client;
+  client->subscribed = 1;
+}
 
-  /* Если во входном буфере ничего нет, то и команды нет - выполнять нечего */
-  if (client->in_size == 0)
+/* Удалить клиента из списка подписчиков */
+void client_unsubscribe(client_t *client)
+{
+  if (!client->subscribed)
   {
-    log_message(LOG_ERR, "client_execute_command: empty input");
-    return -1;
+    return;
   }
 
-  /* Анализируем команду во входном буфере */
-  command_t command = parse_command(client->in_buf);
+  if (client->prev == NULL)
+  {
+    client_subscribers = client->next;
+  }
+  else
+  {
+    client->prev->next = client->next;
+  }
 
-  /* Распознана команда чтения или изменения состояния светодиодов на параллельном порту */
-  if (command.command_type == CT_LEDS)
+  if (client->next != NULL)
   {
-    ssize_t size = 0;
+    client->next->prev = client->prev;
+  }
 
-    /* Выполняем команду. Если в процессе выполнения произошли ошибки, то сообщаем об этом */
-    int leds = parports_leds_ctl(client->parports, command.parport, command.leds_operation, command.operand);
-    if (leds == -1)
-    {
-      log_message(LOG_ERR, "client_execute_command: failed to execute command");
-      size = snprintf(client->out_buf, OUT_BUF_SIZE, "Failed to execute command.\n");
-    }
-    /* Если в процессе выполнения команды ошибок не было, то возвращаем новое состояние светодиодов */
-    else
-    {
-      size = snprintf(client->out_buf, OUT_BUF_SIZE, "0x%04X\n", leds);
-    }
+  client->prev = NULL;
+  client->next = NULL;
+  client->subscribed = 0;
+}
 
-    /* Если возникил ошибки при формировании ответа в буфере, то клиенту ответ не возвращаем */
-    if (size < 0)
-    {
-      log_message(LOG_ERR, "client_execute_command: failed to prepare response");
-      return -1;
-    }
+/* Количество команд, выполненных всеми клиентами с запуска ведомого процесса */
+unsigned long long client_commands_total()
+{
+  return client_commands;
+}
 
-    /* Ответ в буфере сформирован корректно, заполняем поле размера и проставляем завершающий нулевой байт */
-    client->out_size = size;
-    client->out_buf[client->out_size] = '\0';
-  }
-  /* Распознана команда отключения клиента от сервера */
-  else if (command.command_type == CT_EXIT)
+/* Разослать сообщение всем подписчикам. Сообщение дописывается в буфер вывода
+   подписчика вслед за неотправленными данными, а сокет подписчика начинает
+   ожидать готовности к записи. Если сообщение не помещается в буфер вывода
+   или подписчик ожидает захват, то подписчик его не получит */
+int client_publish(const char *message, void *data)
+{
+  (void)data;
+
+  if (message == NULL)
   {
-    client->exit = 1;
+    log_message(LOG_ERR, "client_publish: message is NULL pointer");
+    return -1;
   }
-  /* В процессе анализа команды во входном буфере были найдены ошибки */
-  else if (command.command_type == CT_WRONG)
+
+  size_t size = strlen(message);
+  int dropped = 0;
+  for(client_t *client = client_subscribers; client != NULL; client = client->next)
   {
-    log_message(LOG_ERR, "client_execute_command: parse_command failed with error '%s', unparsed rest of string - '%s'", command.error, command.rest);
+    /* Событие не должно попасть внутрь двоичных данных захвата */
+    if ((client->capture != -1) || (client->out_size + size > OUT_BUF_SIZE))
+    {
+      client->dropped++;
+      dropped = 1;
+      continue;
+    }
 
-    /* Формируем в буфере ответа сообщение об ошибке */
-    ssize_t size = snprintf(client->out_buf, OUT_BUF_SIZE, "%s, unparsed rest of string: %s\n", command.error, command.rest);
+    memcpy(&(client->out_buf[client->out_size]), message, size);
+    client->out_size += size;
+    client->out_buf[client->out_size] = '\0';
 
-    /* Если возникил ошибки при формировании ответа в буфере, то сообщение об ошибке клиенту не возвращаем */
-    if (size < 0)
+    if (evloop_modify_socket(client->evloop, client->socket, EPOLLOUT) == -1)
     {
-      log_message(LOG_ERR, "client_execute_command: failed to prepare error message");
-      return -1;
+      log_message(LOG_WARNING, "client_publish: warning, evloop_modify_socket failed");
     }
+  }
 
-    /* Сообщение об ошибке в буфере сформировано корректно, заполняем поле размера и проставляем завершающий нулевой байт */
-    client->out_size = size;
-    client->out_buf[client->out_size] = '\0';
-    return -1;
+  /* Текст сообщения не меняется от события к событию, поэтому при потоке
+     событий журнал сводит сообщения в одну запись с количеством повторов */
+  if (dropped)
+  {
+    log_message(LOG_WARNING, "client_publish: warning, event dropped for busy clients");
   }
 
   return 0;
 }
 
-/* Функция обрабатывает очередную порцию данных, попавших в буфер чтения. Среди новых данных
-   ищется конец строки.
-
-   Если конец строки найден, а флаг переполнения буфера не активен, то вызывается обработка команды.
-
-   Если конец строки найден, а флаг переполнени буфера активен, то в ответ возвращается сообщение
-   об ошибке переполнения буфера, а флаг переполнения буфера сбрасывается.
-
-   Если новые данные переполнили буфер, то проставляется флаг переполнения буфера. */
-int client_parse_input(client_t *client, size_t offset, ssize_t size)
+/* Функция окончания захвата: готовит в буфере вывода сводку захвата,
+   за которой клиенту будут переданы данные захвата */
+int client_capture_done(void *data)
 {
-  if (client == NULL)
+  if (data == NULL)
   {
-    log_message(LOG_ERR, "client_parse_input: client pointer is NULL");
+    log_message(LOG_ERR, "client_capture_done: data is NULL pointer");
     return -1;
   }
 
-  if (size < 0)
+  client_t *client = data;
+
+  /* Оставляем в буфере место для символа перевода строки */
+  int size = parports_capture_result(client->parports, client->capture, client->out_buf, OUT_BUF_SIZE - 1,
+                                     &(client->stream), &(client->stream_size));
+  if (size == -1)
   {
-    log_message(LOG_ERR, "client_parse_input: negative size of readed data");
-    return -1;
+    log_message(LOG_ERR, "client_capture_done: failed to get capture result");
+    if (parports_capture_release(client->parports, client->capture) == -1)
+    {
+      log_message(LOG_WARNING, "client_capture_done: warning, parports_capture_release failed");
+    }
+    client->capture = -1;
+    client->stream = NULL;
+    client->stream_size = 0;
+    size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+  }
+  else
+  {
+    client->out_buf[size++] = '\n';
   }
 
-  /* Увеличиваем размер данных в буфере чтения на величину новой порции данных */
-  client->in_size += size;
+  client->out_size = size;
+  client->out_buf[client->out_size] = '\0';
 
-  /* Ищем в новых данных символ конца строки */
-  for(size_t p = offset; p < client->in_size; p++)
+  if (evloop_modify_socket(client->evloop, client->socket, EPOLLOUT) == -1)
   {
-    /* Если найден конец строки, то обрабатываем строку */
-    if (client->in_buf[p] == '\n')
-    {
-      client->in_buf[p] = '\0';
+    log_message(LOG_ERR, "client_capture_done: evloop_modify_socket failed");
+    return -1;
+  }
 
-      /* Если не было переполнения буфера ввода, то пытаемся выполнить команду */
-      if (client->overflow == 0)
-      {
-        /* Если выполнение команды не было успешным, то сообщаем об этом в журнал */
+  return 0;
+}
+
+/* Номер порта, к которому относится команда, или -1, если команда
+   не относится к одному порту */
+int command_parport(const command_t *command)
+{
+  switch (command->command_type)
+  {
+    case CT_LEDS:
+      return (command->ports == NULL) ? (int)command->parport : -1;
+    case CT_GAPS:
+    case CT_MATRIX:
+    case CT_SCAN:
+    case CT_SHIFT:
+    case CT_FRAMES:
+    case CT_LCD:
+    case CT_STATUS:
+    case CT_CAPTURE:
+    case CT_COUNTER:
+    case CT_COUNTER_RESET:
+      return (int)command->parport;
+    default:
+      return -1;
+  }
+}
+
+/* Выполнение разобранной команды и подготовка ответа в буфере вывода.
+   В outcome возвращается результат выполнения команды для статистики */
+int client_run_command(client_t *client, command_t command, stats_outcome_t *outcome)
+{
+  *outcome = STATS_OK;
+
+  /* Распознана команда изменения состояния светодиодов сразу на нескольких портах */
+  if ((command.command_type == CT_LEDS) && (command.ports != NULL))
+  {
+    ssize_t size = 0;
+
+    /* Выполняем команду над всеми указанными портами сразу */
+    int changed = parports_bulk_leds_ctl(client->parports, command.ports, command.leds_operation, command.operand);
+    if (changed == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to execute command");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, "changed=%d\n", changed);
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда чтения или изменения состояния светодиодов на параллельном порту */
+  else if (command.command_type == CT_LEDS)
+  {
+    ssize_t size = 0;
+
+    /* Выполняем команду. Если в процессе выполнения произошли ошибки, то сообщаем об этом */
+    long long leds = parports_leds_ctl(client->parports, command.parport, command.leds_operation, command.operand);
+    if (leds == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to execute command");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    /* Если в процессе выполнения команды ошибок не было, то возвращаем новое состояние светодиодов */
+    else
+    {
+      /* Состояние широкого виртуального порта выводим всеми 12 цифрами */
+      if (parports_width(client->parports, command.parport) > 12)
+      {
+        size = snprintf(client->out_buf, OUT_BUF_SIZE, "0x%012llX\n", leds);
+      }
+      else
+      {
+        size = snprintf(client->out_buf, OUT_BUF_SIZE, "0x%04llX\n", leds);
+      }
+    }
+
+    /* Если возникил ошибки при формировании ответа в буфере, то клиенту ответ не возвращаем */
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    /* Ответ в буфере сформирован корректно, заполняем поле размера и проставляем завершающий нулевой байт */
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда получения статистики записей регистров порта */
+  else if (command.command_type == CT_GAPS)
+  {
+    /* Оставляем в буфере место для символа перевода строки */
+    int size = parports_gaps(client->parports, command.parport, client->out_buf, OUT_BUF_SIZE - 1);
+    if (size == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to get gaps");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      client->out_buf[size++] = '\n';
+    }
+
+    /* Если возникли ошибки при формировании ответа в буфере, то клиенту ответ не возвращаем */
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда записи кадрового буфера матрицы */
+  else if (command.command_type == CT_MATRIX)
+  {
+    ssize_t size = 0;
+
+    long long bits = parports_matrix_set(client->parports, command.parport, command.operand);
+    if (bits == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to set matrix");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, "0x%09llX\n", bits);
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда получения счётчиков развёртки матрицы */
+  else if (command.command_type == CT_SCAN)
+  {
+    /* Оставляем в буфере место для символа перевода строки */
+    int size = parports_scan(client->parports, command.parport, client->out_buf, OUT_BUF_SIZE - 1);
+    if (size == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to get scan counters");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      client->out_buf[size++] = '\n';
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда вывода на цепочки сдвиговых регистров или получения
+     счётчиков вывода. В ответ на обе команды возвращаются счётчики вывода */
+  else if ((command.command_type == CT_SHIFT) || (command.command_type == CT_FRAMES))
+  {
+    int size = 0;
+
+    if (command.command_type == CT_SHIFT)
+    {
+      unsigned char vector[PARPORT_SHIFT_MAX_BITS / 8];
+      size_t n = parse_vector(command.vector, command.digits, vector);
+      if (parports_shift(client->parports, command.parport, vector, n) == -1)
+      {
+        log_message(LOG_ERR, "client_run_command: failed to shift vector");
+        size = -1;
+      }
+    }
+
+    /* Оставляем в буфере место для символа перевода строки */
+    if (size != -1)
+    {
+      size = parports_shift_stats(client->parports, command.parport, client->out_buf, OUT_BUF_SIZE - 1);
+    }
+
+    if (size == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to execute command");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      client->out_buf[size++] = '\n';
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда вывода текста на символьный индикатор */
+  else if (command.command_type == CT_LCD)
+  {
+    ssize_t size = 0;
+
+    /* В ответ возвращаем количество символов, изменившихся относительно предыдущего текста */
+    int sent = parports_lcd_print(client->parports, command.parport, command.text);
+    if (sent == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to print on lcd");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, "changed=%d\n", sent);
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда чтения линий состояния порта */
+  else if (command.command_type == CT_STATUS)
+  {
+    ssize_t size = 0;
+
+    int status = parports_status(client->parports, command.parport);
+    if (status == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to get status");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, "0x%02X\n", status);
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда подписки на события или отказа от неё */
+  else if ((command.command_type == CT_SUBSCRIBE) || (command.command_type == CT_UNSUBSCRIBE))
+  {
+    if (command.command_type == CT_SUBSCRIBE)
+    {
+      client_subscribe(client);
+    }
+    else
+    {
+      client_unsubscribe(client);
+    }
+
+    client->out_size = snprintf(client->out_buf, OUT_BUF_SIZE, "OK\n");
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда чтения счётчика импульсов или его сброса.
+     При сбросе возвращается значение счётчика перед сбросом */
+  else if ((command.command_type == CT_COUNTER) || (command.command_type == CT_COUNTER_RESET))
+  {
+    ssize_t size = 0;
+
+    unsigned long long count;
+    if (parports_counter(client->parports, command.parport,
+                         command.command_type == CT_COUNTER_RESET, &count) == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to get counter");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, "count=%llu\n", count);
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда получения задержек ответа на проверки работоспособности */
+  else if (command.command_type == CT_HEARTBEAT)
+  {
+    /* Оставляем в буфере место для символа перевода строки */
+    int size = slave_heartbeat_report(client->out_buf, OUT_BUF_SIZE - 1);
+    if (size == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to get heartbeat");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      client->out_buf[size++] = '\n';
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда получения или смены уровня журнала. Уровень меняется
+     только в этом ведомом процессе и сбрасывается при его перезапуске */
+  else if ((command.command_type == CT_LOG) || (command.command_type == CT_LOG_LEVEL))
+  {
+    ssize_t size = 0;
+
+    if ((command.command_type == CT_LOG_LEVEL) && (log_set_level(command.operand) == -1))
+    {
+      log_message(LOG_ERR, "client_run_command: log level %s is not available", log_level_name(command.operand));
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, "level=%s dropped=%llu\n",
+                      log_level_name(log_level), log_dropped());
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда получения статистики ведомого процесса */
+  else if ((command.command_type == CT_STATS) || (command.command_type == CT_STATS_OPS) ||
+           (command.command_type == CT_STATS_PORTS))
+  {
+    /* Оставляем в буфере место для символа перевода строки */
+    int size;
+    if (command.command_type == CT_STATS)
+    {
+      size = stats_report(client->out_buf, OUT_BUF_SIZE - 1);
+    }
+    else if (command.command_type == CT_STATS_OPS)
+    {
+      size = stats_report_operations(client->out_buf, OUT_BUF_SIZE - 1);
+    }
+    else
+    {
+      size = stats_report_ports(client->out_buf, OUT_BUF_SIZE - 1);
+    }
+
+    if (size == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to get stats");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      client->out_buf[size++] = '\n';
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда получения, сброса статистики цикла обработки событий
+     или включения и выключения её сбора */
+  else if ((command.command_type == CT_LOOP) || (command.command_type == CT_LOOP_ON) ||
+           (command.command_type == CT_LOOP_OFF) || (command.command_type == CT_LOOP_RESET))
+  {
+    if (command.command_type == CT_LOOP_ON)
+    {
+      evloop_set_measure(1);
+    }
+    else if (command.command_type == CT_LOOP_OFF)
+    {
+      evloop_set_measure(0);
+    }
+    else if (command.command_type == CT_LOOP_RESET)
+    {
+      evloop_stats_reset(client->evloop);
+    }
+
+    /* Оставляем в буфере место для символа перевода строки */
+    int size = evloop_report(client->evloop, client->out_buf, OUT_BUF_SIZE - 1);
+    if (size == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to get event loop stats");
+      *outcome = STATS_FAILED;
+      size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+    }
+    else
+    {
+      client->out_buf[size++] = '\n';
+    }
+
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare response");
+      return -1;
+    }
+
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+  }
+  /* Распознана команда захвата линий состояния порта. Ответ будет
+     сформирован по окончании захвата функцией client_capture_done */
+  else if (command.command_type == CT_CAPTURE)
+  {
+    if (parports_capture(client->parports, command.parport, command.operand, client_capture_done, client) == -1)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to start capture");
+      *outcome = STATS_FAILED;
+      client->out_size = snprintf(client->out_buf, OUT_BUF_SIZE, CLIENT_FAILED);
+      client->out_buf[client->out_size] = '\0';
+    }
+    else
+    {
+      client->capture = command.parport;
+    }
+  }
+  /* Распознана команда отключения клиента от сервера */
+  else if (command.command_type == CT_EXIT)
+  {
+    client->exit = 1;
+  }
+  /* В процессе анализа команды во входном буфере были найдены ошибки */
+  else if (command.command_type == CT_WRONG)
+  {
+    *outcome = STATS_WRONG;
+    log_message(LOG_ERR, "client_run_command: parse_command failed with error '%s', unparsed rest of string - '%s'", command.error, command.rest);
+
+    /* Формируем в буфере ответа сообщение об ошибке */
+    ssize_t size = snprintf(client->out_buf, OUT_BUF_SIZE, "%s, unparsed rest of string: %s\n", command.error, command.rest);
+
+    /* Если возникил ошибки при формировании ответа в буфере, то сообщение об ошибке клиенту не возвращаем */
+    if (size < 0)
+    {
+      log_message(LOG_ERR, "client_run_command: failed to prepare error message");
+      return -1;
+    }
+
+    /* Сообщение об ошибке в буфере сформировано корректно, заполняем поле размера и проставляем завершающий нулевой байт */
+    client->out_size = size;
+    client->out_buf[client->out_size] = '\0';
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Функция выполнения команды во входном буфере. Должна вызываться тогда,
+   когда во входном буфере будет собрана полная строка. Перед вызовом
+   функции символ перевода строки должен быть заменён на нулевой байт */
+int client_execute_command(client_t *client)
+{
+  if (client == NULL)
+  {
+    log_message(LOG_ERR, "client_execute_command: client pointer is NULL");
+    return -1;
+  }
+
+  /* Если в выходном буфере есть непрочитанный ответ на предыдущую команду,
+     то новую команду не выполняем */
+  if (client->out_size > 0)
+  {
+    log_message(LOG_ERR, "client_execute_command: client not yet readed response on previous command");
+    return -1;
+  }
+
+  /* Если во входном буфере ничего нет, то и команды нет - выполнять нечего */
+  if (client->in_size == 0)
+  {
+    log_message(LOG_ERR, "client_execute_command: empty input");
+    return -1;
+  }
+
+  /* Анализируем команду во входном буфере */
+  long long start = timer_now_ns();
+  command_t command = parse_command(client->in_buf, client->parports);
+  stats_latency(STATS_PARSE, timer_now_ns() - start);
+  client_commands++;
+
+  stats_outcome_t outcome;
+  int result = client_run_command(client, command, &outcome);
+
+  /* Команда, ответ на которую не удалось подготовить, тоже не выполнена */
+  if ((result == -1) && (outcome == STATS_OK))
+  {
+    outcome = STATS_FAILED;
+  }
+  stats_command((command.command_type == CT_LEDS) ? (int)command.leds_operation : -1,
+                command_parport(&command), outcome);
+  stats_latency(STATS_REQUEST, timer_now_ns() - start);
+
+  return result;
+}
+
+/* Функция обрабатывает очередную порцию данных, попавших в буфер чтения. Среди новых данных
+   ищется конец строки.
+
+   Если конец строки найден, а флаг переполнения буфера не активен, то вызывается обработка команды.
+
+   Если конец строки найден, а флаг переполнени буфера активен, то в ответ возвращается сообщение
+   об ошибке переполнения буфера, а флаг переполнения буфера сбрасывается.
+
+   Если новые данные переполнили буфер, то проставляется флаг переполнения буфера. */
+int client_parse_input(client_t *client, size_t offset, ssize_t size)
+{
+  if (client == NULL)
+  {
+    log_message(LOG_ERR, "client_parse_input: client pointer is NULL");
+    return -1;
+  }
+
+  if (size < 0)
+  {
+    log_message(LOG_ERR, "client_parse_input: negative size of readed data");
+    return -1;
+  }
+
+  /* Увеличиваем размер данных в буфере чтения на величину новой порции данных */
+  client->in_size += size;
+
+  /* Ищем в новых данных символ конца строки */
+  for(size_t p = offset; p < client->in_size; p++)
+  {
+    /* Если найден конец строки, то обрабатываем строку */
+    if (client->in_buf[p] == '\n')
+    {
+      client->in_buf[p] = '\0';
+
+      /* Если не было переполнения буфера ввода, то пытаемся выполнить команду */
+      if (client->overflow == 0)
+      {
+        /* Если выполнение команды не было успешным, то сообщаем об этом в журнал */
         if (client_execute_command(client) == -1)
         { 
           log_message(LOG_WARNING, "client_parse_input: warning, client_execute_command failed");
@@ -592,7 +1518,7 @@ int client_process_event(int fd, int events, void *data)
 
   /* Если клиент прочитал ответ на предыдущий запрос и отправляет новый запрос,
      то читаем поступающие данные в буфер ввода */
-  if ((client->out_size == 0) && (events & EPOLLIN))
+  if ((client->out_size == 0) && (client->capture == -1) && (events & EPOLLIN))
   {
     /* Пытаемся прочитать данные в свободную часть буфера */
     ssize_t r = read(fd, &(client->in_buf[client->in_size]), IN_BUF_SIZE - client->in_size);
@@ -627,6 +1553,31 @@ int client_process_event(int fd, int events, void *data)
     }
   }
 
+  /* Если буфер вывода опустошён, то передаём клиенту данные захвата, а после
+     передачи всех данных освобождаем захват */
+  if ((client->out_size == 0) && (client->stream != NULL) && (events & EPOLLOUT))
+  {
+    if (client->stream_size > 0)
+    {
+      ssize_t w = write(fd, client->stream, client->stream_size);
+      if (w > 0)
+      {
+        client->stream += w;
+        client->stream_size -= w;
+      }
+    }
+
+    if (client->stream_size == 0)
+    {
+      if (parports_capture_release(client->parports, client->capture) == -1)
+      {
+        log_message(LOG_WARNING, "client_process_event: warning, parports_capture_release failed");
+      }
+      client->capture = -1;
+      client->stream = NULL;
+    }
+  }
+
   /* Если клиент ввёл команду завершения сеанса, то завершаем работу с клиентом */
   if (client->exit == 1)
   {
@@ -644,15 +1595,62 @@ int client_process_event(int fd, int events, void *data)
 
   /* Если есть данные для отправки, то не принимаем от клиента новые команды,
      пока он не прочитает ответ на уже выполенную команду */
-  if (client->out_size > 0)
+  if ((client->out_size > 0) || (client->stream != NULL))
   {
     return EPOLLOUT;
   }
 
+  /* Пока идёт захват, новые команды не принимаются. События EPOLLHUP epoll
+     сообщает всегда, поэтому сокет ожидает только отключения клиента,
+     которое прервёт захват */
+  if (client->capture != -1)
+  {
+    return EPOLLHUP;
+  }
+
   /* Если данных для отправки, то ожидаем поступления новых команд от клиента */
   return EPOLLIN;
 }
 
+/* Проверка, что клиента можно передать новой версии программы одним сокетом.
+   Неотправленный ответ клиенту пытаемся дописать без ожидания. Если после
+   этого у клиента остались недочитанная команда, неотправленные данные,
+   подписка на события или захват, то они не переносятся, поэтому сообщаем
+   об этом клиенту и возвращаем 0, чтобы клиента отключили до передачи */
+int client_handoff_keep(int fd, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "client_handoff_keep: data is NULL pointer");
+    return 0;
+  }
+
+  client_t *client = data;
+
+  if (client->out_size > 0)
+  {
+    ssize_t w = send(fd, client->out_buf, client->out_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (w > 0)
+    {
+      memmove(client->out_buf, &(client->out_buf[w]), client->out_size - w);
+      client->out_size -= w;
+    }
+  }
+
+  if ((client->in_size == 0) && (client->out_size == 0) &&
+      !client->subscribed && (client->capture == -1))
+  {
+    return 1;
+  }
+
+  /* Сообщение не должно попасть внутрь неотправленного ответа */
+  if (client->out_size == 0)
+  {
+    send(fd, CLIENT_UPGRADE, strlen(CLIENT_UPGRADE), MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  return 0;
+}
+
 /* Освобождение памяти, занятых приватными данными клиента */
 int client_destroy(void *data)
 {
@@ -662,13 +1660,29 @@ int client_destroy(void *data)
     return -1;
   }
 
-  free(data);
+  client_t *client = data;
+  client_unsubscribe(client);
+
+  /* Прерываем захват, который ожидал клиент */
+  if ((client->capture != -1) &&
+      (parports_capture_release(client->parports, client->capture) == -1))
+  {
+    log_message(LOG_WARNING, "client_destroy: warning, parports_capture_release failed");
+  }
+
+  free(client);
   return 0;
 }
 
 /* Создание клиента, управляющего светодиодами на параллельных портах */
-socket_t *client_create(int fd, parports_t *parports)
+socket_t *client_create(int fd, evloop_t *evloop, parports_t *parports)
 {
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "client_create: evloop is NULL pointer");
+    return NULL;
+  }
+
   if (parports == NULL)
   {
     log_message(LOG_ERR, "client_create: parports is NULL pointer");
@@ -685,6 +1699,14 @@ socket_t *client_create(int fd, parports_t *parports)
   client->overflow = 0;
   client->exit = 0;
   client->parports = parports;
+  client->evloop = evloop;
+  client->subscribed = 0;
+  client->prev = NULL;
+  client->next = NULL;
+  client->dropped = 0;
+  client->capture = -1;
+  client->stream = NULL;
+  client->stream_size = 0;
   client->in_size = 0;
   client->out_size = 0;
 
@@ -696,6 +1718,8 @@ socket_t *client_create(int fd, parports_t *parports)
     free(client);
     return NULL;
   }
+  socket_set_name(socket, "client");
+  client->socket = socket;
 
   return socket;
 }
@@ -4,6 +4,23 @@
 #include "parports.h"
 
 /* Создание клиента, управляющего светодиодами на параллельных портах */
-socket_t *client_create(int fd, parports_t *parports);
+socket_t *client_create(int fd, evloop_t *evloop, parports_t *parports);
+
+/* Обработчик событий в сокете клиента. По нему клиенты отличаются от других
+   сокетов в цикле обработки событий */
+int client_process_event(int fd, int events, void *data);
+
+/* Проверка, что клиента можно передать новой версии программы одним сокетом.
+   Клиенту с недочитанной командой, неотправленным ответом, подпиской на
+   события или захватом сообщает, что его состояние не переносится, и
+   возвращает 0. Подходит в качестве функции keep для evloop_prune */
+int client_handoff_keep(int fd, void *data);
+
+/* Количество команд, выполненных всеми клиентами с запуска ведомого процесса */
+unsigned long long client_commands_total();
+
+/* Разослать сообщение клиентам, подписанным на события командой subscribe.
+   Подходит в качестве функции рассылки для parports_set_publish */
+int client_publish(const char *message, void *data);
 
 #endif
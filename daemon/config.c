@@ -8,6 +8,7 @@
 #include <limits.h>
 #include "daemon.h"
 #include "config.h"
+#include "metrics.h"
 
 /* Возвращает идентификатор пользователя, соответствующий указанному имени пользователя */
 int get_uid(const char *user)
@@ -269,6 +270,197 @@ int parse_mode(const char *s)
   return (int)mode;
 }
 
+/* Преобразование строки с размерами вида <a>x<b> в пару беззнаковых целых чисел */
+int parse_size(const char *s, unsigned *a, unsigned *b)
+{
+  if (s == NULL)
+  {
+    log_message(LOG_ERR, "parse_size: source string is NULL pointer");
+    return -1;
+  }
+
+  if ((a == NULL) || (b == NULL))
+  {
+    log_message(LOG_ERR, "parse_size: target is NULL pointer");
+    return -1;
+  }
+
+  /* Ищем разделитель размеров */
+  const char *x = strchr(s, 'x');
+  if ((x == NULL) || (x == s) || ((size_t)(x - s) >= 16))
+  {
+    log_message(LOG_ERR, "parse_size: wrong size: %s", s);
+    return -1;
+  }
+
+  /* Копируем первый размер, чтобы отделить его от второго */
+  char first[16];
+  memcpy(first, s, x - s);
+  first[x - s] = '\0';
+
+  if ((parse_ui(first, a) == -1) || (parse_ui(x + 1, b) == -1))
+  {
+    log_message(LOG_ERR, "parse_size: wrong size: %s", s);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Преобразование раскладки виртуального порта вида <P>:<B>[-<B>][,...] в массивы
+   номеров портов и светодиодов. Биты логического регистра назначаются по порядку,
+   начиная с младшего, диапазон светодиодов может быть и убывающим */
+int parse_layout(const char *s, unsigned *ports, unsigned *bits, unsigned *width)
+{
+  if (s == NULL)
+  {
+    log_message(LOG_ERR, "parse_layout: source string is NULL pointer");
+    return -1;
+  }
+
+  if ((ports == NULL) || (bits == NULL) || (width == NULL))
+  {
+    log_message(LOG_ERR, "parse_layout: target is NULL pointer");
+    return -1;
+  }
+
+  *width = 0;
+  const char *p = s;
+  while (1)
+  {
+    char *q;
+    unsigned long port, first, last;
+
+    /* Номер физического порта и двоеточие */
+    if (!isdigit(p[0]))
+    {
+      break;
+    }
+    port = strtoul(p, &q, 10);
+    if (q[0] != ':')
+    {
+      break;
+    }
+    p = q + 1;
+
+    /* Номер светодиода или диапазон номеров через дефис */
+    if (!isdigit(p[0]))
+    {
+      break;
+    }
+    first = strtoul(p, &q, 10);
+    last = first;
+    if (q[0] == '-')
+    {
+      p = q + 1;
+      if (!isdigit(p[0]))
+      {
+        break;
+      }
+      last = strtoul(p, &q, 10);
+    }
+    p = q;
+
+    if ((port > UINT_MAX) || (first >= 12) || (last >= 12))
+    {
+      break;
+    }
+
+    for(unsigned long bit = first; ; bit = (first <= last) ? bit + 1 : bit - 1)
+    {
+      if (*width >= LEDS_MAX_WIDTH)
+      {
+        log_message(LOG_ERR, "parse_layout: too many bits in layout: %s", s);
+        return -1;
+      }
+      ports[*width] = (unsigned)port;
+      bits[*width] = (unsigned)bit;
+      (*width)++;
+
+      if (bit == last)
+      {
+        break;
+      }
+    }
+
+    /* Раскладка закончилась или продолжается после запятой */
+    if (p[0] == '\0')
+    {
+      return 0;
+    }
+    if (p[0] != ',')
+    {
+      break;
+    }
+    p++;
+  }
+
+  log_message(LOG_ERR, "parse_layout: wrong layout: %s", s);
+  return -1;
+}
+
+/* Преобразование списка номеров портов через запятую в массив из не более чем
+   size номеров */
+int parse_list(const char *s, unsigned *ports, unsigned size, unsigned *num)
+{
+  if (s == NULL)
+  {
+    log_message(LOG_ERR, "parse_list: source string is NULL pointer");
+    return -1;
+  }
+
+  if ((ports == NULL) || (num == NULL))
+  {
+    log_message(LOG_ERR, "parse_list: target is NULL pointer");
+    return -1;
+  }
+
+  *num = 0;
+  const char *p = s;
+  while (isdigit(p[0]) && (*num < size))
+  {
+    char *q;
+    unsigned long port = strtoul(p, &q, 10);
+    if (port > UINT_MAX)
+    {
+      break;
+    }
+    ports[*num] = (unsigned)port;
+    (*num)++;
+
+    if (q[0] == '\0')
+    {
+      return 0;
+    }
+    if (q[0] != ',')
+    {
+      break;
+    }
+    p = q + 1;
+  }
+
+  log_message(LOG_ERR, "parse_list: wrong list: %s", s);
+  return -1;
+}
+
+/* Проверка, что опция настраивает драйвер последнего указанного физического порта */
+int config_driver_option(const char *option)
+{
+  static const char *options[] = {"--matrix", "--shift", "--lcd", "--lcd-4bit",
+                                  "--scan-rate", "--scan-cpu", "--sampler",
+                                  "--sampler-cpu", "--counter", "--input",
+                                  "--debounce"};
+
+  for(unsigned k = 0; k < sizeof(options) / sizeof(options[0]); k++)
+  {
+    if (strcmp(option, options[k]) == 0)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 /* Функция выполняет разбор переданных аргументов и возвращает структуру со
    значениями настроек программы */
 config_t *config_create(const int carg, const char **varg)
@@ -293,8 +485,18 @@ config_t *config_create(const int carg, const char **varg)
   config->uid = -1;
   config->gid = -1;
   config->chroot_pathname = NULL;
+  config->order = ORDER_DATA_FIRST;
+  config->measure = 0;
+  config->refresh = 0;
+  config->log_level = DEFAULT_LOG_LEVEL;
+  config->metrics_address = NULL;
+  config->measure_loop = 0;
 #ifndef LITE
   config->daemon = 0;
+  config->heartbeat = DEFAULT_HEARTBEAT;
+  config->heartbeat_misses = DEFAULT_HEARTBEAT_MISSES;
+  config->shards = NULL;
+  config->shards_num = 0;
 #endif
   config->mode = MODE_RUN;
 
@@ -307,10 +509,29 @@ config_t *config_create(const int carg, const char **varg)
     return NULL;
   }
 
+  /* Признак того, что порты перечислены в файле со списком портов */
+  int reload = 0;
+
+  /* Признак того, что указаны виртуальные порты или группы зеркальных портов */
+  int virtual = 0;
+
+  /* Признак того, что последним указан виртуальный порт или группа зеркальных портов */
+  int last_virtual = 0;
+
   /* Перебираем аргументы командной строки, ищем среди них названия опций и
      заполняем структуру значениями аргументов */
   for(int i=1; i < carg; i++)
   {
+    /* Опции драйверов относятся к последнему физическому порту, поэтому после
+       виртуального порта или группы зеркальных портов они молча настроили бы
+       не тот порт, за которым указаны */
+    if (last_virtual && config_driver_option(varg[i]))
+    {
+      log_message(LOG_ERR, "config_create: option %s cannot be used for virtual or mirror port", varg[i]);
+      config->mode = MODE_HELP;
+      return config;
+    }
+
     /* Разбор опции, указывающей путь к ещё одному файлу устройства параллельного порта */
     if (strcmp(varg[i], "--parport") == 0)
     {
@@ -323,6 +544,7 @@ config_t *config_create(const int carg, const char **varg)
           config->mode = MODE_HELP;
           return config;
         }
+        last_virtual = 0;
       }
       else
       {
@@ -352,6 +574,118 @@ config_t *config_create(const int carg, const char **varg)
         return config;
       }
     }
+    /* Разбор опции, указывающей период проверки работоспособности ведомого процесса */
+    else if (strcmp(varg[i], "--heartbeat") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        if ((parse_ui(varg[i], &(config->heartbeat)) == -1) ||
+            ((config->heartbeat != 0) && (config->heartbeat < 10)) ||
+            (config->heartbeat > 60000))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --heartbeat");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --heartbeat");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, указывающей количество пропущенных проверок до перезапуска */
+    else if (strcmp(varg[i], "--heartbeat-misses") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        if ((parse_ui(varg[i], &(config->heartbeat_misses)) == -1) ||
+            (config->heartbeat_misses < 1) || (config->heartbeat_misses > 100))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --heartbeat-misses");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --heartbeat-misses");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, добавляющей шард - ведомый процесс для указанных портов */
+    else if (strcmp(varg[i], "--shard") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        shard_t *shards = realloc(config->shards, sizeof(shard_t) * (config->shards_num + 1));
+        if (shards == NULL)
+        {
+          log_message(LOG_ERR, "config_create: failed to allocate memory for shard");
+          config->mode = MODE_HELP;
+          return config;
+        }
+        config->shards = shards;
+        config->shards[config->shards_num].ports = varg[i];
+        config->shards[config->shards_num].pathname = NULL;
+        config->shards[config->shards_num].cpu = -1;
+        config->shards_num++;
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --shard");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, указывающей путь к Unix-сокету последнего указанного шарда */
+    else if (strcmp(varg[i], "--shard-socket") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        if (config->shards_num == 0)
+        {
+          log_message(LOG_ERR, "config_create: option --shard-socket must follow option --shard");
+          config->mode = MODE_HELP;
+          return config;
+        }
+        config->shards[config->shards_num - 1].pathname = varg[i];
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --shard-socket");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, указывающей процессор для последнего указанного шарда */
+    else if (strcmp(varg[i], "--shard-cpu") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned cpu;
+        if ((config->shards_num == 0) || (parse_ui(varg[i], &cpu) == -1) || (cpu > INT_MAX))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --shard-cpu");
+          config->mode = MODE_HELP;
+          return config;
+        }
+        config->shards[config->shards_num - 1].cpu = (int)cpu;
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --shard-cpu");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
 #endif
     /* Разбор опции, указывающей путь к Unix-сокету, на который будут поступать
        входящие подключения */
@@ -491,6 +825,405 @@ config_t *config_create(const int carg, const char **varg)
         return config;
       }
     }
+    /* Разбор опции, указывающей порядок записи регистров данных и управления */
+    else if (strcmp(varg[i], "--update-order") == 0)
+    {
+      i++;
+      if (i >= carg)
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --update-order");
+        config->mode = MODE_HELP;
+        return config;
+      }
+      else if (strcmp(varg[i], "data") == 0)
+      {
+        config->order = ORDER_DATA_FIRST;
+      }
+      else if (strcmp(varg[i], "control") == 0)
+      {
+        config->order = ORDER_CONTROL_FIRST;
+      }
+      else if (strcmp(varg[i], "auto") == 0)
+      {
+        config->order = ORDER_AUTO;
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: wrong value for option --update-order");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, задающей наименее важный уровень сообщений в журнале */
+    else if (strcmp(varg[i], "--log-level") == 0)
+    {
+      i++;
+      if (i >= carg)
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --log-level");
+        config->mode = MODE_HELP;
+        return config;
+      }
+
+      config->log_level = log_level_parse(varg[i], strlen(varg[i]));
+      if ((config->log_level == -1) || (config->log_level > LOG_LEVEL_FLOOR))
+      {
+        log_message(LOG_ERR, "config_create: wrong value for option --log-level");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, задающей адрес слушающего сокета метрик */
+    else if (strcmp(varg[i], "--metrics") == 0)
+    {
+      i++;
+      if (i >= carg)
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --metrics");
+        config->mode = MODE_HELP;
+        return config;
+      }
+
+      if (metrics_check_address(varg[i]) == -1)
+      {
+        log_message(LOG_ERR, "config_create: wrong value for option --metrics");
+        config->mode = MODE_HELP;
+        return config;
+      }
+      config->metrics_address = varg[i];
+    }
+    /* Разбор опции, включающей измерение промежутков между записями регистров */
+    else if (strcmp(varg[i], "--measure-gaps") == 0)
+    {
+      config->measure = 1;
+    }
+    /* Разбор опции, включающей сбор статистики цикла обработки событий */
+    else if (strcmp(varg[i], "--measure-loop") == 0)
+    {
+      config->measure_loop = 1;
+    }
+    /* Разбор опции, включающей кадровый режим с указанной частотой кадров */
+    else if (strcmp(varg[i], "--refresh") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        if ((parse_ui(varg[i], &(config->refresh)) == -1) ||
+            (config->refresh < 1) || (config->refresh > 1000))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --refresh");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --refresh");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, подключающей к последнему указанному порту светодиодную матрицу */
+    else if (strcmp(varg[i], "--matrix") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned rows;
+        unsigned cols;
+        if ((parse_size(varg[i], &rows, &cols) == -1) ||
+            (parports_set_matrix(config->parports, rows, cols) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --matrix");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --matrix");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, подключающей к последнему указанному порту цепочки сдвиговых регистров */
+    else if (strcmp(varg[i], "--shift") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned chains;
+        unsigned length;
+        if ((parse_size(varg[i], &chains, &length) == -1) ||
+            (parports_set_shift(config->parports, chains, length) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --shift");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --shift");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, подключающей к последнему указанному порту символьный индикатор */
+    else if (strcmp(varg[i], "--lcd") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned cols;
+        unsigned rows;
+        if ((parse_size(varg[i], &cols, &rows) == -1) ||
+            (parports_set_lcd(config->parports, cols, rows) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --lcd");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --lcd");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, включающей 4-битный режим обмена с последним указанным индикатором */
+    else if (strcmp(varg[i], "--lcd-4bit") == 0)
+    {
+      if (parports_set_lcd_4bit(config->parports) == -1)
+      {
+        log_message(LOG_ERR, "config_create: option --lcd-4bit must follow option --lcd");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, указывающей частоту развёртки последней указанной матрицы */
+    else if (strcmp(varg[i], "--scan-rate") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned rate;
+        if ((parse_ui(varg[i], &rate) == -1) || (rate < 1) || (rate > 10000) ||
+            (parports_set_scan_rate(config->parports, rate) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --scan-rate");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --scan-rate");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, указывающей процессор для потока развёртки последней указанной матрицы */
+    else if (strcmp(varg[i], "--scan-cpu") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned cpu;
+        if ((parse_ui(varg[i], &cpu) == -1) || (cpu > INT_MAX) ||
+            (parports_set_scan_cpu(config->parports, (int)cpu) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --scan-cpu");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --scan-cpu");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, включающей захват линий состояния последнего указанного порта */
+    else if (strcmp(varg[i], "--sampler") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned kib;
+        if ((parse_ui(varg[i], &kib) == -1) || (kib < 1) || (kib > 65536) ||
+            (parports_set_sampler(config->parports, (size_t)kib * 1024) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --sampler");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --sampler");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, указывающей процессор для потока захвата последнего указанного порта */
+    else if (strcmp(varg[i], "--sampler-cpu") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned cpu;
+        if ((parse_ui(varg[i], &cpu) == -1) || (cpu > INT_MAX) ||
+            (parports_set_sampler_cpu(config->parports, (int)cpu) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --sampler-cpu");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --sampler-cpu");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, включающей счётчик импульсов на линии ACK последнего указанного порта */
+    else if (strcmp(varg[i], "--counter") == 0)
+    {
+      if (parports_set_counter(config->parports) == -1)
+      {
+        log_message(LOG_ERR, "config_create: option --counter must follow option --parport");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, включающей отслеживание линий состояния последнего указанного порта */
+    else if (strcmp(varg[i], "--input") == 0)
+    {
+      if (parports_set_input(config->parports) == -1)
+      {
+        log_message(LOG_ERR, "config_create: option --input must follow option --parport");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, указывающей время успокоения линий состояния после прерывания */
+    else if (strcmp(varg[i], "--debounce") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned debounce;
+        if ((parse_ui(varg[i], &debounce) == -1) || (debounce > 1000) ||
+            (parports_set_debounce(config->parports, debounce) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --debounce");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --debounce");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, добавляющей виртуальный порт из светодиодов указанных ранее портов */
+    else if (strcmp(varg[i], "--virtual") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned ports[LEDS_MAX_WIDTH];
+        unsigned bits[LEDS_MAX_WIDTH];
+        unsigned width;
+        if ((parse_layout(varg[i], ports, bits, &width) == -1) ||
+            (parports_add_virtual(config->parports, width, ports, bits) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --virtual");
+          config->mode = MODE_HELP;
+          return config;
+        }
+        virtual = 1;
+        last_virtual = 1;
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --virtual");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, добавляющей группу зеркальных портов из указанных ранее портов */
+    else if (strcmp(varg[i], "--mirror") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        unsigned ports[LEDS_MAX_WIDTH];
+        unsigned num;
+        if ((parse_list(varg[i], ports, LEDS_MAX_WIDTH, &num) == -1) ||
+            (parports_add_mirror(config->parports, num, ports) == -1))
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --mirror");
+          config->mode = MODE_HELP;
+          return config;
+        }
+        virtual = 1;
+        last_virtual = 1;
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --mirror");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, задающей имя последнему указанному порту */
+    else if (strcmp(varg[i], "--name") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        if (parports_add_name(config->parports, varg[i]) == -1)
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --name");
+          config->mode = MODE_HELP;
+          return config;
+        }
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --name");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
+    /* Разбор опции, указывающей путь к файлу со списком портов */
+    else if (strcmp(varg[i], "--parports-file") == 0)
+    {
+      i++;
+      if (i < carg)
+      {
+        if (parports_set_reload(config->parports, varg[i]) == -1)
+        {
+          log_message(LOG_ERR, "config_create: wrong value for option --parports-file");
+          config->mode = MODE_HELP;
+          return config;
+        }
+        reload = 1;
+      }
+      else
+      {
+        log_message(LOG_ERR, "config_create: missing value for option --parports-file");
+        config->mode = MODE_HELP;
+        return config;
+      }
+    }
     /* Разбор опции, которая указывает на необходимость вывести справку о программе */
     else if (strcmp(varg[i], "--help") == 0)
     {
@@ -506,12 +1239,76 @@ config_t *config_create(const int carg, const char **varg)
   }
 
   /* Если не было указано ни одного устройства параллельного порта, то
-     используем одно устройство по умолчанию */
-  if (parports_number(config->parports) == 0)
+     используем одно устройство по умолчанию. Порты из файла со списком
+     портов будут добавлены при запуске ведомого процесса */
+  if ((parports_number(config->parports) == 0) && !reload)
   {
     parports_add(config->parports, DEFAULT_PARPORT);
   }
 
+  /* Номера виртуальных портов и групп зеркальных портов следуют за номерами
+     физических портов, поэтому порты, добавленные при перечитывании файла
+     со списком портов, сдвинули бы их номера у подключенных клиентов */
+  if (reload && virtual)
+  {
+    log_message(LOG_ERR, "config_create: options --virtual and --mirror cannot be used with option --parports-file");
+    config->mode = MODE_HELP;
+    return config;
+  }
+
+#ifndef LITE
+  /* Порты шардов проверяются, когда известны все порты и их имена. Порты
+     из файла со списком портов появляются только в ведомом процессе,
+     поэтому распределить их по шардам нельзя */
+  if (config->shards_num > 0)
+  {
+    if (reload)
+    {
+      log_message(LOG_ERR, "config_create: option --shard cannot be used with option --parports-file");
+      config->mode = MODE_HELP;
+      return config;
+    }
+
+    const char *lists[config->shards_num];
+    for(unsigned i = 0; i < config->shards_num; i++)
+    {
+      if (config->shards[i].pathname == NULL)
+      {
+        log_message(LOG_ERR, "config_create: missing option --shard-socket for shard %s", config->shards[i].ports);
+        config->mode = MODE_HELP;
+        return config;
+      }
+      lists[i] = config->shards[i].ports;
+    }
+
+    if (parports_partition(config->parports, lists, config->shards_num) == -1)
+    {
+      log_message(LOG_ERR, "config_create: wrong parports of shards");
+      config->mode = MODE_HELP;
+      return config;
+    }
+  }
+#endif
+
+  /* Настраиваем запись регистров на всех портах */
+  if (parports_set_order(config->parports, config->order) == -1)
+  {
+    log_message(LOG_WARNING, "config_create: warning, failed to set update order");
+  }
+  if (parports_set_measure(config->parports, config->measure) == -1)
+  {
+    log_message(LOG_WARNING, "config_create: warning, failed to enable gap measurement");
+  }
+
+  /* Включаем кадровый режим, если указана частота кадров */
+  if (config->refresh > 0)
+  {
+    if (parports_set_refresh(config->parports, 1000 / config->refresh) == -1)
+    {
+      log_message(LOG_WARNING, "config_create: warning, failed to enable frame mode");
+    }
+  }
+
   return config;
 }
 
@@ -529,6 +1326,9 @@ int config_destroy(config_t *config)
     log_message(LOG_WARNING, "config_destroy: warning, failed to destroy parports");
   }
 
+#ifndef LITE
+  free(config->shards);
+#endif
   free(config);
 
   return 0;
@@ -11,6 +11,25 @@
    командной строки не был указан другой путь */
 #define DEFAULT_SOCKET "/run/parled.sock"
 
+/* Период проверки работоспособности ведомого процесса в миллисекундах и
+   количество пропущенных подряд проверок, после которого ведомый процесс
+   перезапускается */
+#define DEFAULT_HEARTBEAT 1000
+#define DEFAULT_HEARTBEAT_MISSES 3
+
+#ifndef LITE
+/* Шард - отдельный ведомый процесс, который обслуживает часть портов
+   на собственном слушающем Unix-сокете */
+typedef struct shard_s
+{
+  const char *ports;    /* Список портов шарда: номера, имена и шаблоны имён
+                           через запятую */
+  const char *pathname; /* Путь к слушающему Unix-сокету шарда */
+  int cpu;              /* Процессор, к которому привязывается ведомый процесс
+                           шарда, или -1 */
+} shard_t;
+#endif
+
 /* Программа может работать в одном из двух режимов:
    MODE_RUN - все аргументы были разобраны успешно,
    MODE_HELP - аргументы не указаны, либо в них есть ошибки */
@@ -43,9 +62,28 @@ typedef struct config_s
   const char *chroot_pathname;      /* Путь к каталогу, который должен стать для
                                        ведомого процесса корневым */
 
+  parport_order_t order;            /* Порядок записи регистров порта */
+  int measure;                      /* 1 - измерять промежутки между записями
+                                       регистров порта */
+  unsigned refresh;                 /* Частота вывода кадров в Гц или 0, если
+                                       кадровый режим выключен */
+  int log_level;                    /* Наименее важный уровень сообщений,
+                                       записываемых в журнал */
+  const char *metrics_address;      /* Адрес слушающего сокета метрик или NULL */
+  int measure_loop;                 /* 1 - собирать статистику цикла обработки
+                                       событий */
+
 #ifndef LITE
   int daemon;                       /* 0 - запуск в интерактивном режиме,
                                        1 - запуск в режиме демона */
+  unsigned heartbeat;               /* Период проверки работоспособности
+                                       ведомого процесса в мс или 0, если
+                                       проверка выключена */
+  unsigned heartbeat_misses;        /* Количество пропущенных подряд проверок,
+                                       после которого ведомый процесс
+                                       перезапускается */
+  shard_t *shards;                  /* Шарды или NULL */
+  unsigned shards_num;              /* Количество шардов */
 #endif
 
   program_mode_t mode;              /* Режим работы программы,
@@ -5,6 +5,12 @@
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "timer.h"
 #include "daemon.h"
 
 #define BUF_SIZE 1024
@@ -24,10 +30,350 @@ const char *strpriority[] = {
   "DEBUG"
 };
 
+/* Наименее важный уровень сообщений, записываемых в журнал */
+int log_level = DEFAULT_LOG_LEVEL;
+
+/* Имена уровней важности, как в syslog.conf */
+const char *log_level_names[] = {
+  "emerg",
+  "alert",
+  "crit",
+  "err",
+  "warning",
+  "notice",
+  "info",
+  "debug"
+};
+
+/* Разбор уровня важности по имени или номеру */
+int log_level_parse(const char *s, size_t len)
+{
+  if (s == NULL)
+  {
+    return -1;
+  }
+
+  if ((len == 1) && (s[0] >= '0') && (s[0] <= '7'))
+  {
+    return s[0] - '0';
+  }
+
+  for(int level = LOG_EMERG; level <= LOG_DEBUG; level++)
+  {
+    if ((strlen(log_level_names[level]) == len) && (strncmp(s, log_level_names[level], len) == 0))
+    {
+      return level;
+    }
+  }
+  return -1;
+}
+
+/* Имя уровня важности для вывода */
+const char *log_level_name(int level)
+{
+  if ((level < LOG_EMERG) || (level > LOG_DEBUG))
+  {
+    return "unknown";
+  }
+  return log_level_names[level];
+}
+
+/* Смена наименее важного уровня записываемых сообщений */
+int log_set_level(int level)
+{
+  if ((level < LOG_EMERG) || (level > LOG_LEVEL_FLOOR))
+  {
+    return -1;
+  }
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Запись в журнале, ожидающая потока записи журнала в кольцевом буфере */
+typedef struct log_record_s
+{
+  unsigned long long seq;  /* Номер записи, которая может занять ячейку или
+                              уже занимает её, для согласования потоков */
+  int priority;            /* Важность сообщения */
+  char text[BUF_SIZE + 1]; /* Полное сообщение */
+} log_record_t;
+
+/* Кольцевой буфер, в который сообщения помещаются любыми потоками без
+   блокировок, а извлекаются одним потоком записи журнала */
+log_record_t log_ring[LOG_RING_SIZE];
+unsigned long long log_ring_tail = 0; /* Номер следующей помещаемой записи */
+unsigned long long log_ring_head = 0; /* Номер следующей извлекаемой записи */
+
+int log_async = 0;         /* 1 - сообщения записывает поток записи журнала */
+int log_stopping = 0;      /* 1 - потоку записи журнала нужно завершиться */
+int log_sleeping = 0;      /* 1 - поток записи журнала ждёт сообщений */
+int log_wakeup = -1;       /* eventfd для пробуждения потока записи журнала */
+pthread_t log_thread;      /* Поток записи журнала */
+
+unsigned long long log_dropped_new = 0;   /* Отброшенные сообщения с прошлой сводки */
+unsigned long long log_dropped_total = 0; /* Все отброшенные сообщения */
+
+/* Вывод полного сообщения в syslog или в стандартный поток диагностических
+   сообщений */
+void log_write(int priority, const char *fullmessage)
+{
+  /* Если программа находится в режиме демона, то выводим сообщение в syslog */
+  if (log_daemon == 1)
+  {
+    syslog(priority, "%s", fullmessage);
+  }
+  /* В противном случае выводим сообщение в стандартный поток диагностических сообщений */
+  else
+  {
+    fprintf(stderr, "%s", fullmessage);
+  }
+}
+
+/* Помещение сообщения в кольцевой буфер. Возвращает -1, если буфер заполнен */
+int log_push(int priority, const char *fullmessage)
+{
+  unsigned long long pos = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+  log_record_t *record;
+  while (1)
+  {
+    record = &(log_ring[pos % LOG_RING_SIZE]);
+    unsigned long long seq = __atomic_load_n(&(record->seq), __ATOMIC_ACQUIRE);
+
+    /* Ячейка ещё занята записью, которую поток записи журнала не извлёк */
+    if (seq < pos)
+    {
+      return -1;
+    }
+
+    /* Ячейка свободна, занимаем её, если другой поток не успел раньше */
+    if ((seq == pos) &&
+        __atomic_compare_exchange_n(&log_ring_tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      break;
+    }
+
+    /* Ячейку занял другой поток, переходим к следующей */
+    if (seq > pos)
+    {
+      pos = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  record->priority = priority;
+  strcpy(record->text, fullmessage);
+  __atomic_store_n(&(record->seq), pos + 1, __ATOMIC_RELEASE);
+
+  /* Будим поток записи журнала, только если он ждёт сообщений, чтобы не
+     делать системный вызов на каждое сообщение */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_RELAXED))
+  {
+    uint64_t one = 1;
+    if (write(log_wakeup, &one, sizeof(one)) == -1)
+    {
+      /* Поток записи журнала всё равно проснётся по тайм-ауту */
+    }
+  }
+  return 0;
+}
+
+/* Извлечение следующей записи из кольцевого буфера. Вызывается только потоком
+   записи журнала. Возвращает 0, если буфер пуст */
+int log_pop(int *priority, char *fullmessage)
+{
+  log_record_t *record = &(log_ring[log_ring_head % LOG_RING_SIZE]);
+  if (__atomic_load_n(&(record->seq), __ATOMIC_ACQUIRE) != log_ring_head + 1)
+  {
+    return 0;
+  }
+
+  *priority = record->priority;
+  strcpy(fullmessage, record->text);
+
+  /* Освобождаем ячейку для записи, которая пройдёт по кольцу следующей */
+  __atomic_store_n(&(record->seq), log_ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+  log_ring_head++;
+  return 1;
+}
+
+/* Недавно записанное сообщение, повторы которого подсчитываются */
+typedef struct log_recent_s
+{
+  char text[BUF_SIZE + 1];     /* Полное сообщение */
+  int priority;                /* Его важность */
+  unsigned long long repeated; /* Сколько раз оно повторилось с записи */
+} log_recent_t;
+
+/* Состояние потока записи журнала: сообщения, записанные за текущий период
+   сводок LOG_SUMMARY_PERIOD, и счётчики для сводок */
+typedef struct log_flusher_s
+{
+  log_recent_t recent[LOG_DEDUP_SIZE]; /* Записанные за период сообщения */
+  unsigned recent_num;                 /* Их количество */
+  unsigned long long written;          /* Записано сообщений за период */
+  unsigned long long suppressed;       /* Не записано из-за ограничения частоты */
+  long long period_start;              /* Начало периода, мс */
+} log_flusher_t;
+
+/* Вывод служебного сообщения о работе журнала в том же формате, что и
+   остальные сообщения */
+void log_write_summary(int priority, const char *format, ...)
+{
+  char message[BUF_SIZE + 1];
+  va_list vl;
+  va_start(vl, format);
+  vsnprintf(message, sizeof(message), format, vl);
+  va_end(vl);
+
+  char fullmessage[BUF_SIZE + 64];
+  snprintf(fullmessage, sizeof(fullmessage), "[%s %s:%d] %s\n", strpriority[priority], __FILE__, __LINE__, message);
+  log_write(priority, fullmessage);
+}
+
+/* Вывод сводок за период и начало нового периода */
+void log_flush_period(log_flusher_t *flusher, long long now)
+{
+  /* Повторы сообщения выводятся вместе с его текстом, потому что между
+     повторами могли быть записаны другие сообщения */
+  for(unsigned i = 0; i < flusher->recent_num; i++)
+  {
+    log_recent_t *recent = &(flusher->recent[i]);
+    if (recent->repeated > 0)
+    {
+      size_t len = strlen(recent->text);
+      if ((len > 0) && (recent->text[len - 1] == '\n'))
+      {
+        recent->text[len - 1] = '\0';
+      }
+      log_write_summary(recent->priority, "message repeated %llu times: %s", recent->repeated, recent->text);
+    }
+  }
+  flusher->recent_num = 0;
+
+  if (flusher->suppressed > 0)
+  {
+    log_write_summary(LOG_WARNING, "warning, %llu messages suppressed by rate limit", flusher->suppressed);
+    flusher->suppressed = 0;
+  }
+
+  unsigned long long dropped = __atomic_exchange_n(&log_dropped_new, 0, __ATOMIC_RELAXED);
+  if (dropped > 0)
+  {
+    log_write_summary(LOG_WARNING, "warning, %llu messages dropped, log buffer is full", dropped);
+  }
+
+  flusher->written = 0;
+  flusher->period_start = now;
+}
+
+/* Запись сообщения с подавлением повторов и ограничением частоты */
+void log_flush_record(log_flusher_t *flusher, int priority, const char *fullmessage)
+{
+  /* Сообщения, уже записанные за период, только подсчитываются */
+  for(unsigned i = 0; i < flusher->recent_num; i++)
+  {
+    log_recent_t *recent = &(flusher->recent[i]);
+    if ((recent->priority == priority) && (strcmp(recent->text, fullmessage) == 0))
+    {
+      recent->repeated++;
+      return;
+    }
+  }
+
+  /* Сообщения сверх LOG_RATE_LIMIT за период только подсчитываются */
+  if (flusher->written >= LOG_RATE_LIMIT)
+  {
+    flusher->suppressed++;
+    return;
+  }
+
+  log_write(priority, fullmessage);
+  flusher->written++;
+
+  if (flusher->recent_num < LOG_DEDUP_SIZE)
+  {
+    log_recent_t *recent = &(flusher->recent[flusher->recent_num++]);
+    strcpy(recent->text, fullmessage);
+    recent->priority = priority;
+    recent->repeated = 0;
+  }
+}
+
+/* Поток записи журнала */
+void *log_flush(void *arg)
+{
+  (void)arg;
+
+  log_flusher_t flusher;
+  flusher.recent_num = 0;
+  flusher.written = 0;
+  flusher.suppressed = 0;
+  flusher.period_start = timer_now();
+
+  int priority;
+  char fullmessage[BUF_SIZE + 1];
+  while (1)
+  {
+    while (log_pop(&priority, fullmessage))
+    {
+      log_flush_record(&flusher, priority, fullmessage);
+    }
+
+    long long now = timer_now();
+    if (now - flusher.period_start >= LOG_SUMMARY_PERIOD)
+    {
+      log_flush_period(&flusher, now);
+    }
+
+    if (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE))
+    {
+      /* Сообщения, помещённые до остановки, уже записаны */
+      if (log_pop(&priority, fullmessage))
+      {
+        log_flush_record(&flusher, priority, fullmessage);
+        continue;
+      }
+      log_flush_period(&flusher, now);
+      break;
+    }
+
+    /* Перед ожиданием ещё раз проверяем буфер: сообщение могло быть помещено
+       до того, как поток объявил об ожидании */
+    __atomic_store_n(&log_sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    log_record_t *record = &(log_ring[log_ring_head % LOG_RING_SIZE]);
+    if (__atomic_load_n(&(record->seq), __ATOMIC_ACQUIRE) == log_ring_head + 1)
+    {
+      __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = log_wakeup;
+    pfd.events = POLLIN;
+    long long timeout = flusher.period_start + LOG_SUMMARY_PERIOD - now;
+    if ((poll(&pfd, 1, (timeout > 0) ? (int)timeout : 0) > 0) && (pfd.revents & POLLIN))
+    {
+      uint64_t n;
+      if (read(log_wakeup, &n, sizeof(n)) == -1)
+      {
+        /* Счётчик уже сброшен */
+      }
+    }
+    __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
 /* Функция для отправки сообщений в журнал. Напрямую не вызывается,
    используется только в макросах log_error и log_message */
 void logger(int priority, int err, const char *filename, const int line, const char *format, ...)
 {
+  /* Запись в журнал не должна менять errno вызывающей стороны */
+  int saved_errno = errno;
+
   /* Если важность выходит за допустимые пределы, возвращаем её в эти пределы */
   if (priority < LOG_EMERG)
   {
@@ -45,6 +391,10 @@ void logger(int priority, int err, const char *filename, const int line, const c
   va_start(vl, format);
   n = vsnprintf(message, BUF_SIZE, format, vl);
   va_end(vl);
+  if (n > BUF_SIZE - 1)
+  {
+    n = BUF_SIZE - 1;
+  }
   message[n] = '\0';
 
   /* Формируем полное сообщение с приоритетом, именем файла модуля, номером строки в этом файле и текстом ошибки */
@@ -58,18 +408,117 @@ void logger(int priority, int err, const char *filename, const int line, const c
   {
     n = snprintf(fullmessage, BUF_SIZE, "[%s %s:%d] %s\n", strpriority[priority], filename, line, message);
   }
+  if (n > BUF_SIZE - 1)
+  {
+    n = BUF_SIZE - 1;
+  }
   fullmessage[n] = '\0';
 
-  /* Если программа находится в режиме демона, то выводим сообщение в syslog */
-  if (log_daemon == 1)
+  /* Если запущен поток записи журнала, то передаём сообщение ему, чтобы
+     медленный syslog не задерживал вызывающий поток. Если буфер заполнен,
+     то сообщение отбрасывается и подсчитывается */
+  if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
   {
-    syslog(priority, "%s", (char *)fullmessage);
+    if (log_push(priority, fullmessage) == -1)
+    {
+      __atomic_add_fetch(&log_dropped_new, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&log_dropped_total, 1, __ATOMIC_RELAXED);
+    }
   }
-  /* В противном случае выводим сообщение в стандартный поток диагностических сообщений */
   else
   {
-    fprintf(stderr, "%s", fullmessage);
+    log_write(priority, fullmessage);
   }
+
+  errno = saved_errno;
+}
+
+/* Запуск потока записи журнала. До запуска и после остановки сообщения
+   записываются синхронно вызывающим потоком */
+int log_start()
+{
+  if (log_async)
+  {
+    return 0;
+  }
+
+  log_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (log_wakeup == -1)
+  {
+    log_error(LOG_ERR, "log_start: eventfd failed");
+    return -1;
+  }
+
+  /* Номер каждой ячейки равен номеру первой записи, которая её займёт */
+  for(unsigned i = 0; i < LOG_RING_SIZE; i++)
+  {
+    log_ring[i].seq = i;
+  }
+  log_ring_tail = 0;
+  log_ring_head = 0;
+  log_stopping = 0;
+  log_sleeping = 0;
+
+  /* Поток записи журнала не должен принимать сигналы */
+  sigset_t sigmask;
+  sigset_t old_sigmask;
+  sigfillset(&sigmask);
+  pthread_sigmask(SIG_SETMASK, &sigmask, &old_sigmask);
+
+  int err = pthread_create(&log_thread, NULL, log_flush, NULL);
+
+  pthread_sigmask(SIG_SETMASK, &old_sigmask, NULL);
+
+  if (err != 0)
+  {
+    log_message(LOG_ERR, "log_start: pthread_create failed: %s", strerror(err));
+    if (close(log_wakeup) == -1)
+    {
+      log_error(LOG_WARNING, "log_start: warning, failed to close eventfd");
+    }
+    log_wakeup = -1;
+    return -1;
+  }
+
+  __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Остановка потока записи журнала после записи всех помещённых в буфер
+   сообщений */
+int log_stop()
+{
+  if (!log_async)
+  {
+    return 0;
+  }
+
+  __atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if (write(log_wakeup, &one, sizeof(one)) == -1)
+  {
+    log_error(LOG_WARNING, "log_stop: warning, failed to wake up logger thread");
+  }
+
+  int err = pthread_join(log_thread, NULL);
+  if (err != 0)
+  {
+    log_message(LOG_WARNING, "log_stop: warning, pthread_join failed: %s", strerror(err));
+  }
+
+  if (close(log_wakeup) == -1)
+  {
+    log_error(LOG_WARNING, "log_stop: warning, failed to close eventfd");
+  }
+  log_wakeup = -1;
+  return 0;
+}
+
+/* Количество сообщений, отброшенных из-за заполнения буфера */
+unsigned long long log_dropped()
+{
+  return __atomic_load_n(&log_dropped_total, __ATOMIC_RELAXED);
 }
 
 /* Переход в режим демона:
@@ -1,6 +1,7 @@
 #ifndef __DAEMON__
 #define __DAEMON__
 
+#include <stddef.h>
 #include <errno.h>
 #include <syslog.h>
 
@@ -11,10 +12,76 @@
    4. связывание потоков стандартного ввода-вывода с пустым устройством */
 int daemonize();
 
+/* Наименее важный уровень сообщений, которые вообще попадают в программу.
+   Вызовы макросов log_error и log_message с менее важным уровнем удаляются
+   компилятором, поэтому отладочные сообщения в "лёгком" варианте ничего
+   не стоят даже на часто выполняемых путях */
+#ifdef LITE
+#define LOG_LEVEL_FLOOR LOG_INFO
+#else
+#define LOG_LEVEL_FLOOR LOG_DEBUG
+#endif
+
+/* Уровень по умолчанию наименее важных сообщений, записываемых в журнал */
+#define DEFAULT_LOG_LEVEL LOG_INFO
+
+/* Наименее важный уровень сообщений, записываемых в журнал. Сообщения менее
+   важных уровней отбрасываются в макросах log_error и log_message до
+   формирования текста сообщения и вычисления его аргументов */
+extern int log_level;
+
+/* Проверка, будет ли записано сообщение с важностью priority */
+#define log_enabled(priority) \
+  (((priority) <= LOG_LEVEL_FLOOR) && ((priority) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)))
+
+/* Разбор уровня важности: имени из syslog.conf без префикса LOG_ (emerg,
+   alert, crit, err, warning, notice, info, debug) или числа от 0 до 7.
+   Разбираются первые len символов строки s. Возвращает уровень или -1 */
+int log_level_parse(const char *s, size_t len);
+
+/* Имя уровня важности для вывода */
+const char *log_level_name(int level);
+
+/* Смена наименее важного уровня записываемых сообщений. Возвращает -1, если
+   уровень недопустим или сообщения этого уровня удалены при компиляции */
+int log_set_level(int level);
+
 /* Функция для отправки сообщений в журнал. Напрямую не вызывается,
    используется только в макросах log_error и log_message */
 void logger(int priority, int err, const char *filename, const int line, const char *format, ...);
 
+/* Количество сообщений в буфере потока записи журнала. Сообщения, не
+   поместившиеся в буфер, отбрасываются и подсчитываются */
+#define LOG_RING_SIZE 256
+
+/* Период сводок о повторах, ограничении частоты и отброшенных сообщениях, мс */
+#define LOG_SUMMARY_PERIOD 1000
+
+/* Количество различных сообщений за период сводок, повторы которых
+   подсчитываются */
+#define LOG_DEDUP_SIZE 32
+
+/* Наибольшее количество различных сообщений, записываемых за период сводок */
+#define LOG_RATE_LIMIT 100
+
+/* Запуск потока записи журнала. После запуска сообщения помещаются в
+   кольцевой буфер без блокировок и системных вызовов, а записываются
+   в syslog или в стандартный поток диагностических сообщений отдельным
+   потоком, поэтому медленный журнал не задерживает вызывающие потоки.
+   Одинаковые сообщения записываются один раз за период сводок, а количество
+   повторов выводится в конце периода сводкой "message repeated N times". Сообщения сверх
+   LOG_RATE_LIMIT за период сводок и сообщения, не поместившиеся в буфер,
+   не записываются, их количество также выводится сводкой. До запуска
+   сообщения записываются синхронно вызывающим потоком */
+int log_start();
+
+/* Остановка потока записи журнала после записи всех сообщений из буфера.
+   После остановки сообщения снова записываются синхронно */
+int log_stop();
+
+/* Количество сообщений, отброшенных из-за заполнения буфера */
+unsigned long long log_dropped();
+
 /* Макросы log_error и log_message выполнены в виде макросов для того, чтобы вызывающая сторона
    могла не указывать функции logger имя файла с исходным текстом и номер строки, из которой
    была вызвана функция. Соответствующие данные берутся из макросов __FILE__ и __LINE__, которые
@@ -28,7 +95,21 @@ void logger(int priority, int err, const char *filename, const int line, const c
    Оба макроса используются абсолютно аналогично: в первом аргументе необходимо указать
    уровень важности из syslog.h, во втором аргументе указывается форматная строка, как в
    функции printf, а далее следуют аргументы, значения которых используются в форматной строке */
-#define log_error(priority, ...) logger(priority, errno, __FILE__, __LINE__, __VA_ARGS__)
-#define log_message(priority, ...) logger(priority, 0, __FILE__, __LINE__, __VA_ARGS__)
+#define log_error(priority, ...) \
+  do \
+  { \
+    if (log_enabled(priority)) \
+    { \
+      logger(priority, errno, __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+#define log_message(priority, ...) \
+  do \
+  { \
+    if (log_enabled(priority)) \
+    { \
+      logger(priority, 0, __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
 
 #endif
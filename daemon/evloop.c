@@ -1,10 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <signal.h>
 #include <errno.h>
 #include "daemon.h"
+#include "timer.h"
+#include "stats.h"
 #include "evloop.h"
 
 /* Структура данных содержит информацию об одном сокете, ожидающем событий */
@@ -39,6 +42,10 @@ struct socket_s
   int (*destroy)(void *data);
 
   void *data;            /* Приватные данные обработчика событий сокета */
+
+  const char *name;      /* Имя типа сокета в статистике цикла */
+  int handler;           /* Номер записи статистики обработчика или -1,
+                            если запись ещё не найдена */
 };
 
 /* Функция для создания новых сокетов, ожидающих событий. Используется для
@@ -86,10 +93,32 @@ socket_t *socket_create(int fd,
   socket->process_event = process_event;
   socket->destroy = destroy;
   socket->data = data;
+  socket->name = "socket";
+  socket->handler = -1;
 
   return socket;
 }
 
+/* Задать имя типа сокета в статистике цикла обработки событий */
+int socket_set_name(socket_t *socket, const char *name)
+{
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "socket_set_name: socket is NULL pointer");
+    return -1;
+  }
+
+  if (name == NULL)
+  {
+    log_message(LOG_ERR, "socket_set_name: name is NULL pointer");
+    return -1;
+  }
+
+  socket->name = name;
+  socket->handler = -1;
+  return 0;
+}
+
 /* Структура данных содержит двусвязный список сокетов, ожидающих событий и
    файловый дескриптор epoll */
 struct evloop_s
@@ -97,8 +126,20 @@ struct evloop_s
   int ep;
   socket_t *first;
   socket_t *last;
+  evloop_stats_t stats;  /* Статистика цикла */
+  struct epoll_event *events;  /* События, обрабатываемые в текущем проходе цикла */
+  int events_num;              /* Количество обрабатываемых событий */
 };
 
+/* Признак сбора статистики цикла обработки событий */
+int evloop_measure = 0;
+
+/* Включить или выключить сбор статистики во всех циклах обработки событий */
+void evloop_set_measure(int measure)
+{
+  evloop_measure = (measure != 0);
+}
+
 /* Количество ожидающих сокетов, обрабатываемых за один проход цикла обработки
    поступивших событий */
 #define MAX_EVENTS 16
@@ -126,6 +167,9 @@ evloop_t *evloop_create()
   /* Список сокетов, ожидающих события, пока что пуст */
   evloop->first = NULL;
   evloop->last = NULL;
+  memset(&(evloop->stats), 0, sizeof(evloop->stats));
+  evloop->events = NULL;
+  evloop->events_num = 0;
 
   return evloop;
 }
@@ -176,6 +220,41 @@ int evloop_add_socket(evloop_t *evloop, socket_t *socket)
   return 0;
 }
 
+/* Изменить события, поступления которых ожидает сокет. Используется, когда
+   событий в сокете нужно начать ожидать не из его обработчика событий, а также
+   когда файловый дескриптор сокета был заменён другим файлом. В последнем
+   случае epoll уже забыл о сокете вместе с закрытым файлом, и сокет
+   регистрируется в epoll заново */
+int evloop_modify_socket(evloop_t *evloop, socket_t *socket, int waited_events)
+{
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "evloop_modify_socket: evloop is NULL pointer");
+    return -1;
+  }
+
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "evloop_modify_socket: socket is NULL pointer");
+    return -1;
+  }
+
+  struct epoll_event event;
+  event.events = waited_events;
+  event.data.ptr = socket;
+  if (epoll_ctl(evloop->ep, EPOLL_CTL_MOD, socket->fd, &event) == -1)
+  {
+    if ((errno != ENOENT) || (epoll_ctl(evloop->ep, EPOLL_CTL_ADD, socket->fd, &event) == -1))
+    {
+      log_error(LOG_ERR, "evloop_modify_socket: failed to modify events, waited by socket");
+      return -1;
+    }
+  }
+
+  socket->waited_events = waited_events;
+  return 0;
+}
+
 /* Удалить сокет из списка сокетов, ожидающих поступления событий */
 int evloop_delete_socket(evloop_t *evloop, socket_t *socket)
 {
@@ -201,7 +280,6 @@ int evloop_delete_socket(evloop_t *evloop, socket_t *socket)
   if (socket->prev == NULL)
   {
     evloop->first = socket->next;
-    evloop->first->prev = NULL;
   }
   /* Если перед этим сокетом в списке есть другой */
   else
@@ -213,7 +291,6 @@ int evloop_delete_socket(evloop_t *evloop, socket_t *socket)
   if (socket->next == NULL)
   {
     evloop->last = socket->prev;
-    evloop->last->next = NULL;
   }
   /* Если за этим сокетом в списке есть другой */
   else
@@ -221,6 +298,16 @@ int evloop_delete_socket(evloop_t *evloop, socket_t *socket)
     socket->next->prev = socket->prev;
   }
 
+  /* Сокет может удалить обработчик событий другого сокета. Если для удаляемого
+     сокета в текущем проходе цикла ещё остались события, то они отбрасываются */
+  for(int i = 0; i < evloop->events_num; i++)
+  {
+    if (evloop->events[i].data.ptr == socket)
+    {
+      evloop->events[i].data.ptr = NULL;
+    }
+  }
+
   /* Корректно освобождаем память, занимаемую приватными данными обработчика событий в сокете */
   if (socket->destroy(socket->data) == -1)
   {
@@ -236,6 +323,80 @@ int evloop_delete_socket(evloop_t *evloop, socket_t *socket)
   return 0;
 }
 
+/* Собрать в массив fds не более max файловых дескрипторов сокетов с указанной
+   функцией-обработчиком событий. Возвращает количество всех таких сокетов */
+int evloop_collect(evloop_t *evloop,
+                   int (*process_event)(int fd,
+                                        int events,
+                                        void *data),
+                   int *fds, unsigned max)
+{
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "evloop_collect: evloop is NULL pointer");
+    return -1;
+  }
+
+  unsigned n = 0;
+  for(socket_t *socket = evloop->first; socket != NULL; socket = socket->next)
+  {
+    if (socket->process_event != process_event)
+    {
+      continue;
+    }
+
+    if ((fds != NULL) && (n < max))
+    {
+      fds[n] = socket->fd;
+    }
+    n++;
+  }
+
+  return n;
+}
+
+/* Удалить сокеты с указанной функцией-обработчиком событий, для которых
+   функция keep вернула 0. Возвращает количество удалённых сокетов */
+int evloop_prune(evloop_t *evloop,
+                 int (*process_event)(int fd,
+                                      int events,
+                                      void *data),
+                 int (*keep)(int fd, void *data))
+{
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "evloop_prune: evloop is NULL pointer");
+    return -1;
+  }
+
+  if (keep == NULL)
+  {
+    log_message(LOG_ERR, "evloop_prune: keep is NULL pointer");
+    return -1;
+  }
+
+  int n = 0;
+  socket_t *next;
+  for(socket_t *socket = evloop->first; socket != NULL; socket = next)
+  {
+    /* Удаление освобождает сокет, поэтому следующий сокет запоминаем заранее */
+    next = socket->next;
+    if ((socket->process_event != process_event) || keep(socket->fd, socket->data))
+    {
+      continue;
+    }
+
+    if (evloop_delete_socket(evloop, socket) == -1)
+    {
+      log_message(LOG_WARNING, "evloop_prune: warning, evloop_delete_socket failed");
+      continue;
+    }
+    n++;
+  }
+
+  return n;
+}
+
 /* Удаление всего списка сокетов, ожидающих поступления событий */
 int evloop_destroy(evloop_t *evloop)
 {
@@ -284,6 +445,153 @@ void evloop_sighandler(int signal)
   }
 }
 
+/* Учесть в статистике пробуждение цикла с n событиями после ожидания
+   длительностью wait наносекунд */
+void evloop_measure_wakeup(evloop_t *evloop, int n, long long wait)
+{
+  evloop->stats.wakeups++;
+  evloop->stats.wait_ns += wait;
+
+  /* Корзина с номером i содержит пачки от 2^i до 2^(i+1)-1 событий */
+  int bucket = 0;
+  while ((bucket < EVLOOP_BATCH_BUCKETS - 1) && (n >> (bucket + 1)))
+  {
+    bucket++;
+  }
+  evloop->stats.batches[bucket]++;
+}
+
+/* Запись статистики обработчиков событий сокетов того же типа, что сокет
+   socket, или NULL, если записи для нового типа закончились */
+evloop_handler_stats_t *evloop_measure_handler(evloop_t *evloop, socket_t *socket)
+{
+  evloop_stats_t *stats = &(evloop->stats);
+
+  /* Номер записи запоминается в сокете, чтобы не искать её по имени при
+     каждом событии. После сброса статистики запись ищется заново */
+  if ((socket->handler >= 0) && ((unsigned)socket->handler < stats->handlers_num) &&
+      (stats->handlers[socket->handler].name == socket->name))
+  {
+    return &(stats->handlers[socket->handler]);
+  }
+
+  for(unsigned i = 0; i < stats->handlers_num; i++)
+  {
+    if (strcmp(stats->handlers[i].name, socket->name) == 0)
+    {
+      socket->handler = i;
+      return &(stats->handlers[i]);
+    }
+  }
+
+  if (stats->handlers_num == EVLOOP_HANDLERS)
+  {
+    return NULL;
+  }
+
+  evloop_handler_stats_t *handler = &(stats->handlers[stats->handlers_num]);
+  handler->name = socket->name;
+  handler->calls = 0;
+  handler->ns = 0;
+  handler->max_ns = 0;
+  socket->handler = stats->handlers_num++;
+  return handler;
+}
+
+/* Статистика цикла обработки событий */
+const evloop_stats_t *evloop_stats(evloop_t *evloop)
+{
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "evloop_stats: evloop is NULL pointer");
+    return NULL;
+  }
+
+  return &(evloop->stats);
+}
+
+/* Сброс статистики цикла обработки событий */
+int evloop_stats_reset(evloop_t *evloop)
+{
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "evloop_stats_reset: evloop is NULL pointer");
+    return -1;
+  }
+
+  memset(&(evloop->stats), 0, sizeof(evloop->stats));
+  return 0;
+}
+
+/* Вывод в буфер статистики цикла обработки событий */
+int evloop_report(evloop_t *evloop, char *buf, size_t size)
+{
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "evloop_report: evloop is NULL pointer");
+    return -1;
+  }
+
+  if (buf == NULL)
+  {
+    log_message(LOG_ERR, "evloop_report: buf is NULL pointer");
+    return -1;
+  }
+
+  if (size < 4)
+  {
+    log_message(LOG_ERR, "evloop_report: buffer is too small");
+    return -1;
+  }
+
+  const evloop_stats_t *stats = &(evloop->stats);
+  long long total = stats->wait_ns + stats->work_ns;
+  int n = snprintf(buf, size, "measure=%s wakeups=%llu wait_ms=%lld work_ms=%lld busy=%.1f%% batch=%llu/%llu/%llu/%llu/%llu",
+                   evloop_measure ? "on" : "off", stats->wakeups,
+                   stats->wait_ns / 1000000, stats->work_ns / 1000000,
+                   (total > 0) ? stats->work_ns * 100.0 / total : 0.0,
+                   stats->batches[0], stats->batches[1], stats->batches[2],
+                   stats->batches[3], stats->batches[4]);
+
+  /* Заголовок должен поместиться вместе с местом для многоточия, иначе
+     смещение записи обработчиков вышло бы за пределы буфера */
+  if ((n < 0) || ((size_t)n >= size - 4))
+  {
+    log_message(LOG_ERR, "evloop_report: buffer is too small");
+    return -1;
+  }
+
+  /* Обработчики выводятся по убыванию наибольшего времени вызова */
+  unsigned char printed[EVLOOP_HANDLERS] = {0};
+  for(unsigned k = 0; k < stats->handlers_num; k++)
+  {
+    int slowest = -1;
+    for(unsigned i = 0; i < stats->handlers_num; i++)
+    {
+      if (!printed[i] && ((slowest == -1) || (stats->handlers[i].max_ns > stats->handlers[slowest].max_ns)))
+      {
+        slowest = i;
+      }
+    }
+    printed[slowest] = 1;
+
+    const evloop_handler_stats_t *handler = &(stats->handlers[slowest]);
+
+    /* Оставляем место для многоточия */
+    int m = snprintf(&(buf[n]), size - n, " %s=%llu/%lld/%lld", handler->name, handler->calls,
+                     (handler->calls > 0) ? handler->ns / (long long)handler->calls : 0,
+                     handler->max_ns);
+    if ((m < 0) || ((size_t)(n + m) >= size - 4))
+    {
+      buf[n] = '\0';
+      return n + snprintf(&(buf[n]), size - n, " ...");
+    }
+    n += m;
+  }
+
+  return n;
+}
+
 /* Функция запускает цикл обработки событий в сокетах. Завершает цикл обработки
    событий по сигналам TERM или INT */
 int evloop_run(evloop_t *evloop)
@@ -323,6 +631,8 @@ int evloop_run(evloop_t *evloop)
   {
     struct epoll_event events[MAX_EVENTS];
 
+    long long wait_start = evloop_measure ? timer_now_ns() : 0;
+
     /* Ожидем наступления событий в указанном количестве сокетов или поступления
        сигнала TERM или INT */
     int n = epoll_pwait(evloop->ep, events, MAX_EVENTS, -1, &sigmask);
@@ -341,15 +651,50 @@ int evloop_run(evloop_t *evloop)
       return -1;
     }
 
+    /* Выключение сбора статистики вступает в силу со следующей итерации */
+    int measure = evloop_measure;
+
+    /* Время обработки событий итерации без ожидания учитывается в статистике.
+       Без сбора статистики цикла часы в итерации не читаются */
+    long long start = measure ? timer_now_ns() : 0;
+    if (measure)
+    {
+      evloop_measure_wakeup(evloop, n, start - wait_start);
+    }
+
     /* Обрабатываем события в каждом из сокетов, где они произошли */
+    evloop->events = events;
+    evloop->events_num = n;
     for(int i = 0; i < n; i++)
     {
       socket_t *socket = events[i].data.ptr;
 
+      /* Сокет удалён обработчиком событий другого сокета */
+      if (socket == NULL)
+      {
+        continue;
+      }
+
+      /* Обработчик может удалить сокет, поэтому запись статистики
+         выбирается до его вызова */
+      evloop_handler_stats_t *handler = measure ? evloop_measure_handler(evloop, socket) : NULL;
+      long long handler_start = (handler != NULL) ? timer_now_ns() : 0;
+
       /* Запускаем обработку события */
       int result = socket->process_event(socket->fd,
                                          events[i].events,
                                          socket->data);
+
+      if (handler != NULL)
+      {
+        long long ns = timer_now_ns() - handler_start;
+        handler->calls++;
+        handler->ns += ns;
+        if (ns > handler->max_ns)
+        {
+          handler->max_ns = ns;
+        }
+      }
       /* Если результат равен -1, значит произошла ошибка в сокете */
       if (result == -1)
       {
@@ -380,6 +725,8 @@ int evloop_run(evloop_t *evloop)
         if (epoll_ctl(evloop->ep, EPOLL_CTL_MOD, socket->fd, &event) == -1)
         {
           log_error(LOG_ERR, "evloop_run: failed to modify events, waited by socket from evloop");
+          evloop->events = NULL;
+          evloop->events_num = 0;
           return -1;
         }
 
@@ -387,6 +734,15 @@ int evloop_run(evloop_t *evloop)
         socket->waited_events = result;
       }
     }
+    evloop->events = NULL;
+    evloop->events_num = 0;
+
+    if (measure)
+    {
+      long long work = timer_now_ns() - start;
+      stats_latency(STATS_ITERATION, work);
+      evloop->stats.work_ns += work;
+    }
   }
 
   return 0;
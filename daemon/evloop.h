@@ -38,15 +38,91 @@ socket_t *socket_create(int fd,
                         int (*destroy)(void *data),
                         void *data);
 
+/* Задать имя типа сокета, например "client", под которым в статистике цикла
+   учитывается время работы его обработчика событий. Имя должно существовать
+   всё время работы цикла, обычно это строковая константа */
+int socket_set_name(socket_t *socket, const char *name);
+
+/* Количество корзин распределения количества событий за одно пробуждение:
+   1, 2-3, 4-7, 8-15 и 16 событий. Последняя корзина - полные пачки, после
+   которых в очереди epoll могли остаться необработанные события */
+#define EVLOOP_BATCH_BUCKETS 5
+
+/* Наибольшее количество типов сокетов в статистике обработчиков событий */
+#define EVLOOP_HANDLERS 16
+
+/* Статистика обработчиков событий сокетов одного типа */
+typedef struct evloop_handler_stats_s
+{
+  const char *name;         /* Имя типа сокета */
+  unsigned long long calls; /* Количество вызовов обработчика */
+  long long ns;             /* Суммарное время работы обработчика, нс */
+  long long max_ns;         /* Наибольшее время одного вызова, нс */
+} evloop_handler_stats_t;
+
+/* Статистика цикла обработки событий */
+typedef struct evloop_stats_s
+{
+  unsigned long long wakeups;                       /* Количество пробуждений */
+  long long wait_ns;                                /* Время ожидания событий, нс */
+  long long work_ns;                                /* Время обработки событий, нс */
+  unsigned long long batches[EVLOOP_BATCH_BUCKETS]; /* Распределение количества
+                                                       событий за пробуждение */
+  unsigned handlers_num;                            /* Количество типов сокетов */
+  evloop_handler_stats_t handlers[EVLOOP_HANDLERS]; /* Статистика по типам сокетов */
+} evloop_stats_t;
+
+/* Признак сбора статистики цикла обработки событий. Время каждого вызова
+   обработчика событий измеряется только при включенном сборе */
+extern int evloop_measure;
+
+/* Включить или выключить сбор статистики во всех циклах обработки событий */
+void evloop_set_measure(int measure);
+
 /* Создать список сокетов, ожидающих события */
 evloop_t *evloop_create();
 
 /* Добавить сокет в список сокетов, ожидающих поступления событий */
 int evloop_add_socket(evloop_t *evloop, socket_t *socket);
 
+/* Изменить события, поступления которых ожидает сокет, вне его обработчика
+   событий. Если файловый дескриптор сокета был заменён другим файлом, то сокет
+   регистрируется в epoll заново */
+int evloop_modify_socket(evloop_t *evloop, socket_t *socket, int waited_events);
+
 /* Удалить сокет из списка сокетов, ожидающих поступления событий */
 int evloop_delete_socket(evloop_t *evloop, socket_t *socket);
 
+/* Собрать в массив fds не более max файловых дескрипторов сокетов с указанной
+   функцией-обработчиком событий, например, всех клиентов. Возвращает
+   количество всех таких сокетов, которое может быть больше max */
+int evloop_collect(evloop_t *evloop,
+                   int (*process_event)(int fd,
+                                        int events,
+                                        void *data),
+                   int *fds, unsigned max);
+
+/* Удалить сокеты с указанной функцией-обработчиком событий, для которых
+   функция keep, получающая файловый дескриптор и приватные данные сокета,
+   вернула 0. Возвращает количество удалённых сокетов */
+int evloop_prune(evloop_t *evloop,
+                 int (*process_event)(int fd,
+                                      int events,
+                                      void *data),
+                 int (*keep)(int fd, void *data));
+
+/* Статистика цикла обработки событий */
+const evloop_stats_t *evloop_stats(evloop_t *evloop);
+
+/* Сброс статистики цикла обработки событий */
+int evloop_stats_reset(evloop_t *evloop);
+
+/* Вывод в буфер времени ожидания и обработки событий, распределения
+   количества событий за пробуждение и статистики обработчиков событий по
+   типам сокетов, начиная с самого медленного. Возвращает количество
+   выведенных символов */
+int evloop_report(evloop_t *evloop, char *buf, size_t size);
+
 /* Удаление всего списка сокетов, ожидающих поступления событий */
 int evloop_destroy(evloop_t *evloop);
 
@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include "daemon.h"
+#include "timer.h"
+#include "lcd.h"
+
+/* Линии порта, к которым подключены линии E и RS индикатора, в тех же
+   обозначениях, что и светодиоды: 0x0100 - линия STROBE, 0x0400 - линия INIT */
+#define LCD_E  0x0100
+#define LCD_RS 0x0400
+
+/* Временные характеристики контроллера HD44780, наносекунды */
+#define LCD_PULSE_NS   450      /* Наименьшая длительность импульса E */
+#define LCD_EXEC_NS    40000    /* Время выполнения большинства команд */
+#define LCD_CLEAR_NS   1600000  /* Время выполнения команд очистки и возврата */
+#define LCD_POWER_NS   15000000 /* Пауза после включения питания */
+#define LCD_RESET1_NS  4100000  /* Пауза после первой команды сброса */
+#define LCD_RESET2_NS  100000   /* Пауза после второй команды сброса */
+
+/* Команды контроллера HD44780 */
+#define LCD_CMD_CLEAR    0x01 /* Очистка экрана */
+#define LCD_CMD_ENTRY    0x06 /* Сдвиг курсора вправо после записи символа */
+#define LCD_CMD_OFF      0x08 /* Выключение экрана */
+#define LCD_CMD_ON       0x0C /* Включение экрана без курсора */
+#define LCD_CMD_FUNCTION 0x20 /* Выбор разрядности шины и количества строк */
+#define LCD_CMD_8BIT     0x10 /* Флаг 8-битной шины в команде выбора разрядности */
+#define LCD_CMD_2LINES   0x08 /* Флаг двух строк в команде выбора разрядности */
+#define LCD_CMD_ADDRESS  0x80 /* Установка адреса курсора */
+
+/* Структура данных драйвера индикатора. Поля initialized, data, control,
+   cursor, shown и buffer использует только поток вывода, а поля, которые
+   заполняет поток цикла обработки событий, защищены блокировкой lock */
+struct lcd_s
+{
+  parport_t *parport; /* Порт, к которому подключен индикатор */
+  unsigned cols;      /* Количество столбцов */
+  unsigned rows;      /* Количество строк */
+  int four_bit;       /* 1 - 4-битный режим обмена */
+
+  int initialized;    /* Признак того, что индикатор инициализирован */
+  int data;           /* Последнее записанное в регистр данных значение или -1 */
+  int control;        /* Последнее записанное в регистр управления значение или -1 */
+  int cursor;         /* Текущий адрес курсора или -1, если он неизвестен */
+
+  char shown[LCD_MAX_ROWS * LCD_MAX_COLS];  /* Содержимое, выведенное на индикатор */
+  char buffer[LCD_MAX_ROWS * LCD_MAX_COLS]; /* Выводимое содержимое экрана */
+
+  pthread_mutex_t lock; /* Блокировка полей, общих с потоком вывода */
+  pthread_cond_t cond;  /* Сигнал потоку вывода о новом содержимом */
+  char next[LCD_MAX_ROWS * LCD_MAX_COLS];   /* Последнее запрошенное содержимое */
+  int printed;        /* Признак того, что содержимое уже запрашивалось */
+  int pending;        /* Признак того, что запрошенное содержимое не выведено */
+  int reset;          /* Признак необходимости заново инициализировать индикатор */
+  int stop;           /* Признак необходимости завершить поток вывода */
+  int started;        /* Признак того, что поток вывода запущен */
+  pthread_t thread;   /* Поток вывода */
+
+  int notify;         /* Копия дескриптора eventfd для сообщений об ошибках или -1 */
+  int failed;         /* Признак ошибки записи, о которой сообщено циклу */
+};
+
+/* Подготовка драйвера индикатора из cols столбцов и rows строк на указанном порту */
+lcd_t *lcd_create(parport_t *parport, unsigned cols, unsigned rows)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "lcd_create: parport is NULL pointer");
+    return NULL;
+  }
+
+  if ((cols < 1) || (cols > LCD_MAX_COLS) || (rows < 1) || (rows > LCD_MAX_ROWS) ||
+      (cols * rows > 80))
+  {
+    log_message(LOG_ERR, "lcd_create: wrong lcd size %ux%u", cols, rows);
+    return NULL;
+  }
+
+  lcd_t *lcd = malloc(sizeof(lcd_t));
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "lcd_create: failed to allocate memory for lcd");
+    return NULL;
+  }
+
+  lcd->parport = parport;
+  lcd->cols = cols;
+  lcd->rows = rows;
+  lcd->four_bit = 0;
+  lcd->initialized = 0;
+  lcd->data = -1;
+  lcd->control = -1;
+  lcd->cursor = -1;
+  memset(lcd->shown, ' ', sizeof(lcd->shown));
+  memset(lcd->buffer, ' ', sizeof(lcd->buffer));
+
+  pthread_mutex_init(&(lcd->lock), NULL);
+  pthread_cond_init(&(lcd->cond), NULL);
+  memset(lcd->next, ' ', sizeof(lcd->next));
+  lcd->printed = 0;
+  lcd->pending = 0;
+  lcd->reset = 0;
+  lcd->stop = 0;
+  lcd->started = 0;
+  lcd->notify = -1;
+  lcd->failed = 0;
+
+  return lcd;
+}
+
+/* Включение 4-битного режима обмена с индикатором */
+int lcd_set_4bit(lcd_t *lcd, int four_bit)
+{
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "lcd_set_4bit: lcd is NULL pointer");
+    return -1;
+  }
+
+  lcd->four_bit = four_bit;
+  lcd->initialized = 0;
+  return 0;
+}
+
+/* Пауза указанной длительности. Короткие паузы выдерживаются активным
+   ожиданием, т.к. точность засыпания хуже длительности самих пауз */
+void lcd_delay(long long ns)
+{
+  if (ns >= LCD_RESET2_NS)
+  {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (nanosleep(&ts, &ts) == -1)
+    {
+      if (errno != EINTR)
+      {
+        log_error(LOG_WARNING, "lcd_delay: warning, nanosleep failed");
+        return;
+      }
+    }
+    return;
+  }
+
+  long long end = timer_now_ns() + ns;
+  while (timer_now_ns() < end)
+  {
+  }
+}
+
+/* Запись регистров порта, значения которых отличаются от последних записанных */
+int lcd_write(lcd_t *lcd, int data, int control)
+{
+  int d = (data != lcd->data) ? data : -1;
+  int c = (control != lcd->control) ? control : -1;
+
+  if ((d == -1) && (c == -1))
+  {
+    return 0;
+  }
+
+  if (parport_write_raw(lcd->parport, d, c) == -1)
+  {
+    log_message(LOG_ERR, "lcd_write: failed to write to parport");
+    lcd->data = -1;
+    lcd->control = -1;
+    return -1;
+  }
+
+  lcd->data = data;
+  lcd->control = control;
+  return 0;
+}
+
+/* Передача индикатору одного значения линий данных: данные и RS выставляются
+   при низком уровне E, а контроллер считывает их по спаду импульса E */
+int lcd_pulse(lcd_t *lcd, unsigned char data, unsigned rs)
+{
+  if ((lcd_write(lcd, data, leds_control(rs)) == -1) ||
+      (lcd_write(lcd, data, leds_control(rs | LCD_E)) == -1))
+  {
+    return -1;
+  }
+
+  lcd_delay(LCD_PULSE_NS);
+
+  if (lcd_write(lcd, data, leds_control(rs)) == -1)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Передача индикатору команды или символа с последующей паузой на её выполнение.
+   В 4-битном режиме байт передаётся двумя половинами, начиная со старшей */
+int lcd_send(lcd_t *lcd, unsigned char byte, unsigned rs, long long ns)
+{
+  if (lcd->four_bit)
+  {
+    if ((lcd_pulse(lcd, byte & 0xF0, rs) == -1) ||
+        (lcd_pulse(lcd, (byte << 4) & 0xF0, rs) == -1))
+    {
+      return -1;
+    }
+  }
+  else if (lcd_pulse(lcd, byte, rs) == -1)
+  {
+    return -1;
+  }
+
+  lcd_delay(ns);
+  return 0;
+}
+
+/* Инициализация индикатора командами сброса по описанию контроллера HD44780.
+   Три команды выбора 8-битной шины приводят контроллер в известное состояние
+   независимо от того, в каком режиме он находился до этого */
+int lcd_init(lcd_t *lcd)
+{
+  lcd->data = -1;
+  lcd->control = -1;
+  lcd->cursor = -1;
+
+  lcd_delay(LCD_POWER_NS);
+
+  unsigned char reset = LCD_CMD_FUNCTION | LCD_CMD_8BIT;
+  if (lcd_pulse(lcd, reset, 0) == -1)
+  {
+    return -1;
+  }
+  lcd_delay(LCD_RESET1_NS);
+  if (lcd_pulse(lcd, reset, 0) == -1)
+  {
+    return -1;
+  }
+  lcd_delay(LCD_RESET2_NS);
+  if (lcd_pulse(lcd, reset, 0) == -1)
+  {
+    return -1;
+  }
+  lcd_delay(LCD_EXEC_NS);
+
+  /* Переключение на 4-битную шину передаётся ещё по 8-битной шине,
+     от которой подключены только старшие 4 линии */
+  unsigned char function = LCD_CMD_FUNCTION;
+  if (lcd->four_bit)
+  {
+    if (lcd_pulse(lcd, function, 0) == -1)
+    {
+      return -1;
+    }
+    lcd_delay(LCD_EXEC_NS);
+  }
+  else
+  {
+    function |= LCD_CMD_8BIT;
+  }
+
+  if (lcd->rows > 1)
+  {
+    function |= LCD_CMD_2LINES;
+  }
+
+  if ((lcd_send(lcd, function, 0, LCD_EXEC_NS) == -1) ||
+      (lcd_send(lcd, LCD_CMD_OFF, 0, LCD_EXEC_NS) == -1) ||
+      (lcd_send(lcd, LCD_CMD_CLEAR, 0, LCD_CLEAR_NS) == -1) ||
+      (lcd_send(lcd, LCD_CMD_ENTRY, 0, LCD_EXEC_NS) == -1) ||
+      (lcd_send(lcd, LCD_CMD_ON, 0, LCD_EXEC_NS) == -1))
+  {
+    return -1;
+  }
+
+  /* После очистки экран заполнен пробелами, а курсор находится в начале */
+  memset(lcd->shown, ' ', sizeof(lcd->shown));
+  lcd->cursor = 0;
+  lcd->initialized = 1;
+  return 0;
+}
+
+/* Адрес символа в памяти индикатора. Третья и четвёртая строки продолжают
+   в памяти первую и вторую строки соответственно */
+int lcd_address(lcd_t *lcd, unsigned row, unsigned col)
+{
+  int address = (row % 2) ? 0x40 : 0;
+  if (row >= 2)
+  {
+    address += lcd->cols;
+  }
+  return address + col;
+}
+
+/* Вывод содержимого buffer на индикатор в потоке вывода. Индикатор
+   инициализируется при первом выводе и после ошибок записи */
+int lcd_output(lcd_t *lcd)
+{
+  if (!lcd->initialized && (lcd_init(lcd) == -1))
+  {
+    log_message(LOG_ERR, "lcd_output: failed to initialize lcd");
+    return -1;
+  }
+
+  /* Отправляем на индикатор только изменившиеся символы. Курсор после записи
+     символа сдвигается вправо, поэтому адрес устанавливается только перед
+     первым из символов, идущих подряд */
+  for(unsigned row = 0; row < lcd->rows; row++)
+  {
+    for(unsigned col = 0; col < lcd->cols; col++)
+    {
+      unsigned i = row * lcd->cols + col;
+      if (lcd->buffer[i] == lcd->shown[i])
+      {
+        continue;
+      }
+
+      int address = lcd_address(lcd, row, col);
+      if ((lcd->cursor != address) &&
+          (lcd_send(lcd, LCD_CMD_ADDRESS | address, 0, LCD_EXEC_NS) == -1))
+      {
+        log_message(LOG_ERR, "lcd_output: failed to set cursor address");
+        lcd->initialized = 0;
+        return -1;
+      }
+
+      if (lcd_send(lcd, lcd->buffer[i], LCD_RS, LCD_EXEC_NS) == -1)
+      {
+        log_message(LOG_ERR, "lcd_output: failed to write character");
+        lcd->initialized = 0;
+        return -1;
+      }
+
+      lcd->shown[i] = lcd->buffer[i];
+      lcd->cursor = address + 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Поток вывода. Паузы, которых требует контроллер индикатора, составляют
+   миллисекунды на символ и десятки миллисекунд на инициализацию, поэтому
+   вывод выполняется вне цикла обработки событий. Если за время вывода
+   запрошено несколько новых текстов, то выводится только последний */
+void *lcd_thread(void *data)
+{
+  lcd_t *lcd = data;
+
+  pthread_mutex_lock(&(lcd->lock));
+  while (!lcd->stop)
+  {
+    if (!lcd->pending)
+    {
+      pthread_cond_wait(&(lcd->cond), &(lcd->lock));
+      continue;
+    }
+
+    lcd->pending = 0;
+    if (lcd->reset)
+    {
+      lcd->reset = 0;
+      lcd->initialized = 0;
+    }
+    memcpy(lcd->buffer, lcd->next, sizeof(lcd->buffer));
+    pthread_mutex_unlock(&(lcd->lock));
+
+    /* Об ошибке сообщаем циклу обработки событий, который переведёт порт
+       в деградировавшее состояние, а после повторного открытия порта
+       содержимое будет выведено заново */
+    if (lcd_output(lcd) == -1)
+    {
+      __atomic_store_n(&(lcd->failed), 1, __ATOMIC_RELAXED);
+
+      int notify = __atomic_load_n(&(lcd->notify), __ATOMIC_ACQUIRE);
+      if ((notify != -1) && (eventfd_write(notify, 1) == -1))
+      {
+        log_error(LOG_WARNING, "lcd_thread: warning, eventfd_write failed");
+      }
+    }
+
+    pthread_mutex_lock(&(lcd->lock));
+  }
+  pthread_mutex_unlock(&(lcd->lock));
+
+  return NULL;
+}
+
+/* Запуск потока вывода */
+int lcd_start(lcd_t *lcd)
+{
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "lcd_start: lcd is NULL pointer");
+    return -1;
+  }
+
+  if (lcd->started)
+  {
+    log_message(LOG_WARNING, "lcd_start: warning, output thread already started");
+    return 0;
+  }
+
+  /* Сигналы INT и TERM должны доставляться потоку цикла обработки событий,
+     поэтому поток вывода создаётся с заблокированными сигналами */
+  sigset_t sigmask;
+  sigset_t old_sigmask;
+  sigfillset(&sigmask);
+  pthread_sigmask(SIG_SETMASK, &sigmask, &old_sigmask);
+
+  lcd->stop = 0;
+  int err = pthread_create(&(lcd->thread), NULL, lcd_thread, lcd);
+
+  pthread_sigmask(SIG_SETMASK, &old_sigmask, NULL);
+
+  if (err != 0)
+  {
+    log_message(LOG_ERR, "lcd_start: pthread_create failed: %s", strerror(err));
+    return -1;
+  }
+
+  lcd->started = 1;
+  return 0;
+}
+
+/* Передать драйверу дескриптор eventfd для сообщений об ошибках записи */
+int lcd_set_notify(lcd_t *lcd, int fd)
+{
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "lcd_set_notify: lcd is NULL pointer");
+    return -1;
+  }
+
+  if (lcd->notify != -1)
+  {
+    log_message(LOG_ERR, "lcd_set_notify: notify descriptor is already set");
+    return -1;
+  }
+
+  int notify = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (notify == -1)
+  {
+    log_error(LOG_ERR, "lcd_set_notify: failed to duplicate eventfd");
+    return -1;
+  }
+
+  __atomic_store_n(&(lcd->notify), notify, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Возвращает 1, если поток вывода сообщал об ошибке записи, и сбрасывает признак */
+int lcd_failed(lcd_t *lcd)
+{
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "lcd_failed: lcd is NULL pointer");
+    return 0;
+  }
+
+  return __atomic_exchange_n(&(lcd->failed), 0, __ATOMIC_RELAXED);
+}
+
+/* Сброс состояния индикатора после повторного открытия порта */
+int lcd_reset(lcd_t *lcd)
+{
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "lcd_reset: lcd is NULL pointer");
+    return -1;
+  }
+
+  pthread_mutex_lock(&(lcd->lock));
+  lcd->reset = 1;
+  if (lcd->printed)
+  {
+    lcd->pending = 1;
+    pthread_cond_signal(&(lcd->cond));
+  }
+  pthread_mutex_unlock(&(lcd->lock));
+  return 0;
+}
+
+/* Вывод текста на индикатор */
+int lcd_print(lcd_t *lcd, const char *text)
+{
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "lcd_print: lcd is NULL pointer");
+    return -1;
+  }
+
+  if (text == NULL)
+  {
+    log_message(LOG_ERR, "lcd_print: text is NULL pointer");
+    return -1;
+  }
+
+  if (!lcd->started)
+  {
+    log_message(LOG_ERR, "lcd_print: output thread is not started");
+    return -1;
+  }
+
+  /* Раскладываем текст по строкам экрана, лишние символы отбрасываем */
+  char screen[LCD_MAX_ROWS * LCD_MAX_COLS];
+  memset(screen, ' ', sizeof(screen));
+  unsigned row = 0;
+  unsigned col = 0;
+  for(; (text[0] != '\0') && (row < lcd->rows); text++)
+  {
+    if (text[0] == '\n')
+    {
+      row++;
+      col = 0;
+    }
+    else if (col < lcd->cols)
+    {
+      screen[row * lcd->cols + col] = text[0];
+      col++;
+    }
+  }
+
+  /* Считаем символы, изменившиеся относительно предыдущего текста, и
+     передаём новое содержимое потоку вывода */
+  pthread_mutex_lock(&(lcd->lock));
+
+  int changed = 0;
+  for(unsigned i = 0; i < lcd->rows * lcd->cols; i++)
+  {
+    if (screen[i] != lcd->next[i])
+    {
+      changed++;
+    }
+  }
+
+  if (!lcd->printed || (changed > 0))
+  {
+    memcpy(lcd->next, screen, sizeof(lcd->next));
+    lcd->printed = 1;
+    lcd->pending = 1;
+    pthread_cond_signal(&(lcd->cond));
+  }
+
+  pthread_mutex_unlock(&(lcd->lock));
+  return changed;
+}
+
+/* Освобождение памяти драйвера индикатора */
+int lcd_destroy(lcd_t *lcd)
+{
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "lcd_destroy: lcd is NULL pointer");
+    return -1;
+  }
+
+  int result = 0;
+
+  /* Если поток вывода запущен, сообщаем ему о необходимости завершиться
+     и дожидаемся его завершения */
+  if (lcd->started)
+  {
+    pthread_mutex_lock(&(lcd->lock));
+    lcd->stop = 1;
+    pthread_cond_signal(&(lcd->cond));
+    pthread_mutex_unlock(&(lcd->lock));
+
+    int err = pthread_join(lcd->thread, NULL);
+    if (err != 0)
+    {
+      log_message(LOG_WARNING, "lcd_destroy: warning, pthread_join failed: %s", strerror(err));
+      result = -1;
+    }
+  }
+
+  if ((lcd->notify != -1) && (close(lcd->notify) == -1))
+  {
+    log_error(LOG_WARNING, "lcd_destroy: warning, failed to close eventfd");
+    result = -1;
+  }
+
+  pthread_cond_destroy(&(lcd->cond));
+  pthread_mutex_destroy(&(lcd->lock));
+  free(lcd);
+  return result;
+}
@@ -0,0 +1,58 @@
+#ifndef __LCD__
+#define __LCD__
+
+#include "parport.h"
+
+/* Драйвер символьного индикатора на контроллере HD44780.
+
+   Линии D0-D7 порта подключаются к линиям данных DB0-DB7 индикатора, а в
+   4-битном режиме линии D4-D7 порта - к линиям DB4-DB7 индикатора. Линия
+   STROBE порта подключается к линии E индикатора, линия INIT - к линии RS.
+   Линия R/W индикатора соединяется с общим проводом, поэтому состояние
+   индикатора не читается, а паузы после команд выдерживаются по времени.
+
+   Драйвер хранит содержимое экрана, которое уже выведено на индикатор, и
+   при выводе нового содержимого отправляет на индикатор только изменившиеся
+   символы. Вывод с паузами, которых требует контроллер, выполняется в
+   отдельном потоке, чтобы не задерживать цикл обработки событий */
+struct lcd_s;
+typedef struct lcd_s lcd_t;
+
+/* Наибольшие размеры индикатора */
+#define LCD_MAX_COLS 40
+#define LCD_MAX_ROWS 4
+
+/* Подготовка драйвера индикатора из cols столбцов и rows строк на указанном порту */
+lcd_t *lcd_create(parport_t *parport, unsigned cols, unsigned rows);
+
+/* Включение 4-битного режима обмена с индикатором */
+int lcd_set_4bit(lcd_t *lcd, int four_bit);
+
+/* Запуск потока вывода. Вызывается после открытия порта */
+int lcd_start(lcd_t *lcd);
+
+/* Передать драйверу дескриптор eventfd, в который поток вывода записывает
+   сообщение об ошибке записи в порт. Драйвер хранит копию дескриптора до
+   освобождения */
+int lcd_set_notify(lcd_t *lcd, int fd);
+
+/* Возвращает 1, если после прошлого вызова поток вывода сообщал об ошибке
+   записи в порт, и сбрасывает признак ошибки */
+int lcd_failed(lcd_t *lcd);
+
+/* Сброс состояния индикатора после повторного открытия порта: индикатор
+   будет инициализирован заново, а последний текст выведен на него целиком */
+int lcd_reset(lcd_t *lcd);
+
+/* Вывод текста на индикатор. Текст заполняет экран построчно, символ перевода
+   строки переходит на следующую строку, а оставшаяся часть строки заполняется
+   пробелами. Текст передаётся потоку вывода, а функция не ждёт окончания
+   вывода. Индикатор инициализируется при первом выводе и после ошибок
+   записи в порт. Возвращает количество символов, изменившихся относительно
+   предыдущего текста */
+int lcd_print(lcd_t *lcd, const char *text);
+
+/* Остановка потока вывода и освобождение памяти драйвера индикатора */
+int lcd_destroy(lcd_t *lcd);
+
+#endif
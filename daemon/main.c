@@ -2,13 +2,14 @@
    порта пространства пользователя. Программа состоит из ведущего и
    ведомого процессов.
  
-   Ведущий управляет PID-файлом, запускает ведомый процесс, перезапускает
-   его при внезапном завершении, завершает его при окончании работы,
-   удаляет за ним Unix-сокет.
+   Ведущий управляет PID-файлом, открывает Unix-сокет для входящих
+   подключений или получает его от systemd, запускает ведомый процесс,
+   перезапускает его при внезапном завершении, завершает его при окончании
+   работы, удаляет за собой Unix-сокет.
 
    Ведомый процесс после запуска открывает все управляемые им файлы
-   устройств параллельных портов, открывает Unix-сокет для входящих
-   подключений, при необходимости сбрасывает привилегии и вход в цикл
+   устройств параллельных портов, принимает подключения на Unix-сокете
+   ведущего процесса, при необходимости сбрасывает привилегии и вход в цикл
    обработки поступающих подключений и запросов. При получении сигнала
    завершения работы от ведущего процесса выходит из цикла. */
 
@@ -17,8 +18,10 @@
 #include <stdlib.h>
 
 #include "daemon.h"
+#include "evloop.h"
 #include "slave.h"
 #include "config.h"
+#include "metrics.h"
 #ifndef LITE
 #include "master.h"
 #endif
@@ -33,32 +36,77 @@ int main(const int carg, const char **varg)
     return 1;
   }
 
+  /* Сообщения менее важных уровней дальше не формируются */
+  log_set_level(config->log_level);
+
+  /* Статистика цикла обработки событий собирается с запуска ведомого процесса */
+  evloop_set_measure(config->measure_loop);
+
+  /* Код завершения программы. Ведомый процесс, который не смог запуститься,
+     завершается с ненулевым кодом, чтобы ведущий процесс перезапустил его */
+  int status = 0;
+
   /* Работа в основном режиме */
   if (config->mode == MODE_RUN)
   {
+    /* Слушающий сокет может быть передан systemd при активации через сокет.
+       Переменная LISTEN_PID проверяется до перехода в режим демона, который
+       меняет идентификатор процесса */
+    int listen_fd = unix_socket_inherit(config->unix_socket_pathname);
+
 #ifndef LITE
-    /* Если требуется работать в режиме демона, то переходим в этот режим */
-    if (config->daemon == 1)
+    /* Предыдущая версия программы при обновлении передаёт сокет, в очереди
+       которого лежат её открытые порты и сокеты клиентов */
+    int resume_fd = -1;
+    const char *resume = getenv(SLAVE_RESUME_ENV);
+    if (resume != NULL)
+    {
+      resume_fd = atoi(resume);
+      unsetenv(SLAVE_RESUME_ENV);
+    }
+
+    /* Если требуется работать в режиме демона, то переходим в этот режим.
+       Новая версия программы уже работает в режиме демона */
+    if ((config->daemon == 1) && (resume_fd == -1))
     {
       daemonize();
     }
 
     /* Запускаем ведущий процесс, который запустит ведомый и будет им управлять */
-    if (master(config->pidfile_pathname,
-               config->parports,
-               config->unix_socket_pathname, config->unix_socket_uid,
-               config->unix_socket_gid, config->unix_socket_mode,
-               config->uid, config->gid, config->chroot_pathname) == -1)
+    status = master(varg,
+                    config->pidfile_pathname,
+                    config->parports,
+                    config->shards, config->shards_num,
+                    listen_fd,
+                    resume_fd,
+                    config->heartbeat, config->heartbeat_misses,
+                    config->metrics_address,
+                    config->unix_socket_pathname, config->unix_socket_uid,
+                    config->unix_socket_gid, config->unix_socket_mode,
+                    config->uid, config->gid, config->chroot_pathname);
+    if (status == -1)
     {
       log_message(LOG_ERR, "main: master failed");
       return 1;
     }
 #else
     /* Запускаем ведомый процесс */
-    if (slave(config->parports,
-              config->unix_socket_pathname, config->unix_socket_uid,
-              config->unix_socket_gid, config->unix_socket_mode,
-              config->uid, config->gid, config->chroot_pathname) == -1)
+    status = slave(config->parports,
+                   listen_fd,
+                   -1, -1, -1, 1,
+                   config->metrics_address,
+                   config->unix_socket_pathname, config->unix_socket_uid,
+                   config->unix_socket_gid, config->unix_socket_mode,
+                   config->uid, config->gid, config->chroot_pathname);
+
+    /* Ведущего процесса нет, поэтому сокет метрик удаляет сам ведомый
+       процесс, если путь к нему не изменился сменой корневого каталога */
+    if ((config->metrics_address != NULL) && (config->chroot_pathname == NULL))
+    {
+      metrics_unlink(config->metrics_address);
+    }
+
+    if (status != 0)
     {
       log_message(LOG_ERR, "main: slave failed");
       return 1;
@@ -88,18 +136,88 @@ int main(const int carg, const char **varg)
             "       --group <group>        - switch to specified group after open all sockets\n"
             "                                and devices\n"
             "       --chroot <path>        - change root path of process to specified path\n"
+            "       --update-order <order> - order of data and control register writes:\n"
+            "                                data (default), control or auto\n"
+            "       --measure-gaps         - measure gaps between register writes\n"
+            "       --measure-loop         - measure event loop wait, handler and\n"
+            "                                iteration times\n"
+            "       --refresh <hz>         - write changed ports to hardware at most <hz>\n"
+            "                                times per second (1-1000), default - on\n"
+            "                                every command\n"
+            "       --matrix <rows>x<cols> - drive a multiplexed led matrix on the last\n"
+            "                                specified parport (rows up to 8, rows + cols\n"
+            "                                up to 12)\n"
+            "       --scan-rate <hz>       - matrix refresh rate (1-10000), default - 500\n"
+            "       --scan-cpu <cpu>       - pin matrix scan thread to specified cpu\n"
+            "       --shift <chains>x<bits> - drive 74HC595 shift register chains on the last\n"
+            "                                specified parport (up to 6 chains, up to 768\n"
+            "                                bits total)\n"
+            "       --lcd <cols>x<rows>    - drive a HD44780 character lcd on the last\n"
+            "                                specified parport (up to 40x4, 80 characters)\n"
+            "       --lcd-4bit             - use 4-bit bus for the last specified lcd\n"
+            "       --input                - watch status lines of the last specified parport\n"
+            "                                and push events to subscribed clients\n"
+            "       --debounce <ms>        - status lines settle time after interrupt\n"
+            "                                (0-1000), default - 20\n"
+            "       --counter              - count ACK line pulses on the last specified\n"
+            "                                parport and push their rate every second\n"
+            "       --sampler <KiB>        - capture buffer size for status line sampling on\n"
+            "                                the last specified parport (1-65536)\n"
+            "       --sampler-cpu <cpu>    - pin capture thread of the last sampler to\n"
+            "                                specified cpu\n"
+            "       --virtual <layout>     - add a virtual port of up to 48 bits made of\n"
+            "                                leds of specified parports, layout is a list\n"
+            "                                of <port>:<led>[-<led>] separated by commas\n"
+            "       --mirror <ports>       - add a mirror group, which writes leds to all\n"
+            "                                specified parports and reads them from the\n"
+            "                                first one, ports are separated by commas\n"
+            "       --name <name>          - name of the last specified parport, virtual\n"
+            "                                port or mirror group, usable instead of its\n"
+            "                                index. The option can be specified multiple\n"
+            "                                times.\n"
+            "       --parports-file <path> - file with a list of parports, one per line:\n"
+            "                                path and names. It is reread on HUP signal,\n"
+            "                                only added and removed parports are changed\n",
+            varg[0],
+            varg[0],
+            DEFAULT_PARPORT,
+            DEFAULT_SOCKET);
+
+    /* Справка выводится по частям, чтобы строки не превышали длину,
+       которую обязаны поддерживать компиляторы C99 */
+    fprintf(stderr,
 #ifndef LITE
             "       --pidfile <PID-file>   - path to file, where will be saved PID, default -\n"
-#endif
             "                                none\n"
+            "       --heartbeat <ms>       - period of slave liveness checks (10-60000),\n"
+            "                                0 - off, default - %d\n"
+            "       --heartbeat-misses <n> - restart slave after so many missed checks in a\n"
+            "                                row (1-100), default - %d\n"
+            "       --shard <ports>        - serve specified parports in a separate slave,\n"
+            "                                ports are numbers, names or name patterns\n"
+            "                                separated by commas\n"
+            "       --shard-socket <path>  - socket of the last specified shard\n"
+            "       --shard-cpu <cpu>      - pin slave of the last specified shard to\n"
+            "                                specified cpu\n"
+#endif
+            "       --metrics <address>    - serve metrics in Prometheus text format on\n"
+            "                                unix socket path or loopback host:port\n"
+            "       --log-level <level>    - least important level of logged messages:\n"
+#ifndef LITE
+            "                                emerg, alert, crit, err, warning, notice,\n"
+            "                                info or debug, default - info\n"
+#else
+            "                                emerg, alert, crit, err, warning, notice or\n"
+            "                                info, default - info\n"
+#endif
             "Modes:\n"
             "       <default> - listen commands on socket and work with leds on parallel\n"
             "                   port.\n"
-            "       --help    - show this help\n",
-            varg[0],
-            varg[0],
-            DEFAULT_PARPORT,
-            DEFAULT_SOCKET);
+            "       --help    - show this help\n"
+#ifndef LITE
+            , DEFAULT_HEARTBEAT, DEFAULT_HEARTBEAT_MISSES
+#endif
+            );
   }
 
   /* Освобождаем память, которая была занята конфигурацией */
@@ -107,5 +225,5 @@ int main(const int carg, const char **varg)
   {
     log_message(LOG_WARNING, "main: failed to destroy config.\n");
   }
-  return 0;
+  return status;
 }
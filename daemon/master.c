@@ -1,18 +1,42 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <sys/file.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
 #include "daemon.h"
+#include "timer.h"
 #include "slave.h"
+#include "notify.h"
+#include "metrics.h"
 #include "config.h"
 #include "master.h"
 
 #define BUF_SIZE 4096
 
+/* Переменная окружения, которая сообщает новой версии программы, что
+   переданный ей слушающий сокет создан ведущим процессом и должен быть
+   удалён при завершении работы */
+#define MASTER_OWNED_ENV "PARLED12_SOCKET_OWNED"
+
+/* Задержка перед перезапуском аварийно завершившегося ведомого процесса
+   удваивается после каждого аварийного завершения подряд от MASTER_BACKOFF_MIN
+   до MASTER_BACKOFF_MAX миллисекунд. Ведомый процесс, проработавший не менее
+   MASTER_STABLE_TIME миллисекунд, считается работавшим стабильно, и задержка
+   сбрасывается. MASTER_CRASH_LOOP аварийных завершений подряд считаются
+   циклом аварийных перезапусков */
+#define MASTER_BACKOFF_MIN 100
+#define MASTER_BACKOFF_MAX 30000
+#define MASTER_STABLE_TIME 10000
+#define MASTER_CRASH_LOOP 5
+
 /* Структура данных с информацией о PID-файле */
 struct pidfile_s
 {
@@ -69,6 +93,19 @@ int pidfile_validate(const char *pathname)
     return -1;
   }
 
+  /* После обновления программы в PID-файле остаётся идентификатор этого же
+     процесса, который запустил новую версию программы вместо себя */
+  if ((pid_t)pid == getpid())
+  {
+    log_message(LOG_INFO, "pidfile_validate: PID-file %s belongs to this process", pathname);
+
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "pidfile_validate: warning, failed to close opened PID-file %s", pathname);
+    }
+    return -1;
+  }
+
   /* Проверяем, активен ли процесс с указанным идентификатором */
   if (kill((pid_t)pid, 0) == -1)
   {
@@ -116,7 +153,7 @@ pidfile_t *pidfile_create(const char *pathname, pid_t pid)
 
   /* Пытаемся открыть существующий файл на запись или создать новый файл
      для записи */
-  int fd = open(pathname, O_RDWR | O_CREAT | O_EXCL);
+  int fd = open(pathname, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC);
   if (fd == -1)
   {
     log_error(LOG_ERR, "pidfile_create: failed to create PID-file %s", pathname);
@@ -227,6 +264,8 @@ int pidfile_destroy(pidfile_t *pidfile)
 
 int master_stop = 0;    /* Признак необходимости завершить работу */
 int master_restart = 1; /* Признак необходимости перезапустить ведомый процесс */
+int master_reload = 0;  /* Признак необходимости перечитать список портов */
+int master_upgrade = 0; /* Признак необходимости обновить программу */
 
 /* Обработчик сигналов. При получении сигналов выставляет признаки необходимости
    завершить работу или перезапустить ведомый процесс */
@@ -244,25 +283,455 @@ void master_sighandler(int signal)
   {
     master_restart = 1;
   }
+  else if (signal == SIGHUP)
+  {
+    master_reload = 1;
+  }
+  else if (signal == SIGUSR2)
+  {
+    master_upgrade = 1;
+  }
+}
+
+/* Состояние проверок работоспособности ведомого процесса */
+typedef struct master_heartbeat_s
+{
+  int fd;              /* Сокет проверок работоспособности или -1 */
+  long long period;    /* Период проверок, нс */
+  unsigned misses;     /* Количество пропущенных проверок подряд, после
+                          которого ведомый процесс перезапускается */
+  int ready;           /* Признак того, что ведомый процесс готов отвечать */
+  unsigned unanswered; /* Количество проверок подряд, оставшихся без ответа */
+  long long deadline;  /* Время отправки следующей проверки, нс */
+  long long started;   /* Время запуска ведомого процесса, нс */
+  heartbeat_t last;    /* Последний отправленный пакет */
+} master_heartbeat_t;
+
+/* Подготовка проверок работоспособности нового ведомого процесса. Сокет fd
+   ведущего процесса закрывается, когда ведомый процесс перезапускается */
+void master_heartbeat_reset(master_heartbeat_t *hb, int fd)
+{
+  if ((hb->fd != -1) && (close(hb->fd) == -1))
+  {
+    log_error(LOG_WARNING, "master_heartbeat_reset: warning, failed to close heartbeat channel");
+  }
+
+  hb->fd = fd;
+  hb->ready = 0;
+  hb->unanswered = 0;
+  hb->deadline = 0;
+
+  /* Количество перезапусков относится к ведущему процессу и сохраняется */
+  unsigned long long restarts = hb->last.restarts;
+  memset(&(hb->last), 0, sizeof(hb->last));
+  hb->last.restarts = restarts;
+}
+
+/* Приём ответов ведомого процесса и измерение их задержек */
+void master_heartbeat_receive(master_heartbeat_t *hb)
+{
+  while (hb->fd != -1)
+  {
+    heartbeat_t pong;
+    ssize_t n = recv(hb->fd, &pong, sizeof(pong), MSG_DONTWAIT);
+    if ((n == -1) && (errno != ECONNRESET))
+    {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+      {
+        log_error(LOG_WARNING, "master_heartbeat_receive: warning, failed to receive heartbeat");
+      }
+      return;
+    }
+
+    /* Ведомый процесс завершился, его перезапустит обработка сигнала CHLD */
+    if (n <= 0)
+    {
+      master_heartbeat_reset(hb, -1);
+      return;
+    }
+
+    if (n != sizeof(pong))
+    {
+      log_message(LOG_WARNING, "master_heartbeat_receive: warning, wrong heartbeat size %zd", n);
+      continue;
+    }
+
+    long long now = timer_now_ns();
+
+    /* Ведомый процесс открыл порты и готов отвечать */
+    if (pong.seq == 0)
+    {
+      hb->ready = 1;
+      hb->deadline = now;
+      hb->last.ready = now - hb->started;
+      log_message(LOG_INFO, "master_heartbeat_receive: slave is ready in %lld ms", hb->last.ready / 1000000);
+      continue;
+    }
+
+    /* Даже запоздавший ответ означает, что ведомый процесс не завис */
+    long long latency = now - pong.sent;
+    if (hb->unanswered > 1)
+    {
+      log_message(LOG_WARNING, "master_heartbeat_receive: warning, slave was stalled for %lld ms", latency / 1000000);
+    }
+    hb->unanswered = 0;
+    hb->last.latency = latency;
+    if (latency > hb->last.max_latency)
+    {
+      hb->last.max_latency = latency;
+    }
+  }
+}
+
+/* Отправка очередной проверки, если подошло её время. Возвращает 1, если
+   ведомый процесс пропустил слишком много проверок и его нужно перезапустить */
+int master_heartbeat_send(master_heartbeat_t *hb)
+{
+  if ((hb->fd == -1) || !hb->ready)
+  {
+    return 0;
+  }
+
+  long long now = timer_now_ns();
+  if (now < hb->deadline)
+  {
+    return 0;
+  }
+
+  if (hb->unanswered >= hb->misses)
+  {
+    return 1;
+  }
+
+  if (hb->unanswered > 0)
+  {
+    hb->last.missed++;
+  }
+
+  hb->last.seq++;
+  hb->last.sent = now;
+  if (send(hb->fd, &(hb->last), sizeof(hb->last), MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+  {
+    log_error(LOG_WARNING, "master_heartbeat_send: warning, failed to send heartbeat");
+  }
+  hb->unanswered++;
+
+  /* Пропущенные из-за долгой обработки сигналов проверки не навёрстываются */
+  hb->deadline += hb->period;
+  if (hb->deadline <= now)
+  {
+    hb->deadline = now + hb->period;
+  }
+  return 0;
+}
+
+/* Ведомый процесс, которым управляет ведущий процесс: основной ведомый
+   процесс или ведомый процесс шарда */
+typedef struct master_slave_s
+{
+  const shard_t *shard;   /* Шард или NULL для основного ведомого процесса,
+                             который обслуживает порты, не вошедшие в шарды */
+  const char *pathname;   /* Путь к слушающему Unix-сокету */
+  int fd;                 /* Слушающий Unix-сокет или -1 */
+  int owned;              /* 1 - сокет создан ведущим процессом и удаляется им */
+  pid_t pid;              /* Идентификатор ведомого процесса или 0 */
+  int start;              /* 1 - ведомый процесс нужно запустить */
+  unsigned failures;      /* Количество аварийных завершений подряд */
+  long long respawn;      /* Время перезапуска после задержки, нс, или 0 */
+  master_heartbeat_t hb;  /* Проверки работоспособности */
+} master_slave_t;
+
+/* Ожидание сигналов с маской sigmask и ответов ведомых процессов до отправки
+   ближайшей проверки, до ближайшего перезапуска после задержки или до времени
+   until, если оно отлично от нуля. Без проверок и задержек равносильно
+   sigsuspend. Массив pfds должен вмещать num элементов */
+void master_wait(master_slave_t *slaves, unsigned num, struct pollfd *pfds, const sigset_t *sigmask,
+                 long long until)
+{
+  for(unsigned k = 0; k < num; k++)
+  {
+    master_heartbeat_t *hb = &(slaves[k].hb);
+
+    /* Отрицательные дескрипторы ppoll пропускает */
+    pfds[k].fd = hb->fd;
+    pfds[k].events = POLLIN;
+    pfds[k].revents = 0;
+
+    if ((slaves[k].respawn != 0) && ((until == 0) || (slaves[k].respawn < until)))
+    {
+      until = slaves[k].respawn;
+    }
+    if ((hb->fd != -1) && hb->ready && ((until == 0) || (hb->deadline < until)))
+    {
+      until = hb->deadline;
+    }
+  }
+
+  struct timespec ts;
+  struct timespec *timeout = NULL;
+  if (until != 0)
+  {
+    long long left = until - timer_now_ns();
+    if (left < 0)
+    {
+      left = 0;
+    }
+    ts.tv_sec = left / 1000000000;
+    ts.tv_nsec = left % 1000000000;
+    timeout = &ts;
+  }
+
+  int n = ppoll(pfds, num, timeout, sigmask);
+  if ((n == -1) && (errno != EINTR))
+  {
+    log_error(LOG_WARNING, "master_wait: warning, ppoll failed");
+    return;
+  }
+
+  for(unsigned k = 0; (n > 0) && (k < num); k++)
+  {
+    if (pfds[k].revents != 0)
+    {
+      master_heartbeat_receive(&(slaves[k].hb));
+    }
+  }
+}
+
+/* Проверка, что хотя бы один ведомый процесс работает и сам отправляет
+   уведомления systemd. Без проверок работоспособности ведомый процесс
+   считается готовым сразу после запуска, а с проверками - после того, как
+   он открыл порты и прислал первый пакет */
+int master_ready(master_slave_t *slaves, unsigned num)
+{
+  for(unsigned k = 0; k < num; k++)
+  {
+    if ((slaves[k].pid > 0) && ((slaves[k].hb.period == 0) || slaves[k].hb.ready))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Закрытие слушающих Unix-сокетов ведомых процессов и удаление сокетов,
+   созданных ведущим процессом */
+void master_close_sockets(master_slave_t *slaves, unsigned num)
+{
+  for(unsigned k = 0; k < num; k++)
+  {
+    if (slaves[k].fd == -1)
+    {
+      continue;
+    }
+
+    if (close(slaves[k].fd) == -1)
+    {
+      log_error(LOG_WARNING, "master_close_sockets: warning, failed to close listen socket");
+    }
+    if (slaves[k].owned && (unlink(slaves[k].pathname) == -1))
+    {
+      log_error(LOG_WARNING, "master_close_sockets: warning, failed to remove unix-socket %s", slaves[k].pathname);
+    }
+    slaves[k].fd = -1;
+  }
+}
+
+/* Оставить в каталоге порты, которые обслуживает ведомый процесс шарда shard,
+   или, если shard равен NULL, порты, не вошедшие ни в один из шардов */
+int master_restrict(parports_t *parports, const shard_t *shards, unsigned shards_num,
+                    const shard_t *shard)
+{
+  if (shard != NULL)
+  {
+    return parports_restrict(parports, shard->ports, 1);
+  }
+
+  for(unsigned i = 0; i < shards_num; i++)
+  {
+    if (parports_restrict(parports, shards[i].ports, 0) == -1)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Отмена подготовки дескрипторов к запуску новой версии программы: копия
+   слушающего сокета fd на месте LISTEN_FDS_START закрывается, а остальные
+   дескрипторы снова закрываются при запуске программ, чтобы их не унаследовали
+   программы, запускаемые ведомыми процессами */
+void master_exec_undo(int fd, int channel)
+{
+  if (fd != LISTEN_FDS_START)
+  {
+    if (close(LISTEN_FDS_START) == -1)
+    {
+      log_error(LOG_WARNING, "master_exec_undo: warning, failed to close copy of listen socket");
+    }
+  }
+  else if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+  {
+    log_error(LOG_WARNING, "master_exec_undo: warning, failed to set close-on-exec flag");
+  }
+
+  if (fcntl(channel, F_SETFD, FD_CLOEXEC) == -1)
+  {
+    log_error(LOG_WARNING, "master_exec_undo: warning, failed to set close-on-exec flag");
+  }
+}
+
+/* Запуск новой версии программы вместо ведущего процесса. Слушающий сокет
+   fd передаётся новой версии так же, как его передаёт systemd, а сокет
+   channel, в очереди которого лежит состояние ведомого процесса, - через
+   переменную окружения SLAVE_RESUME_ENV. Если сокет создан ведущим процессом
+   (owned), то новая версия удалит его при завершении работы. Если сокет
+   channel пришлось перенести на другой дескриптор, то новый номер
+   записывается в channel. Возвращает -1, если запустить новую версию
+   не удалось, при этом дескрипторы снова закрываются при запуске программ */
+int master_exec(const char **varg, int fd, int owned, int *channel, pidfile_t *pidfile)
+{
+  /* Дескриптор LISTEN_FDS_START занимается слушающим сокетом, поэтому другие
+     дескрипторы с этим номером переносим. Прежний номер займёт слушающий
+     сокет, поэтому вызывающая функция должна пользоваться новым номером */
+  if (*channel == LISTEN_FDS_START)
+  {
+    int moved = fcntl(*channel, F_DUPFD_CLOEXEC, LISTEN_FDS_START + 1);
+    if (moved == -1)
+    {
+      log_error(LOG_ERR, "master_exec: failed to move upgrade channel");
+      return -1;
+    }
+    if (close(*channel) == -1)
+    {
+      log_error(LOG_WARNING, "master_exec: warning, failed to close upgrade channel");
+    }
+    *channel = moved;
+  }
+
+  if ((pidfile != NULL) && (pidfile->fd == LISTEN_FDS_START) && (fd != LISTEN_FDS_START))
+  {
+    int moved = fcntl(pidfile->fd, F_DUPFD_CLOEXEC, LISTEN_FDS_START + 1);
+    if (moved == -1)
+    {
+      log_error(LOG_ERR, "master_exec: failed to move PID-file descriptor");
+      return -1;
+    }
+    pidfile->fd = moved;
+  }
+
+  if ((fd != LISTEN_FDS_START) && (dup2(fd, LISTEN_FDS_START) == -1))
+  {
+    log_error(LOG_ERR, "master_exec: failed to move listen socket");
+    return -1;
+  }
+
+  /* Оба дескриптора должны пережить запуск новой версии */
+  if ((fcntl(LISTEN_FDS_START, F_SETFD, 0) == -1) || (fcntl(*channel, F_SETFD, 0) == -1))
+  {
+    log_error(LOG_ERR, "master_exec: failed to clear close-on-exec flag");
+    master_exec_undo(fd, *channel);
+    return -1;
+  }
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%d", (int)getpid());
+  setenv("LISTEN_PID", buf, 1);
+  setenv("LISTEN_FDS", "1", 1);
+  snprintf(buf, sizeof(buf), "%d", *channel);
+  setenv(SLAVE_RESUME_ENV, buf, 1);
+  if (owned)
+  {
+    setenv(MASTER_OWNED_ENV, "1", 1);
+  }
+
+  log_message(LOG_NOTICE, "master_exec: starting new version of %s", varg[0]);
+  execvp(varg[0], (char *const *)varg);
+
+  log_error(LOG_ERR, "master_exec: failed to execute %s", varg[0]);
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv(SLAVE_RESUME_ENV);
+  unsetenv(MASTER_OWNED_ENV);
+  master_exec_undo(fd, *channel);
+  return -1;
+}
+
+/* Задержка перед очередным перезапуском ведомого процесса после failures
+   аварийных завершений подряд, нс. Случайная добавка от половины задержки
+   до полной не даёт нескольким демонам перезапускаться одновременно */
+long long master_backoff(unsigned failures)
+{
+  long long delay = MASTER_BACKOFF_MAX;
+  if (failures <= 16)
+  {
+    delay = (long long)MASTER_BACKOFF_MIN << (failures - 1);
+    if (delay > MASTER_BACKOFF_MAX)
+    {
+      delay = MASTER_BACKOFF_MAX;
+    }
+  }
+
+  delay = delay / 2 + random() % (delay / 2 + 1);
+  return delay * 1000000;
 }
 
 /* Функция, реализующая ведущий процесс.
 
-   Удаляет PID-файл и Unix-сокет, если они существуют,
+   Удаляет PID-файл, если он существует,
+
+   создаёт слушающий Unix-сокет, если он не передан через listen_fd,
+   и передаёт его каждому запускаемому ведомому процессу, поэтому
+   подключения клиентов не отвергаются, пока ведомый процесс перезапускается,
 
    запускает ведомый процесс и ждёт сигналов,
 
-   при получении сигнала CHLD, если до этого ему не были отправлены сигналы INT
-   или TERM, перезапускает ведомый процесс,
+   если указаны шарды shards, то для каждого шарда создаёт его слушающий
+   Unix-сокет и запускает отдельный ведомый процесс, который обслуживает
+   только порты шарда и может быть привязан к своему процессору, а основной
+   ведомый процесс обслуживает остальные порты. Ведомые процессы
+   перезапускаются и проверяются независимо друг от друга,
 
-   при получении сигнала INT или TERM завершает ведомый процесс, удаляет
-   PID-файл и Unix-сокет, после чего завершает работу.
+   при получении сигнала CHLD, если до этого ему не были отправлены сигналы INT
+   или TERM, а ведомый процесс завершился аварийно, перезапускает ведомый
+   процесс с экспоненциально растущей задержкой со случайной добавкой,
+   чтобы не нагружать систему при цикле аварийных перезапусков,
+
+   при получении сигнала HUP передаёт его ведомым процессам, чтобы они
+   перечитали файл со списком портов,
+
+   при получении сигнала USR2, если шарды не указаны, передаёт его ведомому
+   процессу, который передаёт открытые порты и сокеты клиентов и завершается,
+   после чего запускает вместо себя новую версию программы с теми же
+   аргументами командной строки varg, передавая ей слушающий сокет и состояние
+   ведомого процесса. Если запустить новую версию не удалось, то запускает
+   новый ведомый процесс, передавая состояние ему,
+
+   если период heartbeat отличен от нуля, то с этим периодом проверяет
+   работоспособность ведомых процессов через пары сокетов и принудительно
+   перезапускает ведомый процесс, если он не ответил на heartbeat_misses
+   проверок подряд, например, завис в системном вызове или в бесконечном
+   цикле. Задержки ответов сообщаются ведомому процессу, который выводит их
+   по команде heartbeat,
+
+   при получении сигнала INT или TERM завершает ведомые процессы, удаляет
+   PID-файл и созданные им Unix-сокеты, после чего завершает работу.
 
    pidfile_pathname - полный путь к PID-файлу или указатель NULL,
+   shards - шарды или NULL, shards_num - количество шардов,
+   resume_fd - сокет с состоянием, переданным предыдущей версией программы,
+   который передаётся первому ведомому процессу, или -1,
    остальные параметры аналогичны параметрам функции slave, см. файл slave.h */
-int master(const char *pidfile_pathname,
+int master(const char **varg,
+           const char *pidfile_pathname,
            parports_t *parports,
-          
+           const shard_t *shards,
+           unsigned shards_num,
+
+           int listen_fd,
+           int resume_fd,
+           unsigned heartbeat,
+           unsigned heartbeat_misses,
+           const char *metrics_address,
            const char *unix_socket_pathname,
            int unix_socket_uid,
            int unix_socket_gid,
@@ -287,54 +756,186 @@ int master(const char *pidfile_pathname,
     }
   }
 
-  /* Удаляем возможно существующий Unix-сокет */
-  if (unlink(unix_socket_pathname) == -1)
+  /* Основной ведомый процесс и по одному ведомому процессу на каждый шард */
+  unsigned num = shards_num + 1;
+  master_slave_t *slaves = malloc(sizeof(master_slave_t) * num);
+  struct pollfd *pfds = malloc(sizeof(struct pollfd) * num);
+  if ((slaves == NULL) || (pfds == NULL))
+  {
+    log_message(LOG_ERR, "master: failed to allocate memory for slaves");
+    free(slaves);
+    free(pfds);
+    if ((pidfile != NULL) && (pidfile_destroy(pidfile) == -1))
+    {
+      log_message(LOG_WARNING, "master: warning, failed to destory PID-file");
+    }
+    return -1;
+  }
+
+  for(unsigned k = 0; k < num; k++)
   {
-    log_error(LOG_INFO, "master: failed to remove unix-socket");
+    master_slave_t *s = &(slaves[k]);
+    s->shard = (k == 0) ? NULL : &(shards[k - 1]);
+    s->pathname = (k == 0) ? unix_socket_pathname : shards[k - 1].pathname;
+    s->fd = -1;
+    s->owned = 1;
+    s->pid = 0;
+    s->start = 1;
+    s->failures = 0;
+    s->respawn = 0;
+    s->hb.fd = -1;
+    s->hb.period = (long long)heartbeat * 1000000;
+    s->hb.misses = heartbeat_misses;
+    s->hb.started = 0;
+    s->hb.last.restarts = 0;
+    master_heartbeat_reset(&(s->hb), -1);
+  }
+
+  /* Слушающие Unix-сокеты создаются один раз до запуска ведомых процессов.
+     Подключения, пришедшие во время перезапуска ведомого процесса, ждут
+     в очереди сокета, пока новый ведомый процесс их не примет. Сокет,
+     переданный systemd, принадлежит ему и не удаляется, а сокет, переданный
+     предыдущей версией программы, удаляется, если его создала она */
+  slaves[0].owned = (listen_fd == -1) || (getenv(MASTER_OWNED_ENV) != NULL);
+  unsetenv(MASTER_OWNED_ENV);
+  slaves[0].fd = listen_fd;
+  for(unsigned k = 0; k < num; k++)
+  {
+    if (slaves[k].fd != -1)
+    {
+      continue;
+    }
+
+    slaves[k].fd = unix_socket_create(slaves[k].pathname,
+                                      unix_socket_uid,
+                                      unix_socket_gid,
+                                      unix_socket_mode,
+                                      BACKLOG_NUMBER);
+    if (slaves[k].fd == -1)
+    {
+      log_message(LOG_ERR, "master: unix_socket_create failed");
+      master_close_sockets(slaves, num);
+      free(slaves);
+      free(pfds);
+      if ((pidfile != NULL) && (pidfile_destroy(pidfile) == -1))
+      {
+        log_message(LOG_WARNING, "master: warning, failed to destory PID-file");
+      }
+      return -1;
+    }
   }
 
   /* Готовим новый обработчик сигналов. После вызова обработчика сигнала, нужно перезапустить
-     выполнение прерванного системного вызова */
+     выполнение прерванного системного вызова. Остановленный ведомый процесс
+     не завершился, его обнаружат проверки работоспособности */
   struct sigaction new_sa;
   new_sa.sa_handler = master_sighandler;
-  new_sa.sa_flags = SA_RESTART;
+  new_sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
 
   /* Проставляем начальные значения признаков небходимости завершить работу или
      перезапустить ведомый процесс на случай, если функция master вызвана повторно,
-     а в переменных ещё хранятся значения с прошлого запуска */   
+     а в переменных ещё хранятся значения с прошлого запуска. Первый запуск
+     ведомых процессов задаётся их признаками start */
   master_stop = 0;
-  master_restart = 1;
+  master_restart = 0;
+  master_reload = 0;
+  master_upgrade = 0;
 
   /* Устанавливаем новый обработчик и запоминаем прежние обработчики */
   struct sigaction old_term_sa;
   struct sigaction old_int_sa;
   struct sigaction old_chld_sa;
+  struct sigaction old_hup_sa;
+  struct sigaction old_usr2_sa;
   sigaction(SIGTERM, &new_sa, &old_term_sa);
   sigaction(SIGINT, &new_sa, &old_int_sa);
   sigaction(SIGCHLD, &new_sa, &old_chld_sa);
-
-  /* Формируем маску сигналов. Блокируются все сигналы, кроме TERM, INT и CHLD,
-     которые будут разблокировать системный вызов sigsuspend для обработки
-     признаков необходимости завершить работу или перезапустить ведомый процесс,
-     выставленных обработчиком сигналов */
+  sigaction(SIGHUP, &new_sa, &old_hup_sa);
+  sigaction(SIGUSR2, &new_sa, &old_usr2_sa);
+
+  /* Формируем маску сигналов. Блокируются все сигналы, кроме TERM, INT, CHLD,
+     HUP и USR2, которые будут разблокировать системный вызов sigsuspend для
+     обработки признаков необходимости завершить работу, перезапустить ведомый
+     процесс, перечитать список портов или обновить программу, выставленных
+     обработчиком сигналов */
   sigset_t sigmask;
   sigfillset(&sigmask);
   sigdelset(&sigmask, SIGTERM);
   sigdelset(&sigmask, SIGINT);
   sigdelset(&sigmask, SIGCHLD);
-
-  /* Цикл перезапуска ведомого процесса, выход из которого осуществляется по
+  sigdelset(&sigmask, SIGHUP);
+  sigdelset(&sigmask, SIGUSR2);
+
+  /* Вне sigsuspend эти сигналы блокируются, чтобы сигнал, пришедший во время
+     обработки предыдущего, не потерялся до следующего вызова sigsuspend */
+  sigset_t blockmask;
+  sigset_t old_sigmask;
+  sigemptyset(&blockmask);
+  sigaddset(&blockmask, SIGTERM);
+  sigaddset(&blockmask, SIGINT);
+  sigaddset(&blockmask, SIGCHLD);
+  sigaddset(&blockmask, SIGHUP);
+  sigaddset(&blockmask, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &blockmask, &old_sigmask);
+
+  /* Сокет, через который основной ведомый процесс передаёт состояние при
+     обновлении. Состояние нескольких ведомых процессов передать новой
+     версии программы нельзя, поэтому с шардами обновление не поддерживается */
+  int channel = -1;
+
+  /* Случайная добавка к задержкам перезапуска */
+  srandom(getpid() ^ (unsigned)timer_now_ns());
+
+  /* Уведомления WATCHDOG=1 отправляют ведомые процессы. Пока ни один из них
+     не готов, например, во время задержки перед перезапуском, которая может
+     быть дольше периода проверки работоспособности systemd, уведомления
+     вдвое чаще периода отправляет ведущий процесс */
+  long long watchdog = notify_watchdog() * 1000000 / 2;
+  int notify = (watchdog > 0) ? notify_open() : -1;
+  long long watchdog_deadline = 0;
+
+  /* Цикл перезапуска ведомых процессов, выход из которого осуществляется по
      сигналу SIGTERM или SIGINT - "завершить работу" */
   while (1)
   {
-    pid_t pid = 0;
+    /* Задержки перед перезапуском ведомых процессов истекли */
+    long long now = timer_now_ns();
+    for(unsigned k = 0; k < num; k++)
+    {
+      if ((slaves[k].respawn != 0) && (now >= slaves[k].respawn))
+      {
+        slaves[k].respawn = 0;
+        slaves[k].start = 1;
+      }
+    }
 
-    /* Ведомый процесс ещё не запущен или завершился аварийно, его надо запустить */
-    if ((master_stop == 0) && (master_restart == 1))
+    /* Ведомые процессы ещё не запущены или завершились аварийно, их надо запустить */
+    for(unsigned k = 0; (master_stop == 0) && (k < num); k++)
     {
+      master_slave_t *s = &(slaves[k]);
+      if (!s->start)
+      {
+        continue;
+      }
+
+      /* Готовим сокет для передачи состояния ведомого процесса. Пакеты
+         с дескрипторами не должны сливаться, поэтому сокет пакетный */
+      int pair[2] = {-1, -1};
+      if ((num == 1) && (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1))
+      {
+        log_error(LOG_WARNING, "master: warning, failed to create upgrade channel, upgrade is disabled");
+      }
+
+      /* Готовим сокет для проверок работоспособности ведомого процесса */
+      int beat[2] = {-1, -1};
+      if ((heartbeat != 0) && (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, beat) == -1))
+      {
+        log_error(LOG_WARNING, "master: warning, failed to create heartbeat channel, heartbeat is disabled");
+      }
+
       /* Разветвляем процесс на два экземпляра */
-      pid = fork();
-      if (pid == -1)
+      s->pid = fork();
+      if (s->pid == -1)
       {
         /* Ветвление не удалось */
         log_error(LOG_ERR, "master: fork failed");
@@ -351,60 +952,303 @@ int master(const char *pidfile_pathname,
       }
 
       /* Здесь продолжает работу дочерний процесс */
-      if (pid == 0)
+      if (s->pid == 0)
       {
+        sigprocmask(SIG_SETMASK, &old_sigmask, NULL);
+        if ((pair[0] != -1) && (close(pair[0]) == -1))
+        {
+          log_error(LOG_WARNING, "master: warning, failed to close upgrade channel");
+        }
+        if ((channel != -1) && (channel != resume_fd) && (close(channel) == -1))
+        {
+          log_error(LOG_WARNING, "master: warning, failed to close upgrade channel");
+        }
+        if ((beat[0] != -1) && (close(beat[0]) == -1))
+        {
+          log_error(LOG_WARNING, "master: warning, failed to close heartbeat channel");
+        }
+        if ((notify != -1) && (close(notify) == -1))
+        {
+          log_error(LOG_WARNING, "master: warning, failed to close notify socket");
+        }
+
+        /* Сокеты других ведомых процессов этому процессу не нужны */
+        for(unsigned j = 0; j < num; j++)
+        {
+          if ((slaves[j].hb.fd != -1) && (close(slaves[j].hb.fd) == -1))
+          {
+            log_error(LOG_WARNING, "master: warning, failed to close heartbeat channel");
+          }
+          if ((j != k) && (close(slaves[j].fd) == -1))
+          {
+            log_error(LOG_WARNING, "master: warning, failed to close listen socket");
+          }
+        }
+
+        /* Ведомый процесс шарда обслуживает только порты шарда, а основной
+           ведомый процесс - порты, не вошедшие в шарды */
+        if (master_restrict(parports, shards, shards_num, s->shard) == -1)
+        {
+          log_message(LOG_ERR, "master: failed to select parports of slave");
+          return 1;
+        }
+
+        /* Привязываем ведомый процесс шарда к указанному процессору */
+        if ((s->shard != NULL) && (s->shard->cpu != -1))
+        {
+          cpu_set_t cpuset;
+          CPU_ZERO(&cpuset);
+          CPU_SET(s->shard->cpu, &cpuset);
+          if (sched_setaffinity(0, sizeof(cpuset), &cpuset) == -1)
+          {
+            log_error(LOG_WARNING, "master: warning, failed to pin slave to cpu %d", s->shard->cpu);
+          }
+        }
+
         return slave(parports,
-                     unix_socket_pathname,
+                     s->fd,
+                     pair[1],
+                     (k == 0) ? resume_fd : -1,
+                     beat[1],
+                     k == 0,
+                     (k == 0) ? metrics_address : NULL,
+                     s->pathname,
                      unix_socket_uid,
                      unix_socket_gid,
                      unix_socket_mode,
                      uid, gid, chroot_pathname);
       }
 
+      /* Состояние передано ведомому процессу, а сокет для передачи состояния
+         остаётся только у ведущего процесса */
+      if (k == 0)
+      {
+        if ((resume_fd != -1) && (close(resume_fd) == -1))
+        {
+          log_error(LOG_WARNING, "master: warning, failed to close resume channel");
+        }
+        resume_fd = -1;
+        if ((channel != -1) && (close(channel) == -1))
+        {
+          log_error(LOG_WARNING, "master: warning, failed to close upgrade channel");
+        }
+        channel = pair[0];
+      }
+      if ((pair[1] != -1) && (close(pair[1]) == -1))
+      {
+        log_error(LOG_WARNING, "master: warning, failed to close upgrade channel");
+      }
+      if ((beat[1] != -1) && (close(beat[1]) == -1))
+      {
+        log_error(LOG_WARNING, "master: warning, failed to close heartbeat channel");
+      }
+      master_heartbeat_reset(&(s->hb), beat[0]);
+      s->hb.started = timer_now_ns();
+
       /* Ведомый процесс запущен, запускать его пока что более не требуется */
-      master_restart = 0;
+      s->start = 0;
+    }
+
+    /* Сообщаем systemd о работоспособности, пока не готов ни один ведомый процесс */
+    if ((notify != -1) && !master_ready(slaves, num))
+    {
+      now = timer_now_ns();
+      if (now >= watchdog_deadline)
+      {
+        notify_send(notify, "WATCHDOG=1");
+        watchdog_deadline = now + watchdog;
+      }
+    }
+    else
+    {
+      watchdog_deadline = 0;
     }
 
-    /* Ожидаем сигналов TERM, INT или CHLD */
-    sigsuspend(&sigmask);
+    /* Ожидаем сигналов TERM, INT, CHLD, HUP или USR2, а между ними
+       проверяем работоспособность ведомых процессов */
+    if ((master_stop == 0) && (master_restart == 0) && (master_reload == 0) && (master_upgrade == 0))
+    {
+      master_wait(slaves, num, pfds, &sigmask, watchdog_deadline);
+    }
+
+    /* Ведомый процесс завис и не реагирует на сигналы. После его
+       принудительного завершения придёт сигнал CHLD */
+    for(unsigned k = 0; (master_stop == 0) && (k < num); k++)
+    {
+      master_slave_t *s = &(slaves[k]);
+      if ((s->pid > 0) && (master_heartbeat_send(&(s->hb)) == 1))
+      {
+        log_message(LOG_ERR, "master: slave for %s missed %u heartbeats, killing it", s->pathname, s->hb.unanswered);
+        if (kill(s->pid, SIGKILL) == -1)
+        {
+          log_error(LOG_WARNING, "master: warning, failed to kill slave");
+        }
+        master_heartbeat_reset(&(s->hb), -1);
+      }
+    }
 
     /* Анализируем переменные, выставленные обработчиками сигналов */
 
     /* Нужно завершать работу */
     if (master_stop == 1)
     {
-      /* Передаём команду "завершить работу" ведомому процессу */
-      kill(pid, SIGTERM);
+      /* Передаём команду "завершить работу" ведомым процессам. Во время
+         задержки перед перезапуском ведомый процесс не работает */
+      for(unsigned k = 0; k < num; k++)
+      {
+        if (slaves[k].pid > 0)
+        {
+          kill(slaves[k].pid, SIGTERM);
+        }
+      }
 
-      /* Считываем код завершения процесса, чтобы не образовался процесс-зомби */
-      int status;
-      wait(&status);
+      /* Считываем коды завершения процессов, чтобы не образовались процессы-зомби */
+      for(unsigned k = 0; k < num; k++)
+      {
+        if (slaves[k].pid > 0)
+        {
+          int status;
+          waitpid(slaves[k].pid, &status, 0);
+          slaves[k].pid = 0;
 
-      fprintf(stderr, "slave exit status = %d\n", WEXITSTATUS(status));
+          fprintf(stderr, "slave exit status = %d\n", WEXITSTATUS(status));
+        }
+      }
 
-      /* Покидаем цикл. Перезапускать ведомый процесс больше не нужно */
+      /* Покидаем цикл. Перезапускать ведомые процессы больше не нужно */
       break;
     }
     /* Получен сигнал о завершении ведомого процесса */
     else if (master_restart == 1)
     {
-      log_message(LOG_WARNING, "master: warning, slave died");
+      master_restart = 0;
 
-      /* Считываем код завершения процесса, чтобы не образовался процесс-зомби */
+      /* Считываем коды завершения всех завершившихся процессов, чтобы не
+         образовались процессы-зомби */
       int status;
-      wait(&status);
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+      {
+        master_slave_t *s = NULL;
+        for(unsigned k = 0; k < num; k++)
+        {
+          if (slaves[k].pid == pid)
+          {
+            s = &(slaves[k]);
+          }
+        }
+        if (s == NULL)
+        {
+          continue;
+        }
+
+        log_message(LOG_WARNING, "master: warning, slave for %s died", s->pathname);
+        fprintf(stderr, "slave exit status = %d\n", WEXITSTATUS(status));
+        s->pid = 0;
+        master_heartbeat_reset(&(s->hb), -1);
+
+        /* Ведомый процесс передал состояние для обновления. Запускаем новую
+           версию программы, а если это не удалось, то передаём состояние
+           новому ведомому процессу */
+        if (WIFEXITED(status) && (WEXITSTATUS(status) == SLAVE_EXIT_UPGRADE) && (channel != -1))
+        {
+          /* Маска сигналов наследуется новой версией программы */
+          sigprocmask(SIG_SETMASK, &old_sigmask, NULL);
+          if (master_exec(varg, s->fd, s->owned, &channel, pidfile) == -1)
+          {
+            log_message(LOG_ERR, "master: failed to start new version, restarting slave");
+          }
+          sigprocmask(SIG_BLOCK, &blockmask, NULL);
+          resume_fd = channel;
+          channel = -1;
+          s->start = 1;
+          continue;
+        }
+
+        /* Если ведомый процесс завершился по собственной инициативе, значит
+           перезапускать его не нужно, а вслед за ним завершаются остальные */
+        if (WIFEXITED(status) && (WEXITSTATUS(status) == 0))
+        {
+          master_stop = 1;
+          continue;
+        }
 
-      fprintf(stderr, "slave exit status = %d\n", WEXITSTATUS(status));
+        /* Ведомый процесс завершился аварийно или не смог запуститься.
+           Перезапускаем его после задержки, которая растёт, пока ведомый
+           процесс не проработает достаточно долго */
+        if (timer_now_ns() - s->hb.started >= (long long)MASTER_STABLE_TIME * 1000000)
+        {
+          s->failures = 0;
+        }
+        s->failures++;
+        s->hb.last.restarts++;
+
+        if (s->failures == MASTER_CRASH_LOOP)
+        {
+          log_message(LOG_CRIT, "master: slave for %s crashed %u times in a row, crash loop detected", s->pathname, s->failures);
+        }
 
-      /* Если ведомый процесс завершился по собственной инициативе, значит перезапускать его не нужно */ 
-      if (WIFEXITED(status))
+        long long delay = master_backoff(s->failures);
+        log_message(LOG_WARNING, "master: warning, restarting slave for %s in %lld ms, restart %llu",
+                    s->pathname, delay / 1000000, s->hb.last.restarts);
+        s->respawn = timer_now_ns() + delay;
+      }
+    }
+    /* Нужно перечитать список портов. Ведомые процессы перечитывают его сами,
+       не прерывая работы с клиентами */
+    else if (master_reload == 1)
+    {
+      master_reload = 0;
+      for(unsigned k = 0; k < num; k++)
       {
-        break;
+        if ((slaves[k].pid > 0) && (kill(slaves[k].pid, SIGHUP) == -1))
+        {
+          log_error(LOG_WARNING, "master: warning, failed to pass HUP signal to slave");
+        }
+      }
+    }
+    /* Нужно обновить программу. Ведомый процесс передаст состояние и
+       завершится, после чего придёт сигнал CHLD */
+    else if (master_upgrade == 1)
+    {
+      master_upgrade = 0;
+      if (num > 1)
+      {
+        log_message(LOG_WARNING, "master: warning, upgrade is not supported with shards");
+      }
+      else if (channel == -1)
+      {
+        log_message(LOG_WARNING, "master: warning, upgrade channel is not available");
+      }
+      else if ((slaves[0].pid > 0) && (kill(slaves[0].pid, SIGUSR2) == -1))
+      {
+        log_error(LOG_WARNING, "master: warning, failed to pass USR2 signal to slave");
       }
     }
   }
 
-  /* Восстанавливаем старые обработчики сигналов */
+  /* Закрываем сокеты проверок работоспособности */
+  for(unsigned k = 0; k < num; k++)
+  {
+    master_heartbeat_reset(&(slaves[k].hb), -1);
+  }
+
+  /* Закрываем сокет для передачи состояния */
+  if ((channel != -1) && (close(channel) == -1))
+  {
+    log_error(LOG_WARNING, "master: warning, failed to close upgrade channel");
+  }
+
+  /* Закрываем сокет уведомлений systemd */
+  if ((notify != -1) && (close(notify) == -1))
+  {
+    log_error(LOG_WARNING, "master: warning, failed to close notify socket");
+  }
+
+  /* Восстанавливаем старые обработчики сигналов и маску сигналов */
+  sigprocmask(SIG_SETMASK, &old_sigmask, NULL);
+  sigaction(SIGUSR2, &old_usr2_sa, NULL);
+  sigaction(SIGHUP, &old_hup_sa, NULL);
   sigaction(SIGCHLD, &old_chld_sa, NULL);
   sigaction(SIGINT, &old_int_sa, NULL);
   sigaction(SIGTERM, &old_term_sa, NULL);
@@ -418,10 +1262,16 @@ int master(const char *pidfile_pathname,
     }
   }
 
-  /* Удаляем Unix-сокет, который должен был создать ведомый процесс */
-  if (unlink(unix_socket_pathname) == -1)
+  /* Закрываем слушающие Unix-сокеты и удаляем созданные здесь */
+  master_close_sockets(slaves, num);
+  free(slaves);
+  free(pfds);
+
+  /* Сокет метрик создаёт ведомый процесс, но после смены корневого каталога
+     и сброса привилегий удалить его может только ведущий процесс */
+  if (metrics_address != NULL)
   {
-    log_error(LOG_WARNING, "master: warning, failed to remove unix-socket");
+    metrics_unlink(metrics_address);
   }
 
   return 0;
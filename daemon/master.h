@@ -2,24 +2,67 @@
 #define __MASTER__
 
 #include "parports.h"
+#include "config.h"
 
 /* Функция, реализующая ведущий процесс.
 
-   Удаляет PID-файл и Unix-сокет, если они существуют,
+   Удаляет PID-файл, если он существует,
+
+   создаёт слушающий Unix-сокет, если он не передан через listen_fd,
+   и передаёт его каждому запускаемому ведомому процессу, поэтому
+   подключения клиентов не отвергаются, пока ведомый процесс перезапускается,
 
    запускает ведомый процесс и ждёт сигналов,
 
+   если указаны шарды shards, то для каждого шарда создаёт его слушающий
+   Unix-сокет и запускает отдельный ведомый процесс, который обслуживает
+   только порты шарда и может быть привязан к своему процессору, а основной
+   ведомый процесс обслуживает остальные порты. Ведомые процессы
+   перезапускаются и проверяются независимо друг от друга,
+
    при получении сигнала CHLD, если до этого ему не были отправлены сигналы INT
-   или TERM, перезапускает ведомый процесс,
+   или TERM, а ведомый процесс завершился аварийно, перезапускает ведомый
+   процесс с экспоненциально растущей задержкой со случайной добавкой,
+   чтобы не нагружать систему при цикле аварийных перезапусков,
+
+   при получении сигнала HUP передаёт его ведомым процессам, чтобы они
+   перечитали файл со списком портов,
+
+   при получении сигнала USR2, если шарды не указаны, передаёт его ведомому
+   процессу, который передаёт открытые порты и сокеты клиентов и завершается,
+   после чего запускает вместо себя новую версию программы с теми же
+   аргументами командной строки varg, передавая ей слушающий сокет и состояние
+   ведомого процесса. Если запустить новую версию не удалось, то запускает
+   новый ведомый процесс, передавая состояние ему,
+
+   если период heartbeat отличен от нуля, то с этим периодом проверяет
+   работоспособность ведомых процессов через пары сокетов и принудительно
+   перезапускает ведомый процесс, если он не ответил на heartbeat_misses
+   проверок подряд, например, завис в системном вызове или в бесконечном
+   цикле. Задержки ответов сообщаются ведомому процессу, который выводит их
+   по команде heartbeat,
 
-   при получении сигнала INT или TERM завершает ведомый процесс, удаляет
-   PID-файл и Unix-сокет, после чего завершает работу.
+   при получении сигнала INT или TERM завершает ведомые процессы, удаляет
+   PID-файл и созданные им Unix-сокеты, после чего завершает работу.
 
    pidfile_pathname - полный путь к PID-файлу или указатель NULL,
+   shards - шарды или NULL, shards_num - количество шардов,
+   resume_fd - сокет с состоянием, переданным предыдущей версией программы,
+   который передаётся первому ведомому процессу, или -1,
+   metrics_address - адрес слушающего сокета метрик первого ведомого
+   процесса или NULL,
    остальные параметры аналогичны параметрам функции slave, см. файл slave.h */
-int master(const char *pidfile_pathname,
+int master(const char **varg,
+           const char *pidfile_pathname,
            parports_t *parports,
+           const shard_t *shards,
+           unsigned shards_num,
 
+           int listen_fd,
+           int resume_fd,
+           unsigned heartbeat,
+           unsigned heartbeat_misses,
+           const char *metrics_address,
            const char *unix_socket_pathname,
            int unix_socket_uid,
            int unix_socket_gid,
@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "daemon.h"
+#include "timer.h"
+#include "matrix.h"
+
+/* Структура данных драйвера светодиодной матрицы. Поля bits, stop, notify,
+   failed и счётчики используются одновременно потоком развёртки и потоком
+   цикла обработки событий, поэтому обращение к ним выполняется атомарными
+   операциями */
+struct matrix_s
+{
+  parport_t *parport; /* Порт, к которому подключена матрица */
+  unsigned rows;      /* Количество строк */
+  unsigned cols;      /* Количество столбцов */
+  unsigned rate;      /* Частота развёртки всей матрицы, Гц */
+  int cpu;            /* Процессор для потока развёртки или -1 */
+
+  long long bits;     /* Кадровый буфер */
+
+  int notify;         /* Копия дескриптора eventfd для сообщений об ошибках или -1 */
+  int failed;         /* Признак ошибки записи, о которой сообщено циклу */
+  int written;        /* Признак успешной записи после последней ошибки,
+                         используется только потоком развёртки */
+
+  int started;        /* Признак того, что поток развёртки запущен */
+  int stop;           /* Признак необходимости завершить поток развёртки */
+  pthread_t thread;   /* Поток развёртки */
+
+  long long start_time;     /* Время запуска развёртки, нс */
+  unsigned long long frames; /* Количество выведенных кадров */
+  unsigned long long lines;  /* Количество выведенных строк */
+  unsigned long long missed; /* Количество пропущенных сроков вывода строк */
+  unsigned long long errors; /* Количество ошибок записи в порт */
+};
+
+/* Подготовка драйвера матрицы из rows строк и cols столбцов на указанном порту */
+matrix_t *matrix_create(parport_t *parport, unsigned rows, unsigned cols)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "matrix_create: parport is NULL pointer");
+    return NULL;
+  }
+
+  /* Линии строк должны находиться в регистре данных, чтобы при смене строки
+     можно было погасить предыдущую строку одной записью */
+  if ((rows < 1) || (rows > 8) || (cols < 1) || (rows + cols > 12))
+  {
+    log_message(LOG_ERR, "matrix_create: wrong matrix size %ux%u", rows, cols);
+    return NULL;
+  }
+
+  matrix_t *matrix = malloc(sizeof(matrix_t));
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_create: failed to allocate memory for matrix");
+    return NULL;
+  }
+
+  matrix->parport = parport;
+  matrix->rows = rows;
+  matrix->cols = cols;
+  matrix->rate = MATRIX_DEFAULT_RATE;
+  matrix->cpu = -1;
+  matrix->bits = 0;
+  matrix->notify = -1;
+  matrix->failed = 0;
+  matrix->written = 1;
+  matrix->started = 0;
+  matrix->stop = 0;
+  matrix->start_time = 0;
+  matrix->frames = 0;
+  matrix->lines = 0;
+  matrix->missed = 0;
+  matrix->errors = 0;
+
+  return matrix;
+}
+
+/* Изменение частоты развёртки всей матрицы, Гц */
+int matrix_set_rate(matrix_t *matrix, unsigned rate)
+{
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_set_rate: matrix is NULL pointer");
+    return -1;
+  }
+
+  if (rate < 1)
+  {
+    log_message(LOG_ERR, "matrix_set_rate: rate is not a positive integer");
+    return -1;
+  }
+
+  matrix->rate = rate;
+  return 0;
+}
+
+/* Выбор процессора, к которому будет привязан поток развёртки */
+int matrix_set_cpu(matrix_t *matrix, int cpu)
+{
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_set_cpu: matrix is NULL pointer");
+    return -1;
+  }
+
+  matrix->cpu = cpu;
+  return 0;
+}
+
+/* Передать драйверу дескриптор eventfd для сообщений об ошибках записи */
+int matrix_set_notify(matrix_t *matrix, int fd)
+{
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_set_notify: matrix is NULL pointer");
+    return -1;
+  }
+
+  if (matrix->notify != -1)
+  {
+    log_message(LOG_ERR, "matrix_set_notify: notify descriptor is already set");
+    return -1;
+  }
+
+  /* Дескриптор цикла обработки событий может быть закрыт раньше, чем
+     остановится поток развёртки, поэтому поток пишет в свою копию */
+  int notify = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (notify == -1)
+  {
+    log_error(LOG_ERR, "matrix_set_notify: failed to duplicate eventfd");
+    return -1;
+  }
+
+  __atomic_store_n(&(matrix->notify), notify, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Возвращает 1, если поток развёртки сообщал об ошибке записи, и сбрасывает признак */
+int matrix_failed(matrix_t *matrix)
+{
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_failed: matrix is NULL pointer");
+    return 0;
+  }
+
+  return __atomic_exchange_n(&(matrix->failed), 0, __ATOMIC_RELAXED);
+}
+
+/* Запись регистров порта, значения которых отличаются от последних записанных.
+   При ошибке последние записанные значения забываются, чтобы при выводе
+   следующей строки оба регистра были записаны заново. О первой ошибке после
+   успешной записи поток сообщает циклу обработки событий, который переведёт
+   порт в деградировавшее состояние. Пока порт не открыт повторно, запись
+   завершается ошибкой, но повторно не сообщается */
+int matrix_write(matrix_t *matrix, int *cur_data, int *cur_control, int data, int control)
+{
+  int d = (data != *cur_data) ? data : -1;
+  int c = (control != *cur_control) ? control : -1;
+
+  if ((d == -1) && (c == -1))
+  {
+    return 0;
+  }
+
+  if (parport_write_raw(matrix->parport, d, c) == -1)
+  {
+    __atomic_add_fetch(&(matrix->errors), 1, __ATOMIC_RELAXED);
+    *cur_data = -1;
+    *cur_control = -1;
+
+    if (matrix->written)
+    {
+      matrix->written = 0;
+      __atomic_store_n(&(matrix->failed), 1, __ATOMIC_RELAXED);
+
+      int notify = __atomic_load_n(&(matrix->notify), __ATOMIC_ACQUIRE);
+      if ((notify != -1) && (eventfd_write(notify, 1) == -1))
+      {
+        log_error(LOG_WARNING, "matrix_write: warning, eventfd_write failed");
+      }
+    }
+    return -1;
+  }
+
+  matrix->written = 1;
+  *cur_data = data;
+  *cur_control = control;
+  return 0;
+}
+
+/* Поток развёртки матрицы. Строки выводятся на порт строго по очереди через
+   равные промежутки времени, отсчитываемые от абсолютного времени, чтобы
+   задержки вывода одной строки не накапливались */
+void *matrix_scan(void *data)
+{
+  matrix_t *matrix = data;
+
+  /* Привязываем поток к указанному процессору */
+  if (matrix->cpu != -1)
+  {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(matrix->cpu, &cpuset);
+
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (err != 0)
+    {
+      log_message(LOG_WARNING, "matrix_scan: warning, failed to pin thread to cpu %d: %s", matrix->cpu, strerror(err));
+    }
+  }
+
+  /* Период вывода одной строки */
+  long long period = 1000000000LL / ((long long)matrix->rate * matrix->rows);
+  if (period < 1)
+  {
+    period = 1;
+  }
+
+  /* Значения регистров для каждой из строк: погашенная строка с новыми
+     значениями столбцов и светящаяся строка */
+  int blank_data[8];
+  int blank_control[8];
+  int row_data[8];
+  int row_control[8];
+  long long bits = -1;
+
+  int cur_data = -1;
+  int cur_control = -1;
+  unsigned row = 0;
+
+  long long next = timer_now_ns();
+  __atomic_store_n(&(matrix->start_time), next, __ATOMIC_RELAXED);
+
+  while (__atomic_load_n(&(matrix->stop), __ATOMIC_RELAXED) == 0)
+  {
+    /* Если кадровый буфер изменился, пересчитываем значения регистров */
+    long long new_bits = __atomic_load_n(&(matrix->bits), __ATOMIC_RELAXED);
+    if (new_bits != bits)
+    {
+      bits = new_bits;
+
+      unsigned col_mask = (1U << matrix->cols) - 1;
+      for(unsigned r = 0; r < matrix->rows; r++)
+      {
+        /* Светящимся светодиодам в строке соответствуют нулевые линии столбцов */
+        unsigned cols = ~(unsigned)(bits >> (r * matrix->cols)) & col_mask;
+        unsigned blank = cols << matrix->rows;
+        unsigned lines = blank | (1U << r);
+
+        blank_data[r] = blank & 0xFF;
+        blank_control[r] = leds_control(blank);
+        row_data[r] = lines & 0xFF;
+        row_control[r] = leds_control(lines);
+      }
+    }
+
+    /* Если при смене строки меняется регистр управления, то сначала гасим
+       строки и выставляем новые значения столбцов, чтобы светодиоды новой
+       строки не вспыхнули со значениями столбцов предыдущей строки. Если
+       регистр управления не меняется, то строка и столбцы переключаются
+       одной записью в регистр данных */
+    if (row_control[row] != cur_control)
+    {
+      matrix_write(matrix, &cur_data, &cur_control, blank_data[row], blank_control[row]);
+    }
+    matrix_write(matrix, &cur_data, &cur_control, row_data[row], row_control[row]);
+
+    __atomic_add_fetch(&(matrix->lines), 1, __ATOMIC_RELAXED);
+    row++;
+    if (row == matrix->rows)
+    {
+      row = 0;
+      __atomic_add_fetch(&(matrix->frames), 1, __ATOMIC_RELAXED);
+    }
+
+    /* Ждём наступления срока вывода следующей строки. Если срок уже прошёл,
+       то учитываем его как пропущенный, а если отставание превысило период,
+       то отсчитываем следующие сроки от текущего времени */
+    next += period;
+    long long now = timer_now_ns();
+    if (now > next)
+    {
+      __atomic_add_fetch(&(matrix->missed), 1, __ATOMIC_RELAXED);
+      if (now - next > period)
+      {
+        next = now;
+      }
+      continue;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = next / 1000000000LL;
+    ts.tv_nsec = next % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+  }
+
+  /* Гасим матрицу перед завершением потока */
+  matrix_write(matrix, &cur_data, &cur_control, 0, leds_control(0));
+
+  return NULL;
+}
+
+/* Запуск потока развёртки */
+int matrix_start(matrix_t *matrix)
+{
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_start: matrix is NULL pointer");
+    return -1;
+  }
+
+  if (matrix->started)
+  {
+    log_message(LOG_WARNING, "matrix_start: warning, scan thread already started");
+    return 0;
+  }
+
+  /* Поток развёртки наследует маску сигналов, поэтому блокируем все сигналы
+     на время его создания: сигналы INT и TERM должны доставляться потоку
+     цикла обработки событий, чтобы прервать ожидание событий */
+  sigset_t sigmask;
+  sigset_t old_sigmask;
+  sigfillset(&sigmask);
+  pthread_sigmask(SIG_SETMASK, &sigmask, &old_sigmask);
+
+  matrix->stop = 0;
+  int err = pthread_create(&(matrix->thread), NULL, matrix_scan, matrix);
+
+  pthread_sigmask(SIG_SETMASK, &old_sigmask, NULL);
+
+  if (err != 0)
+  {
+    log_message(LOG_ERR, "matrix_start: pthread_create failed: %s", strerror(err));
+    return -1;
+  }
+
+  matrix->started = 1;
+  return 0;
+}
+
+/* Запись нового содержимого кадрового буфера */
+long long matrix_set(matrix_t *matrix, long long bits)
+{
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_set: matrix is NULL pointer");
+    return -1;
+  }
+
+  if (bits < 0)
+  {
+    log_message(LOG_ERR, "matrix_set: bits is negative value");
+    return -1;
+  }
+
+  /* Биты, которым не соответствуют светодиоды матрицы, отбрасываем */
+  long long mask = (1LL << (matrix->rows * matrix->cols)) - 1;
+  if (bits & ~mask)
+  {
+    log_message(LOG_WARNING, "matrix_set: warning, bits value is too big, high bits will be masked");
+    bits &= mask;
+  }
+
+  __atomic_store_n(&(matrix->bits), bits, __ATOMIC_RELAXED);
+  return bits;
+}
+
+/* Вывод в буфер содержимого кадрового буфера и счётчиков развёртки */
+int matrix_stats(matrix_t *matrix, char *buf, size_t size)
+{
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_stats: matrix is NULL pointer");
+    return -1;
+  }
+
+  if (buf == NULL)
+  {
+    log_message(LOG_ERR, "matrix_stats: buf is NULL pointer");
+    return -1;
+  }
+
+  unsigned long long frames = __atomic_load_n(&(matrix->frames), __ATOMIC_RELAXED);
+  long long start_time = __atomic_load_n(&(matrix->start_time), __ATOMIC_RELAXED);
+
+  /* Достигнутая частота кадров с момента запуска развёртки */
+  double rate = 0;
+  long long elapsed = timer_now_ns() - start_time;
+  if (matrix->started && (elapsed > 0))
+  {
+    rate = frames * 1e9 / elapsed;
+  }
+
+  int n = snprintf(buf, size, "bits=0x%09llX frames=%llu rate=%.1fHz lines=%llu missed=%llu errors=%llu",
+                   __atomic_load_n(&(matrix->bits), __ATOMIC_RELAXED),
+                   frames, rate,
+                   __atomic_load_n(&(matrix->lines), __ATOMIC_RELAXED),
+                   __atomic_load_n(&(matrix->missed), __ATOMIC_RELAXED),
+                   __atomic_load_n(&(matrix->errors), __ATOMIC_RELAXED));
+  if ((n < 0) || ((size_t)n >= size))
+  {
+    log_message(LOG_ERR, "matrix_stats: buffer is too small");
+    return -1;
+  }
+
+  return n;
+}
+
+/* Остановка потока развёртки и освобождение памяти драйвера */
+int matrix_destroy(matrix_t *matrix)
+{
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "matrix_destroy: matrix is NULL pointer");
+    return -1;
+  }
+
+  int result = 0;
+
+  /* Если поток развёртки запущен, сообщаем ему о необходимости завершиться
+     и дожидаемся его завершения */
+  if (matrix->started)
+  {
+    __atomic_store_n(&(matrix->stop), 1, __ATOMIC_RELAXED);
+
+    int err = pthread_join(matrix->thread, NULL);
+    if (err != 0)
+    {
+      log_message(LOG_WARNING, "matrix_destroy: warning, pthread_join failed: %s", strerror(err));
+      result = -1;
+    }
+  }
+
+  if ((matrix->notify != -1) && (close(matrix->notify) == -1))
+  {
+    log_error(LOG_WARNING, "matrix_destroy: warning, failed to close eventfd");
+    result = -1;
+  }
+
+  free(matrix);
+  return result;
+}
@@ -0,0 +1,57 @@
+#ifndef __MATRIX__
+#define __MATRIX__
+
+#include <stddef.h>
+#include "parport.h"
+
+/* Драйвер светодиодной матрицы с построчной развёрткой.
+
+   Первые rows линий порта подключаются к строкам матрицы, следующие cols
+   линий - к столбцам. Светодиод в строке r и столбце c светится, когда на
+   линии строки r выставлена единица, а на линии столбца c - ноль. Строки
+   выводятся на порт по очереди в отдельном потоке, так что на порту с 12
+   линиями можно управлять, например, матрицей из 6x6 = 36 светодиодов.
+
+   Кадровый буфер матрицы - это число, бит r * cols + c которого соответствует
+   светодиоду в строке r и столбце c */
+struct matrix_s;
+typedef struct matrix_s matrix_t;
+
+/* Частота развёртки всей матрицы по умолчанию, Гц */
+#define MATRIX_DEFAULT_RATE 500
+
+/* Подготовка драйвера матрицы из rows строк и cols столбцов на указанном порту */
+matrix_t *matrix_create(parport_t *parport, unsigned rows, unsigned cols);
+
+/* Изменение частоты развёртки всей матрицы, Гц */
+int matrix_set_rate(matrix_t *matrix, unsigned rate);
+
+/* Выбор процессора, к которому будет привязан поток развёртки, или -1,
+   если поток не нужно привязывать к процессору */
+int matrix_set_cpu(matrix_t *matrix, int cpu);
+
+/* Передать драйверу дескриптор eventfd, в который поток развёртки записывает
+   сообщение, когда запись в порт, до этого проходившая успешно, не удалась.
+   Драйвер хранит копию дескриптора до освобождения. Можно вызывать после
+   запуска потока развёртки */
+int matrix_set_notify(matrix_t *matrix, int fd);
+
+/* Возвращает 1, если после прошлого вызова поток развёртки сообщал об ошибке
+   записи в порт, и сбрасывает признак ошибки */
+int matrix_failed(matrix_t *matrix);
+
+/* Запуск потока развёртки. Вызывается после открытия порта */
+int matrix_start(matrix_t *matrix);
+
+/* Запись нового содержимого кадрового буфера. Возвращает записанное значение */
+long long matrix_set(matrix_t *matrix, long long bits);
+
+/* Вывод в буфер содержимого кадрового буфера и счётчиков развёртки:
+   количества выведенных кадров и строк, достигнутой частоты кадров,
+   количества пропущенных сроков вывода строк и ошибок записи в порт */
+int matrix_stats(matrix_t *matrix, char *buf, size_t size);
+
+/* Остановка потока развёртки и освобождение памяти драйвера */
+int matrix_destroy(matrix_t *matrix);
+
+#endif
@@ -0,0 +1,755 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include "daemon.h"
+#include "timer.h"
+#include "config.h"
+#include "stats.h"
+#include "client.h"
+#include "slave.h"
+#include "metrics.h"
+
+/* Подключение к слушающему сокету метрик */
+typedef struct metrics_conn_s
+{
+  unsigned slot;                          /* Номер подключения в таблице подключений */
+  socket_t *socket;                       /* Сокет подключения в цикле обработки событий */
+  long long start;                        /* Время подключения, мс */
+  char request[METRICS_REQUEST_SIZE + 1]; /* Принятая часть запроса */
+  size_t request_size;                    /* Размер принятой части запроса */
+  char *response;                         /* Ответ или NULL, если ответ ещё не готов */
+  size_t response_size;                   /* Размер ответа */
+  size_t sent;                            /* Размер отправленной части ответа */
+} metrics_conn_t;
+
+/* Слушающий сокет метрик. В процессе он может быть только один */
+typedef struct metrics_server_s
+{
+  evloop_t *evloop;                               /* Цикл обработки событий */
+  parports_t *parports;                           /* Каталог портов */
+  metrics_conn_t *conns[METRICS_CONNECTIONS_MAX]; /* Таблица подключений */
+} metrics_server_t;
+
+metrics_server_t metrics_server;
+
+/* Буфер, в котором собирается текст ответа */
+typedef struct metrics_buf_s
+{
+  char *data;  /* Текст */
+  size_t size; /* Длина текста */
+  size_t max;  /* Размер выделенной памяти */
+  int failed;  /* Признак того, что память выделить не удалось */
+} metrics_buf_t;
+
+/* Разбор TCP-адреса вида <узел>:<порт>. Допускаются только адреса петлевого
+   интерфейса */
+int metrics_parse_tcp(const char *address, unsigned short *port)
+{
+  const char *colon = strrchr(address, ':');
+  if (colon == NULL)
+  {
+    log_message(LOG_ERR, "metrics_parse_tcp: missing port in metrics address %s", address);
+    return -1;
+  }
+
+  size_t len = colon - address;
+  if ((len != 0) &&
+      !((len == strlen("127.0.0.1")) && (strncmp(address, "127.0.0.1", len) == 0)) &&
+      !((len == strlen("localhost")) && (strncmp(address, "localhost", len) == 0)))
+  {
+    log_message(LOG_ERR, "metrics_parse_tcp: metrics address %s is not loopback", address);
+    return -1;
+  }
+
+  unsigned long n;
+  if ((parse_ul(colon + 1, &n) == -1) || (n < 1) || (n > 65535))
+  {
+    log_message(LOG_ERR, "metrics_parse_tcp: wrong port in metrics address %s", address);
+    return -1;
+  }
+
+  *port = n;
+  return 0;
+}
+
+/* Проверка адреса слушающего сокета метрик */
+int metrics_check_address(const char *address)
+{
+  if (address == NULL)
+  {
+    log_message(LOG_ERR, "metrics_check_address: address is NULL pointer");
+    return -1;
+  }
+
+  /* Путь к Unix-сокету проверяется при создании сокета */
+  if (strchr(address, '/') != NULL)
+  {
+    return 0;
+  }
+
+  unsigned short port;
+  return metrics_parse_tcp(address, &port);
+}
+
+/* Создание слушающего сокета метрик */
+int metrics_listen(const char *address)
+{
+  if (address == NULL)
+  {
+    log_message(LOG_ERR, "metrics_listen: address is NULL pointer");
+    return -1;
+  }
+
+  if (strchr(address, '/') != NULL)
+  {
+    int fd = unix_socket_create(address, -1, -1, -1, BACKLOG_NUMBER);
+    if (fd == -1)
+    {
+      log_message(LOG_ERR, "metrics_listen: unix_socket_create failed");
+      return -1;
+    }
+    return fd;
+  }
+
+  unsigned short port;
+  if (metrics_parse_tcp(address, &port) == -1)
+  {
+    log_message(LOG_ERR, "metrics_listen: metrics_parse_tcp failed");
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+  {
+    log_error(LOG_ERR, "metrics_listen: failed to create socket");
+    return -1;
+  }
+
+  /* Перезапущенный ведомый процесс занимает порт сразу, не дожидаясь
+     закрытия подключений прежнего процесса */
+  int reuse = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
+  {
+    log_error(LOG_WARNING, "metrics_listen: warning, failed to set SO_REUSEADDR");
+  }
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(port);
+
+  if ((bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) ||
+      (listen(fd, BACKLOG_NUMBER) == -1))
+  {
+    log_error(LOG_ERR, "metrics_listen: failed to listen on %s", address);
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "metrics_listen: warning, failed to close listen socket");
+    }
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Дописать в буфер текст по формату */
+void metrics_printf(metrics_buf_t *buf, const char *format, ...)
+{
+  if (buf->failed)
+  {
+    return;
+  }
+
+  while (1)
+  {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(&(buf->data[buf->size]), buf->max - buf->size, format, args);
+    va_end(args);
+
+    if (n < 0)
+    {
+      buf->failed = 1;
+      return;
+    }
+
+    if (buf->size + n < buf->max)
+    {
+      buf->size += n;
+      return;
+    }
+
+    /* Текст не поместился - увеличиваем буфер и повторяем вывод */
+    size_t max = buf->max * 2;
+    while (buf->size + n >= max)
+    {
+      max *= 2;
+    }
+    char *data = realloc(buf->data, max);
+    if (data == NULL)
+    {
+      buf->failed = 1;
+      return;
+    }
+    buf->data = data;
+    buf->max = max;
+  }
+}
+
+/* Дописать в буфер значение метки с экранированием */
+void metrics_label(metrics_buf_t *buf, const char *value)
+{
+  for(const char *p = value; *p != '\0'; p++)
+  {
+    if (*p == '\\')
+    {
+      metrics_printf(buf, "\\\\");
+    }
+    else if (*p == '"')
+    {
+      metrics_printf(buf, "\\\"");
+    }
+    else if (*p == '\n')
+    {
+      metrics_printf(buf, "\\n");
+    }
+    else
+    {
+      metrics_printf(buf, "%c", *p);
+    }
+  }
+}
+
+/* Вывод в буфер одной метрики порта. field - номер поля статистики порта:
+   0 - записи в регистры, 1 - суммарное время обновлений, 2 - количество
+   обновлений, 3 - команды к порту, 4 - неудачные команды к порту */
+void metrics_ports(metrics_buf_t *buf, parports_t *parports, const char *name, int field)
+{
+  int num = parports_number(parports);
+  for(int i = 0; i < num; i++)
+  {
+    const char *pathname;
+    unsigned long long writes;
+    unsigned long long calls;
+    long long ns;
+    if (parports_write_stats(parports, i, &pathname, &writes, &calls, &ns) == -1)
+    {
+      continue;
+    }
+
+    unsigned long long commands;
+    unsigned long long failed;
+    stats_port(i, &commands, &failed);
+
+    metrics_printf(buf, "%s{port=\"%d\",path=\"", name, i);
+    metrics_label(buf, pathname);
+    metrics_printf(buf, "\"} ");
+    switch (field)
+    {
+      case 0:
+        metrics_printf(buf, "%llu\n", writes);
+        break;
+      case 1:
+        metrics_printf(buf, "%.9f\n", ns / 1e9);
+        break;
+      case 2:
+        metrics_printf(buf, "%llu\n", calls);
+        break;
+      case 3:
+        metrics_printf(buf, "%llu\n", commands);
+        break;
+      default:
+        metrics_printf(buf, "%llu\n", failed);
+        break;
+    }
+  }
+}
+
+/* Вывод в буфер статистики цикла обработки событий. Пока сбор статистики
+   выключен, значения не меняются */
+void metrics_evloop(metrics_buf_t *buf)
+{
+  const evloop_stats_t *stats = evloop_stats(metrics_server.evloop);
+  if (stats == NULL)
+  {
+    return;
+  }
+
+  metrics_printf(buf,
+                 "# HELP parled12_evloop_measure Event loop measurement is on.\n"
+                 "# TYPE parled12_evloop_measure gauge\n"
+                 "parled12_evloop_measure %d\n"
+                 "# HELP parled12_evloop_wakeups_total Event loop wakeups.\n"
+                 "# TYPE parled12_evloop_wakeups_total counter\n"
+                 "parled12_evloop_wakeups_total %llu\n"
+                 "# HELP parled12_evloop_wait_seconds_total Time spent waiting for events.\n"
+                 "# TYPE parled12_evloop_wait_seconds_total counter\n"
+                 "parled12_evloop_wait_seconds_total %.9f\n"
+                 "# HELP parled12_evloop_work_seconds_total Time spent processing events.\n"
+                 "# TYPE parled12_evloop_work_seconds_total counter\n"
+                 "parled12_evloop_work_seconds_total %.9f\n",
+                 evloop_measure, stats->wakeups, stats->wait_ns / 1e9, stats->work_ns / 1e9);
+
+  const char *batches[EVLOOP_BATCH_BUCKETS] = {"1", "2-3", "4-7", "8-15", "16"};
+  metrics_printf(buf,
+                 "# HELP parled12_evloop_batches_total Event loop wakeups by number of events.\n"
+                 "# TYPE parled12_evloop_batches_total counter\n");
+  for(int i = 0; i < EVLOOP_BATCH_BUCKETS; i++)
+  {
+    metrics_printf(buf, "parled12_evloop_batches_total{events=\"%s\"} %llu\n", batches[i], stats->batches[i]);
+  }
+
+  metrics_printf(buf,
+                 "# HELP parled12_evloop_handler_calls_total Event handler calls by socket type.\n"
+                 "# TYPE parled12_evloop_handler_calls_total counter\n");
+  for(unsigned i = 0; i < stats->handlers_num; i++)
+  {
+    metrics_printf(buf, "parled12_evloop_handler_calls_total{socket=\"%s\"} %llu\n",
+                   stats->handlers[i].name, stats->handlers[i].calls);
+  }
+  metrics_printf(buf,
+                 "# HELP parled12_evloop_handler_seconds_total Event handler time by socket type.\n"
+                 "# TYPE parled12_evloop_handler_seconds_total counter\n");
+  for(unsigned i = 0; i < stats->handlers_num; i++)
+  {
+    metrics_printf(buf, "parled12_evloop_handler_seconds_total{socket=\"%s\"} %.9f\n",
+                   stats->handlers[i].name, stats->handlers[i].ns / 1e9);
+  }
+  metrics_printf(buf,
+                 "# HELP parled12_evloop_handler_max_seconds Slowest event handler call by socket type.\n"
+                 "# TYPE parled12_evloop_handler_max_seconds gauge\n");
+  for(unsigned i = 0; i < stats->handlers_num; i++)
+  {
+    metrics_printf(buf, "parled12_evloop_handler_max_seconds{socket=\"%s\"} %.9f\n",
+                   stats->handlers[i].name, stats->handlers[i].max_ns / 1e9);
+  }
+}
+
+/* Вывод в буфер всех метрик в текстовом формате Prometheus */
+void metrics_collect(metrics_buf_t *buf)
+{
+  metrics_printf(buf,
+                 "# HELP parled12_clients Connected control clients.\n"
+                 "# TYPE parled12_clients gauge\n"
+                 "parled12_clients %d\n",
+                 evloop_collect(metrics_server.evloop, client_process_event, NULL, 0));
+
+  const char *outcomes[STATS_OUTCOMES] = {"ok", "failed", "wrong"};
+  metrics_printf(buf,
+                 "# HELP parled12_commands_total Commands executed by clients.\n"
+                 "# TYPE parled12_commands_total counter\n");
+  for(int i = 0; i < STATS_OUTCOMES; i++)
+  {
+    metrics_printf(buf, "parled12_commands_total{outcome=\"%s\"} %llu\n", outcomes[i], stats_commands(i));
+  }
+
+  const char *quantiles[] = {"0.5", "0.99", "0.999"};
+  const unsigned permilles[] = {500, 990, 999};
+  metrics_printf(buf,
+                 "# HELP parled12_latency_seconds Latency of parsing, writes, requests and iterations.\n"
+                 "# TYPE parled12_latency_seconds summary\n");
+  for(int i = 0; i < STATS_LATENCIES; i++)
+  {
+    for(unsigned j = 0; j < sizeof(permilles) / sizeof(permilles[0]); j++)
+    {
+      metrics_printf(buf, "parled12_latency_seconds{stage=\"%s\",quantile=\"%s\"} %.9f\n",
+                     stats_latency_name(i), quantiles[j], stats_quantile(i, permilles[j]) / 1e9);
+    }
+
+    unsigned long long count;
+    unsigned long long sum;
+    stats_latency_totals(i, &count, &sum);
+    metrics_printf(buf, "parled12_latency_seconds_sum{stage=\"%s\"} %.9f\n", stats_latency_name(i), sum / 1e9);
+    metrics_printf(buf, "parled12_latency_seconds_count{stage=\"%s\"} %llu\n", stats_latency_name(i), count);
+  }
+
+  metrics_evloop(buf);
+
+  parports_t *parports = metrics_server.parports;
+  metrics_printf(buf,
+                 "# HELP parled12_port_ioctls_total Register writes of parport.\n"
+                 "# TYPE parled12_port_ioctls_total counter\n");
+  metrics_ports(buf, parports, "parled12_port_ioctls_total", 0);
+  metrics_printf(buf,
+                 "# HELP parled12_port_write_seconds Time of leds updates with register writes.\n"
+                 "# TYPE parled12_port_write_seconds summary\n");
+  metrics_ports(buf, parports, "parled12_port_write_seconds_sum", 1);
+  metrics_ports(buf, parports, "parled12_port_write_seconds_count", 2);
+  metrics_printf(buf,
+                 "# HELP parled12_port_commands_total Commands addressed to parport.\n"
+                 "# TYPE parled12_port_commands_total counter\n");
+  metrics_ports(buf, parports, "parled12_port_commands_total", 3);
+  metrics_printf(buf,
+                 "# HELP parled12_port_commands_failed_total Failed commands addressed to parport.\n"
+                 "# TYPE parled12_port_commands_failed_total counter\n");
+  metrics_ports(buf, parports, "parled12_port_commands_failed_total", 4);
+
+  metrics_printf(buf,
+                 "# HELP parled12_restarts_total Restarts of slave process after its crash.\n"
+                 "# TYPE parled12_restarts_total counter\n"
+                 "parled12_restarts_total %llu\n"
+                 "# HELP parled12_log_dropped_total Log messages dropped on full log buffer.\n"
+                 "# TYPE parled12_log_dropped_total counter\n"
+                 "parled12_log_dropped_total %llu\n",
+                 slave_restarts(), log_dropped());
+}
+
+/* Подготовка ответа на принятый запрос */
+int metrics_respond(metrics_conn_t *conn)
+{
+  metrics_buf_t body;
+  body.size = 0;
+  body.max = 4096;
+  body.failed = 0;
+  body.data = malloc(body.max);
+  if (body.data == NULL)
+  {
+    log_message(LOG_ERR, "metrics_respond: failed to allocate memory for response");
+    return -1;
+  }
+  body.data[0] = '\0';
+
+  /* Строка запроса имеет вид "<метод> <путь> HTTP/<версия>" */
+  const char *status = "200 OK";
+  char *method = conn->request;
+  char *path = strchr(method, ' ');
+  if (path == NULL)
+  {
+    status = "400 Bad Request";
+  }
+  else if ((path - method != 3) || (strncmp(method, "GET", 3) != 0))
+  {
+    status = "405 Method Not Allowed";
+  }
+  else
+  {
+    path++;
+    size_t len = strcspn(path, " ?\r\n");
+    if (((len == strlen("/metrics")) && (strncmp(path, "/metrics", len) == 0)) ||
+        ((len == 1) && (path[0] == '/')))
+    {
+      metrics_collect(&body);
+    }
+    else
+    {
+      status = "404 Not Found";
+    }
+  }
+
+  if (body.failed)
+  {
+    log_message(LOG_ERR, "metrics_respond: failed to allocate memory for metrics");
+    free(body.data);
+    return -1;
+  }
+
+  char header[256];
+  int n = snprintf(header, sizeof(header),
+                   "HTTP/1.0 %s\r\n"
+                   "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                   "Content-Length: %zu\r\n"
+                   "Connection: close\r\n"
+                   "\r\n",
+                   status, body.size);
+
+  conn->response = malloc(n + body.size);
+  if (conn->response == NULL)
+  {
+    log_message(LOG_ERR, "metrics_respond: failed to allocate memory for response");
+    free(body.data);
+    return -1;
+  }
+  memcpy(conn->response, header, n);
+  memcpy(&(conn->response[n]), body.data, body.size);
+  conn->response_size = n + body.size;
+  conn->sent = 0;
+  free(body.data);
+  return 0;
+}
+
+/* Обработчик событий в сокете подключения к сокету метрик */
+int metrics_conn_process_event(int fd, int events, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "metrics_conn_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  metrics_conn_t *conn = data;
+
+  /* Подключение оборвано */
+  if (events & EPOLLERR)
+  {
+    return 0;
+  }
+
+  /* Читаем запрос, пока не встретится пустая строка, завершающая заголовок */
+  if ((conn->response == NULL) && (events & (EPOLLIN | EPOLLHUP)))
+  {
+    ssize_t r = read(fd, &(conn->request[conn->request_size]), METRICS_REQUEST_SIZE - conn->request_size);
+    if (r == -1)
+    {
+      return ((errno == EAGAIN) || (errno == EINTR)) ? EPOLLIN : 0;
+    }
+    if (r == 0)
+    {
+      return 0;
+    }
+    conn->request_size += r;
+    conn->request[conn->request_size] = '\0';
+
+    if ((strstr(conn->request, "\r\n\r\n") != NULL) ||
+        (strstr(conn->request, "\n\n") != NULL) ||
+        (conn->request_size == METRICS_REQUEST_SIZE))
+    {
+      /* Слишком длинный заголовок отвергается */
+      if (conn->request_size == METRICS_REQUEST_SIZE)
+      {
+        conn->request[0] = '\0';
+      }
+
+      if (metrics_respond(conn) == -1)
+      {
+        log_message(LOG_ERR, "metrics_conn_process_event: metrics_respond failed");
+        return -1;
+      }
+    }
+  }
+
+  /* Отправляем ответ по мере готовности сокета и закрываем подключение */
+  if ((conn->response != NULL) && (events & EPOLLOUT))
+  {
+    ssize_t w = send(fd, &(conn->response[conn->sent]), conn->response_size - conn->sent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (w == -1)
+    {
+      return ((errno == EAGAIN) || (errno == EINTR)) ? EPOLLOUT : 0;
+    }
+    conn->sent += w;
+    if (conn->sent == conn->response_size)
+    {
+      return 0;
+    }
+  }
+
+  if (events & EPOLLHUP)
+  {
+    return 0;
+  }
+
+  return (conn->response != NULL) ? EPOLLOUT : EPOLLIN;
+}
+
+/* Освобождение данных подключения к сокету метрик */
+int metrics_conn_destroy(void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "metrics_conn_destroy: data is NULL pointer");
+    return -1;
+  }
+
+  metrics_conn_t *conn = data;
+  metrics_server.conns[conn->slot] = NULL;
+  free(conn->response);
+  free(conn);
+  return 0;
+}
+
+/* Обработчик событий в слушающем сокете метрик */
+int metrics_server_process_event(int fd, int events, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "metrics_server_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  metrics_server_t *server = data;
+
+  if (events & EPOLLIN)
+  {
+    int conn_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn_fd == -1)
+    {
+      if ((errno == EAGAIN) || (errno == EINTR) || (errno == ECONNABORTED))
+      {
+        return EPOLLIN;
+      }
+      log_error(LOG_ERR, "metrics_server_process_event: failed to accept connection");
+      return -1;
+    }
+
+    /* Подключения, не завершившие обмен за отведённое время, удаляются из
+       цикла сразу, чтобы освободившиеся места достались новому подключению.
+       События удалённых подключений в текущем проходе цикл отбросит сам */
+    long long now = timer_now();
+    for(unsigned i = 0; i < METRICS_CONNECTIONS_MAX; i++)
+    {
+      metrics_conn_t *conn = server->conns[i];
+      if ((conn != NULL) && (now - conn->start >= METRICS_TIMEOUT) &&
+          (evloop_delete_socket(server->evloop, conn->socket) == -1))
+      {
+        log_message(LOG_WARNING, "metrics_server_process_event: warning, evloop_delete_socket failed");
+      }
+    }
+
+    unsigned slot = METRICS_CONNECTIONS_MAX;
+    for(unsigned i = 0; (slot == METRICS_CONNECTIONS_MAX) && (i < METRICS_CONNECTIONS_MAX); i++)
+    {
+      if (server->conns[i] == NULL)
+      {
+        slot = i;
+      }
+    }
+
+    metrics_conn_t *conn = NULL;
+    if (slot == METRICS_CONNECTIONS_MAX)
+    {
+      log_message(LOG_WARNING, "metrics_server_process_event: warning, too many metrics connections");
+    }
+    else
+    {
+      conn = malloc(sizeof(metrics_conn_t));
+      if (conn == NULL)
+      {
+        log_message(LOG_WARNING, "metrics_server_process_event: warning, failed to allocate memory for connection");
+      }
+    }
+
+    if (conn == NULL)
+    {
+      if (close(conn_fd) == -1)
+      {
+        log_error(LOG_WARNING, "metrics_server_process_event: warning, failed to close connection");
+      }
+      return EPOLLIN;
+    }
+
+    conn->slot = slot;
+    conn->start = now;
+    conn->request[0] = '\0';
+    conn->request_size = 0;
+    conn->response = NULL;
+    conn->response_size = 0;
+    conn->sent = 0;
+
+    socket_t *socket = socket_create(conn_fd, EPOLLIN, metrics_conn_process_event, metrics_conn_destroy, conn);
+    if (socket == NULL)
+    {
+      log_message(LOG_WARNING, "metrics_server_process_event: warning, socket_create failed");
+      if (close(conn_fd) == -1)
+      {
+        log_error(LOG_WARNING, "metrics_server_process_event: warning, failed to close connection");
+      }
+      free(conn);
+      return EPOLLIN;
+    }
+    socket_set_name(socket, "scrape");
+    conn->socket = socket;
+
+    if (evloop_add_socket(server->evloop, socket) == -1)
+    {
+      log_message(LOG_WARNING, "metrics_server_process_event: warning, evloop_add_socket failed");
+      if (close(conn_fd) == -1)
+      {
+        log_error(LOG_WARNING, "metrics_server_process_event: warning, failed to close connection");
+      }
+      free(socket);
+      free(conn);
+      return EPOLLIN;
+    }
+    server->conns[slot] = conn;
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+  {
+    log_message(LOG_ERR, "metrics_server_process_event: socket broken");
+    return -1;
+  }
+
+  return EPOLLIN;
+}
+
+/* Слушающий сокет метрик удаляется из цикла, а подключения продолжают
+   обслуживаться до отправки ответов */
+int metrics_server_destroy(void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "metrics_server_destroy: data is NULL pointer");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Удалить Unix-сокет метрик при завершении работы */
+int metrics_unlink(const char *address)
+{
+  if (address == NULL)
+  {
+    log_message(LOG_ERR, "metrics_unlink: address is NULL pointer");
+    return -1;
+  }
+
+  /* TCP-сокет файла не оставляет */
+  if (strchr(address, '/') == NULL)
+  {
+    return 0;
+  }
+
+  if ((unlink(address) == -1) && (errno != ENOENT))
+  {
+    log_error(LOG_WARNING, "metrics_unlink: warning, failed to remove unix-socket %s", address);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Добавить в цикл обработки событий слушающий сокет метрик */
+int metrics_attach(int fd, evloop_t *evloop, parports_t *parports)
+{
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "metrics_attach: evloop is NULL pointer");
+    return -1;
+  }
+
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "metrics_attach: parports is NULL pointer");
+    return -1;
+  }
+
+  memset(&metrics_server, 0, sizeof(metrics_server));
+  metrics_server.evloop = evloop;
+  metrics_server.parports = parports;
+
+  socket_t *socket = socket_create(fd, EPOLLIN, metrics_server_process_event, metrics_server_destroy, &metrics_server);
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "metrics_attach: socket_create failed");
+    return -1;
+  }
+  socket_set_name(socket, "metrics");
+
+  if (evloop_add_socket(evloop, socket) == -1)
+  {
+    log_message(LOG_ERR, "metrics_attach: evloop_add_socket failed");
+    free(socket);
+    return -1;
+  }
+
+  return 0;
+}
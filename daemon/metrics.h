@@ -0,0 +1,45 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+#include "parports.h"
+#include "evloop.h"
+
+/* Отдача метрик в текстовом формате Prometheus. Метрики отдаются по
+   минимальному HTTP: на запрос GET /metrics отвечает тот же цикл обработки
+   событий, что обслуживает клиентов, поэтому ответ целиком собирается в
+   памяти из уже накопленных счётчиков без обращения к портам, а отправляется
+   без блокировки по мере готовности сокета. Слушающий сокет - Unix-сокет,
+   если адрес содержит /, или TCP-сокет на петлевом интерфейсе с адресом вида
+   127.0.0.1:<порт>, localhost:<порт> или :<порт> */
+
+/* Наибольшее количество одновременных подключений к слушающему сокету метрик */
+#define METRICS_CONNECTIONS_MAX 16
+
+/* Наибольший размер заголовка запроса */
+#define METRICS_REQUEST_SIZE 1024
+
+/* Время, после которого подключение, не завершившее обмен, закрывается
+   при поступлении нового подключения, освобождая место для него, мс */
+#define METRICS_TIMEOUT 5000
+
+/* Проверка адреса слушающего сокета метрик. Возвращает -1, если адрес
+   неправильный или TCP-адрес не относится к петлевому интерфейсу */
+int metrics_check_address(const char *address);
+
+/* Создание слушающего сокета метрик. Сокет нужно создать до смены корневого
+   каталога и сброса привилегий */
+int metrics_listen(const char *address);
+
+/* Удалить Unix-сокет метрик по адресу address при завершении работы.
+   Для TCP-адреса ничего не делает. Сокет создаётся до смены корневого
+   каталога и сброса привилегий, поэтому удалять его должен процесс,
+   который их не сбрасывал */
+int metrics_unlink(const char *address);
+
+/* Добавить в цикл обработки событий слушающий сокет метрик fd. Количество
+   клиентов считается по сокетам цикла, а статистика записей - по портам
+   каталога parports. Если добавить сокет не удалось, его закрывает
+   вызывающая функция */
+int metrics_attach(int fd, evloop_t *evloop, parports_t *parports);
+
+#endif
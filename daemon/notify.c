@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include "daemon.h"
+#include "timer.h"
+#include "config.h"
+#include "client.h"
+#include "notify.h"
+
+/* Данные таймера уведомлений */
+typedef struct notify_s
+{
+  int fd;                      /* Сокет уведомлений systemd */
+  evloop_t *evloop;            /* Цикл обработки событий с клиентами */
+  long long period;            /* Период срабатывания таймера, мс */
+  int watchdog;                /* 1 - отправлять уведомления WATCHDOG=1 */
+  int status;                  /* 1 - обновлять строку состояния */
+  unsigned long long commands; /* Количество команд при прошлом срабатывании */
+  long long time;              /* Время прошлого срабатывания, мс */
+} notify_t;
+
+/* Подключение к сокету уведомлений systemd. Возвращает -1, если переменная
+   окружения NOTIFY_SOCKET не задана */
+int notify_open()
+{
+  const char *pathname = getenv("NOTIFY_SOCKET");
+  if ((pathname == NULL) || (pathname[0] == '\0'))
+  {
+    return -1;
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  size_t len = strlen(pathname);
+  if (len > sizeof(address.sun_path))
+  {
+    log_message(LOG_ERR, "notify_open: too long notify socket path %s", pathname);
+    return -1;
+  }
+  memcpy(address.sun_path, pathname, len);
+
+  /* Абстрактный Unix-сокет не имеет пути в файловой системе */
+  if (address.sun_path[0] == '@')
+  {
+    address.sun_path[0] = '\0';
+  }
+  socklen_t size = sizeof(address) - sizeof(address.sun_path) + len;
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+  {
+    log_error(LOG_ERR, "notify_open: failed to create notify socket");
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr *)&address, size) == -1)
+  {
+    log_error(LOG_ERR, "notify_open: failed to connect to notify socket %s", pathname);
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "notify_open: warning, failed to close notify socket");
+    }
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Отправка уведомления */
+int notify_send(int fd, const char *message)
+{
+  if (message == NULL)
+  {
+    log_message(LOG_ERR, "notify_send: message is NULL pointer");
+    return -1;
+  }
+
+  if (send(fd, message, strlen(message), MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+  {
+    log_error(LOG_WARNING, "notify_send: warning, failed to send notification");
+    return -1;
+  }
+  return 0;
+}
+
+/* Период проверки работоспособности из переменной окружения WATCHDOG_USEC
+   в миллисекундах или 0, если проверка не ведётся */
+long long notify_watchdog()
+{
+  const char *usec = getenv("WATCHDOG_USEC");
+  if (usec == NULL)
+  {
+    return 0;
+  }
+
+  /* В "тяжёлом" варианте systemd следит за ведущим процессом, а уведомления
+     отправляет ведомый процесс */
+  const char *pid = getenv("WATCHDOG_PID");
+  if (pid != NULL)
+  {
+    unsigned long watchdog_pid;
+    if ((parse_ul(pid, &watchdog_pid) == -1) ||
+        ((watchdog_pid != (unsigned long)getpid()) && (watchdog_pid != (unsigned long)getppid())))
+    {
+      return 0;
+    }
+  }
+
+  unsigned long n;
+  if (parse_ul(usec, &n) == -1)
+  {
+    log_message(LOG_WARNING, "notify_watchdog: warning, wrong value of WATCHDOG_USEC: %s", usec);
+    return 0;
+  }
+  return n / 1000;
+}
+
+/* Обработчик срабатываний таймера уведомлений */
+int notify_timer_process_event(int fd, int events, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "notify_timer_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  notify_t *notify = data;
+
+  if (events & EPOLLIN)
+  {
+    if (timer_read(fd) == -1)
+    {
+      log_message(LOG_WARNING, "notify_timer_process_event: warning, timer_read failed");
+    }
+
+    /* Таймер срабатывает из цикла обработки событий, поэтому уведомление
+       WATCHDOG=1 означает, что цикл не завис */
+    if (notify->watchdog)
+    {
+      notify_send(notify->fd, "WATCHDOG=1");
+    }
+
+    if (notify->status)
+    {
+      long long now = timer_now();
+      unsigned long long commands = client_commands_total();
+      double rate = 0;
+      if (now > notify->time)
+      {
+        rate = (commands - notify->commands) * 1000.0 / (now - notify->time);
+      }
+      notify->commands = commands;
+      notify->time = now;
+
+      char message[128];
+      snprintf(message, sizeof(message), "STATUS=%d clients, %.1f commands/s, %llu commands total",
+               evloop_collect(notify->evloop, client_process_event, NULL, 0), rate, commands);
+      notify_send(notify->fd, message);
+    }
+
+    if (timer_arm(fd, notify->period) == -1)
+    {
+      log_message(LOG_ERR, "notify_timer_process_event: timer_arm failed");
+      return -1;
+    }
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+  {
+    log_message(LOG_ERR, "notify_timer_process_event: timer broken");
+    return -1;
+  }
+
+  return EPOLLIN;
+}
+
+/* Освобождение данных таймера уведомлений и закрытие сокета уведомлений */
+int notify_timer_destroy(void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "notify_timer_destroy: data is NULL pointer");
+    return -1;
+  }
+
+  notify_t *notify = data;
+  if (close(notify->fd) == -1)
+  {
+    log_error(LOG_WARNING, "notify_timer_destroy: warning, failed to close notify socket");
+  }
+  free(notify);
+  return 0;
+}
+
+/* Добавить в цикл обработки событий таймер уведомлений */
+int notify_attach(int fd, evloop_t *evloop, int status)
+{
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "notify_attach: evloop is NULL pointer");
+    return -1;
+  }
+
+  notify_t *notify = malloc(sizeof(notify_t));
+  if (notify == NULL)
+  {
+    log_message(LOG_ERR, "notify_attach: failed to allocate memory for notify");
+    return -1;
+  }
+
+  notify->fd = fd;
+  notify->evloop = evloop;
+  notify->status = status;
+  notify->commands = client_commands_total();
+  notify->time = timer_now();
+
+  /* Уведомления WATCHDOG=1 отправляются вдвое чаще, чем их ждёт systemd */
+  long long watchdog = notify_watchdog();
+  notify->watchdog = (watchdog > 0);
+  notify->period = NOTIFY_STATUS_PERIOD;
+  if (notify->watchdog && (watchdog / 2 < notify->period))
+  {
+    notify->period = (watchdog / 2 > 0) ? watchdog / 2 : 1;
+  }
+
+  /* Без проверки работоспособности и строки состояния уведомлять нечего */
+  if (!notify->watchdog && !notify->status)
+  {
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "notify_attach: warning, failed to close notify socket");
+    }
+    free(notify);
+    return 0;
+  }
+
+  int timer = timer_open();
+  if (timer == -1)
+  {
+    log_message(LOG_ERR, "notify_attach: timer_open failed");
+    free(notify);
+    return -1;
+  }
+
+  if (timer_arm(timer, notify->period) == -1)
+  {
+    log_message(LOG_ERR, "notify_attach: timer_arm failed");
+    if (close(timer) == -1)
+    {
+      log_error(LOG_WARNING, "notify_attach: warning, failed to close timer");
+    }
+    free(notify);
+    return -1;
+  }
+
+  socket_t *socket = socket_create(timer, EPOLLIN, notify_timer_process_event, notify_timer_destroy, notify);
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "notify_attach: socket_create failed");
+    if (close(timer) == -1)
+    {
+      log_error(LOG_WARNING, "notify_attach: warning, failed to close timer");
+    }
+    free(notify);
+    return -1;
+  }
+  socket_set_name(socket, "notify");
+
+  if (evloop_add_socket(evloop, socket) == -1)
+  {
+    log_message(LOG_ERR, "notify_attach: evloop_add_socket failed");
+    if (close(timer) == -1)
+    {
+      log_error(LOG_WARNING, "notify_attach: warning, failed to close timer");
+    }
+    free(socket);
+    free(notify);
+    return -1;
+  }
+
+  return 0;
+}
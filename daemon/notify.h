@@ -0,0 +1,35 @@
+#ifndef __NOTIFY__
+#define __NOTIFY__
+
+#include "evloop.h"
+
+/* Уведомление systemd о состоянии демона по протоколу sd_notify без
+   библиотеки libsystemd: строки вида "ИМЯ=значение" отправляются одной
+   датаграммой в Unix-сокет, путь к которому systemd передаёт в переменной
+   окружения NOTIFY_SOCKET. Путь, начинающийся с @, означает абстрактный
+   Unix-сокет */
+
+/* Наибольший период обновления строки состояния, мс */
+#define NOTIFY_STATUS_PERIOD 5000
+
+/* Подключение к сокету уведомлений systemd. Подключаться нужно до смены
+   корневого каталога, после которой путь к сокету станет недоступен.
+   Возвращает -1, если переменная окружения NOTIFY_SOCKET не задана */
+int notify_open();
+
+/* Отправка уведомления, например "READY=1" */
+int notify_send(int fd, const char *message);
+
+/* Период проверки работоспособности из переменной окружения WATCHDOG_USEC
+   в миллисекундах или 0, если systemd не проверяет работоспособность этого
+   процесса или его родителя */
+long long notify_watchdog();
+
+/* Добавить в цикл обработки событий таймер, который отправляет уведомления
+   WATCHDOG=1 с периодом, вдвое меньшим периода проверки работоспособности,
+   и, если задан признак status, обновляет строку состояния с количеством
+   клиентов и частотой выполнения команд. Сокет уведомлений fd закрывается
+   вместе с таймером, а если уведомлять нечего, то сразу */
+int notify_attach(int fd, evloop_t *evloop, int status);
+
+#endif
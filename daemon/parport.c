@@ -1,19 +1,69 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <linux/parport.h>
 #include <linux/ppdev.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "daemon.h"
+#include "timer.h"
 #include "parport.h"
+#include "stats.h"
+
+/* Пределы задержки перед повторной попыткой открыть порт, в миллисекундах.
+   После каждой неудачной попытки задержка удваивается */
+#define PARPORT_BACKOFF_MIN 250
+#define PARPORT_BACKOFF_MAX 30000
+
+/* Линии регистра данных в режиме цепочек сдвиговых регистров: линии D0-D5
+   подключаются к последовательным входам цепочек, линия D6 - к входам
+   защёлок, линия D7 - к тактовым входам всех цепочек */
+#define PARPORT_SHIFT_LATCH 0x40
+#define PARPORT_SHIFT_CLOCK 0x80
 
 struct parport_s
 {
   char *pathname;
   int fd;
-  int leds;
+  int *leds;             /* Кэш состояния светодиодов или -1 */
+  pthread_mutex_t lock;  /* Блокировка, под которой файл устройства закрывается
+                            и заменяется, а поток драйвера записывает регистры */
+
+  parport_state_t state; /* Готов ли порт к работе */
+  long long backoff;     /* Текущая задержка перед повторным открытием, мс */
+  long long retry_time;  /* Время следующей попытки открыть порт, мс */
+
+  int *data;             /* Последнее записанное в регистр данных значение или -1 */
+  int *control;          /* Последнее записанное в регистр управления значение или -1 */
+
+  /* Собственные ячейки для кэша светодиодов и регистров. Порт пользуется ими,
+     пока не привязан к массивам каталога вызовом parport_bind */
+  int own_leds;
+  int own_data;
+  int own_control;
+  parport_order_t order; /* Порядок записи регистров */
+
+  int measure;                                /* Признак измерения промежутков */
+  unsigned long long writes;                  /* Количество записей в регистры */
+  unsigned long long updates;                 /* Количество обновлений обоих регистров */
+  unsigned long long gaps[PARPORT_GAP_BUCKETS]; /* Распределение промежутков */
+  long long gap_min;                          /* Минимальный промежуток, нс */
+  long long gap_max;                          /* Максимальный промежуток, нс */
+  unsigned long long write_calls;             /* Количество обновлений состояния
+                                                 светодиодов с записью регистров */
+  long long write_ns;                         /* Суммарное время этих обновлений, нс */
+
+  unsigned shift_chains;         /* Количество цепочек сдвиговых регистров или 0 */
+  unsigned shift_length;         /* Количество бит в каждой цепочке */
+  unsigned char *shift_vector;   /* Текущее состояние выходов всех цепочек */
+  unsigned long long shift_frames; /* Количество выведенных кадров */
+  long long shift_ns;            /* Суммарное время вывода кадров, нс */
 };
 
 /* Подготовка структуры с информацией о параллельном порте */
@@ -45,11 +95,134 @@ parport_t *parport_prepare(const char *pathname)
   /* Если память удалось выделить, выполняем предварительную инициализацию структуры */
   strcpy(parport->pathname, pathname);
   parport->fd = -1;
-  parport->leds = -1;
+  parport->own_leds = -1;
+  parport->leds = &(parport->own_leds);
+  pthread_mutex_init(&(parport->lock), NULL);
+  parport->state = PARPORT_DEGRADED;
+  parport->backoff = 0;
+  parport->retry_time = 0;
+  parport->own_data = -1;
+  parport->own_control = -1;
+  parport->data = &(parport->own_data);
+  parport->control = &(parport->own_control);
+  parport->order = ORDER_DATA_FIRST;
+  parport->measure = 0;
+  parport->writes = 0;
+  parport->updates = 0;
+  memset(parport->gaps, 0, sizeof(parport->gaps));
+  parport->gap_min = -1;
+  parport->gap_max = -1;
+  parport->write_calls = 0;
+  parport->write_ns = 0;
+  parport->shift_chains = 0;
+  parport->shift_length = 0;
+  parport->shift_vector = NULL;
+  parport->shift_frames = 0;
+  parport->shift_ns = 0;
 
   return parport;
 }
 
+/* Перенос кэша светодиодов и последних записанных значений регистров порта
+   в указанные ячейки. Каталог портов хранит эти значения всех портов
+   в общих массивах и после перераспределения массивов привязывает порты
+   к новым ячейкам. Значения читаются и пишутся только из потока цикла
+   обработки событий, поэтому блокировка порта для этого не нужна */
+int parport_bind(parport_t *parport, int *leds, int *data, int *control)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_bind: parport is NULL pointer");
+    return -1;
+  }
+
+  if ((leds == NULL) || (data == NULL) || (control == NULL))
+  {
+    log_message(LOG_ERR, "parport_bind: cell is NULL pointer");
+    return -1;
+  }
+
+  *leds = *parport->leds;
+  *data = *parport->data;
+  *control = *parport->control;
+  parport->leds = leds;
+  parport->data = data;
+  parport->control = control;
+  return 0;
+}
+
+/* Выбор порядка записи регистров данных и управления */
+int parport_set_order(parport_t *parport, parport_order_t order)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_set_order: parport is NULL pointer");
+    return -1;
+  }
+
+  parport->order = order;
+  return 0;
+}
+
+/* Включение или выключение измерения промежутков между записями регистров */
+int parport_set_measure(parport_t *parport, int measure)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_set_measure: parport is NULL pointer");
+    return -1;
+  }
+
+  parport->measure = measure;
+  return 0;
+}
+
+/* Перевод порта в деградировавшее состояние: файл устройства закрывается,
+   а следующая попытка открыть порт откладывается на удвоенное время */
+void parport_degrade(parport_t *parport)
+{
+  /* Если файл устройства ещё открыт, освобождаем порт и закрываем файл */
+  if (parport->fd != -1)
+  {
+    pthread_mutex_lock(&(parport->lock));
+    if (ioctl(parport->fd, PPRELEASE) == -1)
+    {
+      log_error(LOG_WARNING, "parport_degrade: warning, failed to release port %s", parport->pathname);
+    }
+
+    if (close(parport->fd) == -1)
+    {
+      log_error(LOG_WARNING, "parport_degrade: warning, failed to close device file %s", parport->pathname);
+    }
+    parport->fd = -1;
+    pthread_mutex_unlock(&(parport->lock));
+  }
+
+  /* Содержимое регистров после повторного открытия порта неизвестно */
+  *parport->data = -1;
+  *parport->control = -1;
+
+  /* Вычисляем задержку перед следующей попыткой */
+  if (parport->backoff == 0)
+  {
+    parport->backoff = PARPORT_BACKOFF_MIN;
+  }
+  else if (parport->backoff < PARPORT_BACKOFF_MAX)
+  {
+    parport->backoff *= 2;
+    if (parport->backoff > PARPORT_BACKOFF_MAX)
+    {
+      parport->backoff = PARPORT_BACKOFF_MAX;
+    }
+  }
+
+  parport->state = PARPORT_DEGRADED;
+  parport->retry_time = timer_now() + parport->backoff;
+
+  log_message(LOG_WARNING, "parport_degrade: warning, parport %s is degraded, next open attempt in %lld ms",
+              parport->pathname, parport->backoff);
+}
+
 /* Открытие файла устройства параллельного порта, подготовка порта к работе */
 int parport_open(parport_t *parport)
 {
@@ -60,51 +233,67 @@ int parport_open(parport_t *parport)
   }
 
   /* Открываем файл устройства параллельного порта по пути к нему */
-  parport->fd = open(parport->pathname, O_RDWR);
-  if (parport->fd == -1)
+  int fd = open(parport->pathname, O_RDWR);
+  if (fd == -1)
   {
     log_error(LOG_ERR, "parport_open: failed to open device file %s", parport->pathname);
+    parport_degrade(parport);
     return -1;
   }
 
   /* Запрашиваем доступ к параллельному порту */
-  if (ioctl(parport->fd, PPCLAIM) == -1)
+  if (ioctl(fd, PPCLAIM) == -1)
   {
     log_error(LOG_ERR, "parport_open: failed to claim port %s", parport->pathname);
-    if (close(parport->fd) == -1)
+    if (close(fd) == -1)
     {
       log_error(LOG_WARNING, "parport_open: warning, failed to close device file %s", parport->pathname);
     }
-    parport->fd = -1;
+    parport_degrade(parport);
     return -1;
   }
 
   /* Согласовываем режим совместимости */
   int mode_compat = IEEE1284_MODE_COMPAT;
-  if (ioctl(parport->fd, PPSETMODE, &mode_compat) == -1)
+  if (ioctl(fd, PPSETMODE, &mode_compat) == -1)
   {
     log_error(LOG_ERR, "parport_open: failed to switch port %s to compatibility mode", parport->pathname);
-    if (close(parport->fd) == -1)
+    if (close(fd) == -1)
     {
       log_error(LOG_WARNING, "parport_open: warning, failed to close device file %s", parport->pathname);
     }
-    parport->fd = -1;
+    parport_degrade(parport);
     return -1;
   }
 
   /* Настраиваем направление линий данных */
   int mode_write = 0;
-  if (ioctl(parport->fd, PPDATADIR, &mode_write) == -1)
+  if (ioctl(fd, PPDATADIR, &mode_write) == -1)
   {
     log_error(LOG_ERR, "parport_open: failed to enable data drivers on port %s", parport->pathname);
-    if (close(parport->fd) == -1)
+    if (close(fd) == -1)
     {
       log_error(LOG_WARNING, "parport_open: warning, failed to close device file %s", parport->pathname);
     }
-    parport->fd = -1;
+    parport_degrade(parport);
     return -1;
   }
 
+  /* Поток драйвера начинает записывать регистры в файл устройства только
+     после того, как порт полностью подготовлен */
+  pthread_mutex_lock(&(parport->lock));
+  parport->fd = fd;
+  pthread_mutex_unlock(&(parport->lock));
+
+  /* Содержимое регистров после открытия порта неизвестно */
+  *parport->data = -1;
+  *parport->control = -1;
+
+  /* Порт готов к работе, задержка перед повторными попытками сбрасывается */
+  parport->state = PARPORT_READY;
+  parport->backoff = 0;
+  parport->retry_time = 0;
+
   return 0;
 }
 
@@ -135,46 +324,124 @@ int parport_close(parport_t *parport)
     }
   }
 
+  pthread_mutex_destroy(&(parport->lock));
+  free(parport->shift_vector);
   free(parport->pathname);
   free(parport);
   return result;
 }
 
-/* Выставление активности светодиодов на параллельном порту */
-int parport_leds_set(parport_t *parport, unsigned leds)
+/* Закрытие файла устройства без освобождения структуры порта. Порт остаётся
+   в деградировавшем состоянии, а кэш светодиодов сбрасывается. Порт можно
+   снова открыть вызовом parport_open */
+int parport_release(parport_t *parport)
 {
   if (parport == NULL)
   {
-    log_message(LOG_ERR, "parport_leds_set: parport is NULL pointer");
+    log_message(LOG_ERR, "parport_release: parport is NULL pointer");
     return -1;
   }
 
-  /* Если порт ещё не открыт, то пытаемся его открыть */
-  if (parport->fd == -1)
+  int result = 0;
+
+  if (parport->fd != -1)
   {
-    if (parport_open(parport) == -1)
+    pthread_mutex_lock(&(parport->lock));
+    if (ioctl(parport->fd, PPRELEASE) == -1)
     {
-      log_message(LOG_ERR, "parport_leds_set: failed to open parport %s", parport->pathname);
-      return -1;
+      log_error(LOG_WARNING, "parport_release: warning, failed to release port %s", parport->pathname);
+      result = -1;
+    }
+
+    if (close(parport->fd) == -1)
+    {
+      log_error(LOG_WARNING, "parport_release: warning, failed to close device file %s", parport->pathname);
+      result = -1;
     }
+    parport->fd = -1;
+    pthread_mutex_unlock(&(parport->lock));
   }
 
-  /* Есть только 12 светодиодов, поэтому все биты старше игнорируем */
-  if (leds > 0x0FFF)
+  *parport->leds = -1;
+  *parport->data = -1;
+  *parport->control = -1;
+  parport->state = PARPORT_DEGRADED;
+  parport->backoff = 0;
+  parport->retry_time = 0;
+  return result;
+}
+
+/* Принятие уже открытого и захваченного файла устройства порта вместо
+   открытия порта. Регистры порта не записываются */
+int parport_adopt(parport_t *parport, int fd, int leds)
+{
+  if (parport == NULL)
   {
-    log_message(LOG_WARNING, "parport_leds_set: warning, leds value is too big, high bits will be masked");
-    leds &= 0x0FFF;
+    log_message(LOG_ERR, "parport_adopt: parport is NULL pointer");
+    return -1;
   }
 
-  /* Выставляем состояние линий данных */
-  unsigned char data = leds & 0xFF;
-  if (ioctl(parport->fd, PPWDATA, &data) == -1)
+  if (parport->fd != -1)
+  {
+    log_message(LOG_ERR, "parport_adopt: parport %s is already open", parport->pathname);
+    return -1;
+  }
+
+  pthread_mutex_lock(&(parport->lock));
+  parport->fd = fd;
+  pthread_mutex_unlock(&(parport->lock));
+  *parport->leds = leds;
+
+  /* Значения регистров будут вычислены по кэшу светодиодов при следующей записи */
+  *parport->data = -1;
+  *parport->control = -1;
+
+  parport->state = PARPORT_READY;
+  parport->backoff = 0;
+  parport->retry_time = 0;
+  return 0;
+}
+
+/* Количество записей в регистры, количество обновлений состояния светодиодов
+   с записью регистров и суммарное время этих обновлений в наносекундах */
+int parport_write_stats(parport_t *parport, unsigned long long *writes,
+                        unsigned long long *calls, long long *ns)
+{
+  if (parport == NULL)
   {
-    log_error(LOG_ERR, "parport_leds_set: failed to set data bits on port %s", parport->pathname);
+    log_message(LOG_ERR, "parport_write_stats: parport is NULL pointer");
     return -1;
   }
 
-  /* Вычисляем значение управляющих линий */
+  if ((writes == NULL) || (calls == NULL) || (ns == NULL))
+  {
+    log_message(LOG_ERR, "parport_write_stats: writes, calls or ns is NULL pointer");
+    return -1;
+  }
+
+  *writes = parport->writes;
+  *calls = parport->write_calls;
+  *ns = parport->write_ns;
+  return 0;
+}
+
+/* Возвращает путь к файлу устройства порта */
+const char *parport_pathname(parport_t *parport)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_pathname: parport is NULL pointer");
+    return NULL;
+  }
+
+  return parport->pathname;
+}
+
+/* Вычисление значения регистра управления для старших 4 светодиодов. Часть
+   управляющих линий инвертирована, поэтому для включения светодиода
+   соответствующий бит регистра нужно сбросить */
+unsigned char leds_control(unsigned leds)
+{
   unsigned char control = 0;
   if ((leds & 0x0100) == 0)
   {
@@ -193,15 +460,207 @@ int parport_leds_set(parport_t *parport, unsigned leds)
     control |= PARPORT_CONTROL_SELECT;
   }
 
-  /* Выставляем состояние управляющих линий */
-  if (ioctl(parport->fd, PPWCONTROL, &control) == -1)
+  return control;
+}
+
+/* Запись регистров данных и управления в обход кэша светодиодов. Если значение
+   регистра равно -1, то регистр не записывается. Используется драйверами,
+   которые сами управляют линиями порта из отдельного потока, поэтому при
+   ошибке порт не переводится в деградировавшее состояние: об ошибке драйвер
+   сообщает циклу обработки событий */
+int parport_write_raw(parport_t *parport, int data, int control)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_write_raw: parport is NULL pointer");
+    return -1;
+  }
+
+  /* Поток цикла обработки событий закрывает и заменяет файл устройства
+     под блокировкой, поэтому запись не попадёт в закрытый или уже
+     повторно использованный дескриптор */
+  pthread_mutex_lock(&(parport->lock));
+
+  int result = -1;
+  if (parport->fd != -1)
+  {
+    unsigned char value = data;
+    unsigned char control_value = control;
+    if (((data == -1) || (ioctl(parport->fd, PPWDATA, &value) != -1)) &&
+        ((control == -1) || (ioctl(parport->fd, PPWCONTROL, &control_value) != -1)))
+    {
+      result = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&(parport->lock));
+  return result;
+}
+
+/* Выставление активности светодиодов на параллельном порту */
+int parport_leds_set(parport_t *parport, unsigned leds)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_leds_set: parport is NULL pointer");
+    return -1;
+  }
+
+  /* Линиями порта с цепочками сдвиговых регистров управляет драйвер цепочек */
+  if (parport->shift_chains > 0)
+  {
+    log_message(LOG_ERR, "parport_leds_set: parport %s drives shift register chains", parport->pathname);
+    return -1;
+  }
+
+  /* Если порт не готов к работе, то сразу сообщаем об ошибке. Повторным
+     открытием порта занимается таймер, а не обработчик команд */
+  if (parport->state != PARPORT_READY)
   {
-    log_error(LOG_ERR, "parport_leds_set: failed to set control bits on port %s", parport->pathname);
+    log_message(LOG_ERR, "parport_leds_set: parport %s is degraded", parport->pathname);
     return -1;
   }
 
+  /* Есть только 12 светодиодов, поэтому все биты старше игнорируем */
+  if (leds > 0x0FFF)
+  {
+    log_message(LOG_WARNING, "parport_leds_set: warning, leds value is too big, high bits will be masked");
+    leds &= 0x0FFF;
+  }
+
+  /* Вычисляем значения линий данных и управляющих линий */
+  unsigned char data = leds & 0xFF;
+  unsigned char control = leds_control(leds);
+
+  /* Регистры, значения которых не меняются, не записываем. Если меняется
+     только один из регистров, то промежуточного состояния не возникает */
+  int write_data = (*parport->data != data);
+  int write_control = (*parport->control != control);
+
+  /* Если меняются оба регистра, то выбираем, какой из них записать первым.
+     В автоматическом режиме первым записывается регистр, в котором меняется
+     больше светодиодов, чтобы в промежуточном состоянии как можно меньше
+     светодиодов показывали устаревшее состояние */
+  int control_first = 0;
+  if (write_data && write_control)
+  {
+    if (parport->order == ORDER_CONTROL_FIRST)
+    {
+      control_first = 1;
+    }
+    else if ((parport->order == ORDER_AUTO) && (*parport->leds != -1))
+    {
+      unsigned changed = (unsigned)*parport->leds ^ leds;
+      control_first = __builtin_popcount(changed & 0x0F00) > __builtin_popcount(changed & 0x00FF);
+    }
+  }
+
+  /* Признак того, что записываются оба регистра и промежуток между
+     записями нужно измерить */
+  int measure = parport->measure && write_data && write_control;
+  long long start = 0;
+
+  /* Время начала записи для гистограммы задержек записи регистров */
+  long long write_start = (write_data || write_control) ? timer_now_ns() : 0;
+
+  /* Выставляем состояние управляющих линий, если оно записывается первым */
+  if (write_control && control_first)
+  {
+    if (ioctl(parport->fd, PPWCONTROL, &control) == -1)
+    {
+      log_error(LOG_ERR, "parport_leds_set: failed to set control bits on port %s", parport->pathname);
+      parport_degrade(parport);
+      return -1;
+    }
+    *parport->control = control;
+    parport->writes++;
+
+    /* Время окончания записи первого из двух регистров */
+    if (measure)
+    {
+      start = timer_now_ns();
+    }
+  }
+
+  /* Выставляем состояние линий данных */
+  if (write_data)
+  {
+    if (ioctl(parport->fd, PPWDATA, &data) == -1)
+    {
+      log_error(LOG_ERR, "parport_leds_set: failed to set data bits on port %s", parport->pathname);
+      parport_degrade(parport);
+      return -1;
+    }
+    *parport->data = data;
+    parport->writes++;
+
+    /* Время окончания записи первого из двух регистров */
+    if (measure && !control_first)
+    {
+      start = timer_now_ns();
+    }
+  }
+
+  /* Выставляем состояние управляющих линий, если оно записывается вторым */
+  if (write_control && !control_first)
+  {
+    if (ioctl(parport->fd, PPWCONTROL, &control) == -1)
+    {
+      log_error(LOG_ERR, "parport_leds_set: failed to set control bits on port %s", parport->pathname);
+      parport_degrade(parport);
+      return -1;
+    }
+    *parport->control = control;
+    parport->writes++;
+  }
+
+  /* Время окончания записи снимается сразу после записи последнего регистра,
+     до учёта статистики, и служит концом и промежутка, и всей записи */
+  long long write_end = (write_data || write_control) ? timer_now_ns() : 0;
+
+  if (write_data || write_control)
+  {
+    long long write_ns = write_end - write_start;
+    stats_latency(STATS_WRITE, write_ns);
+    parport->write_calls++;
+    parport->write_ns += write_ns;
+  }
+
+  /* Если записывались оба регистра, то учитываем промежуточное состояние */
+  if (write_data && write_control)
+  {
+    parport->updates++;
+
+    /* Учитываем промежуток между записями в распределении. Корзина с номером i
+       содержит промежутки от 2^i до 2^(i+1) наносекунд */
+    if (measure)
+    {
+      long long gap = write_end - start;
+      if (gap < 1)
+      {
+        gap = 1;
+      }
+
+      int bucket = 63 - __builtin_clzll((unsigned long long)gap);
+      if (bucket >= PARPORT_GAP_BUCKETS)
+      {
+        bucket = PARPORT_GAP_BUCKETS - 1;
+      }
+      parport->gaps[bucket]++;
+
+      if ((parport->gap_min == -1) || (gap < parport->gap_min))
+      {
+        parport->gap_min = gap;
+      }
+      if (gap > parport->gap_max)
+      {
+        parport->gap_max = gap;
+      }
+    }
+  }
+
   /* Запоминаем новое состояние светодиодов в кэше */
-  parport->leds = (int)leds;
+  *parport->leds = (int)leds;
 
   return 0;
 }
@@ -215,20 +674,24 @@ int parport_leds_get(parport_t *parport)
     return -1;
   }
 
+  /* Линиями порта с цепочками сдвиговых регистров управляет драйвер цепочек */
+  if (parport->shift_chains > 0)
+  {
+    log_message(LOG_ERR, "parport_leds_get: parport %s drives shift register chains", parport->pathname);
+    return -1;
+  }
+
   /* Если в кэше есть текущее состояние светодиодов, то сразу возвращаем его */
-  if (parport->leds != -1)
+  if (*parport->leds != -1)
   {
-    return parport->leds;
+    return *parport->leds;
   }
 
-  /* Если порт ещё не открыт, то пытаемся его открыть */
-  if (parport->fd == -1)
+  /* Если порт не готов к работе, то сразу сообщаем об ошибке */
+  if (parport->state != PARPORT_READY)
   {
-    if (parport_open(parport) == -1)
-    {
-      log_message(LOG_ERR, "parport_leds_get: failed to open parport %s", parport->pathname);
-      return -1;
-    }
+    log_message(LOG_ERR, "parport_leds_get: parport %s is degraded", parport->pathname);
+    return -1;
   }
 
   /* Считываем состояние линий данных */
@@ -236,6 +699,7 @@ int parport_leds_get(parport_t *parport)
   if (ioctl(parport->fd, PPRDATA, &data) == -1)
   {
     log_error(LOG_ERR, "parport_leds_get: failed to get data bits from port %s", parport->pathname);
+    parport_degrade(parport);
     return -1;
   }
 
@@ -244,6 +708,7 @@ int parport_leds_get(parport_t *parport)
   if (ioctl(parport->fd, PPRCONTROL, &control) == -1)
   {
     log_error(LOG_ERR, "parport_leds_get: failed to get control bits from port %s", parport->pathname);
+    parport_degrade(parport);
     return -1;
   }
 
@@ -266,129 +731,727 @@ int parport_leds_get(parport_t *parport)
     leds |= 0x0800;
   }
 
-  /* Запоминаем считанное и вычисленное состояние светодиодов в кэше */
-  parport->leds = leds;
+  /* Запоминаем считанное и вычисленное состояние светодиодов в кэше,
+     а считанные значения регистров - как последние записанные */
+  *parport->leds = leds;
+  *parport->data = data;
+  *parport->control = control;
 
   return leds;
 }
 
-/* Функция для манипуляции над светодиодами на параллельном порту */
-int parport_leds_ctl(parport_t *parport, leds_operation_t operation, int operand)
+/* Возвращает время следующей попытки открыть порт в миллисекундах
+   монотонных часов или -1, если порт готов к работе */
+long long parport_retry_time(parport_t *parport)
 {
   if (parport == NULL)
   {
-    log_message(LOG_ERR, "parport_leds_ctl: parport is NULL pointer");
+    log_message(LOG_ERR, "parport_retry_time: parport is NULL pointer");
     return -1;
   }
 
-  /* Если для однооперандной операции указано значение операнда, отличное от -1,
-     выводим предупреждение, что он будет проигнорирован */
-  if ((operation == LEDS_GET) || (operation == LEDS_NOT) ||
-       (operation == LEDS_INC) || (operation == LEDS_DEC))
-  { 
-    if (operand != -1)
-    {
-      log_message(LOG_WARNING, "parport_leds_ctl: warning, operand for unary operation will be ignored");
-    }
-  }
-  /* В противном случае операнд должен быть положительным */
-  else if (operand < 0)
+  if (parport->state == PARPORT_READY)
   {
-    log_message(LOG_ERR, "parport_leds_ctl: operand is negative value");
     return -1;
   }
-  /* Если операция - сдвиг, то операнд должен быть меньше 12, используем только остаток от деления на 12 */
-  else if (((operation == LEDS_RS) || (operation == LEDS_LS) ||
-            (operation == LEDS_RCS) || (operation == LEDS_LCS)) &&
-            (operand >= 12))
+
+  return parport->retry_time;
+}
+
+/* Повторная попытка открыть деградировавший порт */
+int parport_reopen(parport_t *parport)
+{
+  if (parport == NULL)
   {
-    log_message(LOG_WARNING, "parport_leds_ctl: warning, operand is too big, remainder of division by 12 will be taken");
-    operand = operand % 12;
+    log_message(LOG_ERR, "parport_reopen: parport is NULL pointer");
+    return -1;
   }
-  /* В противном случае проверяем, чтобы операнд содержал не более 12 бит */
-  else if (operand > 0x0FFF)
+
+  /* Порт уже готов к работе, делать ничего не нужно */
+  if (parport->state == PARPORT_READY)
   {
-    log_message(LOG_WARNING, "parport_leds_ctl: warning, operand is too big, high bits will be masked");
-    operand &= 0x0FFF;
+    return 0;
   }
 
-  /* Если указана команда установки текущего состояния светодиодов, то выполняем её */
-  if (operation == LEDS_SET)
+  /* Время следующей попытки ещё не наступило */
+  if (timer_now() < parport->retry_time)
   {
-    if (parport_leds_set(parport, operand) == -1)
-    {
-      log_message(LOG_ERR, "parport_leds_ctl: failed to set new state of leds");
-      return -1;
-    }
-
-    return operand;
+    return -1;
   }
 
-  /* Все остальные команды используют текущее состояние светодиодов, узнаём его */
-  int leds = parport_leds_get(parport);
-  if (leds == -1)
+  if (parport_open(parport) == -1)
   {
-    log_message(LOG_ERR, "parport_leds_ctl: failed to get current state of leds");
+    log_message(LOG_ERR, "parport_reopen: failed to reopen parport %s", parport->pathname);
     return -1;
   }
 
+  log_message(LOG_NOTICE, "parport_reopen: parport %s is ready", parport->pathname);
+
+  /* Драйвер мог сбросить состояние линий при повторном открытии,
+     восстанавливаем последнее известное состояние светодиодов */
+  if (parport->shift_chains > 0)
+  {
+    if (parport_shift_out(parport) == -1)
+    {
+      log_message(LOG_WARNING, "parport_reopen: warning, failed to restore shift register chains on parport %s", parport->pathname);
+    }
+  }
+  else if (*parport->leds != -1)
+  {
+    if (parport_leds_set(parport, *parport->leds) == -1)
+    {
+      log_message(LOG_WARNING, "parport_reopen: warning, failed to restore leds on parport %s", parport->pathname);
+    }
+  }
+
+  return 0;
+}
+
+/* Вывод в буфер статистики записей регистров и распределения промежутков
+   между записями регистров данных и управления */
+int parport_gaps(parport_t *parport, char *buf, size_t size)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_gaps: parport is NULL pointer");
+    return -1;
+  }
+
+  if (buf == NULL)
+  {
+    log_message(LOG_ERR, "parport_gaps: buf is NULL pointer");
+    return -1;
+  }
+
+  int n = snprintf(buf, size, "writes=%llu updates=%llu min=%lldns max=%lldns",
+                   parport->writes, parport->updates, parport->gap_min, parport->gap_max);
+  if ((n < 0) || ((size_t)n >= size))
+  {
+    log_message(LOG_ERR, "parport_gaps: buffer is too small");
+    return -1;
+  }
+
+  /* Выводим только непустые корзины, указывая верхнюю границу корзины */
+  for(int i = 0; i < PARPORT_GAP_BUCKETS; i++)
+  {
+    if (parport->gaps[i] == 0)
+    {
+      continue;
+    }
+
+    int m = snprintf(&(buf[n]), size - n, " <%lluns:%llu", 2ULL << i, parport->gaps[i]);
+    if ((m < 0) || ((size_t)m >= size - n))
+    {
+      log_message(LOG_ERR, "parport_gaps: buffer is too small");
+      return -1;
+    }
+    n += m;
+  }
+
+  return n;
+}
+
+/* Возвращает файловый дескриптор открытого порта или -1, если порт не готов к работе */
+int parport_fd(parport_t *parport)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_fd: parport is NULL pointer");
+    return -1;
+  }
+
+  if (parport->state != PARPORT_READY)
+  {
+    return -1;
+  }
+
+  return parport->fd;
+}
+
+/* Чтение линий состояния порта по файловому дескриптору. Не меняет состояния
+   порта и не пишет в журнал, поэтому может вызываться из других потоков */
+int parport_read_status(int fd)
+{
+  unsigned char status = 0;
+  if (ioctl(fd, PPRSTATUS, &status) == -1)
+  {
+    return -1;
+  }
+
+  /* Линия BUSY инвертирована, приводим её к уровню на разъёме */
+  status ^= PARPORT_STATUS_BUSY;
+  return (status & (PARPORT_STATUS_ERROR | PARPORT_STATUS_SELECT | PARPORT_STATUS_PAPEROUT |
+                    PARPORT_STATUS_ACK | PARPORT_STATUS_BUSY)) >> 3;
+}
+
+/* Чтение состояния линий состояния порта. Возвращает уровни линий в битах:
+   0 - ERROR, 1 - SELECT, 2 - PAPEROUT, 3 - ACK, 4 - BUSY */
+int parport_status(parport_t *parport)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_status: parport is NULL pointer");
+    return -1;
+  }
+
+  if (parport->state != PARPORT_READY)
+  {
+    log_message(LOG_ERR, "parport_status: parport %s is degraded", parport->pathname);
+    return -1;
+  }
+
+  int status = parport_read_status(parport->fd);
+  if (status == -1)
+  {
+    log_error(LOG_ERR, "parport_status: failed to get status bits from port %s", parport->pathname);
+    parport_degrade(parport);
+    return -1;
+  }
+
+  return status;
+}
+
+/* Снятие накопленных драйвером прерываний порта. Возвращает количество
+   прерываний с момента предыдущего снятия */
+int parport_irq_clear(parport_t *parport)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_irq_clear: parport is NULL pointer");
+    return -1;
+  }
+
+  if (parport->state != PARPORT_READY)
+  {
+    log_message(LOG_ERR, "parport_irq_clear: parport %s is degraded", parport->pathname);
+    return -1;
+  }
+
+  int count = 0;
+  if (ioctl(parport->fd, PPCLRIRQ, &count) == -1)
+  {
+    log_error(LOG_ERR, "parport_irq_clear: failed to clear interrupts on port %s", parport->pathname);
+    parport_degrade(parport);
+    return -1;
+  }
+
+  return count;
+}
+
+/* Включение режима цепочек сдвиговых регистров: chains цепочек по length бит */
+int parport_set_shift(parport_t *parport, unsigned chains, unsigned length)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_set_shift: parport is NULL pointer");
+    return -1;
+  }
+
+  if ((chains < 1) || (chains > PARPORT_SHIFT_CHAINS) ||
+      (length < 1) || (chains * length > PARPORT_SHIFT_MAX_BITS))
+  {
+    log_message(LOG_ERR, "parport_set_shift: wrong chains size %ux%u", chains, length);
+    return -1;
+  }
+
+  unsigned char *vector = calloc((chains * length + 7) / 8, sizeof(unsigned char));
+  if (vector == NULL)
+  {
+    log_message(LOG_ERR, "parport_set_shift: failed to allocate memory for shift vector");
+    return -1;
+  }
+
+  free(parport->shift_vector);
+  parport->shift_vector = vector;
+  parport->shift_chains = chains;
+  parport->shift_length = length;
+  return 0;
+}
+
+/* Возвращает общее количество бит во всех цепочках сдвиговых регистров
+   или 0, если режим цепочек не включен */
+unsigned parport_shift_bits(parport_t *parport)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_shift_bits: parport is NULL pointer");
+    return 0;
+  }
+
+  return parport->shift_chains * parport->shift_length;
+}
+
+/* Запись одного значения в регистр данных в режиме цепочек сдвиговых регистров */
+int parport_shift_write(parport_t *parport, unsigned char data)
+{
+  if (ioctl(parport->fd, PPWDATA, &data) == -1)
+  {
+    log_error(LOG_ERR, "parport_shift_write: failed to set data bits on port %s", parport->pathname);
+    parport_degrade(parport);
+    return -1;
+  }
+
+  *parport->data = data;
+  parport->writes++;
+  return 0;
+}
+
+/* Вывод текущего состояния выходов на цепочки сдвиговых регистров.
+
+   Биты всех цепочек с одинаковой позицией выставляются на линиях D0-D5 одной
+   записью вместе со спадом тактового сигнала, а следующей записью по фронту
+   тактового сигнала вдвигаются во все цепочки одновременно. Первым вдвигается
+   бит, который должен оказаться в конце цепочки. После вывода всех бит фронт
+   сигнала защёлки одновременно переносит содержимое всех цепочек на выходы,
+   поэтому кадр меняется на выходах целиком. Сигнал защёлки снимается первой
+   записью следующего кадра, так что на кадр тратится 2 * length + 1 записей
+   независимо от количества цепочек */
+int parport_shift_out(parport_t *parport)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_shift_out: parport is NULL pointer");
+    return -1;
+  }
+
+  if (parport->shift_chains == 0)
+  {
+    log_message(LOG_ERR, "parport_shift_out: parport %s does not drive shift register chains", parport->pathname);
+    return -1;
+  }
+
+  /* Если порт не готов к работе, то сразу сообщаем об ошибке */
+  if (parport->state != PARPORT_READY)
+  {
+    log_message(LOG_ERR, "parport_shift_out: parport %s is degraded", parport->pathname);
+    return -1;
+  }
+
+  long long start = timer_now_ns();
+
+  for(unsigned position = parport->shift_length; position-- > 0; )
+  {
+    /* Собираем биты всех цепочек с текущей позицией */
+    unsigned char data = 0;
+    for(unsigned chain = 0; chain < parport->shift_chains; chain++)
+    {
+      unsigned bit = chain * parport->shift_length + position;
+      if (parport->shift_vector[bit / 8] & (1 << (bit % 8)))
+      {
+        data |= 1 << chain;
+      }
+    }
+
+    if ((parport_shift_write(parport, data) == -1) ||
+        (parport_shift_write(parport, data | PARPORT_SHIFT_CLOCK) == -1))
+    {
+      log_message(LOG_ERR, "parport_shift_out: failed to shift bits on port %s", parport->pathname);
+      return -1;
+    }
+  }
+
+  if (parport_shift_write(parport, PARPORT_SHIFT_LATCH) == -1)
+  {
+    log_message(LOG_ERR, "parport_shift_out: failed to latch outputs on port %s", parport->pathname);
+    return -1;
+  }
+
+  parport->shift_frames++;
+  parport->shift_ns += timer_now_ns() - start;
+  return 0;
+}
+
+/* Запись нового состояния выходов цепочек сдвиговых регистров и вывод его
+   на цепочки. Бит k вектора соответствует выходу k % length цепочки k / length */
+int parport_shift_set(parport_t *parport, const unsigned char *vector, size_t size)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_shift_set: parport is NULL pointer");
+    return -1;
+  }
+
+  if (vector == NULL)
+  {
+    log_message(LOG_ERR, "parport_shift_set: vector is NULL pointer");
+    return -1;
+  }
+
+  if (parport->shift_chains == 0)
+  {
+    log_message(LOG_ERR, "parport_shift_set: parport %s does not drive shift register chains", parport->pathname);
+    return -1;
+  }
+
+  /* Биты, которым не соответствуют выходы цепочек, отбрасываем */
+  unsigned bits = parport->shift_chains * parport->shift_length;
+  size_t bytes = (bits + 7) / 8;
+  int masked = 0;
+  for(size_t i = 0; i < size; i++)
+  {
+    unsigned char value = vector[i];
+    if (i >= bytes)
+    {
+      masked |= (value != 0);
+      continue;
+    }
+
+    if ((i == bytes - 1) && (bits % 8 != 0))
+    {
+      unsigned char mask = (1 << (bits % 8)) - 1;
+      masked |= ((value & ~mask) != 0);
+      value &= mask;
+    }
+    parport->shift_vector[i] = value;
+  }
+
+  /* Недостающие старшие байты считаем нулевыми */
+  if (size < bytes)
+  {
+    memset(&(parport->shift_vector[size]), 0, bytes - size);
+  }
+
+  if (masked)
+  {
+    log_message(LOG_WARNING, "parport_shift_set: warning, vector is too long, high bits will be masked");
+  }
+
+  return parport_shift_out(parport);
+}
+
+/* Вывод в буфер количества выведенных на цепочки кадров и пропускной способности */
+int parport_shift_stats(parport_t *parport, char *buf, size_t size)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_shift_stats: parport is NULL pointer");
+    return -1;
+  }
+
+  if (buf == NULL)
+  {
+    log_message(LOG_ERR, "parport_shift_stats: buf is NULL pointer");
+    return -1;
+  }
+
+  if (parport->shift_chains == 0)
+  {
+    log_message(LOG_ERR, "parport_shift_stats: parport %s does not drive shift register chains", parport->pathname);
+    return -1;
+  }
+
+  /* Пропускная способность - количество кадров, которое можно вывести
+     за секунду при среднем времени вывода одного кадра */
+  double fps = 0;
+  if (parport->shift_ns > 0)
+  {
+    fps = parport->shift_frames * 1e9 / parport->shift_ns;
+  }
+
+  int n = snprintf(buf, size, "chains=%u length=%u frames=%llu writes=%u fps=%.1f",
+                   parport->shift_chains, parport->shift_length, parport->shift_frames,
+                   2 * parport->shift_length + 1, fps);
+  if ((n < 0) || ((size_t)n >= size))
+  {
+    log_message(LOG_ERR, "parport_shift_stats: buffer is too small");
+    return -1;
+  }
+
+  return n;
+}
+
+/* Вычисление нового состояния width светодиодов в результате выполнения
+   операции над текущим состоянием leds */
+long long leds_calc_wide(long long leds, leds_operation_t operation, long long operand, unsigned width)
+{
+  if ((width < 1) || (width > LEDS_MAX_WIDTH))
+  {
+    log_message(LOG_ERR, "leds_calc_wide: wrong width %u", width);
+    return -1;
+  }
+
+  long long mask = (1LL << width) - 1;
+
+  /* Если для однооперандной операции указано значение операнда, отличное от -1,
+     выводим предупреждение, что он будет проигнорирован */
+  if ((operation == LEDS_GET) || (operation == LEDS_NOT) ||
+       (operation == LEDS_INC) || (operation == LEDS_DEC))
+  { 
+    if (operand != -1)
+    {
+      log_message(LOG_WARNING, "leds_calc_wide: warning, operand for unary operation will be ignored");
+    }
+  }
+  /* В противном случае операнд должен быть положительным */
+  else if (operand < 0)
+  {
+    log_message(LOG_ERR, "leds_calc_wide: operand is negative value");
+    return -1;
+  }
+  /* Если операция - сдвиг, то операнд должен быть меньше ширины, используем только остаток от деления на ширину */
+  else if (((operation == LEDS_RS) || (operation == LEDS_LS) ||
+            (operation == LEDS_RCS) || (operation == LEDS_LCS)) &&
+            (operand >= width))
+  {
+    log_message(LOG_WARNING, "leds_calc_wide: warning, operand is too big, remainder of division by %u will be taken", width);
+    operand = operand % width;
+  }
+  /* В противном случае проверяем, чтобы операнд содержал не более width бит.
+     Значение LEDS_ALL означает все светодиоды и обрезается без предупреждения */
+  else if (operand > mask)
+  {
+    if (operand != LEDS_ALL)
+    {
+      log_message(LOG_WARNING, "leds_calc_wide: warning, operand is too big, high bits will be masked");
+    }
+    operand &= mask;
+  }
+
+  /* Операцию выполняем над беззнаковым 64-битным значением, в котором
+     оставлены только width бит: сдвиги на величину меньше ширины регистра
+     не выходят за 64 бита, а переполнение при сложении и вычитании
+     определено и отбрасывается маской */
+  unsigned long long value = (unsigned long long)leds & (unsigned long long)mask;
+  unsigned long long arg = (unsigned long long)operand & (unsigned long long)mask;
+  unsigned shift = (unsigned)arg;
+
   /* Выполняем запрошенную операцию над текущим состоянием светодиодов */
   switch (operation)
   {
     case LEDS_GET:
-      leds = parport->leds;
+      break;
+    case LEDS_SET:
+      value = arg;
       break;
     case LEDS_NOT:
-      leds = ~parport->leds;
+      value = ~value;
       break;
     case LEDS_OR:
-      leds = parport->leds | operand;
+      value = value | arg;
       break;
     case LEDS_AND:
-      leds = parport->leds & operand;
+      value = value & arg;
       break;
     case LEDS_XOR:
-      leds = parport->leds ^ operand;
+      value = value ^ arg;
       break;
     case LEDS_ADD:
-      leds = parport->leds + operand;
+      value = value + arg;
       break;
     case LEDS_SUB:
-      leds = parport->leds - operand;
+      value = value - arg;
       break;
     case LEDS_INC:
-      leds = parport->leds + 1;
+      value = value + 1;
       break;
     case LEDS_DEC:
-      leds = parport->leds - 1;
+      value = value - 1;
       break;
     case LEDS_RS:
-      leds = parport->leds >> operand;
+      value = value >> shift;
       break;
     case LEDS_LS:
-      leds = parport->leds << operand;
+      value = value << shift;
       break;
+    /* При нулевом сдвиге width - shift равно ширине регистра, что не больше
+       LEDS_MAX_WIDTH и поэтому допустимо для 64-битного значения */
     case LEDS_RCS:
-      leds = (parport->leds >> operand) |
-             (parport->leds << (12 - operand));
+      value = (value >> shift) |
+              (value << (width - shift));
       break;
     case LEDS_LCS:
-      leds = (parport->leds << operand) |
-             (parport->leds >> (12 - operand));
+      value = (value << shift) |
+              (value >> (width - shift));
       break;
     default:
-      log_message(LOG_ERR, "parport_leds_ctl: unknown operation was specified");
+      log_message(LOG_ERR, "leds_calc_wide: unknown operation was specified");
       return -1;
   }
-  /* Все операции выполняются по модулю, оставляем только 12 бит */
-  leds &= 0x0FFF;
 
-  /* Выставляем новое состояние светодиодов на указанном порту */
-  if (parport_leds_set(parport, leds) == -1)
+  /* Все операции выполняются по модулю, оставляем только width бит */
+  return (long long)(value & (unsigned long long)mask);
+}
+
+/* Вычисление нового состояния светодиодов в результате выполнения операции
+   над текущим состоянием. Сами светодиоды при этом не меняются */
+int leds_calc(int leds, leds_operation_t operation, int operand)
+{
+  return (int)leds_calc_wide(leds, operation, operand, 12);
+}
+
+/* Вычисление нового состояния светодиодов сразу для num портов. Состояния
+   хранятся подряд в массиве leds, новые состояния записываются в массив
+   result. Операция выполняется только над портами, у которых select равен -1,
+   остальные состояния копируются без изменений. Возвращает количество портов,
+   состояние которых изменилось */
+int leds_calc_bulk(const int *leds, int *result, const int *select, unsigned num,
+                   leds_operation_t operation, int operand)
+{
+  if ((leds == NULL) || (result == NULL) || (select == NULL))
+  {
+    log_message(LOG_ERR, "leds_calc_bulk: leds, result or select is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем операнд один раз для всех портов, как это делает leds_calc */
+  if ((operation == LEDS_GET) || (operation == LEDS_NOT) ||
+       (operation == LEDS_INC) || (operation == LEDS_DEC))
+  {
+    operand = -1;
+  }
+  else if (operand < 0)
   {
-    log_message(LOG_ERR, "parport_leds_ctl: failed to set new state of leds");
+    log_message(LOG_ERR, "leds_calc_bulk: operand is negative value");
     return -1;
   }
+  else if ((operation == LEDS_RS) || (operation == LEDS_LS) ||
+           (operation == LEDS_RCS) || (operation == LEDS_LCS))
+  {
+    if (operand >= 12)
+    {
+      log_message(LOG_WARNING, "leds_calc_bulk: warning, operand is too big, remainder of division by 12 will be taken");
+      operand = operand % 12;
+    }
+  }
+  else if (operand > 0x0FFF)
+  {
+    log_message(LOG_WARNING, "leds_calc_bulk: warning, operand is too big, high bits will be masked");
+    operand &= 0x0FFF;
+  }
+
+  if (operation > LEDS_LCS)
+  {
+    log_message(LOG_ERR, "leds_calc_bulk: unknown operation was specified");
+    return -1;
+  }
+
+  int changed = 0;
+  unsigned i = 0;
+
+#ifdef __SSE2__
+  /* Обрабатываем по 4 порта за раз. Состояние каждого порта занимает 32-битную
+     ячейку, поэтому все операции выполняются над ячейками независимо */
+  const __m128i mask = _mm_set1_epi32(0x0FFF);
+  const __m128i value = _mm_set1_epi32(operand);
+  const __m128i count = _mm_cvtsi32_si128(operand);
+  const __m128i rest = _mm_cvtsi32_si128(12 - operand);
+  const __m128i one = _mm_set1_epi32(1);
+
+  for(; i + 4 <= num; i += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)&(leds[i]));
+    __m128i r;
+
+    switch (operation)
+    {
+      case LEDS_SET:
+        r = value;
+        break;
+      case LEDS_NOT:
+        r = _mm_xor_si128(v, mask);
+        break;
+      case LEDS_OR:
+        r = _mm_or_si128(v, value);
+        break;
+      case LEDS_AND:
+        r = _mm_and_si128(v, value);
+        break;
+      case LEDS_XOR:
+        r = _mm_xor_si128(v, value);
+        break;
+      case LEDS_ADD:
+        r = _mm_add_epi32(v, value);
+        break;
+      case LEDS_SUB:
+        r = _mm_sub_epi32(v, value);
+        break;
+      case LEDS_INC:
+        r = _mm_add_epi32(v, one);
+        break;
+      case LEDS_DEC:
+        r = _mm_sub_epi32(v, one);
+        break;
+      case LEDS_RS:
+        r = _mm_srl_epi32(v, count);
+        break;
+      case LEDS_LS:
+        r = _mm_sll_epi32(v, count);
+        break;
+      case LEDS_RCS:
+        r = _mm_or_si128(_mm_srl_epi32(v, count), _mm_sll_epi32(v, rest));
+        break;
+      case LEDS_LCS:
+        r = _mm_or_si128(_mm_sll_epi32(v, count), _mm_srl_epi32(v, rest));
+        break;
+      default:
+        r = v;
+        break;
+    }
+    r = _mm_and_si128(r, mask);
+
+    /* Невыбранные порты сохраняют прежнее состояние */
+    __m128i s = _mm_loadu_si128((const __m128i *)&(select[i]));
+    r = _mm_or_si128(_mm_and_si128(s, r), _mm_andnot_si128(s, v));
+    _mm_storeu_si128((__m128i *)&(result[i]), r);
+
+    /* Изменившиеся порты находим сравнением старых и новых состояний */
+    int same = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(r, v)));
+    changed += 4 - __builtin_popcount(same);
+  }
+#endif
+
+  /* Оставшиеся порты, или все порты без SSE2, обрабатываем по одному */
+  for(; i < num; i++)
+  {
+    result[i] = (select[i] == -1) ? leds_calc(leds[i], operation, operand) : leds[i];
+    if (result[i] != leds[i])
+    {
+      changed++;
+    }
+  }
+
+  return changed;
+}
+
+/* Функция для манипуляции над светодиодами на параллельном порту */
+int parport_leds_ctl(parport_t *parport, leds_operation_t operation, int operand)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "parport_leds_ctl: parport is NULL pointer");
+    return -1;
+  }
+
+  /* Все команды, кроме установки нового состояния, используют текущее
+     состояние светодиодов, узнаём его */
+  int leds = 0;
+  if (operation != LEDS_SET)
+  {
+    leds = parport_leds_get(parport);
+    if (leds == -1)
+    {
+      log_message(LOG_ERR, "parport_leds_ctl: failed to get current state of leds");
+      return -1;
+    }
+  }
+
+  /* Вычисляем новое состояние светодиодов */
+  leds = leds_calc(leds, operation, operand);
+  if (leds == -1)
+  {
+    log_message(LOG_ERR, "parport_leds_ctl: leds_calc failed");
+    return -1;
+  }
+
+  /* Выставляем новое состояние светодиодов на указанном порту */
+  if (operation != LEDS_GET)
+  {
+    if (parport_leds_set(parport, leds) == -1)
+    {
+      log_message(LOG_ERR, "parport_leds_ctl: failed to set new state of leds");
+      return -1;
+    }
+  }
 
   return leds;
 }
@@ -5,9 +5,77 @@
 struct parport_s;
 typedef struct parport_s parport_t;
 
+/* Состояние параллельного порта */
+typedef enum parport_state_e
+{
+  PARPORT_READY,    /* Порт открыт и готов к работе */
+  PARPORT_DEGRADED  /* Порт не открыт, ожидается повторная попытка открыть его */
+} parport_state_t;
+
+/* Порядок записи регистров данных и управления, если при изменении состояния
+   светодиодов меняются оба регистра. Между двумя записями светодиоды
+   показывают промежуточное состояние из старых и новых значений */
+typedef enum parport_order_e
+{
+  ORDER_DATA_FIRST,    /* Сначала регистр данных, затем регистр управления */
+  ORDER_CONTROL_FIRST, /* Сначала регистр управления, затем регистр данных */
+  ORDER_AUTO           /* Первым записывается регистр, в котором меняется
+                          больше светодиодов */
+} parport_order_t;
+
+/* Количество корзин в распределении промежутков между записями регистров */
+#define PARPORT_GAP_BUCKETS 32
+
 /* Подготовка структуры с информацией о параллельном порте */
 parport_t *parport_prepare(const char *pathname);
 
+/* Перенос кэша светодиодов и последних записанных значений регистров порта
+   в ячейки массивов каталога портов */
+int parport_bind(parport_t *parport, int *leds, int *data, int *control);
+
+/* Выбор порядка записи регистров данных и управления */
+int parport_set_order(parport_t *parport, parport_order_t order);
+
+/* Включение или выключение измерения промежутков между записями регистров */
+int parport_set_measure(parport_t *parport, int measure);
+
+/* Вывод в буфер статистики записей регистров и распределения промежутков
+   между записями регистров данных и управления. Возвращает количество
+   выведенных символов */
+int parport_gaps(parport_t *parport, char *buf, size_t size);
+
+/* Режим цепочек сдвиговых регистров 74HC595.
+
+   К линиям D0-D5 порта подключаются последовательные входы до 6 цепочек
+   сдвиговых регистров, к линии D6 - входы защёлок всех регистров, к линии D7 -
+   тактовые входы всех регистров. Все цепочки имеют одинаковую длину и
+   заполняются параллельно, а новое состояние выходов переносится на выходы
+   всех регистров одновременно. В этом режиме операции над светодиодами порта
+   недоступны */
+#define PARPORT_SHIFT_CHAINS 6
+
+/* Наибольшее общее количество выходов во всех цепочках */
+#define PARPORT_SHIFT_MAX_BITS 768
+
+/* Включение режима цепочек сдвиговых регистров: chains цепочек по length бит */
+int parport_set_shift(parport_t *parport, unsigned chains, unsigned length);
+
+/* Возвращает общее количество бит во всех цепочках сдвиговых регистров
+   или 0, если режим цепочек не включен */
+unsigned parport_shift_bits(parport_t *parport);
+
+/* Вывод текущего состояния выходов на цепочки сдвиговых регистров */
+int parport_shift_out(parport_t *parport);
+
+/* Запись нового состояния выходов цепочек сдвиговых регистров и вывод его
+   на цепочки. Вектор из size байт задаётся в порядке от младших байтов
+   к старшим, бит k вектора соответствует выходу k % length цепочки k / length */
+int parport_shift_set(parport_t *parport, const unsigned char *vector, size_t size);
+
+/* Вывод в буфер количества выведенных на цепочки кадров, количества записей
+   в регистр данных на кадр и пропускной способности в кадрах в секунду */
+int parport_shift_stats(parport_t *parport, char *buf, size_t size);
+
 /* Открытие файла устройства параллельного порта, подготовка порта к работе.
 
    Эта операция вынесена в отдельную функцию для того, чтобы отделить
@@ -15,12 +83,67 @@ parport_t *parport_prepare(const char *pathname);
 
    Подготовка списка осуществляется ведущим процессом до демонизации,
    открытие портов осуществляется ведомым процессом до сброса привилегий,
-   использование портов осуществляется ведомым процессом после сброса привилегий. */
+   использование портов осуществляется ведомым процессом после сброса привилегий.
+
+   Если открыть порт не удалось, то порт переходит в деградировавшее состояние,
+   а время следующей попытки открыть порт откладывается с экспоненциально
+   растущей задержкой. */
 int parport_open(parport_t *parport);
 
+/* Возвращает время следующей попытки открыть порт в миллисекундах
+   монотонных часов или -1, если порт готов к работе */
+long long parport_retry_time(parport_t *parport);
+
+/* Перевод порта в деградировавшее состояние: файл устройства закрывается,
+   а следующая попытка открыть порт откладывается на удвоенное время.
+   Используется, когда об ошибке порта сообщил поток драйвера */
+void parport_degrade(parport_t *parport);
+
+/* Повторная попытка открыть деградировавший порт, если время попытки уже
+   наступило. После открытия на порту восстанавливается последнее известное
+   состояние светодиодов. Если порт уже готов к работе, то возвращается 0 */
+int parport_reopen(parport_t *parport);
+
+/* Возвращает файловый дескриптор открытого порта или -1, если порт не готов
+   к работе. Дескриптор становится доступным для чтения, когда драйвер
+   получает прерывание от порта по фронту сигнала на линии ACK */
+int parport_fd(parport_t *parport);
+
+/* Чтение линий состояния порта по файловому дескриптору. Возвращает те же
+   биты, что и parport_status, но не меняет состояния порта и не пишет
+   в журнал, поэтому может вызываться из других потоков */
+int parport_read_status(int fd);
+
+/* Чтение состояния линий состояния порта. Возвращает уровни линий в битах:
+   0 - ERROR, 1 - SELECT, 2 - PAPEROUT, 3 - ACK, 4 - BUSY */
+int parport_status(parport_t *parport);
+
+/* Снятие накопленных драйвером прерываний порта. Возвращает количество
+   прерываний с момента предыдущего снятия */
+int parport_irq_clear(parport_t *parport);
+
 /* Закрытие файла устройства параллельного порта */
 int parport_close(parport_t *parport);
 
+/* Закрытие файла устройства без освобождения структуры порта. Порт остаётся
+   в деградировавшем состоянии, пока не будет снова открыт parport_open */
+int parport_release(parport_t *parport);
+
+/* Принятие уже открытого и захваченного файла устройства порта fd вместо
+   открытия порта, например, переданного предыдущей версией программы при
+   обновлении. Регистры порта не записываются, поэтому светодиоды остаются
+   в прежнем состоянии, а кэш светодиодов заполняется значением leds или
+   сбрасывается, если leds равно -1 */
+int parport_adopt(parport_t *parport, int fd, int leds);
+
+/* Количество записей в регистры (ioctl), количество обновлений состояния
+   светодиодов с записью регистров и суммарное время этих обновлений, нс */
+int parport_write_stats(parport_t *parport, unsigned long long *writes,
+                        unsigned long long *calls, long long *ns);
+
+/* Возвращает путь к файлу устройства порта */
+const char *parport_pathname(parport_t *parport);
+
 /* Варианты операций над текущим состоянием светодиодов */
 typedef enum leds_operation_e
 {
@@ -40,7 +163,49 @@ typedef enum leds_operation_e
   LEDS_LCS  /* Циклический сдвиг влево */
 } leds_operation_t;
 
-/* Функция для манипуляции над светодиодами на параллельном порту */
+/* Наибольшая ширина логического регистра светодиодов */
+#define LEDS_MAX_WIDTH 48
+
+/* Операнд, означающий все светодиоды логического регистра любой ширины */
+#define LEDS_ALL 0xFFFFFFFFFFFFLL
+
+/* Вычисление нового состояния светодиодов в результате выполнения операции
+   над текущим состоянием leds. Сами светодиоды при этом не меняются */
+int leds_calc(int leds, leds_operation_t operation, int operand);
+
+/* Вычисление нового состояния логического регистра из width светодиодов,
+   от 1 до LEDS_MAX_WIDTH. Сдвиги и операции по модулю выполняются
+   над всей шириной регистра */
+long long leds_calc_wide(long long leds, leds_operation_t operation, long long operand, unsigned width);
+
+/* Вычисление нового состояния светодиодов сразу для num портов, состояния
+   которых хранятся подряд в массиве leds. Операция выполняется только над
+   портами, у которых select равен -1. На процессорах с SSE2 состояния
+   обрабатываются по 4 за раз. Возвращает количество изменившихся портов */
+int leds_calc_bulk(const int *leds, int *result, const int *select, unsigned num,
+                   leds_operation_t operation, int operand);
+
+/* Вычисление значения регистра управления для старших 4 светодиодов */
+unsigned char leds_control(unsigned leds);
+
+/* Запись регистров данных и управления в обход кэша светодиодов. Если значение
+   регистра равно -1, то регистр не записывается. Используется драйверами,
+   которые сами управляют линиями порта из отдельного потока, поэтому при
+   ошибке порт не переводится в деградировавшее состояние: об ошибке драйвер
+   сообщает циклу обработки событий */
+int parport_write_raw(parport_t *parport, int data, int control);
+
+/* Выставление активности светодиодов на параллельном порту */
+int parport_leds_set(parport_t *parport, unsigned leds);
+
+/* Получение состояния активности светодиодов на параллельном порту */
+int parport_leds_get(parport_t *parport);
+
+/* Функция для манипуляции над светодиодами на параллельном порту.
+
+   Если порт находится в деградировавшем состоянии, то функция сразу возвращает
+   ошибку, не пытаясь открыть порт. Если при обращении к порту произошла ошибка,
+   то порт переводится в деградировавшее состояние */
 int parport_leds_ctl(parport_t *parport, leds_operation_t operation, int operand);
 
 #endif
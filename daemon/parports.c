@@ -1,16 +1,151 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 
 #include "daemon.h"
+#include "timer.h"
+#include "matrix.h"
+#include "lcd.h"
+#include "sampler.h"
 #include "parports.h"
 
+/* Данные сокета прерываний порта */
+typedef struct input_s
+{
+  parports_t *parports; /* Каталог, которому принадлежит порт */
+  unsigned parport;     /* Номер порта в каталоге */
+  int fd;               /* Копия файлового дескриптора порта, отслеживаемая epoll */
+  socket_t *socket;     /* Сокет в цикле обработки событий */
+} input_t;
+
+/* Виртуальный порт - логический регистр светодиодов, биты которого
+   распределены по линиям нескольких физических портов, или группа зеркальных
+   портов, на которые выводится одно и то же состояние светодиодов */
+typedef struct virtual_s
+{
+  unsigned width;                 /* Ширина логического регистра */
+  unsigned mirror;                /* Количество портов в группе зеркальных
+                                     портов или 0 для логического регистра */
+  unsigned port[LEDS_MAX_WIDTH];  /* Физический порт каждого бита регистра
+                                     или порты группы, начиная с основного */
+  unsigned char bit[LEDS_MAX_WIDTH]; /* Номер светодиода физического порта */
+} virtual_t;
+
+/* Запись хеш-таблицы имён портов */
+typedef struct name_s
+{
+  char *name;           /* Имя порта или NULL для свободной записи */
+  unsigned parport;     /* Номер физического порта или номер виртуального
+                           порта среди виртуальных портов */
+  int virtual;          /* Признак того, что имя принадлежит виртуальному порту */
+} name_t;
+
+/* Открытый порт, переданный предыдущей версией программы при обновлении */
+typedef struct adopt_s
+{
+  char *pathname;       /* Путь к файлу устройства порта */
+  int fd;               /* Открытый и захваченный файл устройства */
+  int leds;             /* Состояние светодиодов или -1, если оно не известно */
+} adopt_t;
+
 struct parports_s
 {
   unsigned num;         /* Количество портов в таблице */
   unsigned max;         /* Количество записей в таблице */
   parport_t **parports; /* Таблица портов */
+  int timer;            /* Файловый дескриптор таймера повторного открытия
+                           портов и вывода кадров или -1, если таймер не создан */
+
+  long long refresh;    /* Период вывода кадров в мс или 0, если кадровый
+                           режим выключен */
+  long long flush_time; /* Время вывода последнего кадра, мс */
+  int *back;            /* Задний буфер - состояния светодиодов в следующем
+                           кадре или -1, если состояние ещё не известно */
+  unsigned char *marked; /* Признаки портов, изменённых в следующем кадре */
+  unsigned *dirty;      /* Номера портов, изменённых в следующем кадре */
+  unsigned dirty_num;   /* Количество изменённых портов */
+  matrix_t **matrix;    /* Драйверы светодиодных матриц или NULL для портов,
+                           к которым матрица не подключена */
+  lcd_t **lcd;          /* Драйверы символьных индикаторов или NULL для портов,
+                           к которым индикатор не подключен */
+
+  evloop_t *evloop;     /* Цикл обработки событий с таймером каталога или NULL */
+  long long debounce;   /* Время успокоения линий состояния после прерывания, мс */
+  int (*publish)(const char *message, void *data); /* Рассылка событий подписчикам */
+  void *publish_data;   /* Данные для функции рассылки событий */
+  unsigned char *input; /* Признаки портов, линии состояния которых отслеживаются */
+  input_t **inputs;     /* Сокеты прерываний портов или NULL */
+  int *input_status;    /* Последнее разосланное состояние линий или -1 */
+  long long *input_time; /* Время окончания успокоения линий или -1 */
+
+  sampler_t **sampler;  /* Захваты линий состояния или NULL для портов,
+                           на которых захват не включен */
+  int (**capture_done)(void *data); /* Функции, вызываемые по окончании захвата, или NULL */
+  void **capture_data;  /* Данные для функций окончания захвата */
+  int capture_fd;       /* Дескриптор eventfd, через который потоки захвата
+                           сообщают об окончании захвата, а потоки развёртки
+                           матриц и вывода на индикаторы - об ошибках записи
+                           в порт, или -1 */
+
+  unsigned char *counter; /* Признаки портов, импульсы на линии ACK которых
+                           считаются и рассылаются подписчикам */
+  unsigned long long *count; /* Счётчики прерываний по линии ACK */
+  unsigned long long *count_prev; /* Значения счётчиков при предыдущей рассылке */
+  long long count_time; /* Время следующего снятия счётчиков, мс, или -1 */
+  long long count_prev_time; /* Время предыдущего снятия счётчиков, мс */
+
+  /* Кэши состояний светодиодов и последние записанные значения регистров
+     всех портов. Порты ссылаются на свои ячейки этих массивов, поэтому
+     групповая операция вычисляет новые состояния прямо над массивом leds */
+  int *leds;            /* Состояния светодиодов портов или -1 */
+  int *data;            /* Значения регистров данных портов или -1 */
+  int *control;         /* Значения регистров управления портов или -1 */
+
+  int *bulk_next;       /* Новые состояния светодиодов после групповой операции */
+  int *bulk_select;     /* Признаки портов, выбранных для групповой операции:
+                           -1 - порт выбран, 0 - не выбран */
+
+  virtual_t *virtual;   /* Виртуальные порты, нумеруются вслед за физическими */
+  unsigned virtual_num; /* Количество виртуальных портов */
+  int last_virtual;     /* Признак того, что последним в каталог был добавлен
+                           виртуальный порт, а не физический */
+
+  char *reload_pathname; /* Файл со списком портов, перечитываемый по сигналу
+                           HUP, или NULL */
+  int reload_fd;        /* Дескриптор signalfd для сигнала HUP или -1 */
+  unsigned char *listed; /* Признаки портов, взятых из файла со списком портов */
+  unsigned char *removed; /* Признаки портов, удалённых из файла со списком
+                           портов. Номера удалённых портов не занимаются
+                           другими портами, чтобы номера остальных портов
+                           не менялись */
+  parport_order_t order; /* Порядок записи регистров для новых портов */
+  int measure;          /* Признак измерения промежутков для новых портов */
+
+  adopt_t *adopt;       /* Переданные порты, ещё не занятые портами каталога */
+  unsigned adopt_num;   /* Количество переданных портов */
+
+  name_t *names;        /* Хеш-таблица имён портов с открытой адресацией */
+  unsigned names_size;  /* Количество записей в хеш-таблице, степень двойки */
+  unsigned names_num;   /* Количество занятых записей в хеш-таблице */
 };
 
+/* Начальный размер хеш-таблицы имён портов */
+#define PARPORTS_NAMES_MIN 64
+
+/* Наибольшая длина имени порта */
+#define PARPORTS_NAME_MAX 64
+
+/* Период снятия и рассылки счётчиков импульсов, мс */
+#define PARPORTS_COUNT_PERIOD 1000
+
 /* С этим шагом будет расти размер таблицы портов */
 #define PARPORTS_CLUSTER 16
 
@@ -29,6 +164,51 @@ parports_t *parports_create()
   parports->num = 0;
   parports->max = 0;
   parports->parports = NULL;
+  parports->timer = -1;
+  parports->refresh = 0;
+  parports->flush_time = 0;
+  parports->back = NULL;
+  parports->marked = NULL;
+  parports->dirty = NULL;
+  parports->dirty_num = 0;
+  parports->matrix = NULL;
+  parports->lcd = NULL;
+  parports->evloop = NULL;
+  parports->debounce = 20;
+  parports->publish = NULL;
+  parports->publish_data = NULL;
+  parports->input = NULL;
+  parports->inputs = NULL;
+  parports->input_status = NULL;
+  parports->input_time = NULL;
+  parports->sampler = NULL;
+  parports->capture_done = NULL;
+  parports->capture_data = NULL;
+  parports->capture_fd = -1;
+  parports->counter = NULL;
+  parports->count = NULL;
+  parports->count_prev = NULL;
+  parports->leds = NULL;
+  parports->data = NULL;
+  parports->control = NULL;
+  parports->bulk_next = NULL;
+  parports->bulk_select = NULL;
+  parports->count_time = -1;
+  parports->count_prev_time = 0;
+  parports->virtual = NULL;
+  parports->virtual_num = 0;
+  parports->last_virtual = 0;
+  parports->reload_pathname = NULL;
+  parports->reload_fd = -1;
+  parports->listed = NULL;
+  parports->removed = NULL;
+  parports->order = ORDER_DATA_FIRST;
+  parports->measure = 0;
+  parports->adopt = NULL;
+  parports->adopt_num = 0;
+  parports->names = NULL;
+  parports->names_size = 0;
+  parports->names_num = 0;
   return parports;
 }
 
@@ -63,8 +243,189 @@ int parports_realloc(parports_t *parports, unsigned number)
     return -1;
   }
 
-  /* Запоминаем новый указатель на таблицу портов и её новый размер */
   parports->parports = new;
+
+  /* Пытаемся поменять размер заднего буфера и списка изменённых портов */
+  int *back = realloc(parports->back, sizeof(int) * number);
+  if (back == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for back buffer");
+    return -1;
+  }
+  parports->back = back;
+
+  unsigned char *marked = realloc(parports->marked, sizeof(unsigned char) * number);
+  if (marked == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for marks");
+    return -1;
+  }
+  parports->marked = marked;
+
+  unsigned *dirty = realloc(parports->dirty, sizeof(unsigned) * number);
+  if (dirty == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for dirty list");
+    return -1;
+  }
+  parports->dirty = dirty;
+
+  matrix_t **matrix = realloc(parports->matrix, sizeof(matrix_t *) * number);
+  if (matrix == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for matrices");
+    return -1;
+  }
+  parports->matrix = matrix;
+
+  lcd_t **lcd = realloc(parports->lcd, sizeof(lcd_t *) * number);
+  if (lcd == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for lcds");
+    return -1;
+  }
+  parports->lcd = lcd;
+
+  unsigned char *input = realloc(parports->input, sizeof(unsigned char) * number);
+  if (input == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for input flags");
+    return -1;
+  }
+  parports->input = input;
+
+  input_t **inputs = realloc(parports->inputs, sizeof(input_t *) * number);
+  if (inputs == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for input sockets");
+    return -1;
+  }
+  parports->inputs = inputs;
+
+  int *input_status = realloc(parports->input_status, sizeof(int) * number);
+  if (input_status == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for input status");
+    return -1;
+  }
+  parports->input_status = input_status;
+
+  long long *input_time = realloc(parports->input_time, sizeof(long long) * number);
+  if (input_time == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for input times");
+    return -1;
+  }
+  parports->input_time = input_time;
+
+  sampler_t **sampler = realloc(parports->sampler, sizeof(sampler_t *) * number);
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for samplers");
+    return -1;
+  }
+  parports->sampler = sampler;
+
+  int (**capture_done)(void *data) = realloc(parports->capture_done, sizeof(*capture_done) * number);
+  if (capture_done == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for capture callbacks");
+    return -1;
+  }
+  parports->capture_done = capture_done;
+
+  void **capture_data = realloc(parports->capture_data, sizeof(void *) * number);
+  if (capture_data == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for capture callback data");
+    return -1;
+  }
+  parports->capture_data = capture_data;
+
+  unsigned char *counter = realloc(parports->counter, sizeof(unsigned char) * number);
+  if (counter == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for counter flags");
+    return -1;
+  }
+  parports->counter = counter;
+
+  unsigned long long *count = realloc(parports->count, sizeof(unsigned long long) * number);
+  if (count == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for counters");
+    return -1;
+  }
+  parports->count = count;
+
+  unsigned long long *count_prev = realloc(parports->count_prev, sizeof(unsigned long long) * number);
+  if (count_prev == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for previous counters");
+    return -1;
+  }
+  parports->count_prev = count_prev;
+
+  /* Порты ссылаются на ячейки массивов состояний, поэтому массивы не
+     перераспределяются на месте: порты переносятся в новые массивы,
+     и только после этого старые массивы освобождаются */
+  int *leds = malloc(sizeof(int) * number);
+  int *data = malloc(sizeof(int) * number);
+  int *control = malloc(sizeof(int) * number);
+  if ((leds == NULL) || (data == NULL) || (control == NULL))
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to allocate memory for port states");
+    free(leds);
+    free(data);
+    free(control);
+    return -1;
+  }
+
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    parport_bind(parports->parports[i], &(leds[i]), &(data[i]), &(control[i]));
+  }
+
+  free(parports->leds);
+  free(parports->data);
+  free(parports->control);
+  parports->leds = leds;
+  parports->data = data;
+  parports->control = control;
+
+  int *bulk_next = realloc(parports->bulk_next, sizeof(int) * number);
+  if (bulk_next == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for bulk results");
+    return -1;
+  }
+  parports->bulk_next = bulk_next;
+
+  int *bulk_select = realloc(parports->bulk_select, sizeof(int) * number);
+  if (bulk_select == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for bulk selection");
+    return -1;
+  }
+  parports->bulk_select = bulk_select;
+
+  unsigned char *listed = realloc(parports->listed, sizeof(unsigned char) * number);
+  if (listed == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for listed flags");
+    return -1;
+  }
+  parports->listed = listed;
+
+  unsigned char *removed = realloc(parports->removed, sizeof(unsigned char) * number);
+  if (removed == NULL)
+  {
+    log_message(LOG_ERR, "parports_realloc: failed to reallocate memory for removed flags");
+    return -1;
+  }
+  parports->removed = removed;
+
+  /* Запоминаем новый размер таблицы */
   parports->max = number;
   return 0;
 }
@@ -101,6 +462,32 @@ int parports_add(parports_t *parports, const char *pathname)
     log_message(LOG_ERR, "parports_add: failed to add parport");
     return -1;
   }
+  parports->back[parports->num] = -1;
+  parports->marked[parports->num] = 0;
+  parports->matrix[parports->num] = NULL;
+  parports->lcd[parports->num] = NULL;
+  parports->input[parports->num] = 0;
+  parports->inputs[parports->num] = NULL;
+  parports->input_status[parports->num] = -1;
+  parports->input_time[parports->num] = -1;
+  parports->sampler[parports->num] = NULL;
+  parports->capture_done[parports->num] = NULL;
+  parports->capture_data[parports->num] = NULL;
+  parports->counter[parports->num] = 0;
+  parports->count[parports->num] = 0;
+  parports->count_prev[parports->num] = 0;
+  parports->last_virtual = 0;
+  if (parport_bind(parports->parports[parports->num], &(parports->leds[parports->num]),
+                   &(parports->data[parports->num]), &(parports->control[parports->num])) == -1)
+  {
+    log_message(LOG_ERR, "parports_add: failed to bind parport");
+    parport_close(parports->parports[parports->num]);
+    return -1;
+  }
+  parports->bulk_next[parports->num] = -1;
+  parports->bulk_select[parports->num] = 0;
+  parports->listed[parports->num] = 0;
+  parports->removed[parports->num] = 0;
   parports->num++;
 
   return 0;
@@ -118,97 +505,3319 @@ int parports_number(parports_t *parports)
   return parports->num;
 }
 
-/* Открыть все порты в каталоге */
-int parports_open(parports_t *parports)
+/* Возвращает 1, если линиями порта управляет драйвер подключенного к нему
+   устройства: матрицы, цепочек сдвиговых регистров или индикатора */
+int parports_driven(parports_t *parports, const unsigned parport)
+{
+  return (parports->matrix[parport] != NULL) ||
+         (parports->lcd[parport] != NULL) ||
+         (parport_shift_bits(parports->parports[parport]) > 0);
+}
+
+/* Запомнить открытый порт, переданный предыдущей версией программы.
+   Порт займёт порт каталога с тем же путём при открытии портов */
+int parports_adopt(parports_t *parports, const char *pathname, int fd, int leds)
 {
   if (parports == NULL)
   {
-    log_message(LOG_ERR, "parports_open: parports is NULL pointer");
+    log_message(LOG_ERR, "parports_adopt: parports is NULL pointer");
     return -1;
   }
 
-  /* Перебираем записи в таблице портов */
-  for(unsigned i = 0; i < parports->num; i++)
+  if (pathname == NULL)
   {
-    /* Пытаемся открыть порт. Если не получилось, то сообщаем об ошибке */
-    if (parport_open(parports->parports[i]) == -1)
+    log_message(LOG_ERR, "parports_adopt: pathname is NULL pointer");
+    return -1;
+  }
+
+  adopt_t *adopt = realloc(parports->adopt, sizeof(adopt_t) * (parports->adopt_num + 1));
+  if (adopt == NULL)
+  {
+    log_message(LOG_ERR, "parports_adopt: failed to allocate memory for adopted parport");
+    return -1;
+  }
+  parports->adopt = adopt;
+
+  adopt[parports->adopt_num].pathname = strdup(pathname);
+  if (adopt[parports->adopt_num].pathname == NULL)
+  {
+    log_message(LOG_ERR, "parports_adopt: failed to allocate memory for pathname");
+    return -1;
+  }
+  adopt[parports->adopt_num].fd = fd;
+  adopt[parports->adopt_num].leds = leds;
+  parports->adopt_num++;
+  return 0;
+}
+
+/* Занять порт каталога переданным портом с тем же путём. Возвращает 1,
+   если порт занят, и 0, если подходящего переданного порта нет */
+int parports_adopt_take(parports_t *parports, const unsigned parport)
+{
+  const char *pathname = parport_pathname(parports->parports[parport]);
+  for(unsigned k = 0; k < parports->adopt_num; k++)
+  {
+    adopt_t *adopt = &(parports->adopt[k]);
+    if (strcmp(adopt->pathname, pathname) != 0)
     {
-      log_message(LOG_ERR, "parports_open: cannot open parport %d", i);
-      return -1;
+      continue;
     }
 
-    /* На секунду включаем все светодиоды на открытом порту,
-       чтобы обозначить их исправность */
-    if (parports_leds_ctl(parports, i, LEDS_SET, 0xFFF) == -1)
+    int taken = (parport_adopt(parports->parports[parport], adopt->fd, adopt->leds) == 0);
+    if (!taken && (close(adopt->fd) == -1))
     {
-      log_message(LOG_WARNING, "parports_open: warning, failed to set all leds");
+      log_error(LOG_WARNING, "parports_adopt_take: warning, failed to close adopted parport %s", pathname);
     }
-    sleep(1);
-    if (parports_leds_ctl(parports, i, LEDS_SET, 0) == -1)
+
+    free(adopt->pathname);
+    parports->adopt[k] = parports->adopt[parports->adopt_num - 1];
+    parports->adopt_num--;
+
+    if (taken)
     {
-      log_message(LOG_WARNING, "parports_open: warning, failed to reset all leds");
+      log_message(LOG_INFO, "parports_adopt_take: parport %d is adopted from previous version", parport);
+    }
+    return taken;
+  }
+  return 0;
+}
+
+/* Закрыть переданные порты, не занятые портами каталога */
+void parports_adopt_drop(parports_t *parports)
+{
+  for(unsigned k = 0; k < parports->adopt_num; k++)
+  {
+    log_message(LOG_WARNING, "parports_adopt_drop: warning, adopted parport %s is not in catalog, closing it",
+                parports->adopt[k].pathname);
+    if (close(parports->adopt[k].fd) == -1)
+    {
+      log_error(LOG_WARNING, "parports_adopt_drop: warning, failed to close adopted parport");
     }
+    free(parports->adopt[k].pathname);
+  }
+
+  free(parports->adopt);
+  parports->adopt = NULL;
+  parports->adopt_num = 0;
+}
+
+/* Получить путь, дескриптор открытого файла устройства и состояние
+   светодиодов порта для передачи новой версии программы. Возвращает -1,
+   если порт не открыт */
+int parports_snapshot(parports_t *parports, const unsigned parport,
+                      const char **pathname, int *fd, int *leds)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_snapshot: parports is NULL pointer");
+    return -1;
+  }
+
+  if ((pathname == NULL) || (fd == NULL) || (leds == NULL))
+  {
+    log_message(LOG_ERR, "parports_snapshot: pathname, fd or leds is NULL pointer");
+    return -1;
+  }
+
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_snapshot: no parport with index %d", parport);
+    return -1;
   }
 
+  parport_t *p = parports->parports[parport];
+  *fd = parport_fd(p);
+  if (*fd == -1)
+  {
+    return -1;
+  }
+
+  *pathname = parport_pathname(p);
+
+  /* Состояние светодиодов портов, линиями которых управляют драйверы
+     устройств, новая версия программы прочитает из порта сама */
+  *leds = parports_driven(parports, parport) ? -1 : parport_leds_get(p);
   return 0;
 }
 
-/* Закрыть все порты в таблице, удалить каталог портов */
-int parports_destroy(parports_t *parports)
+/* Путь к файлу устройства порта и статистика записей в его регистры */
+int parports_write_stats(parports_t *parports, const unsigned parport, const char **pathname,
+                         unsigned long long *writes, unsigned long long *calls, long long *ns)
 {
   if (parports == NULL)
   {
-    log_message(LOG_ERR, "parports_destroy: warning, parports is NULL pointer");
+    log_message(LOG_ERR, "parports_write_stats: parports is NULL pointer");
     return -1;
   }
 
-  /* Перебираем порты, закрываем каждый из них */
-  for(unsigned parport = 0; parport < parports->num; parport++)
+  if (pathname == NULL)
   {
-    if (parports->parports[parport] != NULL)
+    log_message(LOG_ERR, "parports_write_stats: pathname is NULL pointer");
+    return -1;
+  }
+
+  /* Порты другого шарда пропускаются без сообщения об ошибке */
+  if ((parport >= parports->num) || parports->removed[parport])
+  {
+    return -1;
+  }
+
+  parport_t *p = parports->parports[parport];
+  *pathname = parport_pathname(p);
+  return parport_write_stats(p, writes, calls, ns);
+}
+
+/* Открыть все порты в каталоге */
+int parports_open(parports_t *parports)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_open: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Перебираем записи в таблице портов */
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    /* Порт обслуживается ведомым процессом другого шарда */
+    if (parports->removed[i])
     {
-      if (parport_close(parports->parports[parport]) == -1)
+      continue;
+    }
+
+    /* Порт, переданный предыдущей версией программы, уже открыт и захвачен,
+       а светодиоды на нём горят так, как их оставила предыдущая версия */
+    if (parports_adopt_take(parports, i))
+    {
+      continue;
+    }
+
+    /* Пытаемся открыть порт. Если не получилось, то порт остаётся
+       в деградировавшем состоянии до следующей попытки */
+    if (parport_open(parports->parports[i]) == -1)
+    {
+      log_message(LOG_WARNING, "parports_open: warning, cannot open parport %d, it is degraded", i);
+      continue;
+    }
+
+    /* Выходы цепочек сдвиговых регистров после включения питания не определены,
+       гасим их */
+    if (parport_shift_bits(parports->parports[i]) > 0)
+    {
+      if (parport_shift_out(parports->parports[i]) == -1)
       {
-        log_message(LOG_ERR, "parports_close: warning, failed to close port");
+        log_message(LOG_WARNING, "parports_open: warning, failed to clear shift register chains");
       }
+      continue;
+    }
+
+    /* Индикатор инициализируется при первом выводе на него */
+    if (parports->lcd[i] != NULL)
+    {
+      continue;
+    }
+
+    /* На секунду включаем все светодиоды на открытом порту,
+       чтобы обозначить их исправность */
+    if (parport_leds_ctl(parports->parports[i], LEDS_SET, 0xFFF) == -1)
+    {
+      log_message(LOG_WARNING, "parports_open: warning, failed to set all leds");
+    }
+    sleep(1);
+    if (parport_leds_ctl(parports->parports[i], LEDS_SET, 0) == -1)
+    {
+      log_message(LOG_WARNING, "parports_open: warning, failed to reset all leds");
     }
   }
 
-  /* Освобождаем память из под таблицы портов */
-  if (parports->max > 0)
+  /* Переданные порты, которых больше нет в каталоге, закрываются */
+  parports_adopt_drop(parports);
+
+  /* Запускаем развёртку матриц и потоки вывода на индикаторы. Развёртка
+     матрицы на деградировавшем порту тоже запускается и начнёт выводить
+     строки после открытия порта */
+  for(unsigned i = 0; i < parports->num; i++)
   {
-    free(parports->parports);
-  }
+    if ((parports->matrix[i] != NULL) && !parports->removed[i] &&
+        (matrix_start(parports->matrix[i]) == -1))
+    {
+      log_message(LOG_ERR, "parports_open: failed to start matrix scan on parport %d", i);
+      return -1;
+    }
 
-  /* Освобождаем память из под каталога портов */
-  free(parports);
+    if ((parports->lcd[i] != NULL) && !parports->removed[i] &&
+        (lcd_start(parports->lcd[i]) == -1))
+    {
+      log_message(LOG_ERR, "parports_open: failed to start lcd output on parport %d", i);
+      return -1;
+    }
+  }
 
   return 0;
 }
 
-/* Выполнить указанную операцию над портом из каталога */
-int parports_leds_ctl(parports_t *parports, const unsigned parport, leds_operation_t operation, int operand)
+/* Перевзвести таймер на время ближайшей попытки открыть порт, на время
+   вывода следующего кадра, если в нём есть изменения, на время окончания
+   успокоения линий состояния порта после прерывания или на время снятия
+   счётчиков импульсов. Если ждать нечего, то таймер останавливается */
+int parports_schedule(parports_t *parports)
 {
   if (parports == NULL)
   {
-    log_message(LOG_ERR, "parports_leds_ctl: parports is NULL pointer");
+    log_message(LOG_ERR, "parports_schedule: parports is NULL pointer");
     return -1;
   }
 
-  /* Проверяем, что среди портов имеется порт с указанным номером */
-  if (parport >= parports->num)
+  /* Таймер ещё не создан, порты будут открыты после его создания */
+  if (parports->timer == -1)
   {
-    log_message(LOG_ERR, "parports_leds_ctl: no parport with index %d", parport);
-    return -1;
-  } 
+    return 0;
+  }
 
-  /* Выполняем указанную операцию над портом из таблицы */
-  int leds = parport_leds_ctl(parports->parports[parport], operation, operand);
-  if (leds == -1)
+  /* Ищем ближайшее время повторной попытки открыть порт */
+  long long retry_time = -1;
+  for(unsigned i = 0; i < parports->num; i++)
   {
-    log_message(LOG_ERR, "parports_leds_ctl: failed to execute operation");
-    return -1;
-  }
+    /* Удалённые порты повторно не открываются */
+    if (parports->removed[i])
+    {
+      continue;
+    }
+
+    long long t = parport_retry_time(parports->parports[i]);
+    if ((t != -1) && ((retry_time == -1) || (t < retry_time)))
+    {
+      retry_time = t;
+    }
+  }
+
+  /* Если в следующем кадре есть изменённые порты, то учитываем время его вывода */
+  if (parports->dirty_num > 0)
+  {
+    long long t = parports->flush_time + parports->refresh;
+    if ((retry_time == -1) || (t < retry_time))
+    {
+      retry_time = t;
+    }
+  }
+
+  /* Учитываем время снятия счётчиков импульсов */
+  if ((parports->count_time != -1) && ((retry_time == -1) || (parports->count_time < retry_time)))
+  {
+    retry_time = parports->count_time;
+  }
+
+  /* Учитываем время окончания успокоения линий состояния после прерываний */
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    long long t = parports->input_time[i];
+    if ((t != -1) && ((retry_time == -1) || (t < retry_time)))
+    {
+      retry_time = t;
+    }
+  }
+
+  /* Нулевая задержка останавливает таймер, поэтому уже наступившие
+     попытки откладываем на минимально возможное время */
+  long long msec = 0;
+  if (retry_time != -1)
+  {
+    msec = retry_time - timer_now();
+    if (msec < 1)
+    {
+      msec = 1;
+    }
+  }
+
+  if (timer_arm(parports->timer, msec) == -1)
+  {
+    log_message(LOG_ERR, "parports_schedule: timer_arm failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Отметить порт как изменённый в следующем кадре */
+int parports_mark(parports_t *parports, const unsigned parport)
+{
+  /* Порт уже отмечен */
+  if (parports->marked[parport])
+  {
+    return 0;
+  }
+
+  parports->marked[parport] = 1;
+  parports->dirty[parports->dirty_num] = parport;
+  parports->dirty_num++;
+
+  /* Первое изменение в кадре - взводим таймер на время вывода кадра */
+  if (parports->dirty_num == 1)
+  {
+    if (parports_schedule(parports) == -1)
+    {
+      log_message(LOG_ERR, "parports_mark: parports_schedule failed");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Вывести кадр: записать на порты состояния светодиодов из заднего буфера
+   только для изменённых портов, после чего задний буфер становится текущим
+   состоянием портов */
+int parports_flush(parports_t *parports)
+{
+  int result = 0;
+
+  for(unsigned i = 0; i < parports->dirty_num; i++)
+  {
+    unsigned parport = parports->dirty[i];
+
+    /* Порт удалён из списка портов после изменения */
+    if (parports->removed[parport])
+    {
+      parports->marked[parport] = 0;
+      continue;
+    }
+
+    if (parport_leds_set(parports->parports[parport], parports->back[parport]) == -1)
+    {
+      log_message(LOG_ERR, "parports_flush: failed to set leds on parport %d", parport);
+      result = -1;
+    }
+    parports->marked[parport] = 0;
+  }
+
+  parports->dirty_num = 0;
+  parports->flush_time = timer_now();
+  return result;
+}
+
+/* Добавить к счётчику импульсов порта прерывания, накопленные драйвером.
+   Деградировавший порт пропускается: прерывания, полученные до деградации
+   и после неё, теряются */
+int parports_count_collect(parports_t *parports, const unsigned parport)
+{
+  if (parport_retry_time(parports->parports[parport]) != -1)
+  {
+    return 0;
+  }
+
+  int irqs = parport_irq_clear(parports->parports[parport]);
+  if (irqs == -1)
+  {
+    log_message(LOG_ERR, "parports_count_collect: failed to clear interrupts on parport %d", parport);
+    return -1;
+  }
+
+  parports->count[parport] += irqs;
+  return 0;
+}
+
+/* Снять счётчики импульсов всех портов в режиме счётчика и разослать
+   подписчикам их значения и частоту импульсов за прошедший период */
+int parports_count_publish(parports_t *parports)
+{
+  long long now = timer_now();
+  long long elapsed = now - parports->count_prev_time;
+
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if (!parports->counter[i] || parports->removed[i])
+    {
+      continue;
+    }
+
+    if (parports_count_collect(parports, i) == -1)
+    {
+      log_message(LOG_WARNING, "parports_count_publish: warning, parports_count_collect failed");
+    }
+
+    /* Счётчик мог быть сброшен командой клиента */
+    unsigned long long pulses = 0;
+    if (parports->count[i] >= parports->count_prev[i])
+    {
+      pulses = parports->count[i] - parports->count_prev[i];
+    }
+    parports->count_prev[i] = parports->count[i];
+
+    unsigned long long rate = (elapsed > 0) ? pulses * 1000 / elapsed : 0;
+
+    if (parports->publish != NULL)
+    {
+      char message[96];
+      snprintf(message, sizeof(message), "event port %u count %llu rate %llu\n", i, parports->count[i], rate);
+      if (parports->publish(message, parports->publish_data) == -1)
+      {
+        log_message(LOG_WARNING, "parports_count_publish: warning, failed to publish counter");
+      }
+    }
+  }
+
+  /* Следующее снятие отсчитываем от срока предыдущего, чтобы период не
+     накапливал задержки срабатывания таймера */
+  parports->count_prev_time = now;
+  parports->count_time += PARPORTS_COUNT_PERIOD;
+  if (parports->count_time <= now)
+  {
+    parports->count_time = now + PARPORTS_COUNT_PERIOD;
+  }
+
+  return 0;
+}
+
+/* Прочитать линии состояния порта и разослать подписчикам событие,
+   если состояние линий отличается от последнего разосланного */
+int parports_input_check(parports_t *parports, const unsigned parport)
+{
+  int status = parport_status(parports->parports[parport]);
+  if (status == -1)
+  {
+    log_message(LOG_ERR, "parports_input_check: failed to read status of parport %d", parport);
+    return -1;
+  }
+
+  if (status == parports->input_status[parport])
+  {
+    return 0;
+  }
+  parports->input_status[parport] = status;
+
+  if (parports->publish != NULL)
+  {
+    char message[64];
+    snprintf(message, sizeof(message), "event port %u status 0x%02X\n", parport, status);
+    if (parports->publish(message, parports->publish_data) == -1)
+    {
+      log_message(LOG_WARNING, "parports_input_check: warning, failed to publish event");
+    }
+  }
+
+  return 0;
+}
+
+/* Обработать прерывание от порта: снять накопленные прерывания и отложить
+   чтение линий состояния до окончания дребезга контактов */
+int parports_input_process_event(int fd, int events, void *data)
+{
+  (void)fd;
+
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "parports_input_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  input_t *input = data;
+  parports_t *parports = input->parports;
+  unsigned parport = input->parport;
+
+  if (events & EPOLLIN)
+  {
+    /* Прерывания, снятые здесь, не должны потеряться для счётчика импульсов */
+    int irqs = parport_irq_clear(parports->parports[parport]);
+    if (irqs == -1)
+    {
+      /* Порт деградировал, сокет будет создан заново после его открытия */
+      log_message(LOG_ERR, "parports_input_process_event: failed to clear interrupts on parport %d", parport);
+      if (parports_schedule(parports) == -1)
+      {
+        log_message(LOG_WARNING, "parports_input_process_event: warning, parports_schedule failed");
+      }
+      return -1;
+    }
+
+    parports->count[parport] += irqs;
+
+    if (parports->debounce == 0)
+    {
+      if (parports_input_check(parports, parport) == -1)
+      {
+        log_message(LOG_WARNING, "parports_input_process_event: warning, parports_input_check failed");
+      }
+    }
+    /* Повторные прерывания во время дребезга не продлевают ожидание */
+    else if (parports->input_time[parport] == -1)
+    {
+      parports->input_time[parport] = timer_now() + parports->debounce;
+    }
+
+    if (parports_schedule(parports) == -1)
+    {
+      log_message(LOG_WARNING, "parports_input_process_event: warning, parports_schedule failed");
+    }
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+  {
+    log_message(LOG_ERR, "parports_input_process_event: parport %d broken", parport);
+    return -1;
+  }
+
+  return EPOLLIN;
+}
+
+/* Освобождение данных сокета прерываний порта */
+int parports_input_destroy(void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "parports_input_destroy: data is NULL pointer");
+    return -1;
+  }
+
+  input_t *input = data;
+  input->parports->inputs[input->parport] = NULL;
+  input->parports->input_time[input->parport] = -1;
+  free(input);
+  return 0;
+}
+
+/* Начать отслеживать прерывания от открытого порта в цикле обработки событий.
+   В цикле находится копия файлового дескриптора порта. После повторного
+   открытия порта копия заменяется новым файлом, и сокет остаётся прежним */
+int parports_input_attach(parports_t *parports, const unsigned parport)
+{
+  if (!parports->input[parport] || (parports->evloop == NULL))
+  {
+    return 0;
+  }
+
+  int fd = parport_fd(parports->parports[parport]);
+  if (fd == -1)
+  {
+    return 0;
+  }
+
+  /* Состояние линий на момент открытия порта считаем уже известным подписчикам */
+  parports->input_status[parport] = parport_status(parports->parports[parport]);
+
+  input_t *input = parports->inputs[parport];
+  if (input != NULL)
+  {
+    if (dup2(fd, input->fd) == -1)
+    {
+      log_error(LOG_ERR, "parports_input_attach: failed to duplicate parport %d descriptor", parport);
+      return -1;
+    }
+
+    if (evloop_modify_socket(parports->evloop, input->socket, EPOLLIN) == -1)
+    {
+      log_message(LOG_ERR, "parports_input_attach: evloop_modify_socket failed");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  input = malloc(sizeof(input_t));
+  if (input == NULL)
+  {
+    log_message(LOG_ERR, "parports_input_attach: failed to allocate memory for input");
+    return -1;
+  }
+
+  input->parports = parports;
+  input->parport = parport;
+  input->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (input->fd == -1)
+  {
+    log_error(LOG_ERR, "parports_input_attach: failed to duplicate parport %d descriptor", parport);
+    free(input);
+    return -1;
+  }
+
+  input->socket = socket_create(input->fd, EPOLLIN, parports_input_process_event, parports_input_destroy, input);
+  if (input->socket == NULL)
+  {
+    log_message(LOG_ERR, "parports_input_attach: socket_create failed");
+    if (close(input->fd) == -1)
+    {
+      log_error(LOG_WARNING, "parports_input_attach: warning, failed to close descriptor");
+    }
+    free(input);
+    return -1;
+  }
+  socket_set_name(input->socket, "input");
+
+  if (evloop_add_socket(parports->evloop, input->socket) == -1)
+  {
+    log_message(LOG_ERR, "parports_input_attach: evloop_add_socket failed");
+    if (close(input->fd) == -1)
+    {
+      log_error(LOG_WARNING, "parports_input_attach: warning, failed to close descriptor");
+    }
+    free(input->socket);
+    free(input);
+    return -1;
+  }
+
+  parports->inputs[parport] = input;
+  return 0;
+}
+
+/* Обработать сообщение потока захвата об окончании захвата: вызвать функции
+   окончания для всех законченных захватов. Сообщение потока развёртки матрицы
+   или вывода на индикатор об ошибке записи переводит порт в деградировавшее
+   состояние, как ошибка записи из цикла обработки событий, и порт будет
+   открыт повторно */
+int parports_capture_process_event(int fd, int events, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  parports_t *parports = data;
+
+  if (events & EPOLLIN)
+  {
+    eventfd_t value;
+    if (eventfd_read(fd, &value) == -1)
+    {
+      log_error(LOG_WARNING, "parports_capture_process_event: warning, eventfd_read failed");
+    }
+
+    for(unsigned i = 0; i < parports->num; i++)
+    {
+      if ((parports->capture_done[i] == NULL) || !sampler_done(parports->sampler[i]))
+      {
+        continue;
+      }
+
+      /* Функция окончания вызывается однократно */
+      int (*done)(void *data) = parports->capture_done[i];
+      parports->capture_done[i] = NULL;
+      if (done(parports->capture_data[i]) == -1)
+      {
+        log_message(LOG_WARNING, "parports_capture_process_event: warning, capture callback failed");
+      }
+    }
+
+    int degraded = 0;
+    for(unsigned i = 0; i < parports->num; i++)
+    {
+      int failed = ((parports->matrix[i] != NULL) && matrix_failed(parports->matrix[i])) ||
+                   ((parports->lcd[i] != NULL) && lcd_failed(parports->lcd[i]));
+      if (!failed || parports->removed[i] || (parport_retry_time(parports->parports[i]) != -1))
+      {
+        continue;
+      }
+
+      log_message(LOG_ERR, "parports_capture_process_event: driver thread failed to write parport %d", i);
+      parport_degrade(parports->parports[i]);
+      degraded = 1;
+    }
+
+    if (degraded && (parports_schedule(parports) == -1))
+    {
+      log_message(LOG_WARNING, "parports_capture_process_event: warning, parports_schedule failed");
+    }
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+  {
+    log_message(LOG_ERR, "parports_capture_process_event: eventfd broken");
+    return -1;
+  }
+
+  return EPOLLIN;
+}
+
+/* Дескриптор eventfd удаляется из цикла обработки событий раньше каталога портов */
+int parports_capture_destroy(void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture_destroy: data is NULL pointer");
+    return -1;
+  }
+
+  parports_t *parports = data;
+  parports->capture_fd = -1;
+  return 0;
+}
+
+/* Добавить в цикл обработки событий дескриптор eventfd для сообщений
+   об окончании захвата и об ошибках потоков матриц и индикаторов, если
+   захват, матрица или индикатор включены хотя бы на одном порту */
+int parports_capture_attach(parports_t *parports, evloop_t *evloop)
+{
+  unsigned i = 0;
+  while ((i < parports->num) && (parports->sampler[i] == NULL) &&
+         (parports->matrix[i] == NULL) && (parports->lcd[i] == NULL))
+  {
+    i++;
+  }
+
+  if (i == parports->num)
+  {
+    return 0;
+  }
+
+  int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd == -1)
+  {
+    log_error(LOG_ERR, "parports_capture_attach: failed to create eventfd");
+    return -1;
+  }
+
+  socket_t *socket = socket_create(fd, EPOLLIN, parports_capture_process_event, parports_capture_destroy, parports);
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture_attach: socket_create failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "parports_capture_attach: warning, failed to close eventfd");
+    }
+    return -1;
+  }
+  socket_set_name(socket, "capture");
+
+  if (evloop_add_socket(evloop, socket) == -1)
+  {
+    log_message(LOG_ERR, "parports_capture_attach: evloop_add_socket failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "parports_capture_attach: warning, failed to close eventfd");
+    }
+    free(socket);
+    return -1;
+  }
+
+  parports->capture_fd = fd;
+
+  for(i = 0; i < parports->num; i++)
+  {
+    if ((parports->matrix[i] != NULL) && (matrix_set_notify(parports->matrix[i], fd) == -1))
+    {
+      log_message(LOG_WARNING, "parports_capture_attach: warning, matrix_set_notify failed");
+    }
+    if ((parports->lcd[i] != NULL) && (lcd_set_notify(parports->lcd[i], fd) == -1))
+    {
+      log_message(LOG_WARNING, "parports_capture_attach: warning, lcd_set_notify failed");
+    }
+  }
+
+  return 0;
+}
+
+/* Обработчик сигнала HUP, полученного через signalfd: перечитывает список портов */
+int parports_reload_process_event(int fd, int events, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "parports_reload_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  parports_t *parports = data;
+
+  if (events & EPOLLIN)
+  {
+    struct signalfd_siginfo info;
+    if (read(fd, &info, sizeof(info)) != sizeof(info))
+    {
+      log_error(LOG_WARNING, "parports_reload_process_event: warning, failed to read signalfd");
+    }
+
+    log_message(LOG_NOTICE, "parports_reload_process_event: reloading list of parports from %s", parports->reload_pathname);
+    if (parports_reload(parports) == -1)
+    {
+      log_message(LOG_WARNING, "parports_reload_process_event: warning, parports_reload failed");
+    }
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+  {
+    log_message(LOG_ERR, "parports_reload_process_event: signalfd broken");
+    return -1;
+  }
+
+  return EPOLLIN;
+}
+
+/* Дескриптор signalfd удаляется из цикла обработки событий раньше каталога портов */
+int parports_reload_destroy(void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "parports_reload_destroy: data is NULL pointer");
+    return -1;
+  }
+
+  parports_t *parports = data;
+  parports->reload_fd = -1;
+  return 0;
+}
+
+/* Добавить в цикл обработки событий дескриптор signalfd для сигнала HUP,
+   если указан файл со списком портов. Сигнал HUP должен быть заблокирован */
+int parports_reload_attach(parports_t *parports, evloop_t *evloop)
+{
+  if (parports->reload_pathname == NULL)
+  {
+    return 0;
+  }
+
+  sigset_t sigmask;
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGHUP);
+
+  int fd = signalfd(-1, &sigmask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (fd == -1)
+  {
+    log_error(LOG_ERR, "parports_reload_attach: failed to create signalfd");
+    return -1;
+  }
+
+  socket_t *socket = socket_create(fd, EPOLLIN, parports_reload_process_event, parports_reload_destroy, parports);
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "parports_reload_attach: socket_create failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "parports_reload_attach: warning, failed to close signalfd");
+    }
+    return -1;
+  }
+  socket_set_name(socket, "reload");
+
+  if (evloop_add_socket(evloop, socket) == -1)
+  {
+    log_message(LOG_ERR, "parports_reload_attach: evloop_add_socket failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "parports_reload_attach: warning, failed to close signalfd");
+    }
+    free(socket);
+    return -1;
+  }
+
+  parports->reload_fd = fd;
+  return 0;
+}
+
+/* Выводит на открывшийся порт из групп зеркальных портов состояние основного
+   порта группы, а если открылся основной порт, то его состояние - на остальные
+   порты группы, чтобы порты группы не расходились после деградации */
+int parports_mirror_sync(parports_t *parports, const unsigned parport)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_mirror_sync: parports is NULL pointer");
+    return -1;
+  }
+
+  /* В кадровом режиме порт получит состояние из заднего буфера */
+  if (parports->refresh > 0)
+  {
+    return 0;
+  }
+
+  int result = 0;
+  for(unsigned n = 0; n < parports->virtual_num; n++)
+  {
+    virtual_t *v = &(parports->virtual[n]);
+    for(unsigned k = 0; k < v->mirror; k++)
+    {
+      if (v->port[k] != parport)
+      {
+        continue;
+      }
+
+      int leds = parport_leds_get(parports->parports[v->port[0]]);
+      if (leds == -1)
+      {
+        break;
+      }
+
+      for(unsigned m = 1; m < v->mirror; m++)
+      {
+        if (((k == 0) || (m == k)) &&
+            (parport_retry_time(parports->parports[v->port[m]]) == -1) &&
+            (parport_leds_set(parports->parports[v->port[m]], leds) == -1))
+        {
+          log_message(LOG_ERR, "parports_mirror_sync: failed to set leds on parport %u", v->port[m]);
+          result = -1;
+        }
+      }
+      break;
+    }
+  }
+
+  return result;
+}
+
+/* Обработать срабатывание таймера - повторно открыть деградировавшие порты,
+   время попытки открыть которые уже наступило, прочитать линии состояния
+   портов, дребезг на которых закончился, снять счётчики импульсов и вывести
+   кадр, если время его вывода наступило */
+int parports_timer_process_event(int fd, int events, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "parports_timer_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  parports_t *parports = data;
+
+  if (events & EPOLLIN)
+  {
+    if (timer_read(fd) == -1)
+    {
+      log_message(LOG_WARNING, "parports_timer_process_event: warning, timer_read failed");
+    }
+
+    /* Пытаемся открыть порты. Неудачная попытка сама отложит следующую */
+    for(unsigned i = 0; i < parports->num; i++)
+    {
+      if (parports->removed[i])
+      {
+        continue;
+      }
+
+      int ready = (parport_retry_time(parports->parports[i]) == -1);
+
+      if (parport_reopen(parports->parports[i]) == -1)
+      {
+        log_message(LOG_INFO, "parports_timer_process_event: parport %d is still degraded", i);
+        continue;
+      }
+
+      /* Возобновляем отслеживание прерываний от открывшегося порта */
+      if ((!ready || (parports->inputs[i] == NULL)) &&
+          (parports_input_attach(parports, i) == -1))
+      {
+        log_message(LOG_WARNING, "parports_timer_process_event: warning, parports_input_attach failed");
+      }
+
+      /* Выравниваем состояние открывшегося порта с его группой зеркальных портов */
+      if (!ready && (parports_mirror_sync(parports, i) == -1))
+      {
+        log_message(LOG_WARNING, "parports_timer_process_event: warning, parports_mirror_sync failed");
+      }
+
+      /* Состояние индикатора после повторного открытия порта неизвестно,
+         инициализируем его заново и выводим последний текст целиком */
+      if (!ready && (parports->lcd[i] != NULL) && (lcd_reset(parports->lcd[i]) == -1))
+      {
+        log_message(LOG_WARNING, "parports_timer_process_event: warning, lcd_reset failed");
+      }
+
+      /* Если порт открылся в кадровом режиме, то выводим на него состояние
+         из заднего буфера, которое могло не попасть на порт из-за ошибки */
+      if (!ready && (parports->refresh > 0) && (parports->back[i] != -1))
+      {
+        if (parports_mark(parports, i) == -1)
+        {
+          log_message(LOG_WARNING, "parports_timer_process_event: warning, parports_mark failed");
+        }
+      }
+    }
+
+    /* Читаем линии состояния портов, дребезг на которых уже закончился */
+    long long now = timer_now();
+    for(unsigned i = 0; i < parports->num; i++)
+    {
+      if ((parports->input_time[i] != -1) && (now >= parports->input_time[i]))
+      {
+        parports->input_time[i] = -1;
+        if (parports_input_check(parports, i) == -1)
+        {
+          log_message(LOG_WARNING, "parports_timer_process_event: warning, parports_input_check failed");
+        }
+      }
+    }
+
+    /* Если наступило время снятия счётчиков импульсов, то снимаем их */
+    if ((parports->count_time != -1) && (now >= parports->count_time))
+    {
+      if (parports_count_publish(parports) == -1)
+      {
+        log_message(LOG_WARNING, "parports_timer_process_event: warning, parports_count_publish failed");
+      }
+    }
+
+    /* Если наступило время вывода кадра, то выводим его */
+    if ((parports->dirty_num > 0) &&
+        (timer_now() >= parports->flush_time + parports->refresh))
+    {
+      if (parports_flush(parports) == -1)
+      {
+        log_message(LOG_WARNING, "parports_timer_process_event: warning, parports_flush failed");
+      }
+    }
+
+    if (parports_schedule(parports) == -1)
+    {
+      log_message(LOG_ERR, "parports_timer_process_event: parports_schedule failed");
+      return -1;
+    }
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+  {
+    log_message(LOG_ERR, "parports_timer_process_event: timer broken");
+    return -1;
+  }
+
+  return EPOLLIN;
+}
+
+/* Таймер удаляется из цикла обработки событий раньше каталога портов,
+   каталог при этом не освобождается */
+int parports_timer_destroy(void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "parports_timer_destroy: data is NULL pointer");
+    return -1;
+  }
+
+  parports_t *parports = data;
+  parports->timer = -1;
+  parports->evloop = NULL;
+  return 0;
+}
+
+/* Создание таймера повторного открытия деградировавших портов и сокетов
+   прерываний от открытых портов */
+socket_t *parports_timer_create(parports_t *parports, evloop_t *evloop)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_timer_create: parports is NULL pointer");
+    return NULL;
+  }
+
+  if (evloop == NULL)
+  {
+    log_message(LOG_ERR, "parports_timer_create: evloop is NULL pointer");
+    return NULL;
+  }
+
+  int fd = timer_open();
+  if (fd == -1)
+  {
+    log_message(LOG_ERR, "parports_timer_create: timer_open failed");
+    return NULL;
+  }
+
+  socket_t *socket = socket_create(fd, EPOLLIN, parports_timer_process_event, parports_timer_destroy, parports);
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "parports_timer_create: socket_create failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "parports_timer_create: warning, failed to close timer");
+    }
+    return NULL;
+  }
+  socket_set_name(socket, "timer");
+
+  /* Добавляем в цикл обработки событий сокеты прерываний от уже открытых
+     портов. Для остальных портов сокеты будут созданы после их открытия */
+  parports->evloop = evloop;
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if (parports_input_attach(parports, i) == -1)
+    {
+      log_message(LOG_WARNING, "parports_timer_create: warning, parports_input_attach failed");
+    }
+  }
+
+  if (parports_capture_attach(parports, evloop) == -1)
+  {
+    log_message(LOG_WARNING, "parports_timer_create: warning, parports_capture_attach failed");
+  }
+
+  if (parports_reload_attach(parports, evloop) == -1)
+  {
+    log_message(LOG_WARNING, "parports_timer_create: warning, parports_reload_attach failed");
+  }
+
+  /* Если есть порты в режиме счётчика, то начинаем периодически снимать счётчики */
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if (parports->counter[i])
+    {
+      parports->count_prev_time = timer_now();
+      parports->count_time = parports->count_prev_time + PARPORTS_COUNT_PERIOD;
+      break;
+    }
+  }
+
+  /* Взводим таймер на время ближайшей попытки открыть деградировавшие порты */
+  parports->timer = fd;
+  if (parports_schedule(parports) == -1)
+  {
+    log_message(LOG_WARNING, "parports_timer_create: warning, parports_schedule failed");
+  }
+
+  return socket;
+}
+
+/* Включить кадровый режим с указанным периодом вывода кадров в миллисекундах.
+   Нулевой период выключает кадровый режим */
+int parports_set_refresh(parports_t *parports, long long refresh)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_refresh: parports is NULL pointer");
+    return -1;
+  }
+
+  if (refresh < 0)
+  {
+    log_message(LOG_ERR, "parports_set_refresh: refresh is negative value");
+    return -1;
+  }
+
+  parports->refresh = refresh;
+  return 0;
+}
+
+/* Выбрать порядок записи регистров данных и управления для всех портов в каталоге */
+int parports_set_order(parports_t *parports, parport_order_t order)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_order: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Порядок запоминается для портов, которые будут добавлены позже */
+  parports->order = order;
+
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if (parport_set_order(parports->parports[i], order) == -1)
+    {
+      log_message(LOG_ERR, "parports_set_order: parport_set_order failed for parport %d", i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Включить или выключить измерение промежутков между записями регистров
+   для всех портов в каталоге */
+int parports_set_measure(parports_t *parports, int measure)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_measure: parports is NULL pointer");
+    return -1;
+  }
+
+  parports->measure = measure;
+
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if (parport_set_measure(parports->parports[i], measure) == -1)
+    {
+      log_message(LOG_ERR, "parports_set_measure: parport_set_measure failed for parport %d", i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Вывести в буфер статистику записей регистров порта из каталога */
+int parports_gaps(parports_t *parports, const unsigned parport, char *buf, size_t size)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_gaps: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_gaps: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_gaps: parport %d is removed", parport);
+    return -1;
+  }
+
+  return parport_gaps(parports->parports[parport], buf, size);
+}
+
+/* Подключить к последнему добавленному в каталог порту светодиодную матрицу */
+int parports_set_matrix(parports_t *parports, unsigned rows, unsigned cols)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_matrix: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports->num == 0)
+  {
+    log_message(LOG_ERR, "parports_set_matrix: no parport to attach matrix to");
+    return -1;
+  }
+
+  unsigned parport = parports->num - 1;
+  if (parports_driven(parports, parport))
+  {
+    log_message(LOG_ERR, "parports_set_matrix: parport %d already drives a device", parport);
+    return -1;
+  }
+
+  parports->matrix[parport] = matrix_create(parports->parports[parport], rows, cols);
+  if (parports->matrix[parport] == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_matrix: matrix_create failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Возвращает матрицу, подключенную к последнему добавленному в каталог порту */
+matrix_t *parports_last_matrix(parports_t *parports)
+{
+  if ((parports->num == 0) || (parports->matrix[parports->num - 1] == NULL))
+  {
+    log_message(LOG_ERR, "parports_last_matrix: last parport does not drive a matrix");
+    return NULL;
+  }
+
+  return parports->matrix[parports->num - 1];
+}
+
+/* Изменить частоту развёртки матрицы на последнем добавленном в каталог порту */
+int parports_set_scan_rate(parports_t *parports, unsigned rate)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_scan_rate: parports is NULL pointer");
+    return -1;
+  }
+
+  return matrix_set_rate(parports_last_matrix(parports), rate);
+}
+
+/* Выбрать процессор для потока развёртки матрицы на последнем добавленном в каталог порту */
+int parports_set_scan_cpu(parports_t *parports, int cpu)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_scan_cpu: parports is NULL pointer");
+    return -1;
+  }
+
+  return matrix_set_cpu(parports_last_matrix(parports), cpu);
+}
+
+/* Записать новое содержимое кадрового буфера матрицы на порту из каталога */
+long long parports_matrix_set(parports_t *parports, const unsigned parport, long long bits)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_matrix_set: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_matrix_set: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_matrix_set: parport %d is removed", parport);
+    return -1;
+  }
+
+  if (parports->matrix[parport] == NULL)
+  {
+    log_message(LOG_ERR, "parports_matrix_set: parport %d does not drive a matrix", parport);
+    return -1;
+  }
+
+  return matrix_set(parports->matrix[parport], bits);
+}
+
+/* Вывести в буфер счётчики развёртки матрицы на порту из каталога */
+int parports_scan(parports_t *parports, const unsigned parport, char *buf, size_t size)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_scan: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_scan: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_scan: parport %d is removed", parport);
+    return -1;
+  }
+
+  if (parports->matrix[parport] == NULL)
+  {
+    log_message(LOG_ERR, "parports_scan: parport %d does not drive a matrix", parport);
+    return -1;
+  }
+
+  return matrix_stats(parports->matrix[parport], buf, size);
+}
+
+/* Подключить к последнему добавленному в каталог порту цепочки сдвиговых регистров */
+int parports_set_shift(parports_t *parports, unsigned chains, unsigned length)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_shift: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports->num == 0)
+  {
+    log_message(LOG_ERR, "parports_set_shift: no parport to attach shift register chains to");
+    return -1;
+  }
+
+  unsigned parport = parports->num - 1;
+  if (parports_driven(parports, parport))
+  {
+    log_message(LOG_ERR, "parports_set_shift: parport %d already drives a device", parport);
+    return -1;
+  }
+
+  return parport_set_shift(parports->parports[parport], chains, length);
+}
+
+/* Вывести новое состояние выходов цепочек сдвиговых регистров на порту из каталога */
+int parports_shift(parports_t *parports, const unsigned parport, const unsigned char *vector, size_t size)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_shift: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_shift: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_shift: parport %d is removed", parport);
+    return -1;
+  }
+
+  /* Запоминаем, был ли порт готов к работе до вывода */
+  int ready = (parport_retry_time(parports->parports[parport]) == -1);
+
+  if (parport_shift_set(parports->parports[parport], vector, size) == -1)
+  {
+    log_message(LOG_ERR, "parports_shift: parport_shift_set failed");
+
+    /* Если порт только что деградировал, то планируем его повторное открытие */
+    if (ready && (parport_retry_time(parports->parports[parport]) != -1) &&
+        (parports_schedule(parports) == -1))
+    {
+      log_message(LOG_WARNING, "parports_shift: warning, parports_schedule failed");
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Вывести в буфер счётчики вывода на цепочки сдвиговых регистров порта из каталога */
+int parports_shift_stats(parports_t *parports, const unsigned parport, char *buf, size_t size)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_shift_stats: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_shift_stats: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_shift_stats: parport %d is removed", parport);
+    return -1;
+  }
+
+  return parport_shift_stats(parports->parports[parport], buf, size);
+}
+
+/* Подключить к последнему добавленному в каталог порту символьный индикатор */
+int parports_set_lcd(parports_t *parports, unsigned cols, unsigned rows)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_lcd: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports->num == 0)
+  {
+    log_message(LOG_ERR, "parports_set_lcd: no parport to attach lcd to");
+    return -1;
+  }
+
+  unsigned parport = parports->num - 1;
+  if (parports_driven(parports, parport))
+  {
+    log_message(LOG_ERR, "parports_set_lcd: parport %d already drives a device", parport);
+    return -1;
+  }
+
+  parports->lcd[parport] = lcd_create(parports->parports[parport], cols, rows);
+  if (parports->lcd[parport] == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_lcd: lcd_create failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Включить 4-битный режим обмена с индикатором на последнем добавленном в каталог порту */
+int parports_set_lcd_4bit(parports_t *parports)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_lcd_4bit: parports is NULL pointer");
+    return -1;
+  }
+
+  if ((parports->num == 0) || (parports->lcd[parports->num - 1] == NULL))
+  {
+    log_message(LOG_ERR, "parports_set_lcd_4bit: last parport does not drive an lcd");
+    return -1;
+  }
+
+  return lcd_set_4bit(parports->lcd[parports->num - 1], 1);
+}
+
+/* Вывести текст на индикатор, подключенный к порту из каталога */
+int parports_lcd_print(parports_t *parports, const unsigned parport, const char *text)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_lcd_print: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_lcd_print: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_lcd_print: parport %d is removed", parport);
+    return -1;
+  }
+
+  if (parports->lcd[parport] == NULL)
+  {
+    log_message(LOG_ERR, "parports_lcd_print: parport %d does not drive an lcd", parport);
+    return -1;
+  }
+
+  /* Если порт не готов к работе, то сразу сообщаем об ошибке, а не
+     передаём текст потоку вывода */
+  if (parport_retry_time(parports->parports[parport]) != -1)
+  {
+    log_message(LOG_ERR, "parports_lcd_print: parport %d is degraded", parport);
+    return -1;
+  }
+
+  return lcd_print(parports->lcd[parport], text);
+}
+
+/* Включить захват линий состояния на последнем добавленном в каталог порту */
+int parports_set_sampler(parports_t *parports, size_t size)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_sampler: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports->num == 0)
+  {
+    log_message(LOG_ERR, "parports_set_sampler: no parport to capture");
+    return -1;
+  }
+
+  unsigned parport = parports->num - 1;
+  if (parports->sampler[parport] != NULL)
+  {
+    log_message(LOG_ERR, "parports_set_sampler: parport %d already has a sampler", parport);
+    return -1;
+  }
+
+  parports->sampler[parport] = sampler_create(parports->parports[parport], size);
+  if (parports->sampler[parport] == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_sampler: sampler_create failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Выбрать процессор для потока захвата на последнем добавленном в каталог порту */
+int parports_set_sampler_cpu(parports_t *parports, int cpu)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_sampler_cpu: parports is NULL pointer");
+    return -1;
+  }
+
+  if ((parports->num == 0) || (parports->sampler[parports->num - 1] == NULL))
+  {
+    log_message(LOG_ERR, "parports_set_sampler_cpu: last parport has no sampler");
+    return -1;
+  }
+
+  return sampler_set_cpu(parports->sampler[parports->num - 1], cpu);
+}
+
+/* Запустить захват samples выборок линий состояния порта из каталога */
+int parports_capture(parports_t *parports, const unsigned parport, unsigned long long samples,
+                     int (*done)(void *data), void *data)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_capture: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_capture: parport %d is removed", parport);
+    return -1;
+  }
+
+  sampler_t *sampler = parports->sampler[parport];
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture: parport %d has no sampler", parport);
+    return -1;
+  }
+
+  if (done == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture: done is NULL pointer");
+    return -1;
+  }
+
+  if (parports->capture_fd == -1)
+  {
+    log_message(LOG_ERR, "parports_capture: capture notification is not ready");
+    return -1;
+  }
+
+  if (sampler_start(sampler, samples, parports->capture_fd) == -1)
+  {
+    log_message(LOG_ERR, "parports_capture: sampler_start failed");
+    return -1;
+  }
+
+  parports->capture_done[parport] = done;
+  parports->capture_data[parport] = data;
+  return 0;
+}
+
+/* Получить сводку и данные законченного захвата на порту из каталога */
+int parports_capture_result(parports_t *parports, const unsigned parport, char *buf, size_t size,
+                            const unsigned char **data, size_t *data_size)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture_result: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_capture_result: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_capture_result: parport %d is removed", parport);
+    return -1;
+  }
+
+  sampler_t *sampler = parports->sampler[parport];
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture_result: parport %d has no sampler", parport);
+    return -1;
+  }
+
+  return sampler_result(sampler, buf, size, data, data_size);
+}
+
+/* Прервать захват на порту из каталога, если он ещё идёт, и освободить захват */
+int parports_capture_release(parports_t *parports, const unsigned parport)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture_release: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_capture_release: no parport with index %d", parport);
+    return -1;
+  }
+
+  sampler_t *sampler = parports->sampler[parport];
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "parports_capture_release: parport %d has no sampler", parport);
+    return -1;
+  }
+
+  parports->capture_done[parport] = NULL;
+  parports->capture_data[parport] = NULL;
+  return sampler_release(sampler);
+}
+
+/* Включить режим счётчика импульсов на линии ACK последнего добавленного в каталог порта */
+int parports_set_counter(parports_t *parports)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_counter: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports->num == 0)
+  {
+    log_message(LOG_ERR, "parports_set_counter: no parport to count pulses on");
+    return -1;
+  }
+
+  parports->counter[parports->num - 1] = 1;
+  return 0;
+}
+
+/* Получить значение счётчика импульсов порта из каталога и, если нужно, сбросить его */
+int parports_counter(parports_t *parports, const unsigned parport, int reset, unsigned long long *count)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_counter: parports is NULL pointer");
+    return -1;
+  }
+
+  if (count == NULL)
+  {
+    log_message(LOG_ERR, "parports_counter: count is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_counter: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_counter: parport %d is removed", parport);
+    return -1;
+  }
+
+  if (!parports->counter[parport])
+  {
+    log_message(LOG_ERR, "parports_counter: parport %d does not count pulses", parport);
+    return -1;
+  }
+
+  /* Учитываем прерывания, накопленные драйвером с момента последнего снятия */
+  if (parports_count_collect(parports, parport) == -1)
+  {
+    log_message(LOG_ERR, "parports_counter: parports_count_collect failed");
+    if (parports_schedule(parports) == -1)
+    {
+      log_message(LOG_WARNING, "parports_counter: warning, parports_schedule failed");
+    }
+    return -1;
+  }
+
+  *count = parports->count[parport];
+  if (reset)
+  {
+    parports->count[parport] = 0;
+    parports->count_prev[parport] = 0;
+  }
+
+  return 0;
+}
+
+/* Отслеживать линии состояния последнего добавленного в каталог порта */
+int parports_set_input(parports_t *parports)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_input: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports->num == 0)
+  {
+    log_message(LOG_ERR, "parports_set_input: no parport to watch");
+    return -1;
+  }
+
+  parports->input[parports->num - 1] = 1;
+  return 0;
+}
+
+/* Задать время успокоения линий состояния после прерывания в миллисекундах */
+int parports_set_debounce(parports_t *parports, long long debounce)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_debounce: parports is NULL pointer");
+    return -1;
+  }
+
+  if (debounce < 0)
+  {
+    log_message(LOG_ERR, "parports_set_debounce: debounce is negative");
+    return -1;
+  }
+
+  parports->debounce = debounce;
+  return 0;
+}
+
+/* Задать функцию рассылки событий об изменении линий состояния портов */
+int parports_set_publish(parports_t *parports,
+                         int (*publish)(const char *message, void *data),
+                         void *data)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_publish: parports is NULL pointer");
+    return -1;
+  }
+
+  parports->publish = publish;
+  parports->publish_data = data;
+  return 0;
+}
+
+/* Прочитать линии состояния порта из каталога */
+int parports_status(parports_t *parports, const unsigned parport)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_status: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_status: no parport with index %d", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_status: parport %d is removed", parport);
+    return -1;
+  }
+
+  int status = parport_status(parports->parports[parport]);
+  if (status == -1)
+  {
+    /* Порт мог деградировать, учитываем время попытки открыть его */
+    if (parports_schedule(parports) == -1)
+    {
+      log_message(LOG_WARNING, "parports_status: warning, parports_schedule failed");
+    }
+  }
+
+  return status;
+}
+
+/* Закрыть все порты в таблице, удалить каталог портов */
+int parports_destroy(parports_t *parports)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_destroy: warning, parports is NULL pointer");
+    return -1;
+  }
+
+  /* Перебираем порты, останавливаем развёртку матриц и закрываем каждый из них */
+  for(unsigned parport = 0; parport < parports->num; parport++)
+  {
+    if (parports->matrix[parport] != NULL)
+    {
+      if (matrix_destroy(parports->matrix[parport]) == -1)
+      {
+        log_message(LOG_WARNING, "parports_destroy: warning, failed to destroy matrix");
+      }
+    }
+
+    if (parports->lcd[parport] != NULL)
+    {
+      if (lcd_destroy(parports->lcd[parport]) == -1)
+      {
+        log_message(LOG_WARNING, "parports_destroy: warning, failed to destroy lcd");
+      }
+    }
+
+    if (parports->sampler[parport] != NULL)
+    {
+      if (sampler_destroy(parports->sampler[parport]) == -1)
+      {
+        log_message(LOG_WARNING, "parports_destroy: warning, failed to destroy sampler");
+      }
+    }
+
+    if (parports->parports[parport] != NULL)
+    {
+      if (parport_close(parports->parports[parport]) == -1)
+      {
+        log_message(LOG_ERR, "parports_close: warning, failed to close port");
+      }
+    }
+  }
+
+  /* Освобождаем память из под таблицы портов и заднего буфера */
+  if (parports->max > 0)
+  {
+    free(parports->parports);
+    free(parports->back);
+    free(parports->marked);
+    free(parports->dirty);
+    free(parports->matrix);
+    free(parports->lcd);
+    free(parports->input);
+    free(parports->inputs);
+    free(parports->input_status);
+    free(parports->input_time);
+    free(parports->sampler);
+    free(parports->capture_done);
+    free(parports->capture_data);
+    free(parports->counter);
+    free(parports->count);
+    free(parports->count_prev);
+    free(parports->leds);
+    free(parports->data);
+    free(parports->control);
+    free(parports->bulk_next);
+    free(parports->bulk_select);
+    free(parports->listed);
+    free(parports->removed);
+  }
+  parports_adopt_drop(parports);
+  free(parports->reload_pathname);
+  free(parports->virtual);
+  for(unsigned i = 0; i < parports->names_size; i++)
+  {
+    free(parports->names[i].name);
+  }
+  free(parports->names);
+
+  /* Освобождаем память из под каталога портов */
+  free(parports);
+
+  return 0;
+}
+
+/* Добавить в каталог виртуальный порт из width бит. Бит k логического
+   регистра соответствует светодиоду bits[k] физического порта ports[k] */
+int parports_add_virtual(parports_t *parports, unsigned width, const unsigned *ports, const unsigned *bits)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_add_virtual: parports is NULL pointer");
+    return -1;
+  }
+
+  if ((ports == NULL) || (bits == NULL))
+  {
+    log_message(LOG_ERR, "parports_add_virtual: ports or bits is NULL pointer");
+    return -1;
+  }
+
+  if ((width < 1) || (width > LEDS_MAX_WIDTH))
+  {
+    log_message(LOG_ERR, "parports_add_virtual: wrong width %u", width);
+    return -1;
+  }
+
+  virtual_t v;
+  v.width = width;
+  v.mirror = 0;
+  for(unsigned k = 0; k < width; k++)
+  {
+    /* Физический порт должен быть указан раньше виртуального */
+    if ((ports[k] >= parports->num) || (bits[k] >= 12))
+    {
+      log_message(LOG_ERR, "parports_add_virtual: no led %u on parport %u", bits[k], ports[k]);
+      return -1;
+    }
+
+    if (parports_driven(parports, ports[k]))
+    {
+      log_message(LOG_ERR, "parports_add_virtual: parport %u does not drive leds directly", ports[k]);
+      return -1;
+    }
+
+    /* Один светодиод не может принадлежать двум битам регистра */
+    for(unsigned j = 0; j < k; j++)
+    {
+      if ((ports[j] == ports[k]) && (bits[j] == bits[k]))
+      {
+        log_message(LOG_ERR, "parports_add_virtual: led %u on parport %u is mapped twice", bits[k], ports[k]);
+        return -1;
+      }
+    }
+
+    v.port[k] = ports[k];
+    v.bit[k] = bits[k];
+  }
+
+  virtual_t *virtual = realloc(parports->virtual, sizeof(virtual_t) * (parports->virtual_num + 1));
+  if (virtual == NULL)
+  {
+    log_message(LOG_ERR, "parports_add_virtual: failed to reallocate memory for virtual ports");
+    return -1;
+  }
+
+  parports->virtual = virtual;
+  parports->virtual[parports->virtual_num] = v;
+  parports->virtual_num++;
+  parports->last_virtual = 1;
+  return 0;
+}
+
+/* Добавить в каталог группу зеркальных портов из num физических портов.
+   Изменения состояния светодиодов выводятся на все порты группы, а текущее
+   состояние берётся из кэша основного порта ports[0] */
+int parports_add_mirror(parports_t *parports, unsigned num, const unsigned *ports)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_add_mirror: parports is NULL pointer");
+    return -1;
+  }
+
+  if (ports == NULL)
+  {
+    log_message(LOG_ERR, "parports_add_mirror: ports is NULL pointer");
+    return -1;
+  }
+
+  if ((num < 1) || (num > LEDS_MAX_WIDTH))
+  {
+    log_message(LOG_ERR, "parports_add_mirror: wrong number of parports %u", num);
+    return -1;
+  }
+
+  virtual_t v;
+  v.width = 12;
+  v.mirror = num;
+  for(unsigned k = 0; k < num; k++)
+  {
+    /* Физический порт должен быть указан раньше группы */
+    if (ports[k] >= parports->num)
+    {
+      log_message(LOG_ERR, "parports_add_mirror: no parport with index %u", ports[k]);
+      return -1;
+    }
+
+    if (parports_driven(parports, ports[k]))
+    {
+      log_message(LOG_ERR, "parports_add_mirror: parport %u does not drive leds directly", ports[k]);
+      return -1;
+    }
+
+    for(unsigned j = 0; j < k; j++)
+    {
+      if (ports[j] == ports[k])
+      {
+        log_message(LOG_ERR, "parports_add_mirror: parport %u is specified twice", ports[k]);
+        return -1;
+      }
+    }
+
+    v.port[k] = ports[k];
+    v.bit[k] = 0;
+  }
+
+  virtual_t *virtual = realloc(parports->virtual, sizeof(virtual_t) * (parports->virtual_num + 1));
+  if (virtual == NULL)
+  {
+    log_message(LOG_ERR, "parports_add_mirror: failed to reallocate memory for virtual ports");
+    return -1;
+  }
+
+  parports->virtual = virtual;
+  parports->virtual[parports->virtual_num] = v;
+  parports->virtual_num++;
+  parports->last_virtual = 1;
+  return 0;
+}
+
+/* Возвращает ширину регистра светодиодов порта из каталога: 12 для
+   физического порта и ширину логического регистра для виртуального */
+int parports_width(parports_t *parports, const unsigned parport)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_width: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parport < parports->num)
+  {
+    return 12;
+  }
+
+  if (parport - parports->num < parports->virtual_num)
+  {
+    return parports->virtual[parport - parports->num].width;
+  }
+
+  log_message(LOG_ERR, "parports_width: no parport with index %d", parport);
+  return -1;
+}
+
+/* Хеш-функция FNV-1a для имени порта из len символов */
+unsigned parports_name_hash(const char *name, size_t len)
+{
+  unsigned hash = 2166136261u;
+  for(size_t i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Возвращает запись хеш-таблицы с указанным именем из len символов или
+   свободную запись, в которую это имя можно добавить */
+name_t *parports_name_find(parports_t *parports, const char *name, size_t len)
+{
+  unsigned mask = parports->names_size - 1;
+  unsigned i = parports_name_hash(name, len) & mask;
+
+  /* Таблица заполнена не более чем наполовину, поэтому свободная запись
+     всегда найдётся */
+  while (parports->names[i].name != NULL)
+  {
+    if ((strncmp(parports->names[i].name, name, len) == 0) &&
+        (parports->names[i].name[len] == '\0'))
+    {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return &(parports->names[i]);
+}
+
+/* Освобождение хеш-таблицы имён портов из size записей */
+void parports_names_free(name_t *names, unsigned size)
+{
+  for(unsigned i = 0; i < size; i++)
+  {
+    free(names[i].name);
+  }
+  free(names);
+}
+
+/* Перестроение хеш-таблицы имён портов с новым размером size */
+int parports_names_rehash(parports_t *parports, unsigned size)
+{
+  name_t *names = calloc(size, sizeof(name_t));
+  if (names == NULL)
+  {
+    log_message(LOG_ERR, "parports_names_rehash: failed to allocate memory for names");
+    return -1;
+  }
+
+  name_t *old = parports->names;
+  unsigned old_size = parports->names_size;
+
+  parports->names = names;
+  parports->names_size = size;
+  parports->names_num = 0;
+
+  for(unsigned i = 0; i < old_size; i++)
+  {
+    if (old[i].name == NULL)
+    {
+      continue;
+    }
+
+    *parports_name_find(parports, old[i].name, strlen(old[i].name)) = old[i];
+    parports->names_num++;
+  }
+
+  free(old);
+  return 0;
+}
+
+/* Проверка имени порта: имя начинается с буквы и состоит из букв, цифр
+   и символов -, _ и . */
+int parports_name_valid(const char *name)
+{
+  if (!isalpha((unsigned char)name[0]))
+  {
+    return 0;
+  }
+
+  size_t len = 0;
+  for(; name[len] != '\0'; len++)
+  {
+    if (!isalnum((unsigned char)name[len]) && (strchr("-_.", name[len]) == NULL))
+    {
+      return 0;
+    }
+  }
+
+  return len <= PARPORTS_NAME_MAX;
+}
+
+/* Добавить в хеш-таблицу имя физического или виртуального порта */
+int parports_name_insert(parports_t *parports, const char *name, unsigned parport, int virtual)
+{
+  if (!parports_name_valid(name))
+  {
+    log_message(LOG_ERR, "parports_name_insert: wrong parport name %s", name);
+    return -1;
+  }
+
+  /* Поддерживаем заполнение таблицы не более чем наполовину */
+  if ((parports->names_num + 1) * 2 > parports->names_size)
+  {
+    unsigned size = (parports->names_size == 0) ? PARPORTS_NAMES_MIN : parports->names_size * 2;
+    if (parports_names_rehash(parports, size) == -1)
+    {
+      log_message(LOG_ERR, "parports_name_insert: failed to enlarge names table");
+      return -1;
+    }
+  }
+
+  name_t *entry = parports_name_find(parports, name, strlen(name));
+  if (entry->name != NULL)
+  {
+    log_message(LOG_ERR, "parports_name_insert: parport name %s is already used", name);
+    return -1;
+  }
+
+  entry->name = strdup(name);
+  if (entry->name == NULL)
+  {
+    log_message(LOG_ERR, "parports_name_insert: failed to allocate memory for name");
+    return -1;
+  }
+
+  entry->virtual = virtual;
+  entry->parport = parport;
+  parports->names_num++;
+  return 0;
+}
+
+/* Добавить имя последнему добавленному в каталог порту: физическому или
+   виртуальному. У порта может быть несколько имён */
+int parports_add_name(parports_t *parports, const char *name)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_add_name: parports is NULL pointer");
+    return -1;
+  }
+
+  if (name == NULL)
+  {
+    log_message(LOG_ERR, "parports_add_name: name is NULL pointer");
+    return -1;
+  }
+
+  if (parports->num == 0)
+  {
+    log_message(LOG_ERR, "parports_add_name: there is no parport to name");
+    return -1;
+  }
+
+  unsigned parport = parports->last_virtual ? parports->virtual_num - 1 : parports->num - 1;
+  if (parports_name_insert(parports, name, parport, parports->last_virtual) == -1)
+  {
+    log_message(LOG_ERR, "parports_add_name: parports_name_insert failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Возвращает номер порта с указанным именем из len символов или -1,
+   если порта с таким именем нет */
+int parports_lookup(parports_t *parports, const char *name, size_t len)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_lookup: parports is NULL pointer");
+    return -1;
+  }
+
+  if (name == NULL)
+  {
+    log_message(LOG_ERR, "parports_lookup: name is NULL pointer");
+    return -1;
+  }
+
+  if (parports->names_num == 0)
+  {
+    return -1;
+  }
+
+  name_t *entry = parports_name_find(parports, name, len);
+  if (entry->name == NULL)
+  {
+    return -1;
+  }
+
+  return entry->virtual ? (int)(parports->num + entry->parport) : (int)entry->parport;
+}
+
+/* Выполнить операцию над виртуальным портом. Состояние логического регистра
+   собирается из состояний физических портов, а новое состояние раскладывается
+   обратно, после чего изменившиеся физические порты записываются подряд одним
+   проходом, чтобы расхождение во времени между ними было наименьшим */
+long long parports_virtual_leds_ctl(parports_t *parports, virtual_t *v, leds_operation_t operation, long long operand)
+{
+  /* Физические порты, затронутые регистром, и их состояния */
+  unsigned members[LEDS_MAX_WIDTH];
+  int old_leds[LEDS_MAX_WIDTH];
+  int new_leds[LEDS_MAX_WIDTH];
+  unsigned members_num = 0;
+  unsigned member[LEDS_MAX_WIDTH];
+
+  for(unsigned k = 0; k < v->width; k++)
+  {
+    unsigned m = 0;
+    while ((m < members_num) && (members[m] != v->port[k]))
+    {
+      m++;
+    }
+    member[k] = m;
+
+    if (m < members_num)
+    {
+      continue;
+    }
+
+    /* В кадровом режиме текущее состояние берём из заднего буфера */
+    unsigned parport = v->port[k];
+    int leds = (parports->refresh > 0) ? parports->back[parport] : -1;
+    if (leds == -1)
+    {
+      leds = parport_leds_get(parports->parports[parport]);
+      if (leds == -1)
+      {
+        log_message(LOG_ERR, "parports_virtual_leds_ctl: failed to get current state of parport %u", parport);
+        return -1;
+      }
+    }
+
+    members[members_num] = parport;
+    old_leds[members_num] = leds;
+    new_leds[members_num] = leds;
+    members_num++;
+  }
+
+  /* Собираем логический регистр */
+  long long value = 0;
+  for(unsigned k = 0; k < v->width; k++)
+  {
+    if (old_leds[member[k]] & (1 << v->bit[k]))
+    {
+      value |= 1LL << k;
+    }
+  }
+
+  value = leds_calc_wide(value, operation, operand, v->width);
+  if (value == -1)
+  {
+    log_message(LOG_ERR, "parports_virtual_leds_ctl: leds_calc_wide failed");
+    return -1;
+  }
+
+  if (operation == LEDS_GET)
+  {
+    return value;
+  }
+
+  /* Раскладываем новое состояние по физическим портам */
+  for(unsigned k = 0; k < v->width; k++)
+  {
+    if (value & (1LL << k))
+    {
+      new_leds[member[k]] |= 1 << v->bit[k];
+    }
+    else
+    {
+      new_leds[member[k]] &= ~(1 << v->bit[k]);
+    }
+  }
+
+  /* В кадровом режиме изменённые порты будут записаны вместе при выводе кадра */
+  if (parports->refresh > 0)
+  {
+    for(unsigned m = 0; m < members_num; m++)
+    {
+      if (new_leds[m] != parports->back[members[m]])
+      {
+        parports->back[members[m]] = new_leds[m];
+        if (parports_mark(parports, members[m]) == -1)
+        {
+          log_message(LOG_WARNING, "parports_virtual_leds_ctl: warning, parports_mark failed");
+        }
+      }
+    }
+    return value;
+  }
+
+  /* Записываем только изменившиеся порты */
+  int result = 0;
+  for(unsigned m = 0; m < members_num; m++)
+  {
+    if ((new_leds[m] != old_leds[m]) &&
+        (parport_leds_set(parports->parports[members[m]], new_leds[m]) == -1))
+    {
+      log_message(LOG_ERR, "parports_virtual_leds_ctl: failed to set leds on parport %u", members[m]);
+      result = -1;
+    }
+  }
+
+  if (result == -1)
+  {
+    /* Часть портов могла деградировать, планируем их повторное открытие */
+    if (parports_schedule(parports) == -1)
+    {
+      log_message(LOG_WARNING, "parports_virtual_leds_ctl: warning, parports_schedule failed");
+    }
+    return -1;
+  }
+
+  return value;
+}
+
+/* Выполнить операцию над группой зеркальных портов. Новое состояние
+   вычисляется один раз по состоянию основного порта, а затем записывается
+   на все порты группы подряд одним проходом */
+long long parports_mirror_leds_ctl(parports_t *parports, virtual_t *v, leds_operation_t operation, long long operand)
+{
+  unsigned primary = v->port[0];
+
+  /* В кадровом режиме текущее состояние берём из заднего буфера основного порта */
+  int leds = (parports->refresh > 0) ? parports->back[primary] : -1;
+  if (leds == -1)
+  {
+    leds = parport_leds_get(parports->parports[primary]);
+    if (leds == -1)
+    {
+      log_message(LOG_ERR, "parports_mirror_leds_ctl: failed to get current state of parport %u", primary);
+      return -1;
+    }
+  }
+
+  long long value = leds_calc_wide(leds, operation, operand, 12);
+  if (value == -1)
+  {
+    log_message(LOG_ERR, "parports_mirror_leds_ctl: leds_calc_wide failed");
+    return -1;
+  }
+
+  if (operation == LEDS_GET)
+  {
+    return value;
+  }
+
+  /* В кадровом режиме порты группы будут записаны вместе при выводе кадра */
+  if (parports->refresh > 0)
+  {
+    for(unsigned m = 0; m < v->mirror; m++)
+    {
+      if (parports->back[v->port[m]] != value)
+      {
+        parports->back[v->port[m]] = value;
+        if (parports_mark(parports, v->port[m]) == -1)
+        {
+          log_message(LOG_WARNING, "parports_mirror_leds_ctl: warning, parports_mark failed");
+        }
+      }
+    }
+    return value;
+  }
+
+  /* Записываем все порты группы, даже если запись на один из них не удалась.
+     Деградировавший порт получит состояние основного порта после открытия */
+  int result = 0;
+  for(unsigned m = 0; m < v->mirror; m++)
+  {
+    if (parport_retry_time(parports->parports[v->port[m]]) != -1)
+    {
+      continue;
+    }
+
+    if (parport_leds_set(parports->parports[v->port[m]], value) == -1)
+    {
+      log_message(LOG_ERR, "parports_mirror_leds_ctl: failed to set leds on parport %u", v->port[m]);
+      result = -1;
+    }
+  }
+
+  if (result == -1)
+  {
+    if (parports_schedule(parports) == -1)
+    {
+      log_message(LOG_WARNING, "parports_mirror_leds_ctl: warning, parports_schedule failed");
+    }
+  }
+
+  /* Состояние группы определяется основным портом */
+  if (parport_retry_time(parports->parports[primary]) != -1)
+  {
+    log_message(LOG_ERR, "parports_mirror_leds_ctl: primary parport %u is degraded", primary);
+    return -1;
+  }
+
+  return value;
+}
+
+/* Выполнить указанную операцию над портом из каталога */
+long long parports_leds_ctl(parports_t *parports, const unsigned parport, leds_operation_t operation, long long operand)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_leds_ctl: parports is NULL pointer");
+    return -1;
+  }
+
+  /* Порты с номерами после физических - виртуальные */
+  if ((parport >= parports->num) && (parport - parports->num < parports->virtual_num))
+  {
+    virtual_t *v = &(parports->virtual[parport - parports->num]);
+    if (v->mirror > 0)
+    {
+      return parports_mirror_leds_ctl(parports, v, operation, operand);
+    }
+    return parports_virtual_leds_ctl(parports, v, operation, operand);
+  }
+
+  /* Проверяем, что среди портов имеется порт с указанным номером */
+  if (parport >= parports->num)
+  {
+    log_message(LOG_ERR, "parports_leds_ctl: no parport with index %d", parport);
+    return -1;
+  } 
+
+  /* Физический порт содержит 12 светодиодов, лишние биты операнда отбрасываем */
+  if (operand > 0x0FFF)
+  {
+    if (operand != LEDS_ALL)
+    {
+      log_message(LOG_WARNING, "parports_leds_ctl: warning, operand is too big, high bits will be masked");
+    }
+    operand &= 0x0FFF;
+  }
+
+  /* Светодиодами порта с матрицей управляет поток развёртки, а линиями порта
+     с цепочками сдвиговых регистров или индикатором - их драйверы */
+  if (parports_driven(parports, parport))
+  {
+    log_message(LOG_ERR, "parports_leds_ctl: parport %d does not drive leds directly", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_leds_ctl: parport %d is removed", parport);
+    return -1;
+  }
+
+  /* В кадровом режиме операция выполняется над задним буфером, а изменённые
+     порты будут записаны при выводе следующего кадра */
+  if (parports->refresh > 0)
+  {
+    int leds = parports->back[parport];
+
+    /* Если состояние порта в заднем буфере ещё не известно, берём его из порта */
+    if ((leds == -1) && (operation != LEDS_SET))
+    {
+      leds = parport_leds_get(parports->parports[parport]);
+      if (leds == -1)
+      {
+        log_message(LOG_ERR, "parports_leds_ctl: failed to get current state of leds");
+        return -1;
+      }
+    }
+
+    leds = leds_calc(leds, operation, (int)operand);
+    if (leds == -1)
+    {
+      log_message(LOG_ERR, "parports_leds_ctl: leds_calc failed");
+      return -1;
+    }
+
+    if ((operation != LEDS_GET) && (leds != parports->back[parport]))
+    {
+      parports->back[parport] = leds;
+      if (parports_mark(parports, parport) == -1)
+      {
+        log_message(LOG_WARNING, "parports_leds_ctl: warning, parports_mark failed");
+      }
+    }
+
+    return leds;
+  }
+
+  /* Запоминаем, был ли порт готов к работе до выполнения операции */
+  int ready = (parport_retry_time(parports->parports[parport]) == -1);
+
+  /* Выполняем указанную операцию над портом из таблицы */
+  int leds = parport_leds_ctl(parports->parports[parport], operation, (int)operand);
+  if (leds == -1)
+  {
+    log_message(LOG_ERR, "parports_leds_ctl: failed to execute operation");
+
+    /* Если порт только что деградировал, то планируем его повторное открытие.
+       Для уже деградировавшего порта таймер не перевзводится */
+    if (ready && (parport_retry_time(parports->parports[parport]) != -1) &&
+        (parports_schedule(parports) == -1))
+    {
+      log_message(LOG_WARNING, "parports_leds_ctl: warning, parports_schedule failed");
+    }
+    return -1;
+  }
 
   return leds;
 }
+
+/* Выбрать порт для групповой операции. Порт должен быть физическим портом,
+   светодиодами которого можно управлять напрямую, если driven равно 0.
+   Возвращает 1, если порт выбран впервые, и 0, если он уже был выбран */
+int parports_select_one(parports_t *parports, int parport, int driven)
+{
+  if ((parport < 0) || ((unsigned)parport >= parports->num))
+  {
+    log_message(LOG_ERR, "parports_select_one: parport %d is not a physical parport", parport);
+    return -1;
+  }
+
+  if (!driven && parports_driven(parports, parport))
+  {
+    log_message(LOG_ERR, "parports_select_one: parport %d does not drive leds directly", parport);
+    return -1;
+  }
+
+  if (parports->removed[parport])
+  {
+    log_message(LOG_ERR, "parports_select_one: parport %d is removed", parport);
+    return -1;
+  }
+
+  if (parports->bulk_select[parport] != 0)
+  {
+    return 0;
+  }
+
+  parports->bulk_select[parport] = -1;
+  return 1;
+}
+
+/* Выбрать порты для групповой операции по списку через запятую. Элемент
+   списка - номер порта, имя порта или шаблон имён в формате fnmatch(3).
+   Шаблон выбирает все физические порты с подходящими именами, светодиодами
+   которых можно управлять напрямую. Список all выбирает все такие порты.
+   Если driven равно 1, то выбираются и порты, линиями которых управляют
+   драйверы устройств. Возвращает количество выбранных портов */
+int parports_select(parports_t *parports, const char *list, int driven)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_select: parports is NULL pointer");
+    return -1;
+  }
+
+  if (list == NULL)
+  {
+    log_message(LOG_ERR, "parports_select: list is NULL pointer");
+    return -1;
+  }
+
+  memset(parports->bulk_select, 0, sizeof(int) * parports->num);
+
+  if (strcmp(list, "all") == 0)
+  {
+    int selected = 0;
+    for(unsigned i = 0; i < parports->num; i++)
+    {
+      if ((driven || !parports_driven(parports, i)) && !parports->removed[i])
+      {
+        parports->bulk_select[i] = -1;
+        selected++;
+      }
+    }
+    return selected;
+  }
+
+  int selected = 0;
+  const char *p = list;
+  while (1)
+  {
+    while (isspace(p[0]))
+    {
+      p++;
+    }
+
+    /* Выделяем элемент списка до запятой или конца строки */
+    size_t len = 0;
+    while ((p[len] != '\0') && (p[len] != ',') && !isspace(p[len]))
+    {
+      len++;
+    }
+
+    if ((len == 0) || (len > PARPORTS_NAME_MAX))
+    {
+      log_message(LOG_ERR, "parports_select: wrong list of parports: %s", list);
+      return -1;
+    }
+
+    char item[PARPORTS_NAME_MAX + 1];
+    memcpy(item, p, len);
+    item[len] = '\0';
+    p += len;
+
+    int n = 0;
+    if (isdigit(item[0]))
+    {
+      char *q;
+      unsigned long parport = strtoul(item, &q, 10);
+      if ((q[0] != '\0') || (parport >= parports->num))
+      {
+        log_message(LOG_ERR, "parports_select: no parport with index %s", item);
+        return -1;
+      }
+      n = parports_select_one(parports, parport, driven);
+    }
+    /* Шаблон перебирает все имена оставшихся в каталоге портов, светодиодами
+       которых можно управлять */
+    else if (strpbrk(item, "*?[") != NULL)
+    {
+      for(unsigned i = 0; i < parports->names_size; i++)
+      {
+        name_t *entry = &(parports->names[i]);
+        if ((entry->name != NULL) && !entry->virtual && !parports->removed[entry->parport] &&
+            (driven || !parports_driven(parports, entry->parport)) &&
+            (fnmatch(item, entry->name, 0) == 0))
+        {
+          n += parports_select_one(parports, entry->parport, driven);
+        }
+      }
+    }
+    else
+    {
+      int parport = parports_lookup(parports, item, len);
+      if (parport == -1)
+      {
+        log_message(LOG_ERR, "parports_select: no parport with name %s", item);
+        return -1;
+      }
+      n = parports_select_one(parports, parport, driven);
+    }
+
+    if (n == -1)
+    {
+      log_message(LOG_ERR, "parports_select: failed to select parport %s", item);
+      return -1;
+    }
+    selected += n;
+
+    while (isspace(p[0]))
+    {
+      p++;
+    }
+
+    if (p[0] == '\0')
+    {
+      return selected;
+    }
+
+    if (p[0] != ',')
+    {
+      log_message(LOG_ERR, "parports_select: wrong list of parports: %s", list);
+      return -1;
+    }
+    p++;
+  }
+}
+
+/* Проверить списки портов шардов: каждый список должен выбирать хотя бы
+   один физический порт, а каждый порт должен входить не более чем в один
+   список */
+int parports_partition(parports_t *parports, const char **lists, unsigned num)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_partition: parports is NULL pointer");
+    return -1;
+  }
+
+  if ((lists == NULL) && (num > 0))
+  {
+    log_message(LOG_ERR, "parports_partition: lists is NULL pointer");
+    return -1;
+  }
+
+  unsigned char *owned = calloc(parports->num + 1, sizeof(unsigned char));
+  if (owned == NULL)
+  {
+    log_message(LOG_ERR, "parports_partition: failed to allocate memory for owned flags");
+    return -1;
+  }
+
+  int result = 0;
+  for(unsigned k = 0; (result == 0) && (k < num); k++)
+  {
+    int n = parports_select(parports, lists[k], 1);
+    if (n < 1)
+    {
+      log_message(LOG_ERR, "parports_partition: no parports in list %s", lists[k]);
+      result = -1;
+      break;
+    }
+
+    for(unsigned i = 0; i < parports->num; i++)
+    {
+      if (parports->bulk_select[i] == 0)
+      {
+        continue;
+      }
+
+      if (owned[i])
+      {
+        log_message(LOG_ERR, "parports_partition: parport %u is listed more than once", i);
+        result = -1;
+        break;
+      }
+      owned[i] = 1;
+    }
+  }
+
+  free(owned);
+  return result;
+}
+
+/* Отключить порт, удаляемый из каталога, от цикла обработки событий: удалить
+   сокет прерываний порта и прервать идущий на порту захват. Функция окончания
+   прерванного захвата вызывается сразу, результат захвата при этом недоступен */
+void parports_detach(parports_t *parports, const unsigned parport)
+{
+  if ((parports->inputs[parport] != NULL) && (parports->evloop != NULL) &&
+      (evloop_delete_socket(parports->evloop, parports->inputs[parport]->socket) == -1))
+  {
+    log_message(LOG_WARNING, "parports_detach: warning, evloop_delete_socket failed");
+  }
+
+  if ((parports->sampler[parport] != NULL) && (parports->capture_done[parport] != NULL))
+  {
+    int (*done)(void *data) = parports->capture_done[parport];
+    parports->capture_done[parport] = NULL;
+
+    if (sampler_release(parports->sampler[parport]) == -1)
+    {
+      log_message(LOG_WARNING, "parports_detach: warning, sampler_release failed");
+    }
+
+    if (done(parports->capture_data[parport]) == -1)
+    {
+      log_message(LOG_WARNING, "parports_detach: warning, capture callback failed");
+    }
+  }
+}
+
+/* Оставить в каталоге только порты из списка list, если keep равно 1, или
+   все порты, кроме портов из списка, если keep равно 0 */
+int parports_restrict(parports_t *parports, const char *list, int keep)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_restrict: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports_select(parports, list, 1) == -1)
+  {
+    log_message(LOG_ERR, "parports_restrict: wrong list of parports %s", list);
+    return -1;
+  }
+
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if (((parports->bulk_select[i] != 0) != (keep != 0)) && !parports->removed[i])
+    {
+      parports_detach(parports, i);
+      parports->removed[i] = 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Выполнить одну операцию над несколькими портами из каталога. Новые
+   состояния вычисляются одним проходом прямо над массивом состояний
+   светодиодов каталога, на который ссылаются порты, а в кадровом режиме -
+   над задним буфером. Изменившиеся порты записываются подряд или помечаются
+   для вывода в следующем кадре */
+int parports_bulk_leds_ctl(parports_t *parports, const char *list, leds_operation_t operation, long long operand)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_bulk_leds_ctl: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports_select(parports, list, 0) == -1)
+  {
+    log_message(LOG_ERR, "parports_bulk_leds_ctl: parports_select failed");
+    return -1;
+  }
+
+  /* Физический порт содержит 12 светодиодов, лишние биты операнда отбрасываем */
+  if (operand > 0x0FFF)
+  {
+    if (operand != LEDS_ALL)
+    {
+      log_message(LOG_WARNING, "parports_bulk_leds_ctl: warning, operand is too big, high bits will be masked");
+    }
+    operand &= 0x0FFF;
+  }
+
+  /* В кадровом режиме операция выполняется над задним буфером, иначе -
+     над кэшами светодиодов портов */
+  int *leds = (parports->refresh > 0) ? parports->back : parports->leds;
+
+  /* Дочитываем из портов не известные состояния выбранных портов. Порты,
+     состояние которых прочитать не удалось, пропускаем */
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if ((parports->bulk_select[i] == 0) || (leds[i] != -1))
+    {
+      continue;
+    }
+
+    leds[i] = parport_leds_get(parports->parports[i]);
+    if (leds[i] == -1)
+    {
+      log_message(LOG_WARNING, "parports_bulk_leds_ctl: warning, state of parport %u is unknown, skipping it", i);
+      parports->bulk_select[i] = 0;
+    }
+  }
+
+  int changed = leds_calc_bulk(leds, parports->bulk_next, parports->bulk_select,
+                               parports->num, operation, (int)operand);
+  if (changed == -1)
+  {
+    log_message(LOG_ERR, "parports_bulk_leds_ctl: leds_calc_bulk failed");
+    return -1;
+  }
+
+  if (changed == 0)
+  {
+    return 0;
+  }
+
+  /* В кадровом режиме изменённые порты будут записаны вместе при выводе кадра */
+  if (parports->refresh > 0)
+  {
+    for(unsigned i = 0; i < parports->num; i++)
+    {
+      if (parports->bulk_next[i] != leds[i])
+      {
+        parports->back[i] = parports->bulk_next[i];
+        if (parports_mark(parports, i) == -1)
+        {
+          log_message(LOG_WARNING, "parports_bulk_leds_ctl: warning, parports_mark failed");
+        }
+      }
+    }
+    return changed;
+  }
+
+  /* Записываем только изменившиеся порты */
+  int result = 0;
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if ((parports->bulk_next[i] != leds[i]) &&
+        (parport_leds_set(parports->parports[i], parports->bulk_next[i]) == -1))
+    {
+      log_message(LOG_ERR, "parports_bulk_leds_ctl: failed to set leds on parport %u", i);
+      result = -1;
+    }
+  }
+
+  if (result == -1)
+  {
+    if (parports_schedule(parports) == -1)
+    {
+      log_message(LOG_WARNING, "parports_bulk_leds_ctl: warning, parports_schedule failed");
+    }
+    return -1;
+  }
+
+  return changed;
+}
+
+/* Указать файл со списком портов, перечитываемый по сигналу HUP */
+int parports_set_reload(parports_t *parports, const char *pathname)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_reload: parports is NULL pointer");
+    return -1;
+  }
+
+  if (pathname == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_reload: pathname is NULL pointer");
+    return -1;
+  }
+
+  char *copy = strdup(pathname);
+  if (copy == NULL)
+  {
+    log_message(LOG_ERR, "parports_set_reload: failed to allocate memory for pathname");
+    return -1;
+  }
+
+  free(parports->reload_pathname);
+  parports->reload_pathname = copy;
+  return 0;
+}
+
+/* Возвращает номер порта из файла со списком портов с указанным путём
+   или -1, если такого порта нет */
+int parports_reload_find(parports_t *parports, const char *pathname)
+{
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if (parports->listed[i] && (strcmp(parport_pathname(parports->parports[i]), pathname) == 0))
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Перечитать файл со списком портов и привести к нему каталог */
+int parports_reload(parports_t *parports)
+{
+  if (parports == NULL)
+  {
+    log_message(LOG_ERR, "parports_reload: parports is NULL pointer");
+    return -1;
+  }
+
+  if (parports->reload_pathname == NULL)
+  {
+    return 0;
+  }
+
+  FILE *file = fopen(parports->reload_pathname, "r");
+  if (file == NULL)
+  {
+    log_error(LOG_ERR, "parports_reload: failed to open list of parports");
+    return -1;
+  }
+
+  /* Читаем файл целиком до изменения каталога, чтобы ошибка чтения
+     не оставила каталог изменённым наполовину */
+  char **lines = NULL;
+  unsigned lines_num = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  int result = 0;
+  while (getline(&line, &line_size, file) != -1)
+  {
+    char **p = realloc(lines, sizeof(char *) * (lines_num + 1));
+    if (p == NULL)
+    {
+      log_message(LOG_ERR, "parports_reload: failed to allocate memory for list of parports");
+      result = -1;
+      break;
+    }
+    lines = p;
+
+    lines[lines_num] = strdup(line);
+    if (lines[lines_num] == NULL)
+    {
+      log_message(LOG_ERR, "parports_reload: failed to allocate memory for list of parports");
+      result = -1;
+      break;
+    }
+    lines_num++;
+  }
+  if (ferror(file))
+  {
+    log_error(LOG_ERR, "parports_reload: failed to read list of parports");
+    result = -1;
+  }
+  free(line);
+  fclose(file);
+
+  /* Признаки портов, оставшихся в файле. Порты из файла добавляются только
+     в конец таблицы, поэтому признаков строк файла хватит и для новых портов */
+  unsigned char *seen = NULL;
+  /* Номер порта каждой строки файла или -1 и остаток строки с именами порта */
+  int *ports = NULL;
+  char **rest = NULL;
+  if (result == 0)
+  {
+    seen = calloc(parports->num + lines_num + 1, 1);
+    ports = malloc(sizeof(int) * (lines_num + 1));
+    rest = malloc(sizeof(char *) * (lines_num + 1));
+    if ((seen == NULL) || (ports == NULL) || (rest == NULL))
+    {
+      log_message(LOG_ERR, "parports_reload: failed to allocate memory");
+      result = -1;
+    }
+  }
+
+  if (result == -1)
+  {
+    for(unsigned k = 0; k < lines_num; k++)
+    {
+      free(lines[k]);
+    }
+    free(lines);
+    free(seen);
+    free(ports);
+    free(rest);
+    return -1;
+  }
+
+  unsigned added = 0;
+  unsigned removed = 0;
+  unsigned kept = 0;
+
+  /* Первое слово строки - путь к порту, остальные - имена порта.
+     Пустые строки и строки, начинающиеся с #, пропускаются */
+  for(unsigned k = 0; k < lines_num; k++)
+  {
+    ports[k] = -1;
+    char *pathname = strtok_r(lines[k], " \t\r\n", &(rest[k]));
+    if ((pathname == NULL) || (pathname[0] == '#'))
+    {
+      continue;
+    }
+
+    int i = parports_reload_find(parports, pathname);
+    if ((i != -1) && seen[i])
+    {
+      log_message(LOG_WARNING, "parports_reload: warning, parport %s is listed twice", pathname);
+      continue;
+    }
+
+    /* Порты, заданные в командной строке, из файла не добавляются */
+    int fixed = 0;
+    for(unsigned j = 0; j < parports->num; j++)
+    {
+      if (!parports->listed[j] && (strcmp(parport_pathname(parports->parports[j]), pathname) == 0))
+      {
+        fixed = 1;
+        break;
+      }
+    }
+    if (fixed)
+    {
+      log_message(LOG_WARNING, "parports_reload: warning, parport %s is given in command line", pathname);
+      continue;
+    }
+
+    if (i == -1)
+    {
+      if (parports_add(parports, pathname) == -1)
+      {
+        log_message(LOG_ERR, "parports_reload: failed to add parport %s", pathname);
+        result = -1;
+        continue;
+      }
+      i = parports->num - 1;
+      parports->listed[i] = 1;
+
+      if ((parport_set_order(parports->parports[i], parports->order) == -1) ||
+          (parport_set_measure(parports->parports[i], parports->measure) == -1))
+      {
+        log_message(LOG_WARNING, "parports_reload: warning, failed to configure parport %d", i);
+      }
+      added++;
+    }
+    else if (parports->removed[i])
+    {
+      /* Порт вернулся в файл - занимает свой прежний номер */
+      parports->removed[i] = 0;
+      added++;
+    }
+    else
+    {
+      kept++;
+      seen[i] = 1;
+      ports[k] = i;
+      continue;
+    }
+
+    seen[i] = 1;
+    ports[k] = i;
+
+    /* Работающий каталог открывает новые порты сразу. Если открыть порт
+       не получилось, то он остаётся деградировавшим до следующей попытки */
+    if ((parports->evloop != NULL) && (parport_open(parports->parports[i]) == -1))
+    {
+      log_message(LOG_WARNING, "parports_reload: warning, cannot open parport %d, it is degraded", i);
+    }
+  }
+
+  /* Закрываем порты, пропавшие из файла */
+  for(unsigned i = 0; i < parports->num; i++)
+  {
+    if (parports->listed[i] && !parports->removed[i] && !seen[i])
+    {
+      parports_detach(parports, i);
+      if (parport_release(parports->parports[i]) == -1)
+      {
+        log_message(LOG_WARNING, "parports_reload: warning, failed to close parport %d", i);
+      }
+      parports->removed[i] = 1;
+      parports->back[i] = -1;
+      removed++;
+    }
+  }
+
+  /* Имена портов из файла заменяются именами из файла целиком. Новая таблица
+     имён строится отдельно от прежней и заменяет её только целиком */
+  name_t *names = parports->names;
+  unsigned names_size = parports->names_size;
+  unsigned names_num = parports->names_num;
+  parports->names = NULL;
+  parports->names_size = 0;
+  parports->names_num = 0;
+
+  int names_result = 0;
+  for(unsigned i = 0; (names_result == 0) && (i < names_size); i++)
+  {
+    if ((names[i].name == NULL) || (!names[i].virtual && parports->listed[names[i].parport]))
+    {
+      continue;
+    }
+
+    names_result = parports_name_insert(parports, names[i].name, names[i].parport, names[i].virtual);
+  }
+
+  for(unsigned k = 0; (names_result == 0) && (k < lines_num); k++)
+  {
+    if (ports[k] == -1)
+    {
+      continue;
+    }
+
+    char *name = strtok_r(NULL, " \t\r\n", &(rest[k]));
+    for(; name != NULL; name = strtok_r(NULL, " \t\r\n", &(rest[k])))
+    {
+      if (parports_name_insert(parports, name, ports[k], 0) == -1)
+      {
+        log_message(LOG_WARNING, "parports_reload: warning, skipping name %s of parport %d", name, ports[k]);
+      }
+    }
+  }
+
+  if (names_result == -1)
+  {
+    log_message(LOG_ERR, "parports_reload: failed to rebuild names of parports");
+    parports_names_free(parports->names, parports->names_size);
+    parports->names = names;
+    parports->names_size = names_size;
+    parports->names_num = names_num;
+    result = -1;
+  }
+  else
+  {
+    parports_names_free(names, names_size);
+  }
+
+  for(unsigned k = 0; k < lines_num; k++)
+  {
+    free(lines[k]);
+  }
+  free(lines);
+  free(seen);
+  free(ports);
+  free(rest);
+
+  if ((parports->evloop != NULL) && (parports_schedule(parports) == -1))
+  {
+    log_message(LOG_WARNING, "parports_reload: warning, parports_schedule failed");
+  }
+
+  log_message(LOG_NOTICE, "parports_reload: %u parports added, %u removed, %u kept", added, removed, kept);
+  return result;
+}
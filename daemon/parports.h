@@ -1,7 +1,10 @@
 #ifndef __PARPORTS__
 #define __PARPORTS__
 
+#include <stddef.h>
+
 #include "parport.h"
+#include "evloop.h"
 
 /* Каталог портов */
 struct parports_s;
@@ -16,6 +19,13 @@ int parports_add(parports_t *parports, const char *pathname);
 /* Возвращает количество портов в каталоге */
 int parports_number(parports_t *parports);
 
+/* Путь к файлу устройства порта, количество записей в его регистры,
+   количество обновлений состояния светодиодов и их суммарное время в
+   наносекундах. Возвращает -1 для отсутствующего порта или порта, удалённого
+   из каталога */
+int parports_write_stats(parports_t *parports, const unsigned parport, const char **pathname,
+                         unsigned long long *writes, unsigned long long *calls, long long *ns);
+
 /* Открыть все порты в каталоге.
 
    Эта операция вынесена в отдельную функцию для того, чтобы отделить
@@ -23,18 +33,231 @@ int parports_number(parports_t *parports);
 
    Подготовка списка осуществляется ведущим процессом до демонизации,
    открытие портов осуществляется ведомым процессом до сброса привилегий,
-   использование портов осуществляется ведомым процессом после сброса привилегий. */
+   использование портов осуществляется ведомым процессом после сброса привилегий.
+
+   Порты, которые не удалось открыть, не мешают работе с остальными портами:
+   они остаются в деградировавшем состоянии, а повторные попытки открыть их
+   выполняет таймер, созданный функцией parports_timer_create. */
 int parports_open(parports_t *parports);
 
+/* Запомнить открытый и захваченный порт fd с путём pathname и состоянием
+   светодиодов leds, переданный предыдущей версией программы при обновлении.
+   Функция parports_open вместо открытия порта каталога с тем же путём займёт
+   его переданным портом без записи регистров, а переданные порты, которых
+   нет в каталоге, закроет */
+int parports_adopt(parports_t *parports, const char *pathname, int fd, int leds);
+
+/* Получить путь, дескриптор открытого файла устройства и состояние
+   светодиодов порта из каталога для передачи новой версии программы
+   при обновлении. Состояние светодиодов равно -1, если оно не известно.
+   Возвращает -1, если порт не открыт */
+int parports_snapshot(parports_t *parports, const unsigned parport,
+                      const char **pathname, int *fd, int *leds);
+
+/* Вывести кадр: записать на порты состояния светодиодов из заднего буфера
+   только для изменённых портов */
+int parports_flush(parports_t *parports);
+
+/* Создание таймера для цикла обработки событий, который повторно открывает
+   деградировавшие порты из каталога с экспоненциально растущей задержкой
+   и выводит кадры в кадровом режиме. Для открытых портов, линии состояния
+   которых нужно отслеживать, в цикл обработки событий также добавляются
+   сокеты прерываний */
+socket_t *parports_timer_create(parports_t *parports, evloop_t *evloop);
+
+/* Включить кадровый режим с указанным периодом вывода кадров в миллисекундах.
+   Нулевой период выключает кадровый режим.
+
+   В кадровом режиме операции над светодиодами меняют только задний буфер
+   каталога, а таймер, созданный функцией parports_timer_create, раз в период
+   записывает на порты состояния только тех портов, которые изменились.
+   Количество записей в регистры портов при этом ограничено частотой кадров,
+   а не частотой поступления команд */
+int parports_set_refresh(parports_t *parports, long long refresh);
+
+/* Выбрать порядок записи регистров данных и управления для всех портов в каталоге */
+int parports_set_order(parports_t *parports, parport_order_t order);
+
+/* Включить или выключить измерение промежутков между записями регистров
+   для всех портов в каталоге */
+int parports_set_measure(parports_t *parports, int measure);
+
+/* Вывести в буфер статистику записей регистров порта из каталога и
+   распределение промежутков между записями регистров */
+int parports_gaps(parports_t *parports, const unsigned parport, char *buf, size_t size);
+
+/* Подключить к последнему добавленному в каталог порту светодиодную матрицу
+   из rows строк и cols столбцов. Развёртка матрицы запускается функцией
+   parports_open, после чего операции над светодиодами этого порта
+   недоступны, а состоянием матрицы управляет функция parports_matrix_set */
+int parports_set_matrix(parports_t *parports, unsigned rows, unsigned cols);
+
+/* Изменить частоту развёртки матрицы на последнем добавленном в каталог порту */
+int parports_set_scan_rate(parports_t *parports, unsigned rate);
+
+/* Выбрать процессор для потока развёртки матрицы на последнем добавленном в каталог порту */
+int parports_set_scan_cpu(parports_t *parports, int cpu);
+
+/* Записать новое содержимое кадрового буфера матрицы на порту из каталога.
+   Возвращает записанное значение */
+long long parports_matrix_set(parports_t *parports, const unsigned parport, long long bits);
+
+/* Вывести в буфер счётчики развёртки матрицы на порту из каталога */
+int parports_scan(parports_t *parports, const unsigned parport, char *buf, size_t size);
+
+/* Подключить к последнему добавленному в каталог порту chains цепочек
+   сдвиговых регистров по length бит. Подключение описано в parport.h */
+int parports_set_shift(parports_t *parports, unsigned chains, unsigned length);
+
+/* Вывести новое состояние выходов цепочек сдвиговых регистров на порту из каталога.
+   Вектор из size байт задаётся в порядке от младших байтов к старшим */
+int parports_shift(parports_t *parports, const unsigned parport, const unsigned char *vector, size_t size);
+
+/* Вывести в буфер счётчики вывода на цепочки сдвиговых регистров порта из каталога */
+int parports_shift_stats(parports_t *parports, const unsigned parport, char *buf, size_t size);
+
+/* Подключить к последнему добавленному в каталог порту символьный индикатор
+   из cols столбцов и rows строк. Подключение описано в lcd.h */
+int parports_set_lcd(parports_t *parports, unsigned cols, unsigned rows);
+
+/* Включить 4-битный режим обмена с индикатором на последнем добавленном в каталог порту */
+int parports_set_lcd_4bit(parports_t *parports);
+
+/* Вывести текст на индикатор, подключенный к порту из каталога. На индикатор
+   отправляются только изменившиеся символы, количество которых возвращается */
+int parports_lcd_print(parports_t *parports, const unsigned parport, const char *text);
+
+/* Отслеживать линии состояния последнего добавленного в каталог порта.
+
+   Прерывание от порта вызывает фронт сигнала на линии ACK, поэтому кнопки
+   и датчики, подключенные к другим линиям состояния, должны также формировать
+   импульс на линии ACK. После прерывания каталог выжидает время успокоения
+   линий, читает их состояние и, если оно изменилось, рассылает событие
+   "event port <N> status <0xSS>" функцией, заданной parports_set_publish */
+int parports_set_input(parports_t *parports);
+
+/* Задать время успокоения линий состояния после прерывания в миллисекундах.
+   При нулевом времени линии читаются сразу при получении прерывания */
+int parports_set_debounce(parports_t *parports, long long debounce);
+
+/* Задать функцию рассылки событий об изменении линий состояния портов */
+int parports_set_publish(parports_t *parports,
+                         int (*publish)(const char *message, void *data),
+                         void *data);
+
+/* Включить захват линий состояния на последнем добавленном в каталог порту
+   с буфером захвата из size байт. Захват описан в sampler.h */
+int parports_set_sampler(parports_t *parports, size_t size);
+
+/* Выбрать процессор для потока захвата на последнем добавленном в каталог порту */
+int parports_set_sampler_cpu(parports_t *parports, int cpu);
+
+/* Запустить захват samples выборок линий состояния порта из каталога.
+   По окончании захвата функция done вызывается с данными data из цикла
+   обработки событий, после чего результат можно получить функцией
+   parports_capture_result. Захват занимает порт до вызова
+   parports_capture_release */
+int parports_capture(parports_t *parports, const unsigned parport, unsigned long long samples,
+                     int (*done)(void *data), void *data);
+
+/* Вывести в буфер сводку законченного захвата на порту из каталога и получить
+   указатель на данные захвата и их размер */
+int parports_capture_result(parports_t *parports, const unsigned parport, char *buf, size_t size,
+                            const unsigned char **data, size_t *data_size);
+
+/* Прервать захват на порту из каталога, если он ещё идёт, и освободить захват */
+int parports_capture_release(parports_t *parports, const unsigned parport);
+
+/* Включить режим счётчика импульсов на линии ACK последнего добавленного
+   в каталог порта. Каждый фронт сигнала на линии ACK вызывает прерывание,
+   которое драйвер ppdev подсчитывает сам, не пробуждая демон. Раз в секунду
+   таймер каталога забирает у драйвера накопленное количество прерываний,
+   добавляет его к 64-битному счётчику порта и рассылает событие
+   "event port <N> count <C> rate <R>" функцией, заданной parports_set_publish,
+   где R - частота импульсов за прошедшую секунду */
+int parports_set_counter(parports_t *parports);
+
+/* Получить значение счётчика импульсов порта из каталога через count и,
+   если reset отличен от нуля, сбросить счётчик */
+int parports_counter(parports_t *parports, const unsigned parport, int reset, unsigned long long *count);
+
+/* Прочитать линии состояния порта из каталога. Биты результата описаны
+   у функции parport_status в parport.h */
+int parports_status(parports_t *parports, const unsigned parport);
+
+/* Добавить в каталог виртуальный порт - логический регистр из width бит
+   шириной до LEDS_MAX_WIDTH, составленный из светодиодов физических портов.
+   Бит k логического регистра соответствует светодиоду bits[k] порта ports[k].
+   Физические порты должны быть добавлены в каталог раньше, а виртуальные
+   порты получают номера вслед за всеми физическими портами */
+int parports_add_virtual(parports_t *parports, unsigned width, const unsigned *ports, const unsigned *bits);
+
+/* Добавить в каталог группу зеркальных портов из num физических портов,
+   добавленных в каталог раньше. Группа получает номер вслед за всеми
+   физическими портами наравне с виртуальными портами. Изменения состояния
+   светодиодов группы выводятся на все её порты одним проходом, а текущее
+   состояние группы берётся из кэша основного порта ports[0] */
+int parports_add_mirror(parports_t *parports, unsigned num, const unsigned *ports);
+
+/* Добавить имя последнему добавленному в каталог порту: физическому,
+   виртуальному или группе зеркальных портов. Имя начинается с буквы
+   и состоит из букв, цифр и символов -, _ и ., у порта может быть несколько
+   имён. Имена хранятся в хеш-таблице и должны быть уникальными */
+int parports_add_name(parports_t *parports, const char *name);
+
+/* Возвращает номер порта с указанным именем из len символов или -1,
+   если порта с таким именем нет */
+int parports_lookup(parports_t *parports, const char *name, size_t len);
+
+/* Указать файл со списком портов, который читается при запуске каталога
+   и перечитывается по сигналу HUP. Сигнал HUP должен быть заблокирован,
+   а таймер каталога получает его через signalfd */
+int parports_set_reload(parports_t *parports, const char *pathname);
+
+/* Перечитать файл со списком портов. Каждая строка файла содержит путь
+   к порту и, через пробел, имена порта. Новые порты добавляются в конец
+   каталога и в работающем каталоге сразу открываются, порты, пропавшие
+   из файла, закрываются, а их номера остаются за ними. Остальные порты
+   и их клиенты не затрагиваются */
+int parports_reload(parports_t *parports);
+
+/* Возвращает ширину регистра светодиодов порта из каталога: 12 для
+   физического порта и ширину логического регистра для виртуального */
+int parports_width(parports_t *parports, const unsigned parport);
+
 /* Закрыть все порты в таблице, удалить каталог портов */
 int parports_destroy(parports_t *parports);
 
 /* Выполнить указанную операцию над портом из каталога.
 
    Для указания конкретного порта используется его порядковый номер в каталоге.
-   Нумерация портов начинается с нуля.
+   Нумерация портов начинается с нуля, виртуальные порты и группы зеркальных
+   портов нумеруются вслед за физическими.
+
+   Операции над портами leds_operation_t определены в parport.h. Операции над
+   виртуальным портом выполняются над всей шириной его логического регистра */
+long long parports_leds_ctl(parports_t *parports, const unsigned parport, leds_operation_t operation, long long value);
+
+/* Выполнить одну операцию над несколькими физическими портами из каталога.
+   Порты задаются списком list: all - все порты, светодиодами которых можно
+   управлять напрямую, или номера, имена портов и шаблоны имён в формате
+   fnmatch(3) через запятую. Новые состояния
+   вычисляются сразу для всех выбранных портов, а записываются только
+   изменившиеся порты. Возвращает количество изменившихся портов */
+int parports_bulk_leds_ctl(parports_t *parports, const char *list, leds_operation_t operation, long long operand);
+
+/* Проверить списки портов шардов - ведомых процессов, каждый из которых
+   обслуживает свою часть портов. Списки задаются так же, как в функции
+   parports_bulk_leds_ctl, но выбирают и порты, линиями которых управляют
+   драйверы устройств. Каждый список должен выбирать хотя бы один порт,
+   а каждый порт должен входить не более чем в один список */
+int parports_partition(parports_t *parports, const char **lists, unsigned num);
 
-   Операции над портами leds_operation_t определены в parport.h */
-int parports_leds_ctl(parports_t *parports, const unsigned parport, leds_operation_t operation, int value);
+/* Оставить в каталоге только порты из списка list, если keep равно 1, или
+   все порты, кроме портов из списка, если keep равно 0. Остальные порты
+   помечаются удалёнными: они не открываются, а команды над ними завершаются
+   ошибкой, при этом номера портов не меняются. Вызывается в ведомом процессе
+   шарда до открытия портов */
+int parports_restrict(parports_t *parports, const char *list, int keep);
 
 #endif
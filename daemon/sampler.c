@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include "daemon.h"
+#include "timer.h"
+#include "sampler.h"
+
+/* Структура данных захвата. Пока поток захвата работает, его результаты
+   принадлежат ему, а поток цикла обработки событий читает их только после
+   того, как поток захвата выставит признак done */
+struct sampler_s
+{
+  parport_t *parport;     /* Порт, линии состояния которого захватываются */
+  size_t size;            /* Размер буфера захвата */
+  unsigned char *buffer;  /* Буфер захвата */
+  int cpu;                /* Процессор для потока захвата или -1 */
+
+  int fd;                 /* Копия дескриптора порта на время захвата или -1 */
+  int notify;             /* Копия дескриптора eventfd на время захвата или -1 */
+  unsigned long long samples; /* Заказанное количество выборок */
+
+  int started;            /* Признак того, что поток захвата запущен */
+  int stop;               /* Признак необходимости прервать захват */
+  int done;               /* Признак окончания захвата */
+  pthread_t thread;       /* Поток захвата */
+
+  unsigned long long taken;   /* Количество сделанных выборок */
+  unsigned long long changes; /* Количество записанных изменений */
+  unsigned long long dropped; /* Количество отброшенных изменений */
+  size_t used;                /* Количество занятых байтов буфера */
+  long long duration;         /* Длительность захвата, нс */
+  int error;                  /* Признак ошибки чтения линий */
+};
+
+/* Подготовка захвата на указанном порту с буфером захвата из size байт */
+sampler_t *sampler_create(parport_t *parport, size_t size)
+{
+  if (parport == NULL)
+  {
+    log_message(LOG_ERR, "sampler_create: parport is NULL pointer");
+    return NULL;
+  }
+
+  if (size < 1)
+  {
+    log_message(LOG_ERR, "sampler_create: size is not a positive integer");
+    return NULL;
+  }
+
+  sampler_t *sampler = malloc(sizeof(sampler_t));
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "sampler_create: failed to allocate memory for sampler");
+    return NULL;
+  }
+
+  /* Буфер выделяется заранее, чтобы захват не зависел от выделения памяти */
+  sampler->buffer = malloc(size);
+  if (sampler->buffer == NULL)
+  {
+    log_message(LOG_ERR, "sampler_create: failed to allocate %zu bytes for capture buffer", size);
+    free(sampler);
+    return NULL;
+  }
+
+  sampler->parport = parport;
+  sampler->size = size;
+  sampler->cpu = -1;
+  sampler->fd = -1;
+  sampler->notify = -1;
+  sampler->samples = 0;
+  sampler->started = 0;
+  sampler->stop = 0;
+  sampler->done = 0;
+  sampler->taken = 0;
+  sampler->changes = 0;
+  sampler->dropped = 0;
+  sampler->used = 0;
+  sampler->duration = 0;
+  sampler->error = 0;
+
+  return sampler;
+}
+
+/* Выбор процессора, к которому будет привязан поток захвата */
+int sampler_set_cpu(sampler_t *sampler, int cpu)
+{
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "sampler_set_cpu: sampler is NULL pointer");
+    return -1;
+  }
+
+  sampler->cpu = cpu;
+  return 0;
+}
+
+/* Запись изменения в буфер захвата. Возвращает -1, если изменение не поместилось */
+int sampler_record(sampler_t *sampler, long long delta, int status)
+{
+  unsigned char bytes[10];
+  unsigned n = 0;
+
+  uint64_t value = ((uint64_t)delta << 5) | (uint64_t)status;
+  do
+  {
+    bytes[n] = value & 0x7F;
+    value >>= 7;
+    if (value != 0)
+    {
+      bytes[n] |= 0x80;
+    }
+    n++;
+  }
+  while (value != 0);
+
+  if (sampler->used + n > sampler->size)
+  {
+    return -1;
+  }
+
+  memcpy(&(sampler->buffer[sampler->used]), bytes, n);
+  sampler->used += n;
+  return 0;
+}
+
+/* Поток захвата. Линии читаются подряд без пауз, а время запрашивается
+   только при изменении состояния линий, чтобы не снижать частоту выборок */
+void *sampler_capture(void *data)
+{
+  sampler_t *sampler = data;
+
+  /* Привязываем поток к указанному процессору */
+  if (sampler->cpu != -1)
+  {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(sampler->cpu, &cpuset);
+
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (err != 0)
+    {
+      log_message(LOG_WARNING, "sampler_capture: warning, failed to pin thread to cpu %d: %s", sampler->cpu, strerror(err));
+    }
+  }
+
+  int last = -1;
+  long long start = timer_now_ns();
+  long long last_time = start;
+
+  unsigned long long i = 0;
+  for(; i < sampler->samples; i++)
+  {
+    /* Проверка признака остановки стоит дешевле чтения линий, поэтому
+       выполняется на каждой выборке */
+    if (__atomic_load_n(&(sampler->stop), __ATOMIC_RELAXED))
+    {
+      break;
+    }
+
+    int status = parport_read_status(sampler->fd);
+    if (status == -1)
+    {
+      sampler->error = 1;
+      break;
+    }
+
+    if (status != last)
+    {
+      long long now = timer_now_ns();
+      long long delta = (last == -1) ? 0 : now - last_time;
+
+      if (sampler_record(sampler, delta, status) == -1)
+      {
+        sampler->dropped++;
+      }
+      else
+      {
+        sampler->changes++;
+        last_time = now;
+      }
+      last = status;
+    }
+  }
+
+  sampler->taken = i;
+  sampler->duration = timer_now_ns() - start;
+  __atomic_store_n(&(sampler->done), 1, __ATOMIC_RELEASE);
+
+  /* Сообщаем циклу обработки событий об окончании захвата */
+  uint64_t one = 1;
+  if (write(sampler->notify, &one, sizeof(one)) != sizeof(one))
+  {
+    log_error(LOG_WARNING, "sampler_capture: warning, failed to notify event loop");
+  }
+
+  return NULL;
+}
+
+/* Запуск потока захвата указанного количества выборок */
+int sampler_start(sampler_t *sampler, unsigned long long samples, int notify)
+{
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "sampler_start: sampler is NULL pointer");
+    return -1;
+  }
+
+  if (samples < 1)
+  {
+    log_message(LOG_ERR, "sampler_start: samples is not a positive integer");
+    return -1;
+  }
+
+  if (sampler->started)
+  {
+    log_message(LOG_ERR, "sampler_start: capture is already in progress");
+    return -1;
+  }
+
+  int fd = parport_fd(sampler->parport);
+  if (fd == -1)
+  {
+    log_message(LOG_ERR, "sampler_start: parport is degraded");
+    return -1;
+  }
+
+  /* Поток захвата работает с копиями дескрипторов, чтобы закрытие порта
+     при его деградации или удаление eventfd из цикла обработки событий
+     не оставили потоку закрытые или чужие дескрипторы */
+  sampler->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (sampler->fd == -1)
+  {
+    log_error(LOG_ERR, "sampler_start: failed to duplicate parport descriptor");
+    return -1;
+  }
+
+  sampler->notify = fcntl(notify, F_DUPFD_CLOEXEC, 0);
+  if (sampler->notify == -1)
+  {
+    log_error(LOG_ERR, "sampler_start: failed to duplicate notify descriptor");
+    close(sampler->fd);
+    sampler->fd = -1;
+    return -1;
+  }
+
+  sampler->samples = samples;
+  sampler->stop = 0;
+  sampler->done = 0;
+  sampler->taken = 0;
+  sampler->changes = 0;
+  sampler->dropped = 0;
+  sampler->used = 0;
+  sampler->duration = 0;
+  sampler->error = 0;
+
+  /* Сигналы INT и TERM должны доставляться потоку цикла обработки событий,
+     поэтому поток захвата создаётся с заблокированными сигналами */
+  sigset_t sigmask;
+  sigset_t old_sigmask;
+  sigfillset(&sigmask);
+  pthread_sigmask(SIG_SETMASK, &sigmask, &old_sigmask);
+
+  int err = pthread_create(&(sampler->thread), NULL, sampler_capture, sampler);
+
+  pthread_sigmask(SIG_SETMASK, &old_sigmask, NULL);
+
+  if (err != 0)
+  {
+    log_message(LOG_ERR, "sampler_start: pthread_create failed: %s", strerror(err));
+    close(sampler->fd);
+    close(sampler->notify);
+    sampler->fd = -1;
+    sampler->notify = -1;
+    return -1;
+  }
+
+  sampler->started = 1;
+  return 0;
+}
+
+/* Возвращает 1, если захват закончен и его результат можно получить */
+int sampler_done(sampler_t *sampler)
+{
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "sampler_done: sampler is NULL pointer");
+    return 0;
+  }
+
+  return sampler->started && __atomic_load_n(&(sampler->done), __ATOMIC_ACQUIRE);
+}
+
+/* Вывод в буфер сводки законченного захвата и получение его данных */
+int sampler_result(sampler_t *sampler, char *buf, size_t size,
+                   const unsigned char **data, size_t *data_size)
+{
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "sampler_result: sampler is NULL pointer");
+    return -1;
+  }
+
+  if ((buf == NULL) || (data == NULL) || (data_size == NULL))
+  {
+    log_message(LOG_ERR, "sampler_result: buf, data or data_size is NULL pointer");
+    return -1;
+  }
+
+  if (!sampler_done(sampler))
+  {
+    log_message(LOG_ERR, "sampler_result: capture is not finished");
+    return -1;
+  }
+
+  if (sampler->error)
+  {
+    log_message(LOG_ERR, "sampler_result: failed to read status lines during capture");
+    return -1;
+  }
+
+  double rate = 0;
+  if (sampler->duration > 0)
+  {
+    rate = sampler->taken * 1e9 / sampler->duration;
+  }
+
+  int n = snprintf(buf, size, "samples=%llu duration=%lldns rate=%.0fHz changes=%llu dropped=%llu bytes=%zu",
+                   sampler->taken, sampler->duration, rate,
+                   sampler->changes, sampler->dropped, sampler->used);
+  if ((n < 0) || ((size_t)n >= size))
+  {
+    log_message(LOG_ERR, "sampler_result: buffer is too small");
+    return -1;
+  }
+
+  *data = sampler->buffer;
+  *data_size = sampler->used;
+  return n;
+}
+
+/* Остановка захвата, если он ещё идёт, и освобождение захвата для следующего */
+int sampler_release(sampler_t *sampler)
+{
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "sampler_release: sampler is NULL pointer");
+    return -1;
+  }
+
+  if (!sampler->started)
+  {
+    return 0;
+  }
+
+  int result = 0;
+
+  __atomic_store_n(&(sampler->stop), 1, __ATOMIC_RELAXED);
+  int err = pthread_join(sampler->thread, NULL);
+  if (err != 0)
+  {
+    log_message(LOG_WARNING, "sampler_release: warning, pthread_join failed: %s", strerror(err));
+    result = -1;
+  }
+
+  if (close(sampler->fd) == -1)
+  {
+    log_error(LOG_WARNING, "sampler_release: warning, failed to close parport descriptor");
+  }
+  if (close(sampler->notify) == -1)
+  {
+    log_error(LOG_WARNING, "sampler_release: warning, failed to close notify descriptor");
+  }
+
+  sampler->fd = -1;
+  sampler->notify = -1;
+  sampler->started = 0;
+  return result;
+}
+
+/* Остановка захвата и освобождение памяти */
+int sampler_destroy(sampler_t *sampler)
+{
+  if (sampler == NULL)
+  {
+    log_message(LOG_ERR, "sampler_destroy: sampler is NULL pointer");
+    return -1;
+  }
+
+  int result = sampler_release(sampler);
+
+  free(sampler->buffer);
+  free(sampler);
+  return result;
+}
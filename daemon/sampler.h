@@ -0,0 +1,49 @@
+#ifndef __SAMPLER__
+#define __SAMPLER__
+
+#include <stddef.h>
+#include "parport.h"
+
+/* Захват линий состояния порта с наибольшей частотой, которую позволяет порт,
+   для отладки подключения и временных характеристик устройств.
+
+   Линии читаются в отдельном потоке подряд, без пауз. В заранее выделенный
+   буфер захвата записываются только изменения состояния линий: каждое
+   изменение кодируется одним числом (d << 5) | s, где d - время в наносекундах
+   с момента предыдущего изменения, а s - новое состояние линий в битах
+   функции parport_status. Число записывается в формате LEB128: по 7 бит
+   в байте, начиная с младших, старший бит байта означает продолжение числа.
+   Первая запись содержит состояние линий в начале захвата с нулевым временем.
+
+   Изменения, не поместившиеся в буфер, отбрасываются и подсчитываются */
+struct sampler_s;
+typedef struct sampler_s sampler_t;
+
+/* Подготовка захвата на указанном порту с буфером захвата из size байт */
+sampler_t *sampler_create(parport_t *parport, size_t size);
+
+/* Выбор процессора, к которому будет привязан поток захвата, или -1,
+   если поток не нужно привязывать к процессору */
+int sampler_set_cpu(sampler_t *sampler, int cpu);
+
+/* Запуск потока захвата указанного количества выборок. По окончании захвата
+   поток записывает единицу в счётчик eventfd с дескриптором notify */
+int sampler_start(sampler_t *sampler, unsigned long long samples, int notify);
+
+/* Возвращает 1, если захват закончен и его результат можно получить */
+int sampler_done(sampler_t *sampler);
+
+/* Вывод в буфер сводки законченного захвата: количества выборок, длительности,
+   достигнутой частоты выборок, количества изменений, отброшенных изменений
+   и размера данных. Указатель на данные захвата и их размер возвращаются
+   через data и data_size и остаются действительными до sampler_release */
+int sampler_result(sampler_t *sampler, char *buf, size_t size,
+                   const unsigned char **data, size_t *data_size);
+
+/* Остановка захвата, если он ещё идёт, и освобождение захвата для следующего */
+int sampler_release(sampler_t *sampler);
+
+/* Остановка захвата и освобождение памяти */
+int sampler_destroy(sampler_t *sampler);
+
+#endif
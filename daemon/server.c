@@ -42,7 +42,7 @@ int server_process_event(int fd, int events, void *data)
     }
 
     /* Входящее подключение принято, создаём нового клиента */
-    socket_t *client = client_create(conn, server->parports);
+    socket_t *client = client_create(conn, server->evloop, server->parports);
     if (client == NULL)
     {
       log_message(LOG_WARNING, "server_process_event: warning, client_create failed");
@@ -114,6 +114,7 @@ socket_t *server_create(int fd, evloop_t *evloop, parports_t *parports)
     free(server);
     return NULL;
   }
+  socket_set_name(socket, "server");
 
   return socket;
 }
@@ -1,16 +1,33 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include "daemon.h"
 #include "evloop.h"
 #include "server.h"
+#include "client.h"
+#include "notify.h"
+#include "metrics.h"
 #include "slave.h"
 
-#define BACKLOG_NUMBER 16
+/* Наибольшее количество дескрипторов в одном пакете передачи состояния */
+#define SLAVE_HANDOFF_FDS 250
+
+/* Наибольший размер строк записей в одном пакете передачи состояния */
+#define SLAVE_HANDOFF_TEXT 32768
+
+/* Наибольшее время ожидания отправки пакета передачи состояния, с */
+#define SLAVE_HANDOFF_TIMEOUT 5
 
 /* Подготовка слушающего Unix-сокета с указанными правами доступа */
 int unix_socket_create(const char *pathname, int uid, int gid, int mode,
@@ -116,12 +133,620 @@ int unix_socket_create(const char *pathname, int uid, int gid, int mode,
   return fd;
 }
 
+/* Получение слушающего Unix-сокета от systemd при активации через сокет.
+   Возвращает дескриптор сокета или -1, если сокет не передан */
+int unix_socket_inherit(const char *pathname)
+{
+  const char *listen_pid = getenv("LISTEN_PID");
+  const char *listen_fds = getenv("LISTEN_FDS");
+  if ((listen_pid == NULL) || (listen_fds == NULL))
+  {
+    return -1;
+  }
+
+  /* Переменные окружения предназначены только этому процессу, дочерние
+     процессы не должны принять их на свой счёт */
+  long pid = strtol(listen_pid, NULL, 10);
+  long fds = strtol(listen_fds, NULL, 10);
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  if (pid != getpid())
+  {
+    log_message(LOG_WARNING, "unix_socket_inherit: warning, LISTEN_PID does not match process id, ignoring LISTEN_FDS");
+    return -1;
+  }
+
+  if (fds != 1)
+  {
+    log_message(LOG_ERR, "unix_socket_inherit: expected one socket in LISTEN_FDS, got %ld", fds);
+    return -1;
+  }
+
+  int fd = LISTEN_FDS_START;
+
+  /* Проверяем, что передан слушающий потоковый Unix-сокет */
+  struct sockaddr_un address;
+  socklen_t address_size = sizeof(address);
+  int type = 0;
+  socklen_t type_size = sizeof(type);
+  int listening = 0;
+  socklen_t listening_size = sizeof(listening);
+  if ((getsockname(fd, (struct sockaddr *)&address, &address_size) == -1) ||
+      (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_size) == -1) ||
+      (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listening_size) == -1))
+  {
+    log_error(LOG_ERR, "unix_socket_inherit: descriptor %d is not a socket", fd);
+    return -1;
+  }
+
+  if ((address.sun_family != AF_UNIX) || (type != SOCK_STREAM) || !listening)
+  {
+    log_message(LOG_ERR, "unix_socket_inherit: descriptor %d is not a listening unix stream socket", fd);
+    return -1;
+  }
+
+  /* Сокет слушает путь из юнит-файла сокета, а клиенты подключаются к пути
+     из опции --socket. Если пути разошлись, то клиенты не найдут демон */
+  size_t path_size = (address_size > offsetof(struct sockaddr_un, sun_path)) ?
+                     address_size - offsetof(struct sockaddr_un, sun_path) : 0;
+  if ((pathname != NULL) &&
+      ((strnlen(address.sun_path, path_size) != strlen(pathname)) ||
+       (strncmp(address.sun_path, pathname, path_size) != 0)))
+  {
+    log_message(LOG_WARNING, "unix_socket_inherit: warning, passed socket listens on %.*s instead of %s",
+                (int)strnlen(address.sun_path, path_size), address.sun_path, pathname);
+  }
+
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+  {
+    log_error(LOG_WARNING, "unix_socket_inherit: warning, failed to set close-on-exec flag");
+  }
+
+  log_message(LOG_INFO, "unix_socket_inherit: using listening socket passed by service manager");
+  return fd;
+}
+
+/* Данные сокета сигнала USR2, по которому ведомый процесс передаёт своё
+   состояние новой версии программы */
+typedef struct slave_upgrade_s
+{
+  evloop_t *evloop;     /* Цикл обработки событий с клиентами */
+  parports_t *parports; /* Каталог портов */
+  int channel;          /* Сокет для передачи состояния ведущему процессу */
+} slave_upgrade_t;
+
+/* Отправить пакет передачи состояния: строки записей в text и дескрипторы
+   fds, по одному на каждую запись */
+int slave_handoff_send(int channel, const char *text, size_t size, const int *fds, unsigned num)
+{
+  struct iovec iov;
+  iov.iov_base = (void *)text;
+  iov.iov_len = size;
+
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int) * SLAVE_HANDOFF_FDS)];
+    struct cmsghdr align;
+  } control;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * num);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num);
+
+  if (sendmsg(channel, &msg, MSG_NOSIGNAL) == -1)
+  {
+    log_error(LOG_ERR, "slave_handoff_send: failed to send state");
+    return -1;
+  }
+  return 0;
+}
+
+/* Передать ведущему процессу открытые порты с состояниями их светодиодов
+   и сокеты клиентов. Записи собираются в пакеты, чтобы очередь сокета
+   не переполнилась раньше, чем ведущий процесс запустит новую версию */
+int slave_handoff(slave_upgrade_t *upgrade)
+{
+  /* Изменения, ещё не выведенные в кадровом режиме, выводим сейчас, чтобы
+     кэш светодиодов совпадал с состоянием линий порта */
+  if (parports_flush(upgrade->parports) == -1)
+  {
+    log_message(LOG_WARNING, "slave_handoff: warning, parports_flush failed");
+  }
+
+  /* Сокет передаёт только соединение, поэтому клиентов, у которых есть
+     состояние сверх него, предупреждаем и отключаем до передачи */
+  int pruned = evloop_prune(upgrade->evloop, client_process_event, client_handoff_keep);
+  if (pruned > 0)
+  {
+    log_message(LOG_NOTICE, "slave_handoff: %d clients with pending state are disconnected", pruned);
+  }
+
+  int clients_num = evloop_collect(upgrade->evloop, client_process_event, NULL, 0);
+  int *clients = malloc(sizeof(int) * (clients_num + 1));
+  if (clients == NULL)
+  {
+    log_message(LOG_ERR, "slave_handoff: failed to allocate memory for clients");
+    return -1;
+  }
+  evloop_collect(upgrade->evloop, client_process_event, clients, clients_num);
+
+  char text[SLAVE_HANDOFF_TEXT];
+  size_t size = 0;
+  int fds[SLAVE_HANDOFF_FDS];
+  unsigned num = 0;
+  int result = 0;
+
+  int parports_num = parports_number(upgrade->parports);
+  for(int i = 0; (result == 0) && (i < parports_num + clients_num); i++)
+  {
+    int n;
+    if (i < parports_num)
+    {
+      const char *pathname;
+      int leds;
+      if (parports_snapshot(upgrade->parports, i, &pathname, &(fds[num]), &leds) == -1)
+      {
+        continue;
+      }
+      n = snprintf(text + size, sizeof(text) - size, "parport %d %s\n", leds, pathname);
+    }
+    else
+    {
+      fds[num] = clients[i - parports_num];
+      n = snprintf(text + size, sizeof(text) - size, "client\n");
+    }
+
+    /* Запись не поместилась в пакет - отправляем пакет и повторяем запись */
+    if ((n < 0) || ((size_t)n >= sizeof(text) - size))
+    {
+      if (num == 0)
+      {
+        log_message(LOG_WARNING, "slave_handoff: warning, record is too long, skipping it");
+        continue;
+      }
+      result = slave_handoff_send(upgrade->channel, text, size, fds, num);
+      size = 0;
+      num = 0;
+      i--;
+      continue;
+    }
+    size += n;
+    num++;
+
+    if (num == SLAVE_HANDOFF_FDS)
+    {
+      result = slave_handoff_send(upgrade->channel, text, size, fds, num);
+      size = 0;
+      num = 0;
+    }
+  }
+
+  if ((result == 0) && (num > 0))
+  {
+    result = slave_handoff_send(upgrade->channel, text, size, fds, num);
+  }
+
+  free(clients);
+  return result;
+}
+
+/* Обработчик сигнала USR2, полученного через signalfd: передаёт состояние
+   ведущему процессу и завершает ведомый процесс, не освобождая порты */
+int slave_upgrade_process_event(int fd, int events, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "slave_upgrade_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  slave_upgrade_t *upgrade = data;
+
+  if (events & EPOLLIN)
+  {
+    struct signalfd_siginfo info;
+    if (read(fd, &info, sizeof(info)) != sizeof(info))
+    {
+      log_error(LOG_WARNING, "slave_upgrade_process_event: warning, failed to read signalfd");
+    }
+
+    /* Даже если передать удалось не всё, новая версия программы откроет
+       недостающие порты сама, а клиенты подключатся повторно */
+    if (slave_handoff(upgrade) == -1)
+    {
+      log_message(LOG_WARNING, "slave_upgrade_process_event: warning, state is handed off partially");
+    }
+
+    /* Порты и клиенты не закрываются: их дескрипторы уже переданы, а закрытие
+       порта освободило бы его для новой версии программы */
+    log_message(LOG_NOTICE, "slave_upgrade_process_event: state is handed off, exiting for upgrade");
+
+    /* _exit не вызывает обработчики завершения, поэтому оставшиеся в буфере
+       сообщения нужно записать до него */
+    log_stop();
+    _exit(SLAVE_EXIT_UPGRADE);
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+  {
+    log_message(LOG_ERR, "slave_upgrade_process_event: signalfd broken");
+    return -1;
+  }
+
+  return EPOLLIN;
+}
+
+/* Освобождение памяти, занятой данными сокета сигнала USR2 */
+int slave_upgrade_destroy(void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "slave_upgrade_destroy: data is NULL pointer");
+    return -1;
+  }
+
+  slave_upgrade_t *upgrade = data;
+  if (close(upgrade->channel) == -1)
+  {
+    log_error(LOG_WARNING, "slave_upgrade_destroy: warning, failed to close upgrade channel");
+  }
+  free(upgrade);
+  return 0;
+}
+
+/* Добавить в цикл обработки событий сокет сигнала USR2 для передачи состояния
+   по сокету channel. Сигнал USR2 должен быть заблокирован */
+int slave_upgrade_attach(evloop_t *evloop, parports_t *parports, int channel)
+{
+  slave_upgrade_t *upgrade = malloc(sizeof(slave_upgrade_t));
+  if (upgrade == NULL)
+  {
+    log_message(LOG_ERR, "slave_upgrade_attach: failed to allocate memory for upgrade");
+    return -1;
+  }
+  upgrade->evloop = evloop;
+  upgrade->parports = parports;
+  upgrade->channel = channel;
+
+  /* Передача не должна зависнуть, если ведущий процесс перестал отвечать */
+  struct timeval timeout;
+  timeout.tv_sec = SLAVE_HANDOFF_TIMEOUT;
+  timeout.tv_usec = 0;
+  if (setsockopt(channel, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1)
+  {
+    log_error(LOG_WARNING, "slave_upgrade_attach: warning, failed to set send timeout");
+  }
+
+  sigset_t sigmask;
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGUSR2);
+
+  int fd = signalfd(-1, &sigmask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (fd == -1)
+  {
+    log_error(LOG_ERR, "slave_upgrade_attach: failed to create signalfd");
+    free(upgrade);
+    return -1;
+  }
+
+  socket_t *socket = socket_create(fd, EPOLLIN, slave_upgrade_process_event, slave_upgrade_destroy, upgrade);
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "slave_upgrade_attach: socket_create failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "slave_upgrade_attach: warning, failed to close signalfd");
+    }
+    free(upgrade);
+    return -1;
+  }
+  socket_set_name(socket, "upgrade");
+
+  if (evloop_add_socket(evloop, socket) == -1)
+  {
+    log_message(LOG_ERR, "slave_upgrade_attach: evloop_add_socket failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "slave_upgrade_attach: warning, failed to close signalfd");
+    }
+    free(socket);
+    free(upgrade);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Последний пакет проверки работоспособности, полученный от ведущего процесса */
+heartbeat_t slave_heartbeat;
+
+/* Признак того, что ведущий процесс проверяет работоспособность ведомого */
+int slave_heartbeat_enabled = 0;
+
+/* Обработчик пакетов проверки работоспособности: каждый полученный пакет
+   возвращается ведущему процессу без изменений */
+int slave_heartbeat_process_event(int fd, int events, void *data)
+{
+  if (data == NULL)
+  {
+    log_message(LOG_ERR, "slave_heartbeat_process_event: data is NULL pointer");
+    return -1;
+  }
+
+  heartbeat_t *last = data;
+
+  if (events & EPOLLIN)
+  {
+    while (1)
+    {
+      heartbeat_t heartbeat;
+      ssize_t n = recv(fd, &heartbeat, sizeof(heartbeat), MSG_DONTWAIT);
+      if (n == -1)
+      {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        {
+          break;
+        }
+        log_error(LOG_ERR, "slave_heartbeat_process_event: failed to receive heartbeat");
+        return -1;
+      }
+
+      /* Ведущий процесс закрыл сокет */
+      if (n == 0)
+      {
+        log_message(LOG_WARNING, "slave_heartbeat_process_event: warning, master closed heartbeat channel");
+        return 0;
+      }
+
+      if (n != sizeof(heartbeat))
+      {
+        log_message(LOG_WARNING, "slave_heartbeat_process_event: warning, wrong heartbeat size %zd", n);
+        continue;
+      }
+
+      *last = heartbeat;
+      if (send(fd, &heartbeat, sizeof(heartbeat), MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+      {
+        log_error(LOG_WARNING, "slave_heartbeat_process_event: warning, failed to answer heartbeat");
+      }
+    }
+  }
+
+  if (events & (EPOLLERR | EPOLLHUP))
+  {
+    log_message(LOG_WARNING, "slave_heartbeat_process_event: warning, master closed heartbeat channel");
+    return 0;
+  }
+
+  return EPOLLIN;
+}
+
+/* Сокет проверки работоспособности закрыт, отчитываться больше не о чем */
+int slave_heartbeat_destroy(void *data)
+{
+  (void)data;
+
+  slave_heartbeat_enabled = 0;
+  return 0;
+}
+
+/* Добавить в цикл обработки событий сокет проверки работоспособности и
+   сообщить ведущему процессу, что ведомый процесс готов отвечать */
+int slave_heartbeat_attach(evloop_t *evloop, int fd)
+{
+  memset(&slave_heartbeat, 0, sizeof(slave_heartbeat));
+
+  socket_t *socket = socket_create(fd, EPOLLIN, slave_heartbeat_process_event, slave_heartbeat_destroy, &slave_heartbeat);
+  if (socket == NULL)
+  {
+    log_message(LOG_ERR, "slave_heartbeat_attach: socket_create failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "slave_heartbeat_attach: warning, failed to close heartbeat channel");
+    }
+    return -1;
+  }
+  socket_set_name(socket, "heartbeat");
+
+  if (evloop_add_socket(evloop, socket) == -1)
+  {
+    log_message(LOG_ERR, "slave_heartbeat_attach: evloop_add_socket failed");
+    if (close(fd) == -1)
+    {
+      log_error(LOG_WARNING, "slave_heartbeat_attach: warning, failed to close heartbeat channel");
+    }
+    free(socket);
+    return -1;
+  }
+
+  /* Пока ведомый процесс открывает порты, ведущий процесс его не проверяет */
+  heartbeat_t hello = slave_heartbeat;
+  if (send(fd, &hello, sizeof(hello), MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+  {
+    log_error(LOG_WARNING, "slave_heartbeat_attach: warning, failed to send hello");
+  }
+
+  slave_heartbeat_enabled = 1;
+  return 0;
+}
+
+/* Вывод в буфер задержек ответа на проверки работоспособности, сообщённых
+   ведущим процессом. Возвращает -1, если проверки не ведутся */
+int slave_heartbeat_report(char *buf, size_t size)
+{
+  if (buf == NULL)
+  {
+    log_message(LOG_ERR, "slave_heartbeat_report: buf is NULL pointer");
+    return -1;
+  }
+
+  if (!slave_heartbeat_enabled)
+  {
+    log_message(LOG_ERR, "slave_heartbeat_report: heartbeat is disabled");
+    return -1;
+  }
+
+  int n = snprintf(buf, size, "heartbeats=%llu latency=%lldus max=%lldus missed=%llu restarts=%llu ready=%lldms",
+                   slave_heartbeat.seq,
+                   slave_heartbeat.latency / 1000,
+                   slave_heartbeat.max_latency / 1000,
+                   slave_heartbeat.missed,
+                   slave_heartbeat.restarts,
+                   slave_heartbeat.ready / 1000000);
+  if ((n < 0) || ((size_t)n >= size))
+  {
+    log_message(LOG_ERR, "slave_heartbeat_report: buffer is too small");
+    return -1;
+  }
+  return n;
+}
+
+/* Количество перезапусков ведомого процесса */
+unsigned long long slave_restarts()
+{
+  return slave_heartbeat_enabled ? slave_heartbeat.restarts : 0;
+}
+
+/* Принять состояние, переданное предыдущей версией программы через сокет
+   resume_fd: открытые порты запоминаются в каталоге, а сокеты клиентов
+   возвращаются через clients и clients_num */
+int slave_resume(parports_t *parports, int resume_fd, int **clients, unsigned *clients_num)
+{
+  *clients = NULL;
+  *clients_num = 0;
+
+  unsigned ports_num = 0;
+  while (1)
+  {
+    char text[SLAVE_HANDOFF_TEXT + 1];
+    struct iovec iov;
+    iov.iov_base = text;
+    iov.iov_len = SLAVE_HANDOFF_TEXT;
+
+    union
+    {
+      char buf[CMSG_SPACE(sizeof(int) * SLAVE_HANDOFF_FDS)];
+      struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    /* Предыдущая версия уже завершилась, все пакеты лежат в очереди сокета */
+    ssize_t n = recvmsg(resume_fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n == -1)
+    {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+      {
+        log_error(LOG_WARNING, "slave_resume: warning, failed to receive state");
+      }
+      break;
+    }
+    if (n == 0)
+    {
+      break;
+    }
+    text[n] = '\0';
+
+    int fds[SLAVE_HANDOFF_FDS];
+    unsigned num = 0;
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+      {
+        num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * num);
+      }
+    }
+
+    /* Каждая строка пакета соответствует очередному дескриптору */
+    unsigned k = 0;
+    char *save;
+    for(char *line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+    {
+      if (k >= num)
+      {
+        log_message(LOG_WARNING, "slave_resume: warning, record without descriptor: %s", line);
+        break;
+      }
+      int fd = fds[k++];
+
+      char *end;
+      if (strcmp(line, "client") == 0)
+      {
+        int *p = realloc(*clients, sizeof(int) * (*clients_num + 1));
+        if (p != NULL)
+        {
+          *clients = p;
+          (*clients)[(*clients_num)++] = fd;
+          continue;
+        }
+        log_message(LOG_ERR, "slave_resume: failed to allocate memory for client");
+      }
+      else if ((strncmp(line, "parport ", 8) == 0) && (line[8] != '\0'))
+      {
+        long leds = strtol(line + 8, &end, 10);
+        if ((end[0] == ' ') && (end[1] != '\0') &&
+            (parports_adopt(parports, end + 1, fd, leds) == 0))
+        {
+          ports_num++;
+          continue;
+        }
+        log_message(LOG_WARNING, "slave_resume: warning, failed to adopt parport: %s", line);
+      }
+      else
+      {
+        log_message(LOG_WARNING, "slave_resume: warning, unknown record: %s", line);
+      }
+
+      if (close(fd) == -1)
+      {
+        log_error(LOG_WARNING, "slave_resume: warning, failed to close descriptor");
+      }
+    }
+
+    /* Лишние дескрипторы закрываем */
+    for(; k < num; k++)
+    {
+      if (close(fds[k]) == -1)
+      {
+        log_error(LOG_WARNING, "slave_resume: warning, failed to close descriptor");
+      }
+    }
+  }
+
+  if (close(resume_fd) == -1)
+  {
+    log_error(LOG_WARNING, "slave_resume: warning, failed to close resume socket");
+  }
+
+  log_message(LOG_NOTICE, "slave_resume: %u parports and %u clients are taken from previous version",
+              ports_num, *clients_num);
+  return 0;
+}
+
 /* Функция, реализующая ведомый процесс.
 
    Открывает параллельные порты,
 
-   создаёт Unix-сокет и выставляет права дотсупа к нему (если идентификаторы
-   пользователя или группы, или режим доступа отличаются от -1),
+   если слушающий сокет listen_fd не передан (равен -1), создаёт Unix-сокет
+   и выставляет права дотсупа к нему (если идентификаторы пользователя
+   или группы, или режим доступа отличаются от -1),
 
    меняет идентификаторы пользователя и группы процесса (если они отличаются
    от -1),
@@ -131,9 +756,29 @@ int unix_socket_create(const char *pathname, int uid, int gid, int mode,
 
    затем в цикле обрабатывает поступающие подключения и запросы от клиентов.
 
+   Если указан сокет resume_fd, то принимает из него открытые порты и сокеты
+   клиентов, переданные предыдущей версией программы.
+
+   По сигналу HUP перечитывает файл со списком портов, если он указан.
+
+   По сигналу USR2 передаёт открытые порты и сокеты клиентов по сокету
+   upgrade_fd, если он указан, и завершает работу с кодом SLAVE_EXIT_UPGRADE.
+
+   Если указан сокет heartbeat_fd, то отвечает по нему на проверки
+   работоспособности ведущего процесса.
+
+   Если указан адрес metrics_address, то отдаёт по нему метрики в текстовом
+   формате Prometheus.
+
    По сигналу INT или TERM выходит из цикла и завершает работу. */
 int slave(parports_t *parports,
 
+          int listen_fd,
+          int upgrade_fd,
+          int resume_fd,
+          int heartbeat_fd,
+          int primary,
+          const char *metrics_address,
           const char *unix_socket_pathname,
           int unix_socket_uid,
           int unix_socket_gid,
@@ -155,6 +800,36 @@ int slave(parports_t *parports,
     return 1;
   }
 
+  /* Сигналы HUP, по которому перечитывается файл со списком портов, и USR2,
+     по которому состояние передаётся новой версии программы, принимаются
+     через signalfd. Блокируем их до открытия портов, чтобы маску
+     унаследовали потоки развёртки матриц */
+  sigset_t sigmask;
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGHUP);
+  sigaddset(&sigmask, SIGUSR2);
+  if (sigprocmask(SIG_BLOCK, &sigmask, NULL) == -1)
+  {
+    log_error(LOG_WARNING, "slave: warning, failed to block HUP and USR2 signals");
+  }
+
+  /* Принимаем порты и клиентов, переданных предыдущей версией программы */
+  int *clients = NULL;
+  unsigned clients_num = 0;
+  if ((resume_fd != -1) && (slave_resume(parports, resume_fd, &clients, &clients_num) == -1))
+  {
+    log_message(LOG_WARNING, "slave: warning, slave_resume failed");
+  }
+
+  /* Добавляем порты из файла со списком портов, если он указан. Файл
+     читается при каждом запуске ведомого процесса, поэтому перезапущенный
+     ведомый процесс видит его текущее содержимое */
+  if (parports_reload(parports) == -1)
+  {
+    log_message(LOG_ERR, "slave: parports_reload failed");
+    return 1;
+  }
+
   /* Открываем параллельные порты */
   if (parports_open(parports) == -1)
   {
@@ -162,18 +837,35 @@ int slave(parports_t *parports,
     return 1;
   }
 
-  /* Открываем Unix-сокет на прослушивание */
-  int fd = unix_socket_create(unix_socket_pathname,
-                              unix_socket_uid,
-                              unix_socket_gid,
-                              unix_socket_mode,
-                              BACKLOG_NUMBER);
+  /* Открываем Unix-сокет на прослушивание, если слушающий сокет не передан
+     ведущим процессом. Подключения к переданному сокету копятся в его
+     очереди, пока ведомый процесс перезапускается */
+  int fd = listen_fd;
   if (fd == -1)
   {
-    log_message(LOG_ERR, "slave: unix_socket_create failed");
-    return 1;
+    fd = unix_socket_create(unix_socket_pathname,
+                            unix_socket_uid,
+                            unix_socket_gid,
+                            unix_socket_mode,
+                            BACKLOG_NUMBER);
+    if (fd == -1)
+    {
+      log_message(LOG_ERR, "slave: unix_socket_create failed");
+      return 1;
+    }
   }
 
+  /* Открываем слушающий сокет метрик. Без него ведомый процесс продолжает
+     обслуживать клиентов */
+  int metrics = -1;
+  if ((metrics_address != NULL) && ((metrics = metrics_listen(metrics_address)) == -1))
+  {
+    log_message(LOG_WARNING, "slave: warning, metrics_listen failed");
+  }
+
+  /* Подключаемся к сокету уведомлений systemd, пока его путь доступен */
+  int notify = notify_open();
+
   /* Сбрасываем привилегии, если нужно */
   if (chroot_pathname != NULL)
   {
@@ -233,6 +925,106 @@ int slave(parports_t *parports,
     return 1;
   }
 
+  /* Клиенты, переданные предыдущей версией программы, продолжают работу
+     с новой версией без переподключения */
+  for(unsigned i = 0; i < clients_num; i++)
+  {
+    socket_t *client = client_create(clients[i], evloop, parports);
+    if (client == NULL)
+    {
+      log_message(LOG_WARNING, "slave: warning, client_create failed");
+      if (close(clients[i]) == -1)
+      {
+        log_error(LOG_WARNING, "slave: warning, failed to close client socket");
+      }
+    }
+    else if (evloop_add_socket(evloop, client) == -1)
+    {
+      log_message(LOG_WARNING, "slave: warning, evloop_add_socket failed");
+    }
+  }
+  free(clients);
+
+  /* Передача состояния новой версии программы по сигналу USR2 */
+  if ((upgrade_fd != -1) && (slave_upgrade_attach(evloop, parports, upgrade_fd) == -1))
+  {
+    log_message(LOG_WARNING, "slave: warning, slave_upgrade_attach failed");
+  }
+
+  /* События линий состояния портов рассылаются подписавшимся клиентам */
+  if (parports_set_publish(parports, client_publish, NULL) == -1)
+  {
+    log_message(LOG_WARNING, "slave: warning, parports_set_publish failed");
+  }
+
+  /* Создаём таймер, который будет повторно открывать порты, перешедшие
+     в деградировавшее состояние, и добавляем его в цикл обработки событий.
+     Вместе с таймером в цикл добавляются сокеты прерываний от портов */
+  socket_t *timer = parports_timer_create(parports, evloop);
+  if (timer == NULL)
+  {
+    log_message(LOG_ERR, "slave: parports_timer_create failed");
+    if (evloop_destroy(evloop) == -1)
+    {
+      log_message(LOG_WARNING, "slave: warning, evloop_destroy failed");
+    }
+    return 1;
+  }
+
+  if (evloop_add_socket(evloop, timer) == -1)
+  {
+    log_message(LOG_ERR,"slave: failed to add timer to event loop");
+    if (evloop_destroy(evloop) == -1)
+    {
+      log_message(LOG_WARNING, "slave: warning, evloop_destroy failed");
+    }
+    return 1;
+  }
+
+  /* Метрики отдаются из того же цикла обработки событий */
+  if ((metrics != -1) && (metrics_attach(metrics, evloop, parports) == -1))
+  {
+    log_message(LOG_WARNING, "slave: warning, metrics_attach failed");
+    if (close(metrics) == -1)
+    {
+      log_error(LOG_WARNING, "slave: warning, failed to close metrics socket");
+    }
+  }
+
+  /* Проверки работоспособности подключаются последними, когда ведомый
+     процесс готов обслуживать клиентов */
+  if ((heartbeat_fd != -1) && (slave_heartbeat_attach(evloop, heartbeat_fd) == -1))
+  {
+    log_message(LOG_WARNING, "slave: warning, slave_heartbeat_attach failed");
+  }
+
+  /* Порты открыты, а сервер принимает подключения - сообщаем systemd
+     о готовности. Дальше из цикла обработки событий отправляются
+     уведомления о работоспособности и строка состояния. О готовности
+     и состоянии демона сообщает только основной ведомый процесс */
+  if (notify != -1)
+  {
+    if (primary)
+    {
+      notify_send(notify, "READY=1");
+    }
+    if (notify_attach(notify, evloop, primary) == -1)
+    {
+      log_message(LOG_WARNING, "slave: warning, notify_attach failed");
+      if (close(notify) == -1)
+      {
+        log_error(LOG_WARNING, "slave: warning, failed to close notify socket");
+      }
+    }
+  }
+
+  /* Дальше сообщения в журнал записывает отдельный поток, чтобы клиент,
+     вызывающий поток ошибок, не задерживал остальных клиентов */
+  if (log_start() == -1)
+  {
+    log_message(LOG_WARNING, "slave: warning, log_start failed");
+  }
+
   /* Запускаем цикл обработки событий на сокетах. Эта функция завершится
      только по сигналам INT или TERM или при возникновении ошибок
      в процессе работы */
@@ -241,6 +1033,9 @@ int slave(parports_t *parports,
     log_message(LOG_ERR, "slave: evloop_run failed");
   }
 
+  /* Записываем оставшиеся в буфере сообщения */
+  log_stop();
+
   /* Удаляем цикл обработки событий на сокетах */
   if (evloop_destroy(evloop) == -1)
   {
@@ -3,10 +3,62 @@
 
 #include "parports.h"
 
+/* Длина очереди входящих подключений слушающего Unix-сокета */
+#define BACKLOG_NUMBER 16
+
+/* Номер первого дескриптора, передаваемого при активации через сокет */
+#define LISTEN_FDS_START 3
+
+/* Код завершения ведомого процесса, передавшего состояние для обновления */
+#define SLAVE_EXIT_UPGRADE 3
+
+/* Переменная окружения с номером дескриптора сокета, в очереди которого
+   лежит состояние, переданное предыдущей версией программы */
+#define SLAVE_RESUME_ENV "PARLED12_RESUME_FD"
+
+/* Пакет проверки работоспособности ведомого процесса. Ведущий процесс
+   периодически отправляет его ведомому, а тот возвращает пакет без изменений
+   из цикла обработки событий. Первый пакет с номером 0 ведомый процесс
+   отправляет сам, когда готов отвечать. В каждом пакете ведущий процесс
+   сообщает измеренные им задержки ответов */
+typedef struct heartbeat_s
+{
+  unsigned long long seq;    /* Номер пакета */
+  long long sent;            /* Время отправки пакета по монотонным часам, нс */
+  long long latency;         /* Задержка последнего полученного ответа, нс */
+  long long max_latency;     /* Наибольшая задержка ответа, нс */
+  unsigned long long missed; /* Количество пакетов, не получивших ответа
+                                до отправки следующего */
+  unsigned long long restarts; /* Количество перезапусков ведомого процесса
+                                  после его аварийного завершения */
+  long long ready;           /* Время от запуска ведомого процесса до его
+                                готовности принимать подключения, нс */
+} heartbeat_t;
+
+/* Подготовка слушающего Unix-сокета с указанными правами доступа */
+int unix_socket_create(const char *pathname, int uid, int gid, int mode,
+                       unsigned int backlog);
+
+/* Получение слушающего Unix-сокета от systemd при активации через сокет:
+   если переменная окружения LISTEN_PID совпадает с идентификатором процесса,
+   а LISTEN_FDS равна 1, то возвращается дескриптор 3. Переменные окружения
+   при этом удаляются. Если сокет слушает не путь pathname, заданный опцией
+   --socket, то выводится предупреждение. Возвращает -1, если сокет не передан */
+int unix_socket_inherit(const char *pathname);
+
+/* Вывод в буфер задержек ответа на проверки работоспособности, сообщённых
+   ведущим процессом. Возвращает -1, если проверки не ведутся */
+int slave_heartbeat_report(char *buf, size_t size);
+
+/* Количество перезапусков ведомого процесса, сообщённое ведущим процессом
+   в последней проверке работоспособности, или 0, если проверки не ведутся */
+unsigned long long slave_restarts();
+
 /* Функция, реализующая ведомый процесс.
 
    Открывает параллельные порты,
 
+   если слушающий сокет listen_fd не передан (равен -1),
    создаёт Unix-сокет и выставляет права дотсупа к нему
    (если идентификаторы пользователя или группы, или
    режим доступа отличаются от -1),
@@ -20,10 +72,39 @@
    затем в цикле обрабатывает поступающие подключения и
    запросы от клиентов.
 
+   Если указан сокет resume_fd, то принимает из него открытые
+   порты и сокеты клиентов, переданные предыдущей версией
+   программы, и продолжает работу с ними без перезапуска
+   портов и переподключения клиентов.
+
+   По сигналу HUP перечитывает файл со списком портов, если
+   он указан.
+
+   По сигналу USR2, если указан сокет upgrade_fd, передаёт
+   по нему открытые порты с состояниями светодиодов и сокеты
+   клиентов и завершает работу с кодом SLAVE_EXIT_UPGRADE,
+   не освобождая порты.
+
+   Если указан сокет heartbeat_fd, то отвечает по нему на
+   проверки работоспособности ведущего процесса.
+
+   Если задан признак primary, то сообщает systemd о готовности
+   и обновляет строку состояния. Ведомые процессы шардов
+   отправляют systemd только уведомления о работоспособности.
+
+   Если указан адрес metrics_address, то отдаёт по нему
+   метрики в текстовом формате Prometheus, см. metrics.h.
+
    По сигналу INT или TERM выходит из цикла и завершает
    работу. */
 int slave(parports_t *parports,
 
+          int listen_fd,
+          int upgrade_fd,
+          int resume_fd,
+          int heartbeat_fd,
+          int primary,
+          const char *metrics_address,
           const char *unix_socket_pathname,
           int unix_socket_uid,
           int unix_socket_gid,
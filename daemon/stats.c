@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "daemon.h"
+#include "parport.h"
+#include "stats.h"
+
+/* Количество корзин гистограммы: значения меньше STATS_SUB_BUCKETS
+   занимают по корзине, а каждая следующая степень двойки - ещё
+   STATS_SUB_BUCKETS корзин */
+#define STATS_BUCKETS ((64 - STATS_SUB_BUCKETS_BITS + 1) * STATS_SUB_BUCKETS)
+
+/* Количество операций над светодиодами, от LEDS_GET до LEDS_LCS */
+#define STATS_OPERATIONS (LEDS_LCS + 1)
+
+/* Гистограмма задержек */
+typedef struct stats_histogram_s
+{
+  unsigned long long buckets[STATS_BUCKETS]; /* Количество значений в корзинах */
+  unsigned long long count;                  /* Количество всех значений */
+  unsigned long long sum;                    /* Сумма всех значений */
+} stats_histogram_t;
+
+/* Счётчики команд к одному порту */
+typedef struct stats_port_s
+{
+  unsigned long long commands; /* Все команды */
+  unsigned long long failed;   /* Неразобранные и невыполненные команды */
+} stats_port_t;
+
+/* Статистика ведомого процесса */
+typedef struct stats_s
+{
+  stats_histogram_t latencies[STATS_LATENCIES];
+  unsigned long long outcomes[STATS_OUTCOMES];
+  unsigned long long operations[STATS_OPERATIONS];
+  stats_port_t *ports; /* Счётчики по портам, растут по мере надобности */
+  unsigned ports_num;  /* Количество портов в массиве счётчиков */
+} stats_t;
+
+stats_t stats;
+
+/* Имена операций над светодиодами в порядке leds_operation_t */
+const char *stats_operation_names[STATS_OPERATIONS] = {
+  "get", "set", "not", "or", "and", "xor", "add",
+  "sub", "inc", "dec", "rs", "ls", "rcs", "lcs"
+};
+
+/* Номер корзины для значения. Старшие STATS_SUB_BUCKETS_BITS + 1 значащих
+   бит значения выбирают корзину внутри степени двойки */
+unsigned stats_bucket(unsigned long long value)
+{
+  if (value < STATS_SUB_BUCKETS)
+  {
+    return value;
+  }
+
+  unsigned exponent = 63 - __builtin_clzll(value);
+  unsigned shift = exponent - STATS_SUB_BUCKETS_BITS;
+  unsigned sub = (value >> shift) & (STATS_SUB_BUCKETS - 1);
+  return (shift + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+/* Наибольшее значение, попадающее в корзину */
+unsigned long long stats_bucket_value(unsigned bucket)
+{
+  if (bucket < STATS_SUB_BUCKETS)
+  {
+    return bucket;
+  }
+
+  unsigned shift = bucket / STATS_SUB_BUCKETS - 1;
+  unsigned long long sub = bucket % STATS_SUB_BUCKETS;
+  return ((STATS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/* Квантиль гистограммы: верхняя граница корзины, до которой включительно
+   попадает не менее permille тысячных долей всех значений */
+unsigned long long stats_histogram_quantile(const stats_histogram_t *histogram, unsigned permille)
+{
+  if (histogram->count == 0)
+  {
+    return 0;
+  }
+
+  /* Номер значения по порядку, округлённый вверх */
+  unsigned long long rank = (histogram->count * permille + 999) / 1000;
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+
+  unsigned long long seen = 0;
+  for(unsigned i = 0; i < STATS_BUCKETS; i++)
+  {
+    seen += histogram->buckets[i];
+    if (seen >= rank)
+    {
+      return stats_bucket_value(i);
+    }
+  }
+  return stats_bucket_value(STATS_BUCKETS - 1);
+}
+
+/* Учёт задержки в гистограмме */
+void stats_latency(stats_latency_t latency, long long ns)
+{
+  if ((latency < 0) || (latency >= STATS_LATENCIES))
+  {
+    return;
+  }
+
+  stats_histogram_t *histogram = &(stats.latencies[latency]);
+  unsigned long long value = (ns > 0) ? (unsigned long long)ns : 0;
+  histogram->buckets[stats_bucket(value)]++;
+  histogram->count++;
+  histogram->sum += value;
+}
+
+/* Учёт выполненной команды */
+void stats_command(int operation, int parport, stats_outcome_t outcome)
+{
+  if ((outcome < 0) || (outcome >= STATS_OUTCOMES))
+  {
+    return;
+  }
+  stats.outcomes[outcome]++;
+
+  if ((operation >= 0) && (operation < STATS_OPERATIONS))
+  {
+    stats.operations[operation]++;
+  }
+
+  if (parport < 0)
+  {
+    return;
+  }
+
+  /* Массив счётчиков расширяется вдвое, когда встречается порт с большим
+     номером. Если памяти не хватило, то команда к порту не учитывается */
+  if ((unsigned)parport >= stats.ports_num)
+  {
+    unsigned num = (stats.ports_num > 0) ? stats.ports_num : 8;
+    while (num <= (unsigned)parport)
+    {
+      num *= 2;
+    }
+
+    stats_port_t *ports = realloc(stats.ports, sizeof(stats_port_t) * num);
+    if (ports == NULL)
+    {
+      log_message(LOG_WARNING, "stats_command: warning, failed to allocate memory for port counters");
+      return;
+    }
+    memset(&(ports[stats.ports_num]), 0, sizeof(stats_port_t) * (num - stats.ports_num));
+    stats.ports = ports;
+    stats.ports_num = num;
+  }
+
+  stats.ports[parport].commands++;
+  if (outcome != STATS_OK)
+  {
+    stats.ports[parport].failed++;
+  }
+}
+
+/* Количество команд с указанным результатом */
+unsigned long long stats_commands(stats_outcome_t outcome)
+{
+  if ((outcome < 0) || (outcome >= STATS_OUTCOMES))
+  {
+    return 0;
+  }
+  return stats.outcomes[outcome];
+}
+
+/* Имя гистограммы задержек */
+const char *stats_latency_name(stats_latency_t latency)
+{
+  const char *names[STATS_LATENCIES] = {"parse", "write", "request", "iteration"};
+  if ((latency < 0) || (latency >= STATS_LATENCIES))
+  {
+    return "unknown";
+  }
+  return names[latency];
+}
+
+/* Квантиль задержек в наносекундах */
+unsigned long long stats_quantile(stats_latency_t latency, unsigned permille)
+{
+  if ((latency < 0) || (latency >= STATS_LATENCIES))
+  {
+    return 0;
+  }
+  return stats_histogram_quantile(&(stats.latencies[latency]), permille);
+}
+
+/* Количество значений в гистограмме задержек и их сумма */
+int stats_latency_totals(stats_latency_t latency, unsigned long long *count, unsigned long long *sum)
+{
+  if ((latency < 0) || (latency >= STATS_LATENCIES))
+  {
+    log_message(LOG_ERR, "stats_latency_totals: wrong latency %d", latency);
+    return -1;
+  }
+
+  *count = stats.latencies[latency].count;
+  *sum = stats.latencies[latency].sum;
+  return 0;
+}
+
+/* Количество команд и неудачных команд к порту */
+int stats_port(unsigned parport, unsigned long long *commands, unsigned long long *failed)
+{
+  if (parport >= stats.ports_num)
+  {
+    *commands = 0;
+    *failed = 0;
+    return 0;
+  }
+
+  *commands = stats.ports[parport].commands;
+  *failed = stats.ports[parport].failed;
+  return 0;
+}
+
+/* Вывод в буфер количества команд по результатам и квантилей задержек */
+int stats_report(char *buf, size_t size)
+{
+  if (buf == NULL)
+  {
+    log_message(LOG_ERR, "stats_report: buf is NULL pointer");
+    return -1;
+  }
+
+  int n = snprintf(buf, size, "commands=%llu ok=%llu failed=%llu wrong=%llu",
+                   stats.outcomes[STATS_OK] + stats.outcomes[STATS_FAILED] + stats.outcomes[STATS_WRONG],
+                   stats.outcomes[STATS_OK], stats.outcomes[STATS_FAILED], stats.outcomes[STATS_WRONG]);
+  for(unsigned i = 0; (n >= 0) && ((size_t)n < size) && (i < STATS_LATENCIES); i++)
+  {
+    const stats_histogram_t *histogram = &(stats.latencies[i]);
+    int m = snprintf(&(buf[n]), size - n, " %s_ns=%llu/%llu/%llu", stats_latency_name(i),
+                     stats_histogram_quantile(histogram, 500),
+                     stats_histogram_quantile(histogram, 990),
+                     stats_histogram_quantile(histogram, 999));
+    if (m < 0)
+    {
+      return -1;
+    }
+    n += m;
+  }
+
+  if ((n < 0) || ((size_t)n >= size))
+  {
+    log_message(LOG_ERR, "stats_report: buffer is too small");
+    return -1;
+  }
+  return n;
+}
+
+/* Вывод в буфер количества команд по операциям над светодиодами */
+int stats_report_operations(char *buf, size_t size)
+{
+  if (buf == NULL)
+  {
+    log_message(LOG_ERR, "stats_report_operations: buf is NULL pointer");
+    return -1;
+  }
+
+  int n = 0;
+  for(unsigned i = 0; i < STATS_OPERATIONS; i++)
+  {
+    int m = snprintf(&(buf[n]), size - n, "%s%s=%llu", (i > 0) ? " " : "",
+                     stats_operation_names[i], stats.operations[i]);
+    if ((m < 0) || ((size_t)(n + m) >= size))
+    {
+      log_message(LOG_ERR, "stats_report_operations: buffer is too small");
+      return -1;
+    }
+    n += m;
+  }
+  return n;
+}
+
+/* Вывод в буфер количества команд и неудачных команд по портам. Если все
+   порты не поместились в буфер, то вывод заканчивается многоточием */
+int stats_report_ports(char *buf, size_t size)
+{
+  if (buf == NULL)
+  {
+    log_message(LOG_ERR, "stats_report_ports: buf is NULL pointer");
+    return -1;
+  }
+
+  if (size < 4)
+  {
+    log_message(LOG_ERR, "stats_report_ports: buffer is too small");
+    return -1;
+  }
+
+  unsigned ports = 0;
+  for(unsigned i = 0; i < stats.ports_num; i++)
+  {
+    if (stats.ports[i].commands > 0)
+    {
+      ports++;
+    }
+  }
+  int n = snprintf(buf, size, "ports=%u", ports);
+
+  for(unsigned i = 0; (n >= 0) && (i < stats.ports_num); i++)
+  {
+    if (stats.ports[i].commands == 0)
+    {
+      continue;
+    }
+
+    /* Оставляем место для многоточия */
+    int m = snprintf(&(buf[n]), size - n, " %u=%llu/%llu", i,
+                     stats.ports[i].commands, stats.ports[i].failed);
+    if ((m < 0) || ((size_t)(n + m) >= size - 4))
+    {
+      buf[n] = '\0';
+      return n + snprintf(&(buf[n]), size - n, " ...");
+    }
+    n += m;
+  }
+
+  if ((n < 0) || ((size_t)n >= size))
+  {
+    log_message(LOG_ERR, "stats_report_ports: buffer is too small");
+    return -1;
+  }
+  return n;
+}
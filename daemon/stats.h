@@ -0,0 +1,78 @@
+#ifndef __STATS__
+#define __STATS__
+
+#include <stddef.h>
+
+/* Статистика ведомого процесса: счётчики команд по операциям над
+   светодиодами, по портам и по результатам выполнения, а также гистограммы
+   задержек разбора команды, записи регистров порта и выполнения запроса
+   целиком.
+
+   Гистограммы устроены как в HdrHistogram: каждая степень двойки делится
+   на STATS_SUB_BUCKETS равных корзин, поэтому погрешность квантилей не
+   превышает 1/STATS_SUB_BUCKETS при любом масштабе задержек, а запись
+   значения стоит нескольких арифметических операций.
+
+   Команды выполняются и регистры портов записываются только потоком цикла
+   обработки событий, поэтому счётчики принадлежат этому потоку и
+   увеличиваются без атомарных операций и блокировок */
+
+/* Количество корзин на каждую степень двойки */
+#define STATS_SUB_BUCKETS_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKETS_BITS)
+
+/* Гистограммы задержек */
+typedef enum stats_latency_e
+{
+  STATS_PARSE,   /* Разбор команды */
+  STATS_WRITE,   /* Запись регистров порта функцией parport_leds_set */
+  STATS_REQUEST, /* Выполнение запроса от разбора до готового ответа */
+  STATS_ITERATION, /* Обработка событий одной итерации цикла обработки событий */
+  STATS_LATENCIES
+} stats_latency_t;
+
+/* Результат выполнения команды */
+typedef enum stats_outcome_e
+{
+  STATS_OK,     /* Команда выполнена */
+  STATS_FAILED, /* Команда разобрана, но не выполнена */
+  STATS_WRONG,  /* Команда не разобрана */
+  STATS_OUTCOMES
+} stats_outcome_t;
+
+/* Учёт задержки в наносекундах в гистограмме latency */
+void stats_latency(stats_latency_t latency, long long ns);
+
+/* Учёт выполненной команды. operation - операция над светодиодами типа
+   leds_operation_t или -1, если команда не управляет светодиодами, parport -
+   номер порта или -1, если команда не относится к одному порту */
+void stats_command(int operation, int parport, stats_outcome_t outcome);
+
+/* Количество команд с указанным результатом */
+unsigned long long stats_commands(stats_outcome_t outcome);
+
+/* Имя гистограммы задержек: parse, write, request или iteration */
+const char *stats_latency_name(stats_latency_t latency);
+
+/* Квантиль задержек в наносекундах, permille - доля в тысячных, например
+   990 для p99 */
+unsigned long long stats_quantile(stats_latency_t latency, unsigned permille);
+
+/* Количество значений в гистограмме задержек и их сумма в наносекундах */
+int stats_latency_totals(stats_latency_t latency, unsigned long long *count, unsigned long long *sum);
+
+/* Количество команд и неудачных команд к порту */
+int stats_port(unsigned parport, unsigned long long *commands, unsigned long long *failed);
+
+/* Вывод в буфер количества команд по результатам и квантилей p50, p99
+   и p999 задержек в наносекундах. Возвращает количество выведенных символов */
+int stats_report(char *buf, size_t size);
+
+/* Вывод в буфер количества команд по операциям над светодиодами */
+int stats_report_operations(char *buf, size_t size);
+
+/* Вывод в буфер количества команд и неудачных команд по портам. Порты,
+   к которым не было команд, пропускаются */
+int stats_report_ports(char *buf, size_t size);
+
+#endif
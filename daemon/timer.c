@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "daemon.h"
+#include "timer.h"
+
+/* Текущее значение монотонных часов в миллисекундах */
+long long timer_now()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+  {
+    log_error(LOG_ERR, "timer_now: clock_gettime failed");
+    return 0;
+  }
+
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Текущее значение монотонных часов в наносекундах */
+long long timer_now_ns()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+  {
+    log_error(LOG_ERR, "timer_now_ns: clock_gettime failed");
+    return 0;
+  }
+
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Создание файлового дескриптора таймера */
+int timer_open()
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1)
+  {
+    log_error(LOG_ERR, "timer_open: timerfd_create failed");
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Взвести таймер так, чтобы он однократно сработал через msec миллисекунд */
+int timer_arm(int fd, long long msec)
+{
+  if (msec < 0)
+  {
+    log_message(LOG_ERR, "timer_arm: msec is negative value");
+    return -1;
+  }
+
+  /* Нулевое значение it_value останавливает таймер */
+  struct itimerspec its;
+  its.it_interval.tv_sec = 0;
+  its.it_interval.tv_nsec = 0;
+  its.it_value.tv_sec = msec / 1000;
+  its.it_value.tv_nsec = (msec % 1000) * 1000000;
+
+  if (timerfd_settime(fd, 0, &its, NULL) == -1)
+  {
+    log_error(LOG_ERR, "timer_arm: timerfd_settime failed");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Прочитать и сбросить количество срабатываний таймера */
+long long timer_read(int fd)
+{
+  uint64_t expirations = 0;
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+  {
+    /* Таймер мог быть перевзведён до того, как мы прочитали его срабатывание */
+    if (errno == EAGAIN)
+    {
+      return 0;
+    }
+
+    log_error(LOG_WARNING, "timer_read: warning, failed to read timer");
+    return -1;
+  }
+
+  return (long long)expirations;
+}
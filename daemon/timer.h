@@ -0,0 +1,21 @@
+#ifndef __TIMER__
+#define __TIMER__
+
+/* Текущее значение монотонных часов в миллисекундах */
+long long timer_now();
+
+/* Текущее значение монотонных часов в наносекундах */
+long long timer_now_ns();
+
+/* Создание файлового дескриптора таймера, срабатывания которого можно
+   ожидать в цикле обработки событий вместе с сокетами */
+int timer_open();
+
+/* Взвести таймер так, чтобы он однократно сработал через msec миллисекунд.
+   Если msec равно 0, то таймер останавливается */
+int timer_arm(int fd, long long msec);
+
+/* Прочитать и сбросить количество срабатываний таймера */
+long long timer_read(int fd);
+
+#endif